@@ -50,6 +50,11 @@
 #define	BERI_DEBUG_SOCKET_PATH_DEFAULT_1	"/tmp/beri_debug_listen_socket_1"
 #define	BERI_DEBUG_SOCKET_TRACING_ENV		"BERI_DEBUG_SOCKET_TRACING"
 
+/*
+ * Colon-separated descriptor files of a simulator's shared memory DRAM.
+ */
+#define	BERI_DEBUG_SHM_ENV			"BERI_DEBUG_SHM"
+
 /*
  * Return values from BERI debug library functions.
  */
@@ -291,6 +296,9 @@ int	beri_debug_client_open_jtag_atlantic(struct beri_debug **,
 		const char *, const char *, int, uint32_t);
 int	beri_debug_client_open_sc(struct beri_debug **, uint32_t);
 void	beri_debug_client_close(struct beri_debug *);
+int	beri_debug_client_shm_attach(struct beri_debug *, const char *);
+void	*beri_debug_client_shm_ptr(struct beri_debug *, uint64_t, size_t);
+void	beri_debug_client_shm_written(struct beri_debug *, uint64_t, size_t);
 int	beri_debug_client_drain(struct beri_debug *);
 int	beri_debug_client_load_instruction(struct beri_debug *, uint32_t);
 int	beri_debug_client_breakpoint_check(struct beri_debug *, uint64_t *);
@@ -0,0 +1,761 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <assert.h>
+#include <err.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pismdev/pism.h"
+
+/*-
+ * PISM simulation of a last-level cache, stacked in front of another device
+ * on the same bus, named by "backing".  The cache must be configured after
+ * its backing device and with the same addr and length, so that it takes all
+ * of the backing device's requests.
+ *
+ * The cache models timing only: data always live in the backing device, to
+ * which every request is passed on as it is put, so that stores are visible
+ * at once to anything else looking at memory.  The cache keeps tags and
+ * state for "size" bytes, in "ways"-way sets of "linesize"-byte lines, and
+ * is write-allocate and write-back: a store marks its line dirty, and a dirty
+ * line evicted by a fetch costs "writebacklatency" cycles.  A fetch that hits
+ * is returned after "hitlatency" cycles, or when the line's fill completes if
+ * later, and one that misses after "misslatency"; in either case, not before
+ * the backing device responds, which should normally be configured with no
+ * delay of its own.  "replacement" chooses victims by "lru", "fifo" or
+ * "random".
+ *
+ * Tags are kept in a flat array, one set of ways after another, so that a
+ * lookup reads one or two host cache lines; replacement and fill state are
+ * kept alongside in a separate array that only hits and fills touch.  Hit,
+ * miss, eviction and writeback counts are reported at exit.
+ *
+ * The standard "depth" option sets how many fetches may be in flight at
+ * once.  PISM's statistics for the backing device will not count requests
+ * made through the cache.
+ */
+
+static pism_mod_init_t			cache_mod_init;
+static pism_dev_init_t			cache_dev_init;
+static pism_dev_request_ready_t		cache_dev_request_ready;
+static pism_dev_request_put_t		cache_dev_request_put;
+static pism_dev_response_ready_t	cache_dev_response_ready;
+static pism_dev_response_get_t		cache_dev_response_get;
+static pism_dev_addr_valid_t		cache_dev_addr_valid;
+static pism_dev_request_put_burst_t	cache_dev_request_put_burst;
+static pism_dev_checkpoint_t		cache_dev_checkpoint;
+static pism_dev_restore_t		cache_dev_restore;
+
+/*
+ * Cache-specific option names.
+ */
+#define	CACHE_OPTION_BACKING		"backing"	/* Device cached. */
+#define	CACHE_OPTION_SIZE		"size"		/* Capacity, bytes. */
+#define	CACHE_OPTION_WAYS		"ways"		/* Associativity. */
+#define	CACHE_OPTION_LINESIZE		"linesize"	/* Line, bytes. */
+#define	CACHE_OPTION_REPLACEMENT	"replacement"	/* Victim policy. */
+#define	CACHE_OPTION_HITLATENCY		"hitlatency"
+#define	CACHE_OPTION_MISSLATENCY	"misslatency"
+#define	CACHE_OPTION_WRITEBACKLATENCY	"writebacklatency"
+
+#define	CACHE_SIZE_DEFAULT		(1024 * 1024)
+#define	CACHE_WAYS_DEFAULT		8
+#define	CACHE_WAYS_MAXIMUM		64
+#define	CACHE_LINESIZE_DEFAULT		64
+#define	CACHE_LINESIZE_MAXIMUM		4096
+#define	CACHE_HITLATENCY_DEFAULT	8
+#define	CACHE_MISSLATENCY_DEFAULT	40
+#define	CACHE_WRITEBACKLATENCY_DEFAULT	0
+#define	CACHE_LATENCY_MAXIMUM		100000
+
+/*
+ * Possible strings for the "replacement" option.
+ */
+#define	CACHE_REPLACEMENT_LRU_STR	"lru"
+#define	CACHE_REPLACEMENT_FIFO_STR	"fifo"
+#define	CACHE_REPLACEMENT_RANDOM_STR	"random"
+
+#define	CACHE_REPLACEMENT_LRU		0
+#define	CACHE_REPLACEMENT_FIFO		1
+#define	CACHE_REPLACEMENT_RANDOM	2
+
+/*
+ * Each tag is the address of the line held, or zero if none; lines are at
+ * least PISM_DATA_BYTES long, so the low bits are free for its state.
+ */
+#define	CACHE_VALID		0x1
+#define	CACHE_DIRTY		0x2
+
+/*
+ * Per-line replacement and fill state, parallel to the tags.  cm_stamp is
+ * when the line was last used (LRU) or filled (FIFO).
+ */
+struct cache_meta {
+	uint64_t	cm_stamp;
+	uint64_t	cm_ready;	/* Cycle the line's fill completes. */
+};
+
+/*
+ * A fetch in flight, passed on to the backing device with the index of its
+ * entry as the tag.
+ */
+struct cache_request {
+	pism_data_t	 cr_req;	/* As put, then as the backing replied. */
+	uint64_t	 cr_replycycle;	/* Earliest cycle reply permitted. */
+	uint64_t	 cr_seq;	/* Order in which requests were put. */
+	uint16_t	 cr_tag;	/* Bus tag, restored in the reply. */
+	bool		 cr_valid;
+	bool		 cr_backed;	/* Backing device has replied. */
+};
+
+struct cache_stats {
+	uint64_t	cs_fetch_hits;
+	uint64_t	cs_fetch_misses;
+	uint64_t	cs_store_hits;
+	uint64_t	cs_store_misses;
+	uint64_t	cs_evictions;
+	uint64_t	cs_writebacks;
+};
+
+/*
+ * Data structure describing per-cache instance fields, hung off of
+ * pism_device_t->pd_private.  As with DRAM, responses are returned as they
+ * fall due, so the module is marked PISM_MODULE_FLAG_UNORDERED.
+ */
+struct cache_private {
+	pism_device_t		*cp_backing;
+	uint64_t		*cp_tags;	/* cp_nsets * cp_ways. */
+	struct cache_meta	*cp_meta;	/* Likewise. */
+	uint64_t		 cp_setmask;	/* cp_nsets - 1. */
+	u_int			 cp_ways;
+	u_int			 cp_lineshift;	/* log2(linesize). */
+	int			 cp_replacement; /* CACHE_REPLACEMENT_*. */
+	u_int			 cp_hitlatency;
+	u_int			 cp_misslatency;
+	u_int			 cp_writebacklatency;
+	uint64_t		 cp_clock;	/* Replacement stamps. */
+	uint64_t		 cp_random;	/* xorshift64 state. */
+	struct cache_request	*cp_reqs;	/* pd_depth entries. */
+	u_int			 cp_inflight;
+	u_int			 cp_backing_inflight;
+	uint64_t		 cp_seq;
+	struct cache_stats	 cp_stats;
+};
+
+/*
+ * Report each cache's counters at exit.
+ */
+static void
+cache_report(void)
+{
+	struct cache_private *cpp;
+	struct cache_stats *cs;
+	pism_device_t *dev;
+	uint64_t accesses, hits;
+	uint8_t busno;
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_init != cache_dev_init)
+				continue;
+			cpp = dev->pd_private;
+			if (cpp == NULL)
+				continue;
+			cs = &cpp->cp_stats;
+			hits = cs->cs_fetch_hits + cs->cs_store_hits;
+			accesses = hits + cs->cs_fetch_misses +
+			    cs->cs_store_misses;
+			fprintf(stderr, "%s: fetches %ju hit %ju missed, "
+			    "stores %ju hit %ju missed (%.1f%% hits), "
+			    "%ju evictions, %ju writebacks\n", dev->pd_name,
+			    (uintmax_t)cs->cs_fetch_hits,
+			    (uintmax_t)cs->cs_fetch_misses,
+			    (uintmax_t)cs->cs_store_hits,
+			    (uintmax_t)cs->cs_store_misses,
+			    accesses == 0 ? 0.0 : 100.0 * hits / accesses,
+			    (uintmax_t)cs->cs_evictions,
+			    (uintmax_t)cs->cs_writebacks);
+		}
+	}
+}
+
+static bool
+cache_mod_init(pism_module_t *mod)
+{
+
+	if (atexit(cache_report) != 0)
+		warnx("%s: atexit failed", __func__);
+	return (true);
+}
+
+/*
+ * Parse an optional unsigned option, leaving *valp alone if it is absent.
+ */
+static bool
+cache_option_uint(pism_device_t *dev, const char *name, u_int min, u_int max,
+    u_int *valp)
+{
+	const char *option;
+	long long v;
+
+	if (!pism_device_option_get(dev, name, &option))
+		return (true);
+	if (!pism_device_option_parse_longlong(dev, option, &v) ||
+	    v < min || v > max) {
+		warnx("%s: %s option must be between %u and %u on device %s",
+		    __func__, name, min, max, dev->pd_name);
+		return (false);
+	}
+	*valp = v;
+	return (true);
+}
+
+static bool
+cache_str_to_replacement(const char *str, int *replacementp)
+{
+
+	if (strcmp(str, CACHE_REPLACEMENT_LRU_STR) == 0) {
+		*replacementp = CACHE_REPLACEMENT_LRU;
+		return (true);
+	} else if (strcmp(str, CACHE_REPLACEMENT_FIFO_STR) == 0) {
+		*replacementp = CACHE_REPLACEMENT_FIFO;
+		return (true);
+	} else if (strcmp(str, CACHE_REPLACEMENT_RANDOM_STR) == 0) {
+		*replacementp = CACHE_REPLACEMENT_RANDOM;
+		return (true);
+	}
+	return (false);
+}
+
+/*
+ * Find the backing device, which must already have been configured on the
+ * cache's bus, and be able to take everything the cache passes on.
+ */
+static pism_device_t *
+cache_backing_lookup(pism_device_t *dev, const char *name)
+{
+	pism_device_t *backing;
+	pism_module_t *mod;
+
+	SLIST_FOREACH(backing, g_pism_devices[dev->pd_busno], pd_next) {
+		if (strcmp(backing->pd_name, name) == 0)
+			break;
+	}
+	if (backing == NULL) {
+		warnx("%s: backing device %s of device %s must be configured "
+		    "before it", __func__, name, dev->pd_name);
+		return (NULL);
+	}
+	if (backing->pd_base != dev->pd_base ||
+	    backing->pd_length != dev->pd_length) {
+		warnx("%s: device %s must have the same addr and length as "
+		    "its backing device %s", __func__, dev->pd_name, name);
+		return (NULL);
+	}
+	mod = backing->pd_mod;
+	if (backing->pd_private == NULL || mod->pm_dev_request_ready == NULL ||
+	    mod->pm_dev_request_put == NULL ||
+	    mod->pm_dev_request_put_burst == NULL ||
+	    mod->pm_dev_response_ready == NULL ||
+	    mod->pm_dev_response_get == NULL ||
+	    mod->pm_dev_addr_valid == NULL) {
+		warnx("%s: device %s cannot back a cache", __func__, name);
+		return (NULL);
+	}
+	return (backing);
+}
+
+static bool
+cache_dev_init(pism_device_t *dev)
+{
+	struct cache_private *cpp;
+	const char *option_backing, *option_size, *option_replacement;
+	pism_device_t *backing;
+	u_int ways, linesize, hitlatency, misslatency, writebacklatency;
+	uint64_t nsets;
+	long long size;
+	int replacement;
+
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, false);
+
+	/*
+	 * Query and validate options.
+	 */
+	if (!(pism_device_option_get(dev, CACHE_OPTION_BACKING,
+	    &option_backing))) {
+		warnx("%s: missing %s option on device %s", __func__,
+		    CACHE_OPTION_BACKING, dev->pd_name);
+		return (false);
+	}
+	backing = cache_backing_lookup(dev, option_backing);
+	if (backing == NULL)
+		return (false);
+
+	size = CACHE_SIZE_DEFAULT;
+	if (pism_device_option_get(dev, CACHE_OPTION_SIZE, &option_size) &&
+	    (!pism_device_option_parse_longlong(dev, option_size, &size) ||
+	    size <= 0)) {
+		warnx("%s: invalid %s option on device %s", __func__,
+		    CACHE_OPTION_SIZE, dev->pd_name);
+		return (false);
+	}
+	replacement = CACHE_REPLACEMENT_LRU;
+	if (pism_device_option_get(dev, CACHE_OPTION_REPLACEMENT,
+	    &option_replacement) &&
+	    !cache_str_to_replacement(option_replacement, &replacement)) {
+		warnx("%s: invalid %s option %s on device %s", __func__,
+		    CACHE_OPTION_REPLACEMENT, option_replacement,
+		    dev->pd_name);
+		return (false);
+	}
+	ways = CACHE_WAYS_DEFAULT;
+	linesize = CACHE_LINESIZE_DEFAULT;
+	hitlatency = CACHE_HITLATENCY_DEFAULT;
+	misslatency = CACHE_MISSLATENCY_DEFAULT;
+	writebacklatency = CACHE_WRITEBACKLATENCY_DEFAULT;
+	if (!cache_option_uint(dev, CACHE_OPTION_WAYS, 1, CACHE_WAYS_MAXIMUM,
+	    &ways) ||
+	    !cache_option_uint(dev, CACHE_OPTION_LINESIZE, PISM_DATA_BYTES,
+	    CACHE_LINESIZE_MAXIMUM, &linesize) ||
+	    !cache_option_uint(dev, CACHE_OPTION_HITLATENCY, 0,
+	    CACHE_LATENCY_MAXIMUM, &hitlatency) ||
+	    !cache_option_uint(dev, CACHE_OPTION_MISSLATENCY, 0,
+	    CACHE_LATENCY_MAXIMUM, &misslatency) ||
+	    !cache_option_uint(dev, CACHE_OPTION_WRITEBACKLATENCY, 0,
+	    CACHE_LATENCY_MAXIMUM, &writebacklatency))
+		return (false);
+	if ((linesize & (linesize - 1)) != 0) {
+		warnx("%s: %s must be a power of two on device %s", __func__,
+		    CACHE_OPTION_LINESIZE, dev->pd_name);
+		return (false);
+	}
+	nsets = size / ((uint64_t)ways * linesize);
+	if (nsets == 0 || (nsets & (nsets - 1)) != 0 ||
+	    nsets * ways * linesize != (uint64_t)size) {
+		warnx("%s: %s must be a power of two multiple of %s times %s "
+		    "on device %s", __func__, CACHE_OPTION_SIZE,
+		    CACHE_OPTION_WAYS, CACHE_OPTION_LINESIZE, dev->pd_name);
+		return (false);
+	}
+
+	cpp = calloc(1, sizeof(*cpp));
+	if (cpp == NULL) {
+		warn("%s: calloc", __func__);
+		return (false);
+	}
+	cpp->cp_backing = backing;
+	cpp->cp_tags = calloc(nsets * ways, sizeof(*cpp->cp_tags));
+	cpp->cp_meta = calloc(nsets * ways, sizeof(*cpp->cp_meta));
+	cpp->cp_reqs = calloc(dev->pd_depth, sizeof(*cpp->cp_reqs));
+	if (cpp->cp_tags == NULL || cpp->cp_meta == NULL ||
+	    cpp->cp_reqs == NULL) {
+		warn("%s: calloc", __func__);
+		free(cpp->cp_tags);
+		free(cpp->cp_meta);
+		free(cpp->cp_reqs);
+		free(cpp);
+		return (false);
+	}
+	cpp->cp_setmask = nsets - 1;
+	cpp->cp_ways = ways;
+	cpp->cp_lineshift = ffs(linesize) - 1;
+	cpp->cp_replacement = replacement;
+	cpp->cp_hitlatency = hitlatency;
+	cpp->cp_misslatency = misslatency;
+	cpp->cp_writebacklatency = writebacklatency;
+	cpp->cp_random = 0x9e3779b97f4a7c15ULL;
+	PISM_LOG(dev, PISM_LOG_EV_CONFIG, nsets, ways);
+	dev->pd_private = cpp;
+
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, true);
+	return (true);
+}
+
+/*
+ * Choose a way of a full set to replace.
+ */
+static u_int
+cache_victim(struct cache_private *cpp, struct cache_meta *meta)
+{
+	uint64_t x;
+	u_int victim, way;
+
+	if (cpp->cp_replacement == CACHE_REPLACEMENT_RANDOM) {
+		x = cpp->cp_random;
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		cpp->cp_random = x;
+		return (x % cpp->cp_ways);
+	}
+	victim = 0;
+	for (way = 1; way < cpp->cp_ways; way++) {
+		if (meta[way].cm_stamp < meta[victim].cm_stamp)
+			victim = way;
+	}
+	return (victim);
+}
+
+/*
+ * Look up the line holding addr, allocating it on a miss, and return the
+ * cycle from which the line's data can be returned.
+ */
+static uint64_t
+cache_access(struct cache_private *cpp, uint64_t addr, bool store,
+    uint64_t now)
+{
+	struct cache_meta *meta;
+	uint64_t line, ready, *tags;
+	u_int way;
+
+	line = addr >> cpp->cp_lineshift;
+	tags = &cpp->cp_tags[(line & cpp->cp_setmask) * cpp->cp_ways];
+	meta = &cpp->cp_meta[(line & cpp->cp_setmask) * cpp->cp_ways];
+	line = (line << cpp->cp_lineshift) | CACHE_VALID;
+	for (way = 0; way < cpp->cp_ways; way++) {
+		if ((tags[way] & ~CACHE_DIRTY) != line)
+			continue;
+		if (store) {
+			tags[way] |= CACHE_DIRTY;
+			cpp->cp_stats.cs_store_hits++;
+		} else
+			cpp->cp_stats.cs_fetch_hits++;
+		if (cpp->cp_replacement == CACHE_REPLACEMENT_LRU)
+			meta[way].cm_stamp = ++cpp->cp_clock;
+		ready = now + cpp->cp_hitlatency;
+		return (ready > meta[way].cm_ready ? ready :
+		    meta[way].cm_ready);
+	}
+
+	if (store)
+		cpp->cp_stats.cs_store_misses++;
+	else
+		cpp->cp_stats.cs_fetch_misses++;
+	ready = now + cpp->cp_misslatency;
+	for (way = 0; way < cpp->cp_ways; way++) {
+		if (!(tags[way] & CACHE_VALID))
+			break;
+	}
+	if (way == cpp->cp_ways) {
+		way = cache_victim(cpp, meta);
+		cpp->cp_stats.cs_evictions++;
+		if (tags[way] & CACHE_DIRTY) {
+			cpp->cp_stats.cs_writebacks++;
+			ready += cpp->cp_writebacklatency;
+		}
+	}
+	tags[way] = line | (store ? CACHE_DIRTY : 0);
+	meta[way].cm_stamp = ++cpp->cp_clock;
+	meta[way].cm_ready = ready;
+	return (ready);
+}
+
+static bool
+cache_dev_request_ready(pism_device_t *dev, pism_data_t *req)
+{
+	struct cache_private *cpp;
+	pism_device_t *backing;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+	backing = cpp->cp_backing;
+
+	switch (PISM_REQ_ACCTYPE(req)) {
+	case PISM_ACC_STORE:
+		break;
+
+	case PISM_ACC_FETCH:
+		if (cpp->cp_inflight >= dev->pd_depth ||
+		    cpp->cp_backing_inflight >= backing->pd_depth)
+			return (false);
+		break;
+
+	default:
+		PISM_LOG(dev, PISM_LOG_EV_ERROR, req->pd_int.pdi_addr,
+		    PISM_REQ_ACCTYPE(req));
+		assert(0);
+	}
+	return (backing->pd_mod->pm_dev_request_ready(backing, req));
+}
+
+/*
+ * Account for nbeats consecutive beats in the cache, and pass them on to the
+ * backing device.  data is NULL for a single beat.
+ */
+static void
+cache_request(pism_device_t *dev, pism_data_t *req, u_int nbeats,
+    uint8_t *data)
+{
+	struct cache_private *cpp;
+	struct cache_request *crp;
+	pism_device_t *backing;
+	uint64_t addr, end, now, ready, replycycle;
+	bool store;
+	u_int i;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+	backing = cpp->cp_backing;
+
+	store = (PISM_REQ_ACCTYPE(req) == PISM_ACC_STORE);
+	now = pism_cycle_count_get(dev->pd_busno);
+	replycycle = now;
+	addr = req->pd_int.pdi_addr;
+	end = addr + nbeats * PISM_DATA_BYTES;
+	addr &= ~(((uint64_t)1 << cpp->cp_lineshift) - 1);
+	for (; addr < end; addr += (uint64_t)1 << cpp->cp_lineshift) {
+		ready = cache_access(cpp, addr, store, now);
+		if (ready > replycycle)
+			replycycle = ready;
+	}
+
+	if (!store) {
+		assert(cpp->cp_inflight < dev->pd_depth);
+		for (i = 0; cpp->cp_reqs[i].cr_valid; i++)
+			assert(i + 1 < dev->pd_depth);
+		crp = &cpp->cp_reqs[i];
+		memcpy(&crp->cr_req, req, sizeof(crp->cr_req));
+		crp->cr_replycycle = replycycle;
+		crp->cr_seq = cpp->cp_seq++;
+		crp->cr_tag = PISM_REQ_TAG(req);
+		crp->cr_valid = true;
+		crp->cr_backed = false;
+		cpp->cp_inflight++;
+		cpp->cp_backing_inflight++;
+		req = &crp->cr_req;
+		PISM_REQ_TAG(req) = i;
+	}
+	if (data == NULL)
+		backing->pd_mod->pm_dev_request_put(backing, req);
+	else
+		backing->pd_mod->pm_dev_request_put_burst(backing, req, nbeats,
+		    data);
+}
+
+static void
+cache_dev_request_put(pism_device_t *dev, pism_data_t *req)
+{
+
+	cache_request(dev, req, 1, NULL);
+}
+
+static void
+cache_dev_request_put_burst(pism_device_t *dev, pism_data_t *req,
+    u_int nbeats, uint8_t *data)
+{
+
+	cache_request(dev, req, nbeats, data);
+}
+
+/*
+ * Collect any replies the backing device has ready.  Burst data go straight
+ * to the buffer given with the request.
+ */
+static void
+cache_backing_collect(struct cache_private *cpp)
+{
+	struct cache_request *crp, *oldest;
+	pism_device_t *backing;
+	pism_data_t resp;
+	u_int i, depth;
+
+	backing = cpp->cp_backing;
+	depth = backing->pd_depth;
+	while (cpp->cp_backing_inflight > 0 &&
+	    backing->pd_mod->pm_dev_response_ready(backing)) {
+		resp = backing->pd_mod->pm_dev_response_get(backing);
+		if (backing->pd_mod->pm_flags & PISM_MODULE_FLAG_UNORDERED) {
+			crp = &cpp->cp_reqs[PISM_REQ_TAG(&resp)];
+		} else {
+			/* Replies come in the order requests were put. */
+			oldest = NULL;
+			for (i = 0; i < depth; i++) {
+				crp = &cpp->cp_reqs[i];
+				if (crp->cr_valid && !crp->cr_backed &&
+				    (oldest == NULL ||
+				    crp->cr_seq < oldest->cr_seq))
+					oldest = crp;
+			}
+			crp = oldest;
+		}
+		assert(crp != NULL && crp->cr_valid && !crp->cr_backed);
+		crp->cr_req = resp;
+		crp->cr_backed = true;
+		cpp->cp_backing_inflight--;
+	}
+}
+
+/*
+ * Find the fetch whose reply is due soonest, preferring the oldest request
+ * among those due on the same cycle, if the backing device has replied.
+ */
+static struct cache_request *
+cache_dev_next_reply(pism_device_t *dev, struct cache_private *cpp)
+{
+	struct cache_request *crp, *next;
+	u_int i;
+
+	next = NULL;
+	for (i = 0; i < dev->pd_depth; i++) {
+		crp = &cpp->cp_reqs[i];
+		if (!crp->cr_valid || !crp->cr_backed)
+			continue;
+		if (next == NULL ||
+		    crp->cr_replycycle < next->cr_replycycle ||
+		    (crp->cr_replycycle == next->cr_replycycle &&
+		    crp->cr_seq < next->cr_seq))
+			next = crp;
+	}
+	return (next);
+}
+
+static bool
+cache_dev_response_ready(pism_device_t *dev)
+{
+	struct cache_private *cpp;
+	struct cache_request *crp;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+
+	cache_backing_collect(cpp);
+	crp = cache_dev_next_reply(dev, cpp);
+	return (crp != NULL &&
+	    crp->cr_replycycle <= pism_cycle_count_get(dev->pd_busno));
+}
+
+static pism_data_t
+cache_dev_response_get(pism_device_t *dev)
+{
+	struct cache_private *cpp;
+	struct cache_request *crp;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+
+	crp = cache_dev_next_reply(dev, cpp);
+	assert(crp != NULL);
+	crp->cr_valid = false;
+	cpp->cp_inflight--;
+	PISM_REQ_TAG(&crp->cr_req) = crp->cr_tag;
+	return (crp->cr_req);
+}
+
+static bool
+cache_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
+{
+	struct cache_private *cpp;
+	pism_device_t *backing;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+	backing = cpp->cp_backing;
+	return (backing->pd_mod->pm_dev_addr_valid(backing, req));
+}
+
+/*
+ * Checkpoints hold the tags, replacement state and counters, so that a
+ * restored simulation sees the same hits and misses.  Fill cycles are
+ * absolute, as is the restored cycle count.
+ */
+static bool
+cache_dev_checkpoint(pism_device_t *dev, FILE *fp)
+{
+	struct cache_private *cpp;
+	size_t nlines;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+	nlines = (cpp->cp_setmask + 1) * cpp->cp_ways;
+	return (pism_checkpoint_write(fp, cpp->cp_tags,
+	    nlines * sizeof(*cpp->cp_tags)) &&
+	    pism_checkpoint_write(fp, cpp->cp_meta,
+	    nlines * sizeof(*cpp->cp_meta)) &&
+	    pism_checkpoint_write(fp, &cpp->cp_clock, sizeof(cpp->cp_clock)) &&
+	    pism_checkpoint_write(fp, &cpp->cp_random,
+	    sizeof(cpp->cp_random)) &&
+	    pism_checkpoint_write(fp, &cpp->cp_stats, sizeof(cpp->cp_stats)));
+}
+
+static bool
+cache_dev_restore(pism_device_t *dev, FILE *fp)
+{
+	struct cache_private *cpp;
+	size_t nlines;
+
+	cpp = dev->pd_private;
+	assert(cpp != NULL);
+	nlines = (cpp->cp_setmask + 1) * cpp->cp_ways;
+	return (pism_checkpoint_read(fp, cpp->cp_tags,
+	    nlines * sizeof(*cpp->cp_tags)) &&
+	    pism_checkpoint_read(fp, cpp->cp_meta,
+	    nlines * sizeof(*cpp->cp_meta)) &&
+	    pism_checkpoint_read(fp, &cpp->cp_clock, sizeof(cpp->cp_clock)) &&
+	    pism_checkpoint_read(fp, &cpp->cp_random,
+	    sizeof(cpp->cp_random)) &&
+	    pism_checkpoint_read(fp, &cpp->cp_stats, sizeof(cpp->cp_stats)));
+}
+
+static const char *cache_option_list[] = {
+	CACHE_OPTION_BACKING,
+	CACHE_OPTION_SIZE,
+	CACHE_OPTION_WAYS,
+	CACHE_OPTION_LINESIZE,
+	CACHE_OPTION_REPLACEMENT,
+	CACHE_OPTION_HITLATENCY,
+	CACHE_OPTION_MISSLATENCY,
+	CACHE_OPTION_WRITEBACKLATENCY,
+	NULL
+};
+
+PISM_MODULE_INFO(cache_module) = {
+	.pm_name = "cache",
+	.pm_option_list = cache_option_list,
+	.pm_flags = PISM_MODULE_FLAG_UNORDERED,
+	.pm_mod_init = cache_mod_init,
+	.pm_dev_init = cache_dev_init,
+	.pm_dev_request_ready = cache_dev_request_ready,
+	.pm_dev_request_put = cache_dev_request_put,
+	.pm_dev_response_ready = cache_dev_response_ready,
+	.pm_dev_response_get = cache_dev_response_get,
+	.pm_dev_addr_valid = cache_dev_addr_valid,
+	.pm_dev_request_put_burst = cache_dev_request_put_burst,
+	.pm_dev_checkpoint = cache_dev_checkpoint,
+	.pm_dev_restore = cache_dev_restore,
+};
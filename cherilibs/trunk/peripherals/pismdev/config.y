@@ -288,13 +288,18 @@ device_start(const char *name)
 static void
 device_finish(void)
 {
+	uint64_t start;
 	bool ret;
 
 	assert(curpd != NULL);
 	assert(curmod != NULL);
 	ret = pism_device_options_finalise(curpd);
-	if (curmod->pm_dev_init != NULL)
+	PISM_LOG_DEVICE(curpd);
+	if (curmod->pm_dev_init != NULL) {
+		PISM_PROF_START(start);
 		curmod->pm_dev_init(curpd);
+		PISM_PROF_STOP(curmod, PISM_PROF_DEV_INIT, start);
+	}
 	SLIST_INSERT_HEAD(g_pism_devices[yybusno], curpd, pd_next);
 	curpd = NULL;
 	curmod = NULL;
@@ -69,11 +69,17 @@
  * XXXRW: Unfortunately, this is not PISM.  Instead we rely on the input ready
  * interface being invoked every cycle.  If/when the debug unit is hooked up
  * to a PISM bus, we can switch to using the PSIM cycle tick event.
- * XXXCR: I don't think debug_cycle_counter is ever initialised...
+ *
+ * The interval adapts to traffic: a poll that moves data drops it to
+ * MIN_DEBUG_CYCLE_INTERVAL, and each one that doesn't doubles it, up to
+ * MAX_DEBUG_CYCLE_INTERVAL.  A poll falling due is skipped while the CPU has
+ * at least half a ring of input still to read and no output waiting.
  */
+#define 		MIN_DEBUG_CYCLE_INTERVAL	64
 #define 		MAX_DEBUG_CYCLE_INTERVAL	10000
 static uint64_t		 debug_cycle_interval[BERI_DEBUG_SOCKET_COUNT]
-				= {10000, 10000};
+				= {MAX_DEBUG_CYCLE_INTERVAL,
+				    MAX_DEBUG_CYCLE_INTERVAL};
 static uint64_t		 debug_cycle_counter[BERI_DEBUG_SOCKET_COUNT];
 
 /*
@@ -88,18 +94,28 @@ static int		 debug_listen_socket[BERI_DEBUG_SOCKET_COUNT]
 
 static int		 debug_session_socket[BERI_DEBUG_SOCKET_COUNT]
 				= {-1, -1};
-static bool		 debug_session_socket_writable[BERI_DEBUG_SOCKET_COUNT]
-				= {false, false};
 
 /*
  * If source "ready" returns true, then source "get" is not allowed to fail.
- * as such, if we poll and the session socket is readable, we immediately read
- * one character into a small buffer so that it is available for retrieval by
- * the CPU if we return "ready".
+ * As such, input is read from the session socket into a ring as it arrives,
+ * as much at a time as fits, and the CPU takes characters from the ring.
+ * Output is likewise queued in a ring and sent in as large pieces as the
+ * socket will take, so that neither the CPU's "get" nor its "put" makes a
+ * system call.  Indices run freely and are masked on use.
  */
-static uint8_t		 debug_buffer[BERI_DEBUG_SOCKET_COUNT];
-static bool		 debug_buffer_readable[BERI_DEBUG_SOCKET_COUNT]
-				= {false, false};
+#define	DEBUG_RING_SIZE		65536	/* Power of two. */
+
+struct debug_ring {
+	uint32_t	dr_head;		/* Next character written. */
+	uint32_t	dr_tail;		/* Next character read. */
+	uint8_t		dr_buf[DEBUG_RING_SIZE];
+};
+
+static struct debug_ring debug_rx[BERI_DEBUG_SOCKET_COUNT];
+static struct debug_ring debug_tx[BERI_DEBUG_SOCKET_COUNT];
+
+#define	DEBUG_RING_USED(dr)	((dr)->dr_head - (dr)->dr_tail)
+#define	DEBUG_RING_SPACE(dr)	(DEBUG_RING_SIZE - DEBUG_RING_USED(dr))
 
 /*
  * Rudimentary tracing facility for the debug socket.
@@ -134,7 +150,70 @@ debug_session_socket_close(uint8_t stream_no)
 
 	close(debug_session_socket[stream_no]);
 	debug_session_socket[stream_no] = -1;
-	debug_session_socket_writable[stream_no] = 0;
+	debug_tx[stream_no].dr_tail = debug_tx[stream_no].dr_head;
+}
+
+/*
+ * Read as much input as fits in the contiguous free part of the RX ring.
+ * Returns the number of characters read; closes the session at end of file.
+ */
+static size_t
+debug_session_read(uint8_t stream_no)
+{
+	struct debug_ring *dr;
+	ssize_t len;
+	size_t space;
+
+	dr = &debug_rx[stream_no];
+	space = DEBUG_RING_SPACE(dr);
+	if (space > DEBUG_RING_SIZE - dr->dr_head % DEBUG_RING_SIZE)
+		space = DEBUG_RING_SIZE - dr->dr_head % DEBUG_RING_SIZE;
+	len = read(debug_session_socket[stream_no],
+	    &dr->dr_buf[dr->dr_head % DEBUG_RING_SIZE], space);
+	if (len > 0) {
+		dr->dr_head += len;
+		return (len);
+	}
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return (0);
+	if (len < 0)
+		warn("(%u) %s: DEBUG POLL ERROR: len: %zd", stream_no,
+		    __func__, len);
+	debug_session_socket_close(stream_no);
+	return (0);
+}
+
+/*
+ * Send as much of the TX ring as the socket will take without blocking.
+ * Returns the number of characters sent.
+ */
+static size_t
+debug_session_write(uint8_t stream_no)
+{
+	struct debug_ring *dr;
+	ssize_t len;
+	size_t sent, used;
+
+	dr = &debug_tx[stream_no];
+	sent = 0;
+	while ((used = DEBUG_RING_USED(dr)) != 0) {
+		if (used > DEBUG_RING_SIZE - dr->dr_tail % DEBUG_RING_SIZE)
+			used = DEBUG_RING_SIZE - dr->dr_tail % DEBUG_RING_SIZE;
+		len = send(debug_session_socket[stream_no],
+		    &dr->dr_buf[dr->dr_tail % DEBUG_RING_SIZE], used,
+		    MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (len > 0) {
+			dr->dr_tail += len;
+			sent += len;
+			continue;
+		}
+		if (len < 0 && (errno == EINTR || errno == EAGAIN ||
+		    errno == EWOULDBLOCK))
+			break;
+		debug_session_socket_close(stream_no);
+		break;
+	}
+	return (sent);
 }
 
 /*
@@ -146,71 +225,63 @@ static void
 debug_poll(uint8_t stream_no)
 {
 	struct pollfd pollfd;
-	ssize_t len;
+	size_t moved;
 	int ret;
 
 	DEBUG_TRACE_FUNC(stream_no);
 
-	debug_cycle_counter[stream_no]++;
-	if (debug_cycle_counter[stream_no] % debug_cycle_interval[stream_no]
-			!= 0)
+	if (++debug_cycle_counter[stream_no] < debug_cycle_interval[stream_no])
 		return;
+	debug_cycle_counter[stream_no] = 0;
 
 	if (debug_listen_socket[stream_no] == -1)
 		return;
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = debug_listen_socket[stream_no];
-	pollfd.events = POLLIN;
-	ret = poll(&pollfd, 1, 0);
-	if (ret == -1)
-		err(1, "(%u) %s: poll on listen socket", stream_no, __func__);
-	if (ret == 1) {
-		assert(pollfd.revents == POLLIN);
-		debug_session_socket[stream_no] =
-			accept(debug_listen_socket[stream_no], NULL, NULL);
-		assert(debug_session_socket[stream_no] != -1);
-	}
-
-	if (debug_session_socket[stream_no] == -1)
-		return;
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = debug_session_socket[stream_no];
-	pollfd.events = POLLIN | POLLOUT;
-	ret = poll(&pollfd, 1, 0);
-	if (ret == -1)
-		err(1, "(%u) %s: poll on accepted socket", stream_no, __func__);
-	if (ret == 0)
+	if (DEBUG_RING_USED(&debug_rx[stream_no]) >= DEBUG_RING_SIZE / 2 &&
+	    DEBUG_RING_USED(&debug_tx[stream_no]) == 0)
 		return;
-	assert(ret == 1);
-
-	/* XXXRW: Handle POLLHUP? */
-
-	if (pollfd.revents & POLLOUT)
-		debug_session_socket_writable[stream_no] = true;
-
-	/*
-	 * If the session socket was readable and we haven't already buffered
-	 * an input character, read and buffer one now.
-	 */
-	if ((pollfd.revents & POLLIN) && !debug_buffer_readable[stream_no]) {
-		len = read(debug_session_socket[stream_no],
-			   &debug_buffer[stream_no],
-			   sizeof(debug_buffer[stream_no]));
-		if (len > 0) {
-			assert(len == sizeof(debug_buffer[stream_no]));
-			debug_buffer_readable[stream_no] = true;
-			DEBUG_TRACE_RECV(stream_no, debug_buffer[stream_no]);
-			debug_cycle_interval[stream_no] = 10;
-		} else if (len == 0) {
-			debug_session_socket_close(stream_no);
-			if (debug_cycle_interval[stream_no] < MAX_DEBUG_CYCLE_INTERVAL)
-				debug_cycle_interval[stream_no] *= 2;
-			else debug_cycle_interval[stream_no] = MAX_DEBUG_CYCLE_INTERVAL;
-		} else {
-			warn("(%u) %s: DEBUG POLL ERROR: len: %zd", stream_no,
-				__func__, len);
+	moved = 0;
+	if (debug_session_socket[stream_no] == -1) {
+		memset(&pollfd, 0, sizeof(pollfd));
+		pollfd.fd = debug_listen_socket[stream_no];
+		pollfd.events = POLLIN;
+		ret = poll(&pollfd, 1, 0);
+		if (ret == -1)
+			err(1, "(%u) %s: poll on listen socket", stream_no,
+			    __func__);
+		if (ret == 1) {
+			assert(pollfd.revents == POLLIN);
+			debug_session_socket[stream_no] =
+				accept(debug_listen_socket[stream_no], NULL,
+				    NULL);
+			assert(debug_session_socket[stream_no] != -1);
+			moved = 1;	/* Expect a command soon. */
 		}
 	}
+
+	if (debug_session_socket[stream_no] != -1) {
+		memset(&pollfd, 0, sizeof(pollfd));
+		pollfd.fd = debug_session_socket[stream_no];
+		if (DEBUG_RING_SPACE(&debug_rx[stream_no]) != 0)
+			pollfd.events |= POLLIN;
+		if (DEBUG_RING_USED(&debug_tx[stream_no]) != 0)
+			pollfd.events |= POLLOUT;
+		ret = poll(&pollfd, 1, 0);
+		if (ret == -1)
+			err(1, "(%u) %s: poll on accepted socket", stream_no,
+			    __func__);
+		if (ret == 1 && (pollfd.revents & POLLOUT))
+			moved += debug_session_write(stream_no);
+		if (ret == 1 && debug_session_socket[stream_no] != -1 &&
+		    (pollfd.revents & (POLLIN | POLLHUP | POLLERR)))
+			moved += debug_session_read(stream_no);
+	}
+
+	if (moved != 0)
+		debug_cycle_interval[stream_no] = MIN_DEBUG_CYCLE_INTERVAL;
+	else if (debug_cycle_interval[stream_no] * 2 < MAX_DEBUG_CYCLE_INTERVAL)
+		debug_cycle_interval[stream_no] *= 2;
+	else
+		debug_cycle_interval[stream_no] = MAX_DEBUG_CYCLE_INTERVAL;
 }
 
 bool
@@ -278,13 +349,14 @@ debug_stream_sink_ready(uint8_t stream_no)
 
 	DEBUG_TRACE_FUNC(stream_no);
 
-	return (debug_session_socket_writable[stream_no]);
+	return (debug_session_socket[stream_no] != -1 &&
+	    DEBUG_RING_SPACE(&debug_tx[stream_no]) != 0);
 }
 
 void
 debug_stream_sink_put(uint8_t stream_no, uint8_t ch)
 {
-	ssize_t len;
+	struct debug_ring *dr;
 
 	DEBUG_TRACE_FUNC(stream_no);
 
@@ -293,16 +365,16 @@ debug_stream_sink_put(uint8_t stream_no, uint8_t ch)
 	 * socket closed.  There is no way to report an error here, so we eat
 	 * it if one occurs.
 	 */
-	if (debug_session_socket[stream_no] == -1)
+	dr = &debug_tx[stream_no];
+	if (debug_session_socket[stream_no] == -1 ||
+	    DEBUG_RING_SPACE(dr) == 0)
 		return;
 	DEBUG_TRACE_SEND(stream_no, ch);
-	len = send(debug_session_socket[stream_no], &ch, sizeof(ch),
-			MSG_NOSIGNAL);
-	if (len < 0 || len == 0)
-		debug_session_socket_close(stream_no);
-	else
-		assert(len == sizeof(ch));
-	debug_session_socket_writable[stream_no] = false;
+	dr->dr_buf[dr->dr_head++ % DEBUG_RING_SIZE] = ch;
+	if (debug_cycle_interval[stream_no] > MIN_DEBUG_CYCLE_INTERVAL) {
+		debug_cycle_interval[stream_no] = MIN_DEBUG_CYCLE_INTERVAL;
+		debug_cycle_counter[stream_no] = 0;
+	}
 }
 
 bool
@@ -315,22 +387,23 @@ debug_stream_source_ready(uint8_t stream_no)
 
 	/*
 	 * The check here is not whether the socket is present and readable,
-	 * but rather, whether we have already buffered an input character,
-	 * which may be the case even if the socket has been closed or is not
-	 * readable.
+	 * but rather, whether we have already buffered input, which may be
+	 * the case even if the socket has been closed or is not readable.
 	 */
-	return (debug_buffer_readable[stream_no]);
+	return (DEBUG_RING_USED(&debug_rx[stream_no]) != 0);
 }
 
 uint8_t
 debug_stream_source_get(uint8_t stream_no)
 {
+	struct debug_ring *dr;
+	uint8_t ch;
 
 	DEBUG_TRACE_FUNC(stream_no);
 
-	/* XXXRW: Hopefully this is true? */
-	assert(debug_buffer_readable[stream_no]);
-
-	debug_buffer_readable[stream_no] = false;
-	return (debug_buffer[stream_no]);
+	dr = &debug_rx[stream_no];
+	assert(DEBUG_RING_USED(dr) != 0);
+	ch = dr->dr_buf[dr->dr_tail++ % DEBUG_RING_SIZE];
+	DEBUG_TRACE_RECV(stream_no, ch);
+	return (ch);
 }
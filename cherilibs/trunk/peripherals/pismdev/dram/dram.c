@@ -42,16 +42,28 @@
 #include <sys/stat.h>
 
 #include <assert.h>
+#include <elf.h>
+#if defined(__linux__)
+#include <endian.h>
+#elif (__FreeBSD__)
+#include <sys/endian.h>
+#endif
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include "pismdev/pism.h"
 #include "pismdev/dram/dram.h"
 
@@ -60,97 +72,1301 @@
  * memory, or memory mapped from a file.  A delay, in cycles, may be specified
  * for how quickly memory operations should take.
  *
- * TODO:
- * - Allow configurable pipeline depth -- currently that depth is hard-coded
- *   at 1 (the actual minimum given the protocol used to talk to DRAM).
- * - Allow custom fill words of varying lengths, perhaps named "fill1",
- *   "fill2", "fill4", and "fill8".
+ * Sparse DRAM, the default, is zero-filled memory that the host commits only
+ * as the simulation touches it, so that many simulators with large DRAMs can
+ * share a host.  The "hugepages" option backs it with transparent or
+ * explicitly reserved huge pages.  How much of each zero-filled DRAM is
+ * resident is reported at exit.
+ *
+ * DRAM of type "elf" loads the PT_LOAD segments of the 64-bit ELF image
+ * named by "path" into zero-filled memory at their load addresses, so that
+ * test programs need no conversion to run.  Page-aligned parts of segments
+ * are mapped from the image rather than copied, and BSS is left as
+ * untouched zero-filled memory.  Writes are always copy-on-write.
+ *
+ * DRAM of type "shm" is a POSIX shared memory object, named by "path" or
+ * after the simulator's process and the device, so that host tools such as
+ * berictl can read and write a running simulation's memory directly.  The
+ * tag bitmap follows the data in the object, so that tools can clear the
+ * tags of lines they write.  The object's base, length, name and tag offset
+ * are written to the file named by "descriptor", if set.  Both are removed
+ * at exit.  An existing object is never reused, as it may belong to
+ * another simulator.
+ *
+ * Setting "banks" replaces the fixed delay with a banked timing model, in
+ * which each bank has one open row.  An access to the open row costs
+ * "rowhit" cycles; otherwise the bank pays "precharge" to close the row, if
+ * one is open, and "rowmiss" to open the new one and access it.  Every
+ * "refresh" cycles, all banks are unavailable for "refreshtime" cycles and
+ * their rows are closed.  "bandwidth" caps the bytes per cycle the device
+ * can transfer.  Stores and fetches are both charged; a store is accepted
+ * only once its bank and the port are free, and "delay" remains a floor on
+ * fetch latency.
+ *
+ * Each DRAM keeps a CHERI tag bit for every PISM_DATA_BYTES line; see
+ * PISM_CAPTAG_BEAT().  Tags of mmap DRAM may be mapped from a file named by
+ * "tagpath", with the same permissions and copy-on-write behaviour as the
+ * data, so that tagged images can be loaded and saved.  Tags are otherwise
+ * zero-filled, and are included in checkpoints.
+ *
+ * Setting "heatmap" to a file name profiles accesses: each DRAM_HEAT_PAGE
+ * page counts its reads and writes and records the cycles of its first and
+ * last access, and every "heatmapperiod" cycles the pages accessed in that
+ * period are appended to the file (see struct dram_heat_header).  The
+ * dramheat tool summarises the working set over time and the hottest
+ * pages.
+ *
+ * Bytes that a fetch doesn't enable read as 0xab, or as the fill word set by
+ * one of "fill1", "fill2", "fill4" or "fill8": a byte, halfword, word or
+ * doubleword, repeated in big-endian order.
+ *
+ * Setting "poison" finds reads of uninitialised memory in zero-filled DRAM.
+ * A bitmap records which lines have been written, by a store or by loading
+ * an ELF image; a fetch of a line never written returns the fill word in
+ * place of the line's zeroes, and the first "poison" such reads are reported
+ * at exit with their cycles, along with how many there were in all.
+ *
+ * The standard "depth" option sets how many fetches may be in flight at
+ * once.
  */
 
 static pism_mod_init_t			dram_mod_init;
+static pism_dev_init_t			dram_dev_init;
 static pism_dev_request_ready_t		dram_dev_request_ready;
 static pism_dev_request_put_t		dram_dev_request_put;
 static pism_dev_response_ready_t	dram_dev_response_ready;
 static pism_dev_response_get_t		dram_dev_response_get;
 static pism_dev_addr_valid_t		dram_dev_addr_valid;
+static pism_dev_request_put_burst_t	dram_dev_request_put_burst;
+static pism_dev_checkpoint_t		dram_dev_checkpoint;
+static pism_dev_restore_t		dram_dev_restore;
+static pism_dev_fork_t			dram_dev_fork;
+
+static void	dram_poison_report(pism_device_t *dev, struct dram_poison *dpn);
+static void	dram_heat_snapshot(pism_device_t *dev, struct dram_heat *dh,
+		    uint64_t cycle);
 
 /*
  * DRAM-specific option names.
  */
 #define	DRAM_OPTION_TYPE	"type"	/* DRAM mapping type. */
 #define	DRAM_OPTION_PATH	"path"	/* File system path to memory map. */
+#define	DRAM_OPTION_TAGPATH	"tagpath"	/* Tag file to memory map. */
+#define	DRAM_OPTION_DESCRIPTOR	"descriptor"	/* Publish shm object here. */
 #define	DRAM_OPTION_COW		"cow"	/* Enable copy-on-write. */
 #define	DRAM_OPTION_DELAY	"delay"	/* Cycles each read takes. */
+#define	DRAM_OPTION_HUGEPAGES	"hugepages"	/* Huge page backing. */
+#define	DRAM_OPTION_BANKS	"banks"		/* Enable timing model. */
+#define	DRAM_OPTION_ROWSIZE	"rowsize"	/* Bytes per bank row. */
+#define	DRAM_OPTION_ROWHIT	"rowhit"	/* Open-row access cycles. */
+#define	DRAM_OPTION_ROWMISS	"rowmiss"	/* Activate + access cycles. */
+#define	DRAM_OPTION_PRECHARGE	"precharge"	/* Row close cycles. */
+#define	DRAM_OPTION_REFRESH	"refresh"	/* Cycles between refreshes. */
+#define	DRAM_OPTION_REFRESHTIME	"refreshtime"	/* Cycles each refresh. */
+#define	DRAM_OPTION_BANDWIDTH	"bandwidth"	/* Bytes per cycle. */
+#define	DRAM_OPTION_HEATMAP	"heatmap"	/* Access heatmap file. */
+#define	DRAM_OPTION_HEATMAPPERIOD "heatmapperiod" /* Cycles per snapshot. */
+#define	DRAM_OPTION_FILL1	"fill1"		/* Fill byte. */
+#define	DRAM_OPTION_FILL2	"fill2"		/* Fill halfword. */
+#define	DRAM_OPTION_FILL4	"fill4"		/* Fill word. */
+#define	DRAM_OPTION_FILL8	"fill8"		/* Fill doubleword. */
+#define	DRAM_OPTION_POISON	"poison"	/* Unwritten reads to report. */
 
 /*
  * Possible strings for the "type" option.
  */
 #define	DRAM_TYPE_ZERO_STR	"zero"
 #define	DRAM_TYPE_MMAP_STR	"mmap"
+#define	DRAM_TYPE_SPARSE_STR	"sparse"
+#define	DRAM_TYPE_ELF_STR	"elf"
+#define	DRAM_TYPE_SHM_STR	"shm"
+
+/*
+ * Possible strings for the "hugepages" option.
+ */
+#define	DRAM_HUGEPAGES_NONE_STR		"none"
+#define	DRAM_HUGEPAGES_TRANSPARENT_STR	"transparent"
+#define	DRAM_HUGEPAGES_EXPLICIT_STR	"explicit"
 
 /*
  * Default options for the DRAM module.
  */
 #define	DRAM_TYPE_ZERO		0
 #define	DRAM_TYPE_MMAP		1
-#define	DRAM_TYPE_DEFAULT	DRAM_TYPE_ZERO	/* Zero'd memory by default. */
+#define	DRAM_TYPE_SPARSE	2
+#define	DRAM_TYPE_ELF		3
+#define	DRAM_TYPE_SHM		4
+#define	DRAM_TYPE_DEFAULT	DRAM_TYPE_SPARSE /* Zero'd memory by default. */
+
+#define	DRAM_HUGEPAGES_NONE		0
+#define	DRAM_HUGEPAGES_TRANSPARENT	1
+#define	DRAM_HUGEPAGES_EXPLICIT		2
+#define	DRAM_HUGEPAGES_DEFAULT		DRAM_HUGEPAGES_NONE
+
+/*
+ * Explicit huge page mappings must be a multiple of the huge page size.
+ */
+#define	DRAM_HUGEPAGE_SIZE	(2 * 1024 * 1024)
 
 #define	DRAM_DELAY_DEFAULT	1
 #define	DRAM_DELAY_MINIMUM	1
 #define	DRAM_DELAY_MAXIMUM	UINT_MAX
 
+/*
+ * Timing model defaults and limits.  Refresh and the bandwidth cap are off
+ * unless configured.
+ */
+#define	DRAM_BANKS_MAXIMUM	1024
+#define	DRAM_ROWSIZE_DEFAULT	2048
+#define	DRAM_ROWSIZE_MAXIMUM	(1024 * 1024)
+#define	DRAM_ROWHIT_DEFAULT	4
+#define	DRAM_ROWMISS_DEFAULT	8
+#define	DRAM_PRECHARGE_DEFAULT	4
+#define	DRAM_LATENCY_MAXIMUM	100000
+
+#define	DRAM_ROW_NONE		UINT64_MAX
+
+#define	DRAM_HEATMAPPERIOD_DEFAULT	1000000
+
+#define	DRAM_POISON_MAXIMUM		(1024 * 1024)
+
+/*
+ * MIPS unmapped segments, for ELF load addresses.
+ */
+#define	DRAM_ELF_XKPHYS_MASK	0x07ffffffffffffffULL
+#define	DRAM_ELF_KSEG0		0xffffffff80000000ULL
+#define	DRAM_ELF_KSEG2		0xffffffffc0000000ULL
+#define	DRAM_ELF_KSEG_MASK	0x1fffffffULL
+
+/*
+ * Size of the tag bitmap for a DRAM of len bytes.
+ */
+#define	DRAM_TAG_BYTES(len)	(((len) / PISM_DATA_BYTES + 7) / 8)
+
 /*
  * Memory aligment required for Virtio device
  */
 #define	DRAM_ALIGN		4096
 
-static char		*g_dram_debug = NULL;
-
-#define	DDBG_MOD(...)	do	{					\
-	if (g_dram_debug == NULL) {					\
-		break;							\
-	}								\
-	printf("dram: %s(%s:%d): ", __func__, __FILE__, __LINE__);	\
-	printf(__VA_ARGS__);						\
-	printf("\n");							\
-} while (0)
-
-#define	DDBG(dev, ...)	do	{					\
-	if (g_dram_debug == NULL) {					\
-		break;							\
-	}								\
-	printf("%s(%s:%d) ", __func__, __FILE__, __LINE__);		\
-	if ((dev) != NULL)						\
-		printf("dram@%jx ", dev->pd_base);			\
-	printf(__VA_ARGS__);						\
-	printf("\n");							\
-} while (0)
+/*
+ * Checkpoints hold only pages with non-zero contents, each preceded by its
+ * offset, and end with DRAM_CHECKPOINT_END.
+ */
+#define	DRAM_CHECKPOINT_PAGE	4096
+#define	DRAM_CHECKPOINT_END	UINT64_MAX
 
 #define	ROUNDUP(x, y)	((((x) + (y) - 1)/(y)) * (y))
 
+#define	DRAM_BYTEENABLE_ALL	0xffffffff
+#define	DRAM_FILL_DEFAULT	0xab	/* Returned for disabled bytes. */
+
+/*
+ * Beats with only some bytes enabled are merged by dram_blend, which copies
+ * the enabled bytes of src and the remaining bytes of other into dst.  It is
+ * chosen at module load time from the implementations below, according to
+ * what the host CPU supports.
+ */
+typedef void	dram_blend_t(uint8_t *, const uint8_t *, const uint8_t *,
+		    uint32_t);
+
+static dram_blend_t	dram_blend_scalar;
+#if defined(__SSE2__)
+static dram_blend_t	dram_blend_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+static dram_blend_t	dram_blend_avx2;
+#endif
+
+static dram_blend_t	*dram_blend = dram_blend_scalar;
+
+/*
+ * Byte mask for each possible byte of byte-enable bits: bit i set gives
+ * 0xff in byte i.
+ */
+static uint64_t		dram_bytemask[256];
+
+/*
+ * Fill options, indexed by log2 of the width of their word.
+ */
+static const char	*dram_fill_options[] = {
+	DRAM_OPTION_FILL1,
+	DRAM_OPTION_FILL2,
+	DRAM_OPTION_FILL4,
+	DRAM_OPTION_FILL8,
+};
+
+static void
+dram_blend_scalar(uint8_t *dst, const uint8_t *other, const uint8_t *src,
+    uint32_t byteenable)
+{
+	uint64_t m, o, v;
+	int i;
+
+	for (i = 0; i < PISM_DATA_BYTES; i += sizeof(v)) {
+		m = dram_bytemask[byteenable & 0xff];
+		memcpy(&o, other + i, sizeof(o));
+		memcpy(&v, src + i, sizeof(v));
+		v = (v & m) | (o & ~m);
+		memcpy(dst + i, &v, sizeof(v));
+		byteenable >>= 8;
+	}
+}
+
+#if defined(__SSE2__)
+static void
+dram_blend_sse2(uint8_t *dst, const uint8_t *other, const uint8_t *src,
+    uint32_t byteenable)
+{
+	__m128i m, o, v;
+	int i;
+
+	for (i = 0; i < PISM_DATA_BYTES; i += sizeof(v)) {
+		m = _mm_set_epi64x(dram_bytemask[(byteenable >> 8) & 0xff],
+		    dram_bytemask[byteenable & 0xff]);
+		o = _mm_loadu_si128((const __m128i *)(other + i));
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		v = _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, o));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+		byteenable >>= 16;
+	}
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Expand the 32 byte-enable bits into a byte mask without a table: give
+ * byte i a copy of the byte holding bit i, then test bit (i % 8) of it.
+ */
+__attribute__((target("avx2")))
+static void
+dram_blend_avx2(uint8_t *dst, const uint8_t *other, const uint8_t *src,
+    uint32_t byteenable)
+{
+	const __m256i sel = _mm256_setr_epi8(
+	    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+	    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i bits = _mm256_set1_epi64x(0x8040201008040201LL);
+	__m256i m;
+
+	m = _mm256_shuffle_epi8(_mm256_set1_epi32(byteenable), sel);
+	m = _mm256_cmpeq_epi8(_mm256_and_si256(m, bits), bits);
+	_mm256_storeu_si256((__m256i *)dst, _mm256_blendv_epi8(
+	    _mm256_loadu_si256((const __m256i *)other),
+	    _mm256_loadu_si256((const __m256i *)src), m));
+}
+#endif
+
+/*
+ * Return a malloc'd vector with one byte per host page of zero-filled DRAM,
+ * bit 0 of which is set if the page is resident.  A page that isn't may
+ * still hold data that has been swapped out, so this is only for reporting.
+ * Returns NULL for DRAM with file-backed pages, or on failure.
+ */
+static unsigned char *
+dram_resident(pism_device_t *dev, struct dram_private *dpp, size_t *npagesp)
+{
+	unsigned char *vec;
+	size_t npages, pagesize;
+
+	if (dpp->dp_type != DRAM_TYPE_ZERO && dpp->dp_type != DRAM_TYPE_SPARSE)
+		return (NULL);
+	pagesize = getpagesize();
+	npages = ROUNDUP(dev->pd_length, pagesize) / pagesize;
+	vec = malloc(npages);
+	if (vec == NULL) {
+		warn("%s: malloc", __func__);
+		return (NULL);
+	}
+	if (mincore(dpp->dp_data, npages * pagesize, (void *)vec) < 0) {
+		warn("%s: mincore on device %s", __func__, dev->pd_name);
+		free(vec);
+		return (NULL);
+	}
+	*npagesp = npages;
+	return (vec);
+}
+
+/*
+ * At exit, finish each heatmap with a snapshot of its final, partial
+ * period, withdraw shared memory objects, and report how much of each
+ * zero-filled DRAM the host has had to commit.
+ */
+static void
+dram_report(void)
+{
+	struct dram_private *dpp;
+	struct dram_heat *dh;
+	pism_device_t *dev;
+	unsigned char *vec;
+	size_t i, npages, resident;
+	uint8_t busno;
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_init != dram_dev_init)
+				continue;
+			dpp = dev->pd_private;
+			if (dpp == NULL)
+				continue;
+			dh = dpp->dp_heat;
+			if (dh != NULL && dh->dh_fp != NULL) {
+				dram_heat_snapshot(dev, dh,
+				    pism_cycle_count_get(dev->pd_busno));
+				if (dh->dh_fp != NULL)
+					fclose(dh->dh_fp);
+				dh->dh_fp = NULL;
+			}
+			if (dpp->dp_shmname != NULL && g_pism_fork_child < 0) {
+				shm_unlink(dpp->dp_shmname);
+				if (dpp->dp_shmdesc != NULL)
+					unlink(dpp->dp_shmdesc);
+			}
+			if (dpp->dp_poison != NULL)
+				dram_poison_report(dev, dpp->dp_poison);
+			vec = dram_resident(dev, dpp, &npages);
+			if (vec == NULL)
+				continue;
+			resident = 0;
+			for (i = 0; i < npages; i++)
+				resident += vec[i] & 1;
+			free(vec);
+			fprintf(stderr, "%s: %zu of %ju KB resident\n",
+			    dev->pd_name, resident * (getpagesize() / 1024),
+			    (uintmax_t)dev->pd_length / 1024);
+		}
+	}
+}
+
 static bool
 dram_mod_init(pism_module_t *mod)
 {
+	u_int b, i;
+
+	for (b = 0; b < 256; b++) {
+		dram_bytemask[b] = 0;
+		for (i = 0; i < 8; i++) {
+			if (b & (1 << i))
+				dram_bytemask[b] |= (uint64_t)0xff << (i * 8);
+		}
+	}
+#if defined(__SSE2__)
+	dram_blend = dram_blend_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx2"))
+		dram_blend = dram_blend_avx2;
+#endif
+	if (atexit(dram_report) != 0)
+		warnx("%s: atexit failed", __func__);
+	return (true);
+}
+
+static bool
+dram_str_to_type(const char *str, int *typep)
+{
+
+	if (strcmp(str, DRAM_TYPE_ZERO_STR) == 0) {
+		*typep = DRAM_TYPE_ZERO;
+		return (true);
+	} else if (strcmp(str, DRAM_TYPE_MMAP_STR) == 0) {
+		*typep = DRAM_TYPE_MMAP;
+		return (true);
+	} else if (strcmp(str, DRAM_TYPE_SPARSE_STR) == 0) {
+		*typep = DRAM_TYPE_SPARSE;
+		return (true);
+	} else if (strcmp(str, DRAM_TYPE_ELF_STR) == 0) {
+		*typep = DRAM_TYPE_ELF;
+		return (true);
+	} else if (strcmp(str, DRAM_TYPE_SHM_STR) == 0) {
+		*typep = DRAM_TYPE_SHM;
+		return (true);
+	}
+	return (false);
+}
+
+static bool
+dram_str_to_hugepages(const char *str, int *hugepagesp)
+{
+
+	if (strcmp(str, DRAM_HUGEPAGES_NONE_STR) == 0) {
+		*hugepagesp = DRAM_HUGEPAGES_NONE;
+		return (true);
+	} else if (strcmp(str, DRAM_HUGEPAGES_TRANSPARENT_STR) == 0) {
+		*hugepagesp = DRAM_HUGEPAGES_TRANSPARENT;
+		return (true);
+	} else if (strcmp(str, DRAM_HUGEPAGES_EXPLICIT_STR) == 0) {
+		*hugepagesp = DRAM_HUGEPAGES_EXPLICIT;
+		return (true);
+	}
+	return (false);
+}
+
+/*
+ * Parse an optional unsigned option, leaving *valp alone if it is absent.
+ */
+static bool
+dram_option_uint(pism_device_t *dev, const char *name, u_int min, u_int max,
+    u_int *valp)
+{
+	const char *option;
+	long long v;
+
+	if (!pism_device_option_get(dev, name, &option))
+		return (true);
+	if (!pism_device_option_parse_longlong(dev, option, &v) ||
+	    v < min || v > max) {
+		warnx("%s: %s option must be between %u and %u on device %s",
+		    __func__, name, min, max, dev->pd_name);
+		return (false);
+	}
+	*valp = v;
+	return (true);
+}
+
+/*
+ * Parse the fill options, at most one of which may be set, into a beat of
+ * fill bytes.
+ */
+static bool
+dram_fill_option(pism_device_t *dev, uint8_t *fill)
+{
+	const char *name, *option;
+	unsigned long long v;
+	char *endp;
+	u_int i, j, width;
+	bool found;
+
+	memset(fill, DRAM_FILL_DEFAULT, PISM_DATA_BYTES);
+	found = false;
+	for (i = 0; i < sizeof(dram_fill_options) /
+	    sizeof(dram_fill_options[0]); i++) {
+		name = dram_fill_options[i];
+		if (!pism_device_option_get(dev, name, &option))
+			continue;
+		if (found) {
+			warnx("%s: more than one fill option on device %s",
+			    __func__, dev->pd_name);
+			return (false);
+		}
+		found = true;
+		width = 1 << i;
+		errno = 0;
+		v = strtoull(option, &endp, 0);
+		if (errno != 0 || *option == '\0' || *endp != '\0' ||
+		    (width < sizeof(v) && v >> (width * 8) != 0)) {
+			warnx("%s: invalid %s option on device %s", __func__,
+			    name, dev->pd_name);
+			return (false);
+		}
+		for (j = 0; j < PISM_DATA_BYTES; j++)
+			fill[j] = v >> ((width - 1 - j % width) * 8);
+	}
+	return (true);
+}
+
+static bool
+dram_timing_options(pism_device_t *dev, struct dram_timing *dt)
+{
+	u_int n, rowsize;
+
+	memset(dt, 0, sizeof(*dt));
+	if (!dram_option_uint(dev, DRAM_OPTION_BANKS, 1, DRAM_BANKS_MAXIMUM,
+	    &dt->dt_nbanks))
+		return (false);
+	if (dt->dt_nbanks == 0) {
+		if (pism_device_option_get(dev, DRAM_OPTION_ROWSIZE, NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_ROWHIT, NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_ROWMISS, NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_PRECHARGE, NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_REFRESH, NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_REFRESHTIME,
+		    NULL) ||
+		    pism_device_option_get(dev, DRAM_OPTION_BANDWIDTH, NULL)) {
+			warnx("%s: timing options require %s on device %s",
+			    __func__, DRAM_OPTION_BANKS, dev->pd_name);
+			return (false);
+		}
+		return (true);
+	}
+	rowsize = DRAM_ROWSIZE_DEFAULT;
+	dt->dt_hit = DRAM_ROWHIT_DEFAULT;
+	dt->dt_miss = DRAM_ROWMISS_DEFAULT;
+	dt->dt_precharge = DRAM_PRECHARGE_DEFAULT;
+	if (!dram_option_uint(dev, DRAM_OPTION_ROWSIZE, PISM_DATA_BYTES,
+	    DRAM_ROWSIZE_MAXIMUM, &rowsize) ||
+	    !dram_option_uint(dev, DRAM_OPTION_ROWHIT, 1,
+	    DRAM_LATENCY_MAXIMUM, &dt->dt_hit) ||
+	    !dram_option_uint(dev, DRAM_OPTION_ROWMISS, 1,
+	    DRAM_LATENCY_MAXIMUM, &dt->dt_miss) ||
+	    !dram_option_uint(dev, DRAM_OPTION_PRECHARGE, 0,
+	    DRAM_LATENCY_MAXIMUM, &dt->dt_precharge) ||
+	    !dram_option_uint(dev, DRAM_OPTION_REFRESH, 1, UINT_MAX,
+	    &dt->dt_refresh) ||
+	    !dram_option_uint(dev, DRAM_OPTION_REFRESHTIME, 0,
+	    DRAM_LATENCY_MAXIMUM, &dt->dt_refreshtime) ||
+	    !dram_option_uint(dev, DRAM_OPTION_BANDWIDTH, 1, UINT_MAX,
+	    &dt->dt_bandwidth))
+		return (false);
+	if ((dt->dt_nbanks & (dt->dt_nbanks - 1)) != 0 ||
+	    (rowsize & (rowsize - 1)) != 0) {
+		warnx("%s: %s and %s must be powers of two on device %s",
+		    __func__, DRAM_OPTION_BANKS, DRAM_OPTION_ROWSIZE,
+		    dev->pd_name);
+		return (false);
+	}
+	if (dt->dt_refresh != 0 && dt->dt_refreshtime >= dt->dt_refresh) {
+		warnx("%s: %s must be less than %s on device %s", __func__,
+		    DRAM_OPTION_REFRESHTIME, DRAM_OPTION_REFRESH,
+		    dev->pd_name);
+		return (false);
+	}
+	dt->dt_rowshift = ffs(rowsize) - 1;
+	if (dt->dt_bandwidth != 0) {
+		for (n = 1; n <= PISM_BURST_MAX_BEATS; n++)
+			dt->dt_xfer[n] = (n * PISM_DATA_BYTES +
+			    dt->dt_bandwidth - 1) / dt->dt_bandwidth;
+	}
+	return (true);
+}
+
+static void
+dram_timing_reset(struct dram_timing *dt)
+{
+	u_int i;
+
+	for (i = 0; i < dt->dt_nbanks; i++) {
+		dt->dt_banks[i].db_row = DRAM_ROW_NONE;
+		dt->dt_banks[i].db_ready = 0;
+		dt->dt_banks[i].db_refresh = 0;
+	}
+	dt->dt_port_ready = 0;
+	dt->dt_period = 0;
+	dt->dt_period_start = 0;
+	dt->dt_ready_bank = NULL;
+}
+
+/*
+ * Return the first cycle at or after now at which a bank can take a command,
+ * allowing for refresh, and the refresh period that cycle falls in.  Refresh
+ * occupies the start of each period.  The current period is cached to avoid
+ * a division on each access.
+ */
+static inline uint64_t
+dram_timing_start(struct dram_timing *dt, struct dram_bank *db, uint64_t now,
+    uint64_t *periodp)
+{
+	uint64_t start;
+
+	start = (db->db_ready > now) ? db->db_ready : now;
+	if (dt->dt_refresh == 0) {
+		*periodp = 0;
+		return (start);
+	}
+	if (start - dt->dt_period_start >= dt->dt_refresh) {
+		dt->dt_period = start / dt->dt_refresh;
+		dt->dt_period_start = dt->dt_period * dt->dt_refresh;
+	}
+	if (start - dt->dt_period_start < dt->dt_refreshtime)
+		start = dt->dt_period_start + dt->dt_refreshtime;
+	*periodp = dt->dt_period;
+	return (start);
+}
+
+static inline struct dram_bank *
+dram_timing_bank(struct dram_timing *dt, uint64_t addr, uint64_t *rowp)
+{
+
+	*rowp = addr >> dt->dt_rowshift;	/* Row and bank together. */
+	return (&dt->dt_banks[*rowp & (dt->dt_nbanks - 1)]);
+}
+
+/*
+ * Can a store to addr be accepted this cycle?  If so, the decode is kept
+ * for dram_timing_access(), as the store is normally put straight away.
+ */
+static bool
+dram_timing_ready(struct dram_timing *dt, uint64_t addr, uint64_t now)
+{
+	struct dram_bank *db;
+	uint64_t period, row;
+
+	db = dram_timing_bank(dt, addr, &row);
+	if (dram_timing_start(dt, db, now, &period) > now ||
+	    dt->dt_port_ready > now)
+		return (false);
+	dt->dt_ready_bank = db;
+	dt->dt_ready_addr = addr;
+	dt->dt_ready_now = now;
+	dt->dt_ready_row = row;
+	dt->dt_ready_period = period;
+	return (true);
+}
+
+/*
+ * Charge an access of nbeats at addr, which is issued as soon as its bank is
+ * free, and return the cycle on which its data transfer completes.  A burst
+ * is charged to the bank of its first beat.
+ */
+static uint64_t
+dram_timing_access(struct dram_timing *dt, uint64_t addr, u_int nbeats,
+    uint64_t now)
+{
+	struct dram_bank *db;
+	uint64_t done, period, row, start;
+	u_int latency;
+
+	db = dt->dt_ready_bank;
+	if (db != NULL && dt->dt_ready_addr == addr &&
+	    dt->dt_ready_now == now) {
+		row = dt->dt_ready_row;
+		period = dt->dt_ready_period;
+		start = now;
+	} else {
+		db = dram_timing_bank(dt, addr, &row);
+		start = dram_timing_start(dt, db, now, &period);
+	}
+	dt->dt_ready_bank = NULL;
+	if (db->db_row == row && db->db_refresh == period)
+		latency = dt->dt_hit;
+	else if (db->db_row == DRAM_ROW_NONE || db->db_refresh != period)
+		latency = dt->dt_miss;
+	else
+		latency = dt->dt_precharge + dt->dt_miss;
+	db->db_row = row;
+	db->db_refresh = period;
+	db->db_ready = start + latency;
+
+	/*
+	 * Data transfers are serialised on the port.
+	 */
+	done = (db->db_ready > dt->dt_port_ready) ? db->db_ready :
+	    dt->dt_port_ready;
+	done += dt->dt_xfer[nbeats];
+	dt->dt_port_ready = done;
+	return (done);
+}
+
+/*
+ * Count an access of nbytes at addr against each heatmap page it touches.
+ */
+static inline void
+dram_heat_touch(struct dram_heat *dh, uint64_t addr, u_int nbytes,
+    bool write, uint64_t now)
+{
+	struct dram_heat_page *dhp, *end;
+
+	dhp = &dh->dh_pages[addr / DRAM_HEAT_PAGE];
+	end = &dh->dh_pages[(addr + nbytes - 1) / DRAM_HEAT_PAGE];
+	for (; dhp <= end; dhp++) {
+		if (write)
+			dhp->dhp_writes += (dhp->dhp_writes != UINT32_MAX);
+		else
+			dhp->dhp_reads += (dhp->dhp_reads != UINT32_MAX);
+		if (dhp->dhp_first == 0)
+			dhp->dhp_first = now + 1;
+		dhp->dhp_last = now;
+	}
+}
+
+/*
+ * Append a snapshot of the pages accessed since the last one, and start a
+ * new period.
+ */
+static void
+dram_heat_snapshot(pism_device_t *dev, struct dram_heat *dh, uint64_t cycle)
+{
+	struct dram_heat_snapshot dhs;
+	struct dram_heat_record dhr;
+	struct dram_heat_page *dhp;
+	uint64_t page;
+
+	dhs.dhs_cycle = cycle;
+	dhs.dhs_npages = 0;
+	for (page = 0; page < dh->dh_npages; page++) {
+		dhp = &dh->dh_pages[page];
+		if (dhp->dhp_reads != 0 || dhp->dhp_writes != 0)
+			dhs.dhs_npages++;
+	}
+	if (fwrite(&dhs, sizeof(dhs), 1, dh->dh_fp) != 1)
+		goto error;
+	for (page = 0; page < dh->dh_npages; page++) {
+		dhp = &dh->dh_pages[page];
+		if (dhp->dhp_reads == 0 && dhp->dhp_writes == 0)
+			continue;
+		dhr.dhr_page = page;
+		dhr.dhr_reads = dhp->dhp_reads;
+		dhr.dhr_writes = dhp->dhp_writes;
+		dhr.dhr_first = dhp->dhp_first - 1;
+		dhr.dhr_last = dhp->dhp_last;
+		if (fwrite(&dhr, sizeof(dhr), 1, dh->dh_fp) != 1)
+			goto error;
+		dhp->dhp_reads = 0;
+		dhp->dhp_writes = 0;
+	}
+	return;
+
+error:
+	warn("%s: write failed on device %s; heatmap disabled", __func__,
+	    dev->pd_name);
+	fclose(dh->dh_fp);
+	dh->dh_fp = NULL;
+	pism_timer_cancel(&dh->dh_timer);
+}
 
-	DDBG_MOD("called");
+static void
+dram_heat_timer(pism_device_t *dev, void *arg)
+{
+	struct dram_heat *dh;
+	uint64_t now;
+
+	dh = arg;
+	now = pism_cycle_count_get(dev->pd_busno);
+	dram_heat_snapshot(dev, dh, now);
+	if (dh->dh_fp != NULL)
+		pism_timer_schedule(&dh->dh_timer, now + dh->dh_period);
+}
 
-	g_dram_debug = getenv("CHERI_DEBUG_DRAM");
+/*
+ * Open the heatmap file, or this child's copy of it, and write its header.
+ */
+static bool
+dram_heat_open(pism_device_t *dev, struct dram_heat *dh, const char *path)
+{
+	struct dram_heat_header dhh;
+	char buf[PATH_MAX];
 
-	DDBG_MOD("returned - %d", true);
+	if (!pism_fork_path(path, buf, sizeof(buf)))
+		return (false);
+	dh->dh_fp = fopen(buf, "w");
+	if (dh->dh_fp == NULL) {
+		warn("%s: open of %s failed on device %s", __func__, buf,
+		    dev->pd_name);
+		return (false);
+	}
+	memset(&dhh, 0, sizeof(dhh));
+	memcpy(dhh.dhh_magic, DRAM_HEAT_MAGIC, sizeof(dhh.dhh_magic));
+	dhh.dhh_version = DRAM_HEAT_VERSION;
+	dhh.dhh_pagesize = DRAM_HEAT_PAGE;
+	dhh.dhh_base = dev->pd_base;
+	dhh.dhh_length = dev->pd_length;
+	dhh.dhh_period = dh->dh_period;
+	strncpy(dhh.dhh_name, dev->pd_name, sizeof(dhh.dhh_name) - 1);
+	if (fwrite(&dhh, sizeof(dhh), 1, dh->dh_fp) != 1) {
+		warn("%s: write of %s failed on device %s", __func__, buf,
+		    dev->pd_name);
+		fclose(dh->dh_fp);
+		dh->dh_fp = NULL;
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * The page array is mapped like sparse DRAM, so that only the parts of it
+ * covering memory the simulation touches are committed.
+ */
+static struct dram_heat *
+dram_heat_init(pism_device_t *dev, const char *path, u_int period)
+{
+	struct dram_heat *dh;
+	size_t len;
+
+	dh = calloc(1, sizeof(*dh));
+	assert(dh != NULL);
+	dh->dh_npages = ROUNDUP(dev->pd_length, DRAM_HEAT_PAGE) /
+	    DRAM_HEAT_PAGE;
+	dh->dh_period = period;
+	len = dh->dh_npages * sizeof(*dh->dh_pages);
+	dh->dh_pages = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (dh->dh_pages == MAP_FAILED) {
+		warn("%s: mmap on device %s failed", __func__, dev->pd_name);
+		free(dh);
+		return (NULL);
+	}
+	if (!dram_heat_open(dev, dh, path)) {
+		munmap(dh->dh_pages, len);
+		free(dh);
+		return (NULL);
+	}
+	pism_timer_init(&dh->dh_timer, dev, dram_heat_timer, dh);
+	pism_timer_schedule(&dh->dh_timer,
+	    pism_cycle_count_get(dev->pd_busno) + period);
+	return (dh);
+}
+
+/*
+ * Undo dram_heat_init() for a device that failed to initialise.
+ */
+static void
+dram_heat_free(struct dram_heat *dh)
+{
+
+	pism_timer_cancel(&dh->dh_timer);
+	fclose(dh->dh_fp);
+	munmap(dh->dh_pages, dh->dh_npages * sizeof(*dh->dh_pages));
+	free(dh);
+}
+
+/*
+ * Map zero-filled memory without reserving swap for it, so that pages are
+ * committed only when first touched.
+ */
+static uint8_t *
+dram_sparse_map(pism_device_t *dev, int hugepages)
+{
+	void *data;
+	size_t length;
+	int flags;
+
+	length = dev->pd_length;
+	flags = MAP_PRIVATE | MAP_ANON;
+	if (hugepages == DRAM_HUGEPAGES_EXPLICIT) {
+		/*
+		 * Huge pages come from a pool reserved at mmap time, so
+		 * don't skip the reservation or a short pool would surface
+		 * as SIGBUS on first touch instead of an error here.
+		 */
+#ifdef MAP_HUGETLB
+		length = ROUNDUP(length, DRAM_HUGEPAGE_SIZE);
+		flags |= MAP_HUGETLB;
+#else
+		warnx("%s: explicit huge pages unsupported on device %s",
+		    __func__, dev->pd_name);
+		return (NULL);
+#endif
+	} else
+		flags |= MAP_NORESERVE;
+	data = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (data == MAP_FAILED) {
+		warn("%s: mmap of %zu bytes failed on device %s", __func__,
+		    length, dev->pd_name);
+		return (NULL);
+	}
+	if (hugepages == DRAM_HUGEPAGES_TRANSPARENT) {
+#ifdef MADV_HUGEPAGE
+		if (madvise(data, length, MADV_HUGEPAGE) < 0)
+			warn("%s: madvise failed on device %s", __func__,
+			    dev->pd_name);
+#else
+		warnx("%s: transparent huge pages unsupported on device %s",
+		    __func__, dev->pd_name);
+#endif
+	}
+	return (data);
+}
+
+/*
+ * Map the tag bitmap from a file, as for the data; the file must be large
+ * enough, unless the device may create it.
+ */
+static uint8_t *
+dram_tags_map_file(pism_device_t *dev, const char *path, int open_flags,
+    int mmap_prot, bool cow_flag)
+{
+	struct stat sb;
+	void *tags;
+	size_t length;
+	int fd;
+
+	length = DRAM_TAG_BYTES(dev->pd_length);
+	fd = open(path, open_flags, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		warn("%s: open of %s failed on device %s", __func__, path,
+		    dev->pd_name);
+		return (NULL);
+	}
+	if (fstat(fd, &sb) < 0) {
+		warn("%s: fstat of %s failed on device %s", __func__, path,
+		    dev->pd_name);
+		close(fd);
+		return (NULL);
+	}
+	if ((uint64_t)sb.st_size < length) {
+		if (!(dev->pd_perms & PISM_PERM_ALLOW_CREATE) ||
+		    ftruncate(fd, length) < 0) {
+			warnx("%s: %s shorter than %zu bytes on device %s",
+			    __func__, path, length, dev->pd_name);
+			close(fd);
+			return (NULL);
+		}
+	}
+	tags = mmap(NULL, length, mmap_prot,
+	    (cow_flag ? MAP_PRIVATE : MAP_SHARED), fd, 0);
+	close(fd);
+	if (tags == MAP_FAILED) {
+		warn("%s: mmap of %s on device %s failed", __func__, path,
+		    dev->pd_name);
+		return (NULL);
+	}
+	return (tags);
+}
+
+static uint8_t *
+dram_tags_map_zero(pism_device_t *dev)
+{
+	void *tags;
+
+	tags = mmap(NULL, DRAM_TAG_BYTES(dev->pd_length),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+	    -1, 0);
+	if (tags == MAP_FAILED) {
+		warn("%s: mmap failed on device %s", __func__, dev->pd_name);
+		return (NULL);
+	}
+	return (tags);
+}
+
+/*
+ * The bitmap of written lines is the same size as the tag bitmap, and
+ * likewise only committed where lines have been written.
+ */
+static struct dram_poison *
+dram_poison_init(pism_device_t *dev, u_int max)
+{
+	struct dram_poison *dpn;
+
+	dpn = calloc(1, sizeof(*dpn));
+	if (dpn == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	dpn->dpn_written = dram_tags_map_zero(dev);
+	if (dpn->dpn_written == NULL) {
+		free(dpn);
+		return (NULL);
+	}
+	if (max != 0) {
+		dpn->dpn_reads = calloc(max, sizeof(*dpn->dpn_reads));
+		if (dpn->dpn_reads == NULL) {
+			warn("%s: calloc", __func__);
+			munmap(dpn->dpn_written,
+			    DRAM_TAG_BYTES(dev->pd_length));
+			free(dpn);
+			return (NULL);
+		}
+	}
+	dpn->dpn_max = max;
+	return (dpn);
+}
+
+/*
+ * Undo dram_poison_init() for a device that failed to initialise.
+ */
+static void
+dram_poison_free(pism_device_t *dev, struct dram_poison *dpn)
+{
+
+	free(dpn->dpn_reads);
+	munmap(dpn->dpn_written, DRAM_TAG_BYTES(dev->pd_length));
+	free(dpn);
+}
+
+/*
+ * Mark the lines holding len bytes at offset addr written.
+ */
+static void
+dram_poison_write(struct dram_poison *dpn, uint64_t addr, uint64_t len)
+{
+	uint64_t line, end;
+
+	end = (addr + len + PISM_DATA_BYTES - 1) / PISM_DATA_BYTES;
+	for (line = addr / PISM_DATA_BYTES; line < end; line++)
+		dpn->dpn_written[line / 8] |= 1 << (line % 8);
+}
+
+/*
+ * Return a bit for each of nbeats lines that has never been written.  A
+ * single beat costs one load and a shift, so that fetches of initialised
+ * memory stay fast.
+ */
+static inline uint8_t
+dram_poison_unwritten(struct dram_poison *dpn, uint64_t addr, u_int nbeats)
+{
+	uint64_t line;
+	u_int beat;
+	uint8_t written;
+
+	written = 0;
+	line = addr / PISM_DATA_BYTES;
+	for (beat = 0; beat < nbeats; beat++, line++)
+		written |= ((dpn->dpn_written[line / 8] >> (line % 8)) & 1) <<
+		    beat;
+	return (~written & ((1 << nbeats) - 1));
+}
+
+/*
+ * Return the fill word for each unwritten beat of a fetch, and record the
+ * reads.
+ */
+static void
+dram_poison_fetch(pism_device_t *dev, struct dram_private *dpp,
+    uint64_t addr, uint8_t unwritten, uint8_t *data)
+{
+	struct dram_poison *dpn;
+	struct dram_poison_read *dpr;
+	u_int beat;
+
+	dpn = dpp->dp_poison;
+	for (beat = 0; unwritten != 0; beat++, unwritten >>= 1) {
+		if (!(unwritten & 1))
+			continue;
+		memcpy(data + beat * PISM_DATA_BYTES, dpp->dp_fill,
+		    PISM_DATA_BYTES);
+		if (dpn->dpn_count < dpn->dpn_max) {
+			dpr = &dpn->dpn_reads[dpn->dpn_count];
+			dpr->dpr_addr = dev->pd_base + addr +
+			    beat * PISM_DATA_BYTES;
+			dpr->dpr_cycle = pism_cycle_count_get(dev->pd_busno);
+		}
+		dpn->dpn_count++;
+	}
+}
+
+static void
+dram_poison_report(pism_device_t *dev, struct dram_poison *dpn)
+{
+	uint64_t i;
+
+	fprintf(stderr, "%s: %ju reads of unwritten memory\n", dev->pd_name,
+	    (uintmax_t)dpn->dpn_count);
+	for (i = 0; i < dpn->dpn_count && i < dpn->dpn_max; i++)
+		fprintf(stderr, "%s:   0x%016jx at cycle %ju\n", dev->pd_name,
+		    (uintmax_t)dpn->dpn_reads[i].dpr_addr,
+		    (uintmax_t)dpn->dpn_reads[i].dpr_cycle);
+}
+
+/*
+ * Offset of the tag bitmap in a shared memory object, and the object's
+ * length.
+ */
+static size_t
+dram_shm_tagoff(pism_device_t *dev)
+{
+
+	return (ROUNDUP(dev->pd_length, getpagesize()));
+}
+
+static size_t
+dram_shm_length(pism_device_t *dev)
+{
+
+	return (dram_shm_tagoff(dev) + DRAM_TAG_BYTES(dev->pd_length));
+}
+
+/*
+ * Back DRAM and its tags with a POSIX shared memory object, so that host
+ * tools can map the memory of a running simulation.  If a descriptor file
+ * is named, its base, length, object name and tag offset are published
+ * there for them to find.
+ */
+static uint8_t *
+dram_shm_map(pism_device_t *dev, struct dram_private *dpp, const char *name,
+    const char *descriptor)
+{
+	char buf[PATH_MAX];
+	FILE *fp;
+	uint8_t *data;
+	int fd;
+
+	if (name == NULL) {
+		snprintf(buf, sizeof(buf), "/pism.%d.%s", getpid(),
+		    dev->pd_name);
+		name = buf;
+	}
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		warn("%s: shm_open of %s failed on device %s", __func__, name,
+		    dev->pd_name);
+		return (NULL);
+	}
+	if (ftruncate(fd, dram_shm_length(dev)) < 0) {
+		warn("%s: ftruncate of %s failed on device %s", __func__,
+		    name, dev->pd_name);
+		goto error;
+	}
+	data = mmap(NULL, dram_shm_length(dev), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		warn("%s: mmap of %s failed on device %s", __func__, name,
+		    dev->pd_name);
+		goto error;
+	}
+	if (descriptor != NULL) {
+		fp = fopen(descriptor, "w");
+		if (fp == NULL ||
+		    fprintf(fp, "base 0x%jx\nlength 0x%jx\npath %s\n"
+		    "tags 0x%zx\ntagline %d\n", (uintmax_t)dev->pd_base,
+		    (uintmax_t)dev->pd_length, name, dram_shm_tagoff(dev),
+		    PISM_DATA_BYTES) < 0 || fclose(fp) != 0) {
+			warn("%s: write of %s failed on device %s", __func__,
+			    descriptor, dev->pd_name);
+			munmap(data, dram_shm_length(dev));
+			goto error;
+		}
+		dpp->dp_shmdesc = strdup(descriptor);
+		assert(dpp->dp_shmdesc != NULL);
+	}
+	dpp->dp_shmname = strdup(name);
+	assert(dpp->dp_shmname != NULL);
+	dpp->dp_shmfd = fd;
+	dpp->dp_tags = data + dram_shm_tagoff(dev);
+	return (data);
+
+error:
+	shm_unlink(name);
+	close(fd);
+	return (NULL);
+}
+
+/*
+ * Fields of an ELF image are in its own byte order.
+ */
+#define	DRAM_ELF16(eh, v)						\
+	((eh)->e_ident[EI_DATA] == ELFDATA2MSB ? be16toh(v) : le16toh(v))
+#define	DRAM_ELF32(eh, v)						\
+	((eh)->e_ident[EI_DATA] == ELFDATA2MSB ? be32toh(v) : le32toh(v))
+#define	DRAM_ELF64(eh, v)						\
+	((eh)->e_ident[EI_DATA] == ELFDATA2MSB ? be64toh(v) : le64toh(v))
+
+/*
+ * Segment load addresses may be MIPS virtual addresses in an unmapped
+ * segment, as when a linker script gives no separate load address; reduce
+ * those to physical addresses.
+ */
+static uint64_t
+dram_elf_paddr(uint64_t addr)
+{
+
+	if ((addr >> 62) == 2)			/* xkphys */
+		return (addr & DRAM_ELF_XKPHYS_MASK);
+	if (addr >= DRAM_ELF_KSEG0 && addr < DRAM_ELF_KSEG2)
+		return (addr & DRAM_ELF_KSEG_MASK);
+	return (addr);
+}
+
+/*
+ * Copy filesz bytes at offset in the image to dst.  Whole pages are mapped
+ * copy-on-write from the image instead if its layout allows, so that they
+ * are read only if the simulation touches them.  The segment must lie
+ * within the image, as pages mapped past its end would fault when touched.
+ */
+static bool
+dram_elf_segment(pism_device_t *dev, int fd, uint8_t *dst, off_t offset,
+    uint64_t filesz)
+{
+	struct stat sb;
+	uint8_t *start, *end;
+	size_t pagesize;
+	void *p;
+
+	if (fstat(fd, &sb) < 0) {
+		warn("%s: fstat failed on device %s", __func__, dev->pd_name);
+		return (false);
+	}
+	if (offset < 0 || offset > sb.st_size ||
+	    filesz > (uint64_t)(sb.st_size - offset)) {
+		warnx("%s: segment at offset 0x%jx, 0x%jx bytes, runs past "
+		    "the end of the image on device %s", __func__,
+		    (intmax_t)offset, (uintmax_t)filesz, dev->pd_name);
+		return (false);
+	}
+	pagesize = getpagesize();
+	start = dst;
+	end = dst;
+	if (((uintptr_t)dst - offset) % pagesize == 0) {
+		start = (uint8_t *)ROUNDUP((uintptr_t)dst, pagesize);
+		end = (uint8_t *)(((uintptr_t)dst + filesz) / pagesize *
+		    pagesize);
+		if (end <= start)
+			start = end = dst;
+	}
+	if (end > start) {
+		p = mmap(start, end - start, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_FIXED, fd, offset + (start - dst));
+		if (p == MAP_FAILED) {
+			warn("%s: mmap failed on device %s", __func__,
+			    dev->pd_name);
+			return (false);
+		}
+	}
+	if (pread(fd, dst, start - dst, offset) != start - dst ||
+	    pread(fd, end, dst + filesz - end, offset + (end - dst)) !=
+	    dst + filesz - end) {
+		warnx("%s: short read on device %s", __func__, dev->pd_name);
+		return (false);
+	}
 	return (true);
 }
 
+/*
+ * Load the PT_LOAD segments of an ELF image into zero-filled memory.  The
+ * memory beyond each segment's file contents is its BSS, which is already
+ * zero and so isn't touched, though it counts as written if dpn is set.
+ */
 static bool
-dram_str_to_type(const char *str, int *typep)
+dram_elf_load(pism_device_t *dev, uint8_t *data, const char *path,
+    struct dram_poison *dpn)
 {
-
-	if (strcmp(str, DRAM_TYPE_ZERO_STR) == 0) {
-		*typep = DRAM_TYPE_ZERO;
-		return (true);
-	} else if (strcmp(str, DRAM_TYPE_MMAP_STR) == 0) {
-		*typep = DRAM_TYPE_MMAP;
-		return (true);
+	Elf64_Ehdr eh;
+	Elf64_Phdr ph;
+	uint64_t addr, filesz, memsz, phoff;
+	u_int i, phentsize, phnum;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s: open of %s failed on device %s", __func__, path,
+		    dev->pd_name);
+		return (false);
+	}
+	if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) ||
+	    memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+	    eh.e_ident[EI_CLASS] != ELFCLASS64) {
+		warnx("%s: %s is not a 64-bit ELF image on device %s",
+		    __func__, path, dev->pd_name);
+		goto error;
 	}
+	phoff = DRAM_ELF64(&eh, eh.e_phoff);
+	phentsize = DRAM_ELF16(&eh, eh.e_phentsize);
+	phnum = DRAM_ELF16(&eh, eh.e_phnum);
+	if (phentsize < sizeof(ph)) {
+		warnx("%s: bad program header size in %s on device %s",
+		    __func__, path, dev->pd_name);
+		goto error;
+	}
+	for (i = 0; i < phnum; i++) {
+		if (pread(fd, &ph, sizeof(ph), phoff + i * phentsize) !=
+		    sizeof(ph)) {
+			warnx("%s: short read of %s on device %s", __func__,
+			    path, dev->pd_name);
+			goto error;
+		}
+		if (DRAM_ELF32(&eh, ph.p_type) != PT_LOAD)
+			continue;
+		addr = dram_elf_paddr(DRAM_ELF64(&eh, ph.p_paddr));
+		filesz = DRAM_ELF64(&eh, ph.p_filesz);
+		memsz = DRAM_ELF64(&eh, ph.p_memsz);
+		if (filesz > memsz || addr < dev->pd_base ||
+		    addr - dev->pd_base > dev->pd_length ||
+		    memsz > dev->pd_length - (addr - dev->pd_base)) {
+			warnx("%s: segment %u of %s at 0x%jx, 0x%jx bytes, "
+			    "doesn't fit device %s", __func__, i, path,
+			    (uintmax_t)addr, (uintmax_t)memsz, dev->pd_name);
+			goto error;
+		}
+		if (filesz != 0 && !dram_elf_segment(dev, fd,
+		    data + (addr - dev->pd_base),
+		    DRAM_ELF64(&eh, ph.p_offset), filesz))
+			goto error;
+		if (dpn != NULL)
+			dram_poison_write(dpn, addr - dev->pd_base, memsz);
+	}
+	close(fd);
+	return (true);
+
+error:
+	close(fd);
 	return (false);
 }
 
@@ -160,13 +1376,17 @@ dram_dev_init(pism_device_t *dev)
 	struct stat sb;
 	struct dram_private *dpp;
 	const char *option_type, *option_path, *option_cow, *option_delay;
+	const char *option_hugepages, *option_tagpath, *option_heatmap;
+	const char *option_descriptor;
+	struct dram_timing timing;
+	struct dram_heat *heat;
+	struct dram_poison *poison;
+	uint8_t fill[PISM_DATA_BYTES];
+	u_int heatmapperiod, poisonmax;
 	uint64_t length;
 	long long delayll;
-	int delay, fd, open_flags, dram_type, mmap_prot;
-	bool cow_flag;
-
-	DDBG(dev, "called for mapping at %jx, length %jx", dev->pd_base,
-	    dev->pd_length);
+	int delay, fd, open_flags, dram_type, hugepages, mmap_prot;
+	bool cow_flag, option_poison;
 
 	assert(dev->pd_base % PISM_DATA_BYTES == 0);
 	assert(dev->pd_length % PISM_DATA_BYTES == 0);
@@ -178,44 +1398,78 @@ dram_dev_init(pism_device_t *dev)
 		option_type = NULL;
 	if (!(pism_device_option_get(dev, DRAM_OPTION_PATH, &option_path)))
 		option_path = NULL;
+	if (!(pism_device_option_get(dev, DRAM_OPTION_TAGPATH,
+	    &option_tagpath)))
+		option_tagpath = NULL;
+	if (!(pism_device_option_get(dev, DRAM_OPTION_DESCRIPTOR,
+	    &option_descriptor)))
+		option_descriptor = NULL;
 	if (!(pism_device_option_get(dev, DRAM_OPTION_COW, &option_cow)))
 		option_cow = NULL;
 	if (!(pism_device_option_get(dev, DRAM_OPTION_DELAY, &option_delay)))
 		option_delay = NULL;
+	if (!(pism_device_option_get(dev, DRAM_OPTION_HUGEPAGES,
+	    &option_hugepages)))
+		option_hugepages = NULL;
 	if (option_type != NULL) {
 		if (!(dram_str_to_type(option_type, &dram_type))) {
 			warnx("%s: invalid DRAM type on device %s", __func__,
 			    dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 	} else
 		dram_type = DRAM_TYPE_DEFAULT;
 	if (option_cow != NULL) {
-		if (dram_type != DRAM_TYPE_MMAP) {
+		if (dram_type != DRAM_TYPE_MMAP && dram_type != DRAM_TYPE_ELF) {
 			warnx("%s: unexpected cow option on device %s",
 			    __func__, dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 		if (!(pism_device_option_parse_bool(dev, option_cow,
 		    &cow_flag))) {
 			warnx("%s: invalid cow option on device %s", __func__,
 			    dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 	} else
-		cow_flag = false;
-	if (dram_type == DRAM_TYPE_MMAP && option_path == NULL) {
-		warnx("%s: DRAM type mmap requires path on device %s",
+		cow_flag = (dram_type == DRAM_TYPE_ELF);
+	if (dram_type == DRAM_TYPE_ELF && !cow_flag) {
+		warnx("%s: DRAM type elf is always copy-on-write on device %s",
 		    __func__, dev->pd_name);
-		DDBG(dev, "returned - %d", false);
 		return (false);
-	} else if (dram_type != DRAM_TYPE_MMAP && option_path != NULL) {
+	}
+	if (option_hugepages != NULL) {
+		if (dram_type != DRAM_TYPE_SPARSE) {
+			warnx("%s: unexpected hugepages option on device %s",
+			    __func__, dev->pd_name);
+			return (false);
+		}
+		if (!(dram_str_to_hugepages(option_hugepages, &hugepages))) {
+			warnx("%s: invalid hugepages option on device %s",
+			    __func__, dev->pd_name);
+			return (false);
+		}
+	} else
+		hugepages = DRAM_HUGEPAGES_DEFAULT;
+	if ((dram_type == DRAM_TYPE_MMAP || dram_type == DRAM_TYPE_ELF) &&
+	    option_path == NULL) {
+		warnx("%s: DRAM type %s requires path on device %s",
+		    __func__, option_type, dev->pd_name);
+		return (false);
+	} else if (dram_type != DRAM_TYPE_MMAP && dram_type != DRAM_TYPE_ELF &&
+	    dram_type != DRAM_TYPE_SHM && option_path != NULL) {
 		warnx("%s: unexpected path option on device %s", __func__,
 		    dev->pd_name);
-		DDBG(dev, "returned - %d", false);
+		return (false);
+	}
+	if (dram_type != DRAM_TYPE_SHM && option_descriptor != NULL) {
+		warnx("%s: unexpected descriptor option on device %s",
+		    __func__, dev->pd_name);
+		return (false);
+	}
+	if (dram_type != DRAM_TYPE_MMAP && option_tagpath != NULL) {
+		warnx("%s: unexpected tagpath option on device %s", __func__,
+		    dev->pd_name);
 		return (false);
 	}
 	if (option_delay != NULL) {
@@ -223,26 +1477,64 @@ dram_dev_init(pism_device_t *dev)
 		    &delayll)) {
 			warnx("%s: invalid delay option on device %s",
 			    __func__, dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 		if (delayll < DRAM_DELAY_MINIMUM) {
 			warnx("%s: requested delay %lld below minimum %d on "
 			    "device %s", __func__, delayll,
 			    DRAM_DELAY_MINIMUM, dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 		if (delayll > DRAM_DELAY_MAXIMUM) {
 			warnx("%s: requested delay %lld above maximum %d on "
 			    "device %s", __func__, delayll,
 			    DRAM_DELAY_MAXIMUM, dev->pd_name);
-			DDBG(dev, "returned - %d", false);
 			return (false);
 		}
 		delay = delayll;
 	} else
 		delay = DRAM_DELAY_DEFAULT;
+	if (!dram_timing_options(dev, &timing))
+		return (false);
+	if (!(pism_device_option_get(dev, DRAM_OPTION_HEATMAP,
+	    &option_heatmap)))
+		option_heatmap = NULL;
+	heatmapperiod = DRAM_HEATMAPPERIOD_DEFAULT;
+	if (!dram_option_uint(dev, DRAM_OPTION_HEATMAPPERIOD, 1, UINT_MAX,
+	    &heatmapperiod))
+		return (false);
+	if (!dram_fill_option(dev, fill))
+		return (false);
+	poisonmax = 0;
+	if (!dram_option_uint(dev, DRAM_OPTION_POISON, 0, DRAM_POISON_MAXIMUM,
+	    &poisonmax))
+		return (false);
+	if (pism_device_option_get(dev, DRAM_OPTION_POISON, NULL)) {
+		if (dram_type == DRAM_TYPE_MMAP || dram_type == DRAM_TYPE_SHM) {
+			warnx("%s: unexpected poison option on device %s",
+			    __func__, dev->pd_name);
+			return (false);
+		}
+		option_poison = true;
+	} else
+		option_poison = false;
+
+	/*
+	 * From here on, anything set up must be undone on failure.
+	 */
+	dpp = NULL;
+	heat = NULL;
+	poison = NULL;
+	if (option_heatmap != NULL) {
+		heat = dram_heat_init(dev, option_heatmap, heatmapperiod);
+		if (heat == NULL)
+			goto fail;
+	}
+	if (option_poison) {
+		poison = dram_poison_init(dev, poisonmax);
+		if (poison == NULL)
+			goto fail;
+	}
 
 	const uint32_t fetch_store_perms = (PISM_PERM_ALLOW_FETCH | 
 			PISM_PERM_ALLOW_STORE);
@@ -259,7 +1551,38 @@ dram_dev_init(pism_device_t *dev)
 	case DRAM_TYPE_ZERO:
 		posix_memalign((void **)&dpp->dp_data, DRAM_ALIGN, dev->pd_length);
 		assert(dpp->dp_data != NULL);
-		DDBG(dev, "dp_data 0x%016lx\n", (uint64_t)dpp->dp_data);
+		PISM_LOG(dev, PISM_LOG_EV_CONFIG, (uintptr_t)dpp->dp_data,
+		    dev->pd_length);
+		break;
+
+	case DRAM_TYPE_SPARSE:
+		dpp->dp_data = dram_sparse_map(dev, hugepages);
+		if (dpp->dp_data == NULL)
+			goto fail;
+		PISM_LOG(dev, PISM_LOG_EV_CONFIG, (uintptr_t)dpp->dp_data,
+		    dev->pd_length);
+		break;
+
+	case DRAM_TYPE_ELF:
+		dpp->dp_data = dram_sparse_map(dev, DRAM_HUGEPAGES_NONE);
+		if (dpp->dp_data == NULL)
+			goto fail;
+		if (!dram_elf_load(dev, dpp->dp_data, option_path, poison)) {
+			munmap(dpp->dp_data, dev->pd_length);
+			goto fail;
+		}
+		PISM_LOG(dev, PISM_LOG_EV_CONFIG, (uintptr_t)dpp->dp_data,
+		    dev->pd_length);
+		break;
+
+	case DRAM_TYPE_SHM:
+		dpp->dp_data = dram_shm_map(dev, dpp, option_path,
+		    option_descriptor);
+		if (dpp->dp_data == NULL)
+			goto fail;
+		PISM_LOG(dev, PISM_LOG_EV_CONFIG, (uintptr_t)dpp->dp_data,
+		    dev->pd_length);
+		dpp->dp_shared = true;
 		break;
 
 	case DRAM_TYPE_MMAP:
@@ -285,17 +1608,13 @@ dram_dev_init(pism_device_t *dev)
 		if (fd < 0) {
 			warn("%s: open of %s failed on device %s", __func__,
 			    option_path, dev->pd_name);
-			free(dpp);
-			DDBG(dev, "returned - %d", false);
-			return (false);
+			goto fail;
 		}
 		if (fstat(fd, &sb) < 0) {
 			warn("%s: fstat of %s failed on device %s", __func__,
 			    option_path, dev->pd_name);
-			free(dpp);
 			close(fd);
-			DDBG(dev, "returned - %d", false);
-			return (false);
+			goto fail;
 		}
 		if (dev->pd_perms & PISM_PERM_ALLOW_CREATE) {
 			length = ROUNDUP(dev->pd_length, PISM_DATA_BYTES);
@@ -318,24 +1637,57 @@ dram_dev_init(pism_device_t *dev)
 		if (dpp->dp_data == MAP_FAILED) {
 			warn("%s: mmap of %s on device %s failed", __func__,
 			    option_path, dev->pd_name);
-			free(dpp);
 			close(fd);
-			DDBG(dev, "returned - %d", false);
-			return (false);
+			goto fail;
 		}
 		close(fd);
+		if (option_tagpath != NULL) {
+			dpp->dp_tags = dram_tags_map_file(dev, option_tagpath,
+			    open_flags, mmap_prot, cow_flag);
+			if (dpp->dp_tags == NULL) {
+				munmap(dpp->dp_data, dev->pd_length);
+				goto fail;
+			}
+		}
+		dpp->dp_shared = !cow_flag && (mmap_prot & PROT_WRITE);
 		break;
 
 	default:
 		assert(0);
 	}
 
+	if (dpp->dp_tags == NULL) {
+		dpp->dp_tags = dram_tags_map_zero(dev);
+		assert(dpp->dp_tags != NULL);
+	}
+	dpp->dp_reqs = calloc(dev->pd_depth, sizeof(*dpp->dp_reqs));
+	assert(dpp->dp_reqs != NULL);
+	dpp->dp_type = dram_type;
 	dpp->dp_delay = delay;
-	dpp->dp_reqfifo_empty = true;
+	if (timing.dt_nbanks != 0) {
+		dpp->dp_timing = malloc(sizeof(*dpp->dp_timing));
+		assert(dpp->dp_timing != NULL);
+		*dpp->dp_timing = timing;
+		dpp->dp_timing->dt_banks = calloc(timing.dt_nbanks,
+		    sizeof(*dpp->dp_timing->dt_banks));
+		assert(dpp->dp_timing->dt_banks != NULL);
+		dram_timing_reset(dpp->dp_timing);
+	}
+	dpp->dp_heat = heat;
+	dpp->dp_poison = poison;
+	memcpy(dpp->dp_fill, fill, sizeof(dpp->dp_fill));
 	dev->pd_private = dpp;
 
-	DDBG(dev, "returned - %d", true);
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, true);
 	return (true);
+
+fail:
+	if (heat != NULL)
+		dram_heat_free(heat);
+	if (poison != NULL)
+		dram_poison_free(dev, poison);
+	free(dpp);
+	return (false);
 }
 
 static bool
@@ -343,72 +1695,233 @@ dram_dev_request_ready(pism_device_t *dev, pism_data_t *req)
 {
 	struct dram_private *dpp;
 
-	DDBG(dev, "called - acctype %d", PISM_REQ_ACCTYPE(req));
-
 	dpp = dev->pd_private;
 	assert(dpp != NULL);
 
 	switch (PISM_REQ_ACCTYPE(req)) {
 	case PISM_ACC_STORE:
-		DDBG(dev, "returned - %d", true);
+		if (dpp->dp_timing != NULL)
+			return (dram_timing_ready(dpp->dp_timing,
+			    PISM_DEV_REQ_ADDR(dev, req),
+			    pism_cycle_count_get(dev->pd_busno)));
 		return (true);
 
 	case PISM_ACC_FETCH:
-		DDBG(dev, "returned - %d", dpp->dp_reqfifo_empty);
-		return (dpp->dp_reqfifo_empty);
+		return (dpp->dp_inflight < dev->pd_depth);
 
 	default:
-		DDBG(dev, "unknown request type");
+		PISM_LOG(dev, PISM_LOG_EV_ERROR, req->pd_int.pdi_addr,
+		    PISM_REQ_ACCTYPE(req));
 		assert(0);
 	}
 }
 
+/*
+ * Update the tags of nbeats lines from a store; see PISM_CAPTAG_BEAT().
+ * Host tools clear tags in shared memory DRAM as they write it, so updates
+ * there must be atomic.
+ */
+static inline void
+dram_tags_store(struct dram_private *dpp, uint64_t addr, u_int nbeats,
+    pism_data_t *req)
+{
+	uint64_t line;
+	u_int beat;
+	uint8_t bit;
+	bool set;
+
+	line = addr / PISM_DATA_BYTES;
+	for (beat = 0; beat < nbeats; beat++, line++) {
+		bit = 1 << (line % 8);
+		set = req->pd_int.pdi_byteenable == DRAM_BYTEENABLE_ALL &&
+		    PISM_CAPTAG_BEAT(req, beat);
+		if (dpp->dp_shared && dpp->dp_type == DRAM_TYPE_SHM) {
+			if (set)
+				__atomic_fetch_or(&dpp->dp_tags[line / 8], bit,
+				    __ATOMIC_RELAXED);
+			else
+				__atomic_fetch_and(&dpp->dp_tags[line / 8],
+				    (uint8_t)~bit, __ATOMIC_RELAXED);
+		} else if (set)
+			dpp->dp_tags[line / 8] |= bit;
+		else
+			dpp->dp_tags[line / 8] &= ~bit;
+	}
+}
+
+static inline uint8_t
+dram_tags_fetch(struct dram_private *dpp, uint64_t addr, u_int nbeats)
+{
+	uint64_t line;
+	u_int beat;
+	uint8_t captag;
+
+	captag = 0;
+	line = addr / PISM_DATA_BYTES;
+	for (beat = 0; beat < nbeats; beat++, line++)
+		captag |= ((dpp->dp_tags[line / 8] >> (line % 8)) & 1) << beat;
+	return (captag);
+}
+
+/*
+ * Write nbeats consecutive beats to DRAM, taking data from the request
+ * itself for a single beat, or from a separate buffer for a burst.  The byte
+ * enables apply to every beat, so a fully enabled request is one copy.
+ */
+static void
+dram_store(pism_device_t *dev, struct dram_private *dpp, pism_data_t *req,
+    u_int nbeats, const uint8_t *data)
+{
+	uint32_t byteenable;
+	uint8_t *p;
+	u_int beat;
+
+	p = dpp->dp_data + PISM_DEV_REQ_ADDR(dev, req);
+	assert(PISM_DEV_REQ_ADDR(dev, req) + nbeats * PISM_DATA_BYTES <=
+	    dev->pd_length);
+	assert(dpp->dp_data != NULL);
+	if (dpp->dp_timing != NULL)
+		(void)dram_timing_access(dpp->dp_timing,
+		    PISM_DEV_REQ_ADDR(dev, req), nbeats,
+		    pism_cycle_count_get(dev->pd_busno));
+	if (dpp->dp_heat != NULL)
+		dram_heat_touch(dpp->dp_heat, PISM_DEV_REQ_ADDR(dev, req),
+		    nbeats * PISM_DATA_BYTES, true,
+		    pism_cycle_count_get(dev->pd_busno));
+	dram_tags_store(dpp, PISM_DEV_REQ_ADDR(dev, req), nbeats, req);
+	if (dpp->dp_poison != NULL)
+		dram_poison_write(dpp->dp_poison, PISM_DEV_REQ_ADDR(dev, req),
+		    nbeats * PISM_DATA_BYTES);
+	if (data == NULL)
+		data = req->pd_int.pdi_data;
+	byteenable = req->pd_int.pdi_byteenable;
+	if (byteenable == DRAM_BYTEENABLE_ALL) {
+		memcpy(p, data, nbeats * PISM_DATA_BYTES);
+		return;
+	}
+	for (beat = 0; beat < nbeats; beat++) {
+		dram_blend(p, p, data, byteenable);
+		p += PISM_DATA_BYTES;
+		data += PISM_DATA_BYTES;
+	}
+}
+
+/*
+ * Queue a fetch of nbeats beats; data is NULL for a single beat, which is
+ * returned in the request itself.
+ */
+static void
+dram_fetch_enqueue(pism_device_t *dev, struct dram_private *dpp,
+    pism_data_t *req, u_int nbeats, uint8_t *data)
+{
+	struct dram_request *drp;
+	uint64_t done, now;
+	u_int i;
+
+	assert(dpp->dp_inflight < dev->pd_depth);
+	for (i = 0; dpp->dp_reqs[i].dr_valid; i++)
+		assert(i + 1 < dev->pd_depth);
+	drp = &dpp->dp_reqs[i];
+	memcpy(&drp->dr_req, req, sizeof(drp->dr_req));
+	drp->dr_data = data;
+	drp->dr_nbeats = nbeats;
+	now = pism_cycle_count_get(dev->pd_busno);
+	drp->dr_replycycle = now + dpp->dp_delay;
+	if (dpp->dp_timing != NULL) {
+		done = dram_timing_access(dpp->dp_timing,
+		    PISM_DEV_REQ_ADDR(dev, req), nbeats, now);
+		if (done > drp->dr_replycycle)
+			drp->dr_replycycle = done;
+	}
+	if (dpp->dp_heat != NULL)
+		dram_heat_touch(dpp->dp_heat, PISM_DEV_REQ_ADDR(dev, req),
+		    nbeats * PISM_DATA_BYTES, false, now);
+	drp->dr_seq = dpp->dp_seq++;
+	drp->dr_valid = true;
+	dpp->dp_inflight++;
+	dpp->dp_next = NULL;
+}
+
 static void
 dram_dev_request_put(pism_device_t *dev, pism_data_t *req)
 {
 	struct dram_private *dpp;
-	uint64_t addr;
-	int i;
 
-	DDBG(dev, "called - acctype %d", PISM_REQ_ACCTYPE(req));
+	dpp = dev->pd_private;
+	assert(dpp != NULL);
+
+	switch (PISM_REQ_ACCTYPE(req)) {
+	case PISM_ACC_STORE:
+		dram_store(dev, dpp, req, 1, NULL);
+		break;
+
+	case PISM_ACC_FETCH:
+		dram_fetch_enqueue(dev, dpp, req, 1, NULL);
+		break;
+
+	default:
+		assert(0);
+	}
+}
+
+static void
+dram_dev_request_put_burst(pism_device_t *dev, pism_data_t *req,
+    u_int nbeats, uint8_t *data)
+{
+	struct dram_private *dpp;
 
 	dpp = dev->pd_private;
 	assert(dpp != NULL);
 
 	switch (PISM_REQ_ACCTYPE(req)) {
 	case PISM_ACC_STORE:
-		addr = PISM_DEV_REQ_ADDR(dev, req);
-		for (i = 0; i < PISM_DATA_BYTES; i++) {
-			if (!PISM_REQ_BYTEENABLED(req, i))
-				continue;
-			assert(addr + i < dev->pd_length);
-			assert(dpp->dp_data != NULL);
-			dpp->dp_data[addr + i] = PISM_REQ_BYTE(req, i);
-		}
+		dram_store(dev, dpp, req, nbeats, data);
 		break;
 
 	case PISM_ACC_FETCH:
-		assert(dpp->dp_reqfifo_empty);
-		memcpy(&dpp->dp_reqfifo, req, sizeof(dpp->dp_reqfifo));
-		dpp->dp_reqfifo_empty = false;
-		dpp->dp_replycycle = pism_cycle_count_get(dev->pd_busno) + dpp->dp_delay;
+		dram_fetch_enqueue(dev, dpp, req, nbeats, data);
 		break;
 
 	default:
 		assert(0);
 	}
+}
 
-	DDBG(dev, "returned");
+/*
+ * Find the in-flight fetch whose reply is due soonest, preferring the oldest
+ * request among those due on the same cycle.  The answer is cached until a
+ * fetch is queued or replied to, as the bus asks every cycle until it is due.
+ */
+static struct dram_request *
+dram_dev_next_reply(pism_device_t *dev, struct dram_private *dpp)
+{
+	struct dram_request *drp, *next;
+	u_int i;
+
+	if (dpp->dp_next != NULL || dpp->dp_inflight == 0)
+		return (dpp->dp_next);
+	next = NULL;
+	for (i = 0; i < dev->pd_depth; i++) {
+		drp = &dpp->dp_reqs[i];
+		if (!drp->dr_valid)
+			continue;
+		if (next == NULL ||
+		    drp->dr_replycycle < next->dr_replycycle ||
+		    (drp->dr_replycycle == next->dr_replycycle &&
+		    drp->dr_seq < next->dr_seq))
+			next = drp;
+	}
+	dpp->dp_next = next;
+	return (next);
 }
 
 static bool
 dram_dev_response_ready(pism_device_t *dev)
 {
 	struct dram_private *dpp;
+	struct dram_request *drp;
 	bool ret;
 
-	DDBG(dev, "called");
-
 	dpp = dev->pd_private;
 	assert(dpp != NULL);
 
@@ -416,15 +1929,12 @@ dram_dev_response_ready(pism_device_t *dev)
 	 * Implement delay: don't allow the reply to a request to come out
 	 * before the scheduled reply cycle.
 	 */
-
-
-
-	if (dpp->dp_replycycle <= pism_cycle_count_get(dev->pd_busno))
-		ret = !dpp->dp_reqfifo_empty;
+	drp = dram_dev_next_reply(dev, dpp);
+	if (drp != NULL &&
+	    drp->dr_replycycle <= pism_cycle_count_get(dev->pd_busno))
+		ret = true;
 	else
 		ret = false;
-
-	DDBG(dev, "returned - %d", ret);
 	return (ret);
 }
 
@@ -432,18 +1942,23 @@ static pism_data_t
 dram_dev_response_get(pism_device_t *dev)
 {
 	struct dram_private *dpp;
+	struct dram_request *drp;
 	pism_data_t *req;
 	uint64_t addr;
-	int i;
-
-	DDBG(dev, "called");
+	uint32_t byteenable;
+	const uint8_t *p;
+	uint8_t *data, unwritten;
+	u_int beat;
 
 	dpp = dev->pd_private;
 	assert(dpp != NULL);
 
-	assert(!dpp->dp_reqfifo_empty);
-	dpp->dp_reqfifo_empty = true;
-	req = &dpp->dp_reqfifo;
+	drp = dram_dev_next_reply(dev, dpp);
+	assert(drp != NULL);
+	drp->dr_valid = false;
+	dpp->dp_inflight--;
+	dpp->dp_next = NULL;
+	req = &drp->dr_req;
 
 	switch (PISM_REQ_ACCTYPE(req)) {
 	case PISM_ACC_STORE:
@@ -453,20 +1968,34 @@ dram_dev_response_get(pism_device_t *dev)
 
 	case PISM_ACC_FETCH:
 		addr = PISM_DEV_REQ_ADDR(dev, req);
-		for (i = 0; i < PISM_DATA_BYTES; i++) {
-			if (PISM_REQ_BYTEENABLED(req, i)) {
-				assert(addr + i < dev->pd_length);
-				PISM_REQ_BYTE(req, i) =
-				    dpp->dp_data[addr + i];
-			} else
-				PISM_REQ_BYTE(req, i) = 0xab;	/* Filler. */
+		p = dpp->dp_data + addr;
+		data = (drp->dr_data != NULL) ? drp->dr_data :
+		    req->pd_int.pdi_data;
+		assert(addr + drp->dr_nbeats * PISM_DATA_BYTES <=
+		    dev->pd_length);
+		req->pd_int.pdi_captag = dram_tags_fetch(dpp, addr,
+		    drp->dr_nbeats);
+		byteenable = req->pd_int.pdi_byteenable;
+		if (byteenable == DRAM_BYTEENABLE_ALL)
+			memcpy(data, p, drp->dr_nbeats * PISM_DATA_BYTES);
+		else {
+			for (beat = 0; beat < drp->dr_nbeats; beat++)
+				dram_blend(data + beat * PISM_DATA_BYTES,
+				    dpp->dp_fill, p + beat * PISM_DATA_BYTES,
+				    byteenable);
+		}
+		if (dpp->dp_poison != NULL) {
+			unwritten = dram_poison_unwritten(dpp->dp_poison,
+			    addr, drp->dr_nbeats);
+			if (unwritten != 0)
+				dram_poison_fetch(dev, dpp, addr, unwritten,
+				    data);
 		}
 		break;
 
 	default:
 		assert(0);
 	}
-	DDBG(dev, "returned");
 	return (*req);
 }
 
@@ -474,21 +2003,318 @@ static bool
 dram_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
 {
 
-	DDBG(dev, "returned - %d", true);
+	return (true);
+}
+
+static bool
+dram_page_is_zero(const uint8_t *data, size_t len)
+{
+	const uint64_t *p;
+	size_t i;
+
+	p = (const uint64_t *)data;
+	for (i = 0; i < len / sizeof(*p); i++) {
+		if (p[i] != 0)
+			return (false);
+	}
+	for (i *= sizeof(*p); i < len; i++) {
+		if (data[i] != 0)
+			return (false);
+	}
+	return (true);
+}
+
+static size_t
+dram_page_len(uint64_t length, uint64_t offset)
+{
+
+	if (length - offset < DRAM_CHECKPOINT_PAGE)
+		return (length - offset);
+	return (DRAM_CHECKPOINT_PAGE);
+}
+
+/*
+ * Write the non-zero pages of a region.
+ */
+static bool
+dram_checkpoint_region(FILE *fp, const uint8_t *data, uint64_t length)
+{
+	uint64_t offset, end;
+	size_t len;
+
+	for (offset = 0; offset < length; offset += DRAM_CHECKPOINT_PAGE) {
+		len = dram_page_len(length, offset);
+		if (dram_page_is_zero(data + offset, len))
+			continue;
+		if (!pism_checkpoint_write(fp, &offset, sizeof(offset)) ||
+		    !pism_checkpoint_write(fp, data + offset, len))
+			return (false);
+	}
+	end = DRAM_CHECKPOINT_END;
+	return (pism_checkpoint_write(fp, &end, sizeof(end)));
+}
+
+/*
+ * The checkpoint holds the data pages and then the tag pages, followed by
+ * the bitmap of written lines if "poison" is set.  Reading pages of
+ * zero-filled DRAM that were never touched maps the host's shared zero page,
+ * so looking at every page doesn't commit them.  The contents of read-only
+ * DRAM can't have changed, so none is saved for it.
+ */
+static bool
+dram_dev_checkpoint(pism_device_t *dev, FILE *fp)
+{
+	struct dram_private *dpp;
+	uint64_t end;
+
+	dpp = dev->pd_private;
+	assert(dpp != NULL);
+	assert(dpp->dp_inflight == 0);
+
+	if (!pism_checkpoint_write(fp, &dev->pd_length,
+	    sizeof(dev->pd_length)))
+		return (false);
+	if (!(dev->pd_perms & PISM_PERM_ALLOW_STORE)) {
+		end = DRAM_CHECKPOINT_END;
+		return (pism_checkpoint_write(fp, &end, sizeof(end)) &&
+		    pism_checkpoint_write(fp, &end, sizeof(end)));
+	}
+	return (dram_checkpoint_region(fp, dpp->dp_data, dev->pd_length) &&
+	    dram_checkpoint_region(fp, dpp->dp_tags,
+	    DRAM_TAG_BYTES(dev->pd_length)) &&
+	    (dpp->dp_poison == NULL ||
+	    dram_checkpoint_region(fp, dpp->dp_poison->dpn_written,
+	    DRAM_TAG_BYTES(dev->pd_length))));
+}
+
+/*
+ * Pages absent from the checkpoint are zeroed, but only if they are not
+ * already zero, so that untouched memory stays untouched.  Sparse DRAM
+ * instead hands its pages back to the host, which refills them with zeroes
+ * if they are touched again.
+ */
+static void
+dram_zero_range(uint8_t *data, uint64_t length, uint64_t start, uint64_t end,
+    bool sparse)
+{
+	uint64_t offset;
+	size_t len;
+
+	if (sparse && end > start &&
+	    madvise(data + start, end - start, MADV_DONTNEED) == 0)
+		return;
+	for (offset = start; offset < end; offset += DRAM_CHECKPOINT_PAGE) {
+		len = dram_page_len(length, offset);
+		if (!dram_page_is_zero(data + offset, len))
+			memset(data + offset, 0, len);
+	}
+}
+
+static bool
+dram_restore_region(pism_device_t *dev, FILE *fp, uint8_t *data,
+    uint64_t length, bool sparse)
+{
+	uint64_t offset, next;
+
+	next = 0;
+	for (;;) {
+		if (!pism_checkpoint_read(fp, &offset, sizeof(offset)))
+			return (false);
+		if (offset == DRAM_CHECKPOINT_END)
+			break;
+		if (offset % DRAM_CHECKPOINT_PAGE != 0 || offset < next ||
+		    offset >= length ||
+		    !(dev->pd_perms & PISM_PERM_ALLOW_STORE)) {
+			warnx("%s: bad page offset %jx on device %s",
+			    __func__, (uintmax_t)offset, dev->pd_name);
+			return (false);
+		}
+		dram_zero_range(data, length, next, offset, sparse);
+		if (!pism_checkpoint_read(fp, data + offset,
+		    dram_page_len(length, offset)))
+			return (false);
+		next = offset + DRAM_CHECKPOINT_PAGE;
+	}
+	if (dev->pd_perms & PISM_PERM_ALLOW_STORE)
+		dram_zero_range(data, length, next, length, sparse);
+	return (true);
+}
+
+static bool
+dram_dev_restore(pism_device_t *dev, FILE *fp)
+{
+	struct dram_private *dpp;
+	uint64_t length;
+
+	dpp = dev->pd_private;
+	assert(dpp != NULL);
+	assert(dpp->dp_inflight == 0);
+
+	if (!pism_checkpoint_read(fp, &length, sizeof(length)))
+		return (false);
+	if (length != dev->pd_length) {
+		warnx("%s: checkpoint length %ju differs on device %s",
+		    __func__, (uintmax_t)length, dev->pd_name);
+		return (false);
+	}
+	if (!dram_restore_region(dev, fp, dpp->dp_data, dev->pd_length,
+	    dpp->dp_type == DRAM_TYPE_SPARSE) ||
+	    !dram_restore_region(dev, fp, dpp->dp_tags,
+	    DRAM_TAG_BYTES(dev->pd_length), dpp->dp_type != DRAM_TYPE_SHM &&
+	    !pism_device_option_get(dev, DRAM_OPTION_TAGPATH, NULL)))
+		return (false);
+	if (dpp->dp_poison != NULL && (dev->pd_perms & PISM_PERM_ALLOW_STORE) &&
+	    !dram_restore_region(dev, fp, dpp->dp_poison->dpn_written,
+	    DRAM_TAG_BYTES(dev->pd_length), true))
+		return (false);
+
+	/*
+	 * Timing state isn't saved; restore with all rows closed.
+	 */
+	if (dpp->dp_timing != NULL)
+		dram_timing_reset(dpp->dp_timing);
+	return (true);
+}
+
+/*
+ * Anonymous and copy-on-write DRAM is private to each child after fork(),
+ * but a shared file mapping must be replaced by a private one, so that
+ * children see the parent's memory without seeing each other's writes.
+ */
+static bool
+dram_remap_private_fd(pism_device_t *dev, const char *path, int fd,
+    void *addr, size_t length)
+{
+	void *data;
+
+	data = mmap(addr, length, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_FIXED, fd, 0);
+	if (data == MAP_FAILED) {
+		warn("%s: mmap of %s on device %s failed", __func__, path,
+		    dev->pd_name);
+		return (false);
+	}
+	assert(data == addr);
+	return (true);
+}
+
+static bool
+dram_remap_private(pism_device_t *dev, const char *path, void *addr,
+    size_t length)
+{
+	bool ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		warn("%s: open of %s failed on device %s", __func__, path,
+		    dev->pd_name);
+		return (false);
+	}
+	ret = dram_remap_private_fd(dev, path, fd, addr, length);
+	close(fd);
+	return (ret);
+}
+
+/*
+ * Each child writes its own heatmap, starting from the fork: the parent's
+ * finishes with the period in progress at the fork.
+ */
+static bool
+dram_heat_fork(pism_device_t *dev, struct dram_heat *dh)
+{
+	struct dram_heat_page *dhp;
+	const char *option_heatmap;
+	uint64_t page;
+
+	if (dh->dh_fp == NULL)
+		return (true);
+	fclose(dh->dh_fp);
+	dh->dh_fp = NULL;
+	for (page = 0; page < dh->dh_npages; page++) {
+		dhp = &dh->dh_pages[page];
+		if (dhp->dhp_reads != 0 || dhp->dhp_writes != 0) {
+			dhp->dhp_reads = 0;
+			dhp->dhp_writes = 0;
+		}
+	}
+	if (!pism_device_option_get(dev, DRAM_OPTION_HEATMAP,
+	    &option_heatmap))
+		assert(0);
+	if (!dram_heat_open(dev, dh, option_heatmap)) {
+		pism_timer_cancel(&dh->dh_timer);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+dram_dev_fork(pism_device_t *dev, int child)
+{
+	struct dram_private *dpp;
+	const char *option_path, *option_tagpath;
+
+	dpp = dev->pd_private;
+	assert(dpp != NULL);
+	if (dpp->dp_heat != NULL && !dram_heat_fork(dev, dpp->dp_heat))
+		return (false);
+	if (!dpp->dp_shared)
+		return (true);
+	if (dpp->dp_type == DRAM_TYPE_SHM) {
+		/*
+		 * The parent's object stays published; children's memory
+		 * isn't visible to host tools.
+		 */
+		if (!dram_remap_private_fd(dev, dpp->dp_shmname, dpp->dp_shmfd,
+		    dpp->dp_data, dram_shm_length(dev)))
+			return (false);
+		dpp->dp_shared = false;
+		return (true);
+	}
+	if (!pism_device_option_get(dev, DRAM_OPTION_PATH, &option_path))
+		assert(0);
+	if (!dram_remap_private(dev, option_path, dpp->dp_data,
+	    dev->pd_length))
+		return (false);
+	if (pism_device_option_get(dev, DRAM_OPTION_TAGPATH,
+	    &option_tagpath) &&
+	    !dram_remap_private(dev, option_tagpath, dpp->dp_tags,
+	    DRAM_TAG_BYTES(dev->pd_length)))
+		return (false);
+	dpp->dp_shared = false;
 	return (true);
 }
 
 static const char *dram_option_list[] = {
 	DRAM_OPTION_TYPE,
 	DRAM_OPTION_PATH,
+	DRAM_OPTION_TAGPATH,
+	DRAM_OPTION_DESCRIPTOR,
 	DRAM_OPTION_COW,
 	DRAM_OPTION_DELAY,
+	DRAM_OPTION_HUGEPAGES,
+	DRAM_OPTION_BANKS,
+	DRAM_OPTION_ROWSIZE,
+	DRAM_OPTION_ROWHIT,
+	DRAM_OPTION_ROWMISS,
+	DRAM_OPTION_PRECHARGE,
+	DRAM_OPTION_REFRESH,
+	DRAM_OPTION_REFRESHTIME,
+	DRAM_OPTION_BANDWIDTH,
+	DRAM_OPTION_HEATMAP,
+	DRAM_OPTION_HEATMAPPERIOD,
+	DRAM_OPTION_FILL1,
+	DRAM_OPTION_FILL2,
+	DRAM_OPTION_FILL4,
+	DRAM_OPTION_FILL8,
+	DRAM_OPTION_POISON,
 	NULL
 };
 
 PISM_MODULE_INFO(dram_module) = {
 	.pm_name = "dram",
 	.pm_option_list = dram_option_list,
+	.pm_flags = PISM_MODULE_FLAG_UNORDERED,
 	.pm_mod_init = dram_mod_init,
 	.pm_dev_init = dram_dev_init,
 	.pm_dev_request_ready = dram_dev_request_ready,
@@ -496,4 +2322,8 @@ PISM_MODULE_INFO(dram_module) = {
 	.pm_dev_response_ready = dram_dev_response_ready,
 	.pm_dev_response_get = dram_dev_response_get,
 	.pm_dev_addr_valid = dram_dev_addr_valid,
+	.pm_dev_request_put_burst = dram_dev_request_put_burst,
+	.pm_dev_checkpoint = dram_dev_checkpoint,
+	.pm_dev_restore = dram_dev_restore,
+	.pm_dev_fork = dram_dev_fork,
 };
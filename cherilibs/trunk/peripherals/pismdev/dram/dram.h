@@ -33,16 +33,147 @@
  * @BERI_LICENSE_HEADER_END@
  */
 
+/*
+ * A fetch in flight in a DRAM device.
+ */
+struct dram_request {
+	pism_data_t	 dr_req;
+	uint8_t		*dr_data;	/* Burst data, or NULL. */
+	u_int		 dr_nbeats;
+	uint64_t	 dr_replycycle;	/* Earliest cycle reply permitted. */
+	uint64_t	 dr_seq;	/* Order in which requests were put. */
+	bool		 dr_valid;
+};
+
+/*
+ * Optional banked timing model; see dram.c.  Cycle numbers are absolute.
+ */
+struct dram_bank {
+	uint64_t	 db_row;	/* Open row, or DRAM_ROW_NONE. */
+	uint64_t	 db_ready;	/* Cycle bank can take a command. */
+	uint64_t	 db_refresh;	/* Refresh period row opened in. */
+};
+
+struct dram_timing {
+	struct dram_bank	*dt_banks;
+	u_int			 dt_nbanks;	/* Power of two. */
+	u_int			 dt_rowshift;	/* log2(row size). */
+	u_int			 dt_hit;	/* Row-hit latency. */
+	u_int			 dt_miss;	/* Activate + access latency. */
+	u_int			 dt_precharge;	/* Close an open row. */
+	u_int			 dt_refresh;	/* Refresh interval, or 0. */
+	u_int			 dt_refreshtime; /* Cycles each refresh. */
+	u_int			 dt_bandwidth;	/* Bytes/cycle, or 0. */
+	/* Cycles to move n beats through the port, indexed by n. */
+	u_int			 dt_xfer[PISM_BURST_MAX_BEATS + 1];
+	uint64_t		 dt_port_ready;	/* Cycle port is free. */
+	uint64_t		 dt_period;	/* Cached refresh period... */
+	uint64_t		 dt_period_start; /* ...and its first cycle. */
+
+	/*
+	 * The decode of the store last found ready, for its put to reuse if
+	 * nothing has happened in between.
+	 */
+	struct dram_bank	*dt_ready_bank;	/* NULL if none. */
+	uint64_t		 dt_ready_addr;
+	uint64_t		 dt_ready_now;
+	uint64_t		 dt_ready_row;
+	uint64_t		 dt_ready_period;
+};
+
+/*
+ * Optional access heatmap; see dram.c.  Counters are per DRAM_HEAT_PAGE
+ * bytes and cover the current snapshot period; first and last touch cycles
+ * are cumulative.  dhp_first is the first touch cycle plus one, so that a
+ * zero-filled page has never been touched.
+ */
+#define	DRAM_HEAT_PAGE		4096
+
+struct dram_heat_page {
+	uint32_t	dhp_reads;
+	uint32_t	dhp_writes;
+	uint64_t	dhp_first;
+	uint64_t	dhp_last;
+};
+
+struct dram_heat {
+	struct dram_heat_page	*dh_pages;
+	uint64_t		 dh_npages;
+	uint64_t		 dh_period;	/* Cycles between snapshots. */
+	FILE			*dh_fp;
+	struct pism_timer	 dh_timer;
+};
+
+/*
+ * Heatmap file format, read by dramheat: a header, then a snapshot header
+ * at the end of each period followed by one record for each page accessed
+ * during it.  All fields are host-endian.
+ */
+#define	DRAM_HEAT_MAGIC		"DRAMHEAT"
+#define	DRAM_HEAT_VERSION	1
+#define	DRAM_HEAT_NAME_LEN	32
+
+struct dram_heat_header {
+	char		dhh_magic[8];
+	uint32_t	dhh_version;
+	uint32_t	dhh_pagesize;
+	uint64_t	dhh_base;
+	uint64_t	dhh_length;
+	uint64_t	dhh_period;
+	char		dhh_name[DRAM_HEAT_NAME_LEN];
+};
+
+struct dram_heat_snapshot {
+	uint64_t	dhs_cycle;	/* Cycle at end of period. */
+	uint64_t	dhs_npages;	/* Records that follow. */
+};
+
+struct dram_heat_record {
+	uint64_t	dhr_page;	/* Page number within device. */
+	uint32_t	dhr_reads;
+	uint32_t	dhr_writes;
+	uint64_t	dhr_first;
+	uint64_t	dhr_last;
+};
+
+/*
+ * Optional detection of reads of uninitialised memory; see dram.c.
+ * dpn_written has a bit for each PISM_DATA_BYTES line, set once the line has
+ * been written.
+ */
+struct dram_poison_read {
+	uint64_t	dpr_addr;
+	uint64_t	dpr_cycle;
+};
+
+struct dram_poison {
+	uint8_t			*dpn_written;
+	struct dram_poison_read	*dpn_reads;	/* First dpn_max reads. */
+	u_int			 dpn_max;
+	uint64_t		 dpn_count;	/* All reads of unwritten lines. */
+};
+
 /*
  * Data structure describing per-DRAM instance fields, hung off of
- * pism_device_t->pd_private.  Once we support pipelining, dp_reqfifo will
- * need to actually be a FIFO, and the reply cycle will be per-entry.
+ * pism_device_t->pd_private.  Up to pd_depth fetches may be in flight, each
+ * with its own reply cycle; responses are returned as they fall due, so the
+ * module is marked PISM_MODULE_FLAG_UNORDERED.
  */
 struct dram_private {
-	uint8_t		*dp_data;
-	pism_data_t	 dp_reqfifo;
-	bool		 dp_reqfifo_empty;
-	uint		 dp_delay;
-	uint64_t	 dp_replycycle;	/* Earliest cycle reply permitted. */
+	uint8_t			*dp_data;
+	uint8_t			*dp_tags;	/* CHERI tag bit per line. */
+	struct dram_request	*dp_reqs;	/* pd_depth entries. */
+	u_int			 dp_inflight;
+	struct dram_request	*dp_next;	/* Next reply, or NULL if unknown. */
+	uint64_t		 dp_seq;
+	int			 dp_type;	/* DRAM_TYPE_*. */
+	uint			 dp_delay;
+	struct dram_timing	*dp_timing;	/* NULL for fixed delay. */
+	struct dram_heat	*dp_heat;	/* NULL unless profiling. */
+	struct dram_poison	*dp_poison;	/* NULL unless detecting. */
+	uint8_t			 dp_fill[PISM_DATA_BYTES]; /* Fill word. */
+	bool			 dp_shared;	/* Writable MAP_SHARED file. */
+	char			*dp_shmname;	/* Shared memory object... */
+	char			*dp_shmdesc;	/* ...its descriptor file... */
+	int			 dp_shmfd;	/* ...and descriptor. */
 };
-
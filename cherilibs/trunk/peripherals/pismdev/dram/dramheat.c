@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * dramheat: summarise a DRAM access heatmap, written if a dram device had
+ * the "heatmap" option set: the working set of each snapshot period, then
+ * the hottest pages over the whole run.
+ */
+
+#include <sys/queue.h>
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pismdev/pism.h"
+#include "pismdev/dram/dram.h"
+
+#define	DRAMHEAT_TOP_DEFAULT	20
+
+struct dramheat_page {
+	uint64_t	dp_reads;
+	uint64_t	dp_writes;
+	uint64_t	dp_first;
+	uint64_t	dp_last;
+	bool		dp_touched;
+};
+
+static struct dramheat_page	*dramheat_pages;
+
+static int
+dramheat_compare(const void *a, const void *b)
+{
+	const struct dramheat_page *pa, *pb;
+	uint64_t ta, tb;
+
+	pa = &dramheat_pages[*(const uint64_t *)a];
+	pb = &dramheat_pages[*(const uint64_t *)b];
+	ta = pa->dp_reads + pa->dp_writes;
+	tb = pb->dp_reads + pb->dp_writes;
+	if (ta != tb)
+		return (ta < tb ? 1 : -1);
+	return (*(const uint64_t *)a < *(const uint64_t *)b ? -1 : 1);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "Usage: dramheat [-n top] filename\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct dram_heat_header dhh;
+	struct dram_heat_snapshot dhs;
+	struct dram_heat_record dhr;
+	struct dramheat_page *dp;
+	uint64_t i, npages, nsorted, *sorted, reads, writes, total;
+	unsigned long top;
+	char *endp;
+	FILE *fp;
+	int ch;
+
+	top = DRAMHEAT_TOP_DEFAULT;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			top = strtoul(optarg, &endp, 0);
+			if (*optarg == '\0' || *endp != '\0')
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if ((fp = fopen(argv[0], "r")) == NULL)
+		err(2, "%s", argv[0]);
+	if (fread(&dhh, sizeof(dhh), 1, fp) != 1)
+		errx(3, "%s: short header", argv[0]);
+	if (memcmp(dhh.dhh_magic, DRAM_HEAT_MAGIC, sizeof(dhh.dhh_magic)) != 0)
+		errx(3, "%s: not a DRAM heatmap", argv[0]);
+	if (dhh.dhh_version != DRAM_HEAT_VERSION || dhh.dhh_pagesize == 0)
+		errx(3, "%s: unsupported version %u, page size %u", argv[0],
+		    dhh.dhh_version, dhh.dhh_pagesize);
+	dhh.dhh_name[sizeof(dhh.dhh_name) - 1] = '\0';
+	npages = (dhh.dhh_length + dhh.dhh_pagesize - 1) / dhh.dhh_pagesize;
+	dramheat_pages = calloc(npages, sizeof(*dramheat_pages));
+	if (dramheat_pages == NULL)
+		err(4, "calloc");
+
+	printf("%s: base 0x%jx length 0x%jx, %u-byte pages, period %ju "
+	    "cycles\n\n", dhh.dhh_name, (uintmax_t)dhh.dhh_base,
+	    (uintmax_t)dhh.dhh_length, dhh.dhh_pagesize,
+	    (uintmax_t)dhh.dhh_period);
+	printf("%20s %10s %12s %12s %12s %12s\n", "cycle", "pages", "KB",
+	    "reads", "writes", "total KB");
+	nsorted = 0;
+	while (fread(&dhs, sizeof(dhs), 1, fp) == 1) {
+		reads = writes = 0;
+		for (i = 0; i < dhs.dhs_npages; i++) {
+			if (fread(&dhr, sizeof(dhr), 1, fp) != 1)
+				errx(3, "%s: truncated snapshot at cycle %ju",
+				    argv[0], (uintmax_t)dhs.dhs_cycle);
+			if (dhr.dhr_page >= npages)
+				errx(3, "%s: page %ju out of range", argv[0],
+				    (uintmax_t)dhr.dhr_page);
+			dp = &dramheat_pages[dhr.dhr_page];
+			if (!dp->dp_touched) {
+				dp->dp_touched = true;
+				dp->dp_first = dhr.dhr_first;
+				nsorted++;
+			}
+			dp->dp_reads += dhr.dhr_reads;
+			dp->dp_writes += dhr.dhr_writes;
+			dp->dp_last = dhr.dhr_last;
+			reads += dhr.dhr_reads;
+			writes += dhr.dhr_writes;
+		}
+		printf("%20ju %10ju %12ju %12ju %12ju %12ju\n",
+		    (uintmax_t)dhs.dhs_cycle, (uintmax_t)dhs.dhs_npages,
+		    (uintmax_t)dhs.dhs_npages * dhh.dhh_pagesize / 1024,
+		    (uintmax_t)reads, (uintmax_t)writes,
+		    (uintmax_t)nsorted * dhh.dhh_pagesize / 1024);
+	}
+	if (ferror(fp))
+		err(4, "%s", argv[0]);
+	fclose(fp);
+
+	sorted = calloc(nsorted == 0 ? 1 : nsorted, sizeof(*sorted));
+	if (sorted == NULL)
+		err(4, "calloc");
+	for (i = 0, nsorted = 0; i < npages; i++)
+		if (dramheat_pages[i].dp_touched)
+			sorted[nsorted++] = i;
+	qsort(sorted, nsorted, sizeof(*sorted), dramheat_compare);
+
+	printf("\n%18s %12s %12s %12s %20s %20s\n", "address", "reads",
+	    "writes", "total", "first", "last");
+	for (i = 0; i < nsorted && i < top; i++) {
+		dp = &dramheat_pages[sorted[i]];
+		total = dp->dp_reads + dp->dp_writes;
+		printf("0x%016jx %12ju %12ju %12ju %20ju %20ju\n",
+		    (uintmax_t)(dhh.dhh_base + sorted[i] * dhh.dhh_pagesize),
+		    (uintmax_t)dp->dp_reads, (uintmax_t)dp->dp_writes,
+		    (uintmax_t)total, (uintmax_t)dp->dp_first,
+		    (uintmax_t)dp->dp_last);
+	}
+	free(sorted);
+	free(dramheat_pages);
+	return (0);
+}
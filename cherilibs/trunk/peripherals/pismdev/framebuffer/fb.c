@@ -74,25 +74,16 @@ static SDL_Surface *screen;
 /*
  * We trigger an SDL update at least frequent intervals than memory writes in
  * order to avoid high refresh costs.  To this end, remember what bits of the
- * screen have been written.
+ * screen have been written.  The update timer is only armed while there is
+ * something to update.
  */
-static uint64_t	cycle_last_tick;
+static struct pism_timer fb_update_timer;
 static uint64_t	cycle_last_update;
 static u_int	x_lower = -1, x_upper = -1;
 static u_int	y_lower = -1, y_upper = -1;
 
 #define	UPDATE_RATE	50000
 
-static char	*g_fb_debug = NULL;
-#define	UDBG(...)	do	{		\
-	if (g_fb_debug == NULL) {		\
-		break;				\
-	}					\
-	printf("%s(%d): ", __func__, __LINE__);	\
-	printf(__VA_ARGS__);			\
-	printf("\n");				\
-} while (0)
-
 #define	FRAMEBUFFER_BASE	(CHERI_FRAMEBUF_BASE)
 #define	FRAMEBUFFER_LENGTH	(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 2)
 #define	TOUCHSCREEN_BASE	(CHERI_TOUCHSCREEN_BASE)
@@ -140,11 +131,23 @@ putpixel(SDL_Surface *surface, int x, int y, uint32_t pixel)
 	}
 }
 
+static void
+fb_update(pism_device_t *dev, void *arg)
+{
+
+	if (x_lower == -1)
+		return;
+	SDL_UpdateRect(screen, x_lower, y_lower, x_upper - x_lower + 1,
+	    y_upper - y_lower + 1);
+	x_lower = x_upper = -1;
+	y_lower = y_upper = -1;
+	cycle_last_update = pism_cycle_count_get(dev->pd_busno);
+}
+
 static bool
 fb_mod_init(pism_module_t *mod)
 {
 
-	g_fb_debug = getenv("CHERI_DEBUG_FB");
 	return (true);
 }
 
@@ -176,6 +179,7 @@ fb_dev_init(pism_device_t *dev)
 		return (false);
 	}
 	fb_counter++;
+	pism_timer_init(&fb_update_timer, dev, fb_update, NULL);
 
 	if (pism_device_option_get(dev, FRAMEBUFFER_OPTION_LAZY, &optval)) {
 		if (!(pism_device_option_parse_bool(dev, optval, &lazy))) {
@@ -341,6 +345,9 @@ framebuffer_request_put(struct pism_data_int *pd_int)
 		if (tmp > y_upper)
 			y_upper = tmp;
 	}
+	if (!pism_timer_pending(&fb_update_timer))
+		pism_timer_schedule(&fb_update_timer,
+		    cycle_last_update + UPDATE_RATE);
 }
 
 static void
@@ -455,25 +462,6 @@ fb_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
 	return (0);
 }
 
-static void
-fb_dev_cycle_tick(pism_device_t *dev)
-{
-
-	if (!fb_initialised)
-		return;
-
-	cycle_last_tick++;
-	if (cycle_last_tick < cycle_last_update + UPDATE_RATE)
-		return;
-	if (x_lower == -1)
-		return;
-	SDL_UpdateRect(screen, x_lower, y_lower, x_upper - x_lower + 1,
-	    y_upper - y_lower + 1);
-	x_lower = x_upper = -1;
-	y_lower = y_upper = -1;
-	cycle_last_update = cycle_last_tick;
-}
-
 static const char *framebuffer_option_list[] = {
 	FRAMEBUFFER_OPTION_LAZY,
 	NULL
@@ -489,5 +477,4 @@ PISM_MODULE_INFO(fb_module) = {
 	.pm_dev_response_ready = fb_dev_response_ready,
 	.pm_dev_response_get = fb_dev_response_get,
 	.pm_dev_addr_valid = fb_dev_addr_valid,
-	.pm_dev_cycle_tick = fb_dev_cycle_tick,
 };
@@ -50,19 +50,6 @@
 #include "pismdev/cheri.h"
 #include "y.tab.h"
 
-/*
- * Debugging for this file.
- */
-static char	*g_pism_debug = NULL;
-#define	PDBG(busno, ...)	do	{				\
-	if (g_pism_debug == NULL) {					\
-		break;							\
-	};								\
-	printf("%s(%s:%d) bus %d: ", __func__, __FILE__, __LINE__, busno); \
-	printf(__VA_ARGS__);						\
-	printf("\n");							\
-} while (0)
-
 /*
  * Global variables.
  */
@@ -74,6 +61,7 @@ struct pism_devices *g_pism_devices[PISM_BUS_COUNT] =
 struct pism_modules pism_modules_head;
 struct pism_modules *g_pism_modules = &pism_modules_head;
 static bool pism_modules_initialised = false;
+static bool pism_globals_initialised = false;
 
 extern FILE *yyin;
 extern const char *yyfile;
@@ -86,6 +74,28 @@ extern int yyparse(void);
 static uint64_t pism_cycle_count[PISM_BUS_COUNT];
 
 static bool pism_initialized[PISM_BUS_COUNT] = {false, false, false};
+static uint32_t pism_interrupts_last[PISM_BUS_COUNT];
+
+/*
+ * Devices whose modules implement pm_dev_cycle_tick, so that
+ * pism_cycle_tick() need not walk devices that don't.
+ */
+static pism_device_t	**pism_ticklist[PISM_BUS_COUNT];
+static u_int		pism_ticklist_count[PISM_BUS_COUNT];
+
+/*
+ * Per-bus hashed timer wheel: a pending timer lives on the slot for its
+ * cycle modulo the wheel size, so each tick only visits one slot.  Timers
+ * more than a revolution away share the slot and are skipped until due.
+ */
+#define	PISM_TIMER_WHEEL_SLOTS	1024	/* Must be a power of two. */
+LIST_HEAD(pism_timer_list, pism_timer);
+static struct pism_timer_list	pism_timer_wheel[PISM_BUS_COUNT]
+				    [PISM_TIMER_WHEEL_SLOTS];
+
+static void	pism_bus_ticklist_build(uint8_t busno);
+static void	pism_queue_init(uint8_t busno, const char *depth_env_name,
+		    const char *tagged_env_name);
 
 void *
 pism_dev_get_private(uint8_t busno, const char *name)
@@ -117,12 +127,7 @@ pism_init(uint8_t busno)
 	struct pism_module *pm;
 	bool ret;
 	const char *conf_env_name, *conf_filename;
-
-	// XXX cr437: we should possibly have seperate ones for each bus
-	// additionally, debug doesn't happen if init not called first...
-	g_pism_debug = getenv("CHERI_DEBUG_PISM");
-
-	PDBG(busno, "called");
+	const char *depth_env_name, *tagged_env_name;
 
 	assert(busno == PISM_BUSNO_MEMORY || 
 			busno == PISM_BUSNO_PERIPHERAL || 
@@ -131,6 +136,17 @@ pism_init(uint8_t busno)
 
 	pism_initialized[busno] = true;
 	yybusno = busno;
+	/* Process-wide facilities, set up by whichever bus comes first. */
+	if (!pism_globals_initialised) {
+		pism_stats_init();
+		pism_prof_init();
+		pism_fork_init();
+		pism_overlay_init();
+#ifdef PISM_LOGGING
+		pism_log_init();
+#endif
+		pism_globals_initialised = true;
+	}
 
 	SLIST_INIT(g_pism_devices[busno]);
 	if (!pism_modules_initialised) {
@@ -142,19 +158,27 @@ pism_init(uint8_t busno)
 	case PISM_BUSNO_MEMORY:
 		conf_env_name = "CHERI_MEMORY_CONFIG";
 		conf_filename = "./memoryconfig";
+		depth_env_name = "CHERI_MEMORY_QUEUE_DEPTH";
+		tagged_env_name = "CHERI_MEMORY_TAGGED";
 		break;
 	case PISM_BUSNO_PERIPHERAL:
 		conf_env_name = "CHERI_PERIPHERAL_CONFIG";
 		conf_filename = "./peripheralconfig";
+		depth_env_name = "CHERI_PERIPHERAL_QUEUE_DEPTH";
+		tagged_env_name = "CHERI_PERIPHERAL_TAGGED";
 		break;
 	case PISM_BUSNO_TRACE:
 		conf_env_name = "CHERI_TRACE_CONFIG";
 		conf_filename = "./traceconfig";
+		depth_env_name = "CHERI_TRACE_QUEUE_DEPTH";
+		tagged_env_name = "CHERI_TRACE_TAGGED";
 		break;
 	default:
 		assert(0); /* something's gone really badly wrong. */
 	}
 
+	pism_queue_init(busno, depth_env_name, tagged_env_name);
+
 	g_cheri_config = getenv(conf_env_name);
 	if (g_cheri_config == NULL)
 		g_cheri_config = strdup(conf_filename);
@@ -165,6 +189,9 @@ pism_init(uint8_t busno)
 	if (yyparse() != 0)
 		err(3, "Couldn't parse %s", g_cheri_config);
 
+	pism_bus_decoder_build(busno);
+	pism_bus_ticklist_build(busno);
+
 	SLIST_FOREACH(pm, g_pism_modules, pm_next) {
 		if (!pm->pm_initialised) {
 			ret = pm->pm_mod_init(pm);
@@ -179,91 +206,583 @@ pism_init(uint8_t busno)
 
 	g_cheri_config = NULL; /* use same global for trace & sim. */
 
-	PDBG(busno, "returned %d", true);
+	PISM_LOG_BUS(busno, PISM_LOG_EV_INIT, 0, true);
 	return (true);
 }
 
+/*
+ * Wrappers for module methods, so that host time spent in each can be
+ * profiled.
+ */
+static inline bool
+pism_method_request_ready(pism_device_t *dev, pism_data_t *req)
+{
+	uint64_t start;
+	bool ret;
+
+	PISM_PROF_START(start);
+	ret = dev->pd_mod->pm_dev_request_ready(dev, req);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_REQUEST_READY, start);
+	return (ret);
+}
+
+static inline void
+pism_method_request_put(pism_device_t *dev, pism_data_t *req)
+{
+	uint64_t start;
+
+	PISM_PROF_START(start);
+	dev->pd_mod->pm_dev_request_put(dev, req);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_REQUEST_PUT, start);
+}
+
+static inline void
+pism_method_request_put_burst(pism_device_t *dev, pism_data_t *req,
+    u_int nbeats, uint8_t *data)
+{
+	uint64_t start;
+
+	PISM_PROF_START(start);
+	dev->pd_mod->pm_dev_request_put_burst(dev, req, nbeats, data);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_REQUEST_PUT_BURST, start);
+}
+
+static inline bool
+pism_method_response_ready(pism_device_t *dev)
+{
+	uint64_t start;
+	bool ret;
+
+	PISM_PROF_START(start);
+	ret = dev->pd_mod->pm_dev_response_ready(dev);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_RESPONSE_READY, start);
+	return (ret);
+}
+
+static inline pism_data_t
+pism_method_response_get(pism_device_t *dev)
+{
+	pism_data_t ret;
+	uint64_t start;
+
+	PISM_PROF_START(start);
+	ret = dev->pd_mod->pm_dev_response_get(dev);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_RESPONSE_GET, start);
+	return (ret);
+}
+
+static inline bool
+pism_method_addr_valid(pism_device_t *dev, pism_data_t *req)
+{
+	uint64_t start;
+	bool ret;
+
+	PISM_PROF_START(start);
+	ret = dev->pd_mod->pm_dev_addr_valid(dev, req);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_ADDR_VALID, start);
+	return (ret);
+}
+
+static inline bool
+pism_method_interrupt_get(pism_device_t *dev)
+{
+	uint64_t start;
+	bool ret;
+
+	PISM_PROF_START(start);
+	ret = dev->pd_mod->pm_dev_interrupt_get(dev);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_INTERRUPT_GET, start);
+	return (ret);
+}
+
+static inline void
+pism_method_cycle_tick(pism_device_t *dev)
+{
+	uint64_t start;
+
+	PISM_PROF_START(start);
+	dev->pd_mod->pm_dev_cycle_tick(dev);
+	PISM_PROF_STOP(dev->pd_mod, PISM_PROF_CYCLE_TICK, start);
+}
+
+static inline void
+pism_stats_request(pism_device_t *dev, pism_data_t *req, u_int nbeats)
+{
+	uint64_t bytes;
+
+	bytes = (uint64_t)__builtin_popcount(req->pd_int.pdi_byteenable) *
+	    nbeats;
+	if (PISM_REQ_ACCTYPE(req) == PISM_ACC_FETCH) {
+		dev->pd_stats.pds_fetches++;
+		dev->pd_stats.pds_fetch_bytes += bytes;
+	} else {
+		dev->pd_stats.pds_stores++;
+		dev->pd_stats.pds_store_bytes += bytes;
+	}
+}
+
+static inline void
+pism_stats_latency(pism_device_t *dev, uint64_t cycles)
+{
+	u_int bucket;
+
+	bucket = (cycles == 0) ? 0 : 64 - __builtin_clzll(cycles);
+	if (bucket >= PISM_STATS_LATENCY_BUCKETS)
+		bucket = PISM_STATS_LATENCY_BUCKETS - 1;
+	dev->pd_stats.pds_latency[bucket]++;
+}
+
 /*
  * CHERI expects that PISM, like Avalon, will return responses to fetch
- * operations in FIFO order.  This requires PISM to remember what order
- * fetches to devices were issued in so that it can maintain that order as
- * responses are picked up.  Implement a simple FIFO to support this.
- *
- * XXXRW: Currently, CHERI ignores _read() methods, so may attempt to overflow
- * this FIFO.
+ * operations in FIFO order.  PISM therefore tracks the fetches outstanding on
+ * each bus in a ring of slots, in the order they were put.  Devices see the
+ * slot index as the request's pdi_tag: ordinary devices respond in request
+ * order, whereas PISM_MODULE_FLAG_UNORDERED devices may complete in any order
+ * and identify responses by tag.  Responses are collected from devices as
+ * soon as they are ready, which frees the device for further requests, and
+ * are then returned in request order -- or, on a tagged bus, oldest completed
+ * first, carrying the tag supplied with the request.
  */
+struct pism_slot {
+	pism_device_t	*ps_dev;
+	pism_data_t	 ps_resp;	/* Response, or burst request. */
+	uint8_t		*ps_data;	/* Burst data. */
+	u_int		 ps_nbeats;	/* Burst length. */
+	u_int		 ps_beats_put;	/* Beats put, for per-beat bursts. */
+	u_int		 ps_beats_got;	/* Beats collected, likewise. */
+	uint64_t	 ps_putcycle;	/* Cycle request was put. */
+	uint16_t	 ps_tag;	/* Tag supplied with the request. */
+	bool		 ps_burst;	/* Fetch is a burst. */
+	bool		 ps_done;	/* Response collected from device. */
+	bool		 ps_delivered;	/* Response returned by PISM. */
+};
+
+struct pism_queue {
+	struct pism_slot	*pq_slots;
+	uint8_t			*pq_data;	/* Burst data for all slots. */
+	u_int			 pq_depth;
+	u_int			 pq_tail;	/* Oldest occupied slot. */
+	u_int			 pq_count;	/* Occupied slots. */
+	bool			 pq_tagged;
+};
+
+static struct pism_queue	pism_queue[PISM_BUS_COUNT];
+
+static inline u_int
+pism_queue_inc(struct pism_queue *pq, u_int i)
+{
 
-#define	PISM_FIFO_DEPTH		16
-static pism_device_t	*pism_fifo[PISM_BUS_COUNT][PISM_FIFO_DEPTH];
-static int	pism_fifo_head[PISM_BUS_COUNT], pism_fifo_tail[PISM_BUS_COUNT];
+	return (i + 1 == pq->pq_depth ? 0 : i + 1);
+}
 
-static inline int
-pism_fifo_inc(int a)
+static inline u_int
+pism_queue_index(struct pism_queue *pq, u_int n)
 {
 
-	return ((a + 1) % PISM_FIFO_DEPTH);
+	return ((pq->pq_tail + n) % pq->pq_depth);
 }
 
 static void
-pism_fifo_enqueue(uint8_t busno, pism_device_t *dev)
+pism_queue_init(uint8_t busno, const char *depth_env_name,
+    const char *tagged_env_name)
+{
+	struct pism_queue *pq;
+	const char *env;
+	char *endp;
+	long depth, i;
+
+	pq = &pism_queue[busno];
+	depth = PISM_BUS_DEPTH_DEFAULT;
+	env = getenv(depth_env_name);
+	if (env != NULL) {
+		depth = strtol(env, &endp, 0);
+		if (*endp != '\0' || depth < 1 || depth > PISM_BUS_DEPTH_MAX)
+			errx(3, "%s: invalid queue depth %s", depth_env_name,
+			    env);
+	}
+	pq->pq_slots = calloc(depth, sizeof(*pq->pq_slots));
+	assert(pq->pq_slots != NULL);
+	pq->pq_data = calloc(depth, PISM_BURST_MAX_BYTES);
+	assert(pq->pq_data != NULL);
+	for (i = 0; i < depth; i++)
+		pq->pq_slots[i].ps_data = pq->pq_data +
+		    i * PISM_BURST_MAX_BYTES;
+	pq->pq_depth = depth;
+	pq->pq_tagged = (getenv(tagged_env_name) != NULL);
+}
+
+static inline bool
+pism_queue_full(uint8_t busno)
 {
 
-	assert(pism_fifo_inc(pism_fifo_head[busno]) != pism_fifo_tail[busno]);
-	pism_fifo[busno][pism_fifo_head[busno]] = dev;
-	pism_fifo_head[busno] = pism_fifo_inc(pism_fifo_head[busno]);
+	return (pism_queue[busno].pq_count == pism_queue[busno].pq_depth);
 }
 
-static bool
-pism_fifo_empty(uint8_t busno)
+/*
+ * Check whether the queue can take a request to a device: fetches need a
+ * slot on the bus and must not exceed the depth configured for the device,
+ * and nothing may overtake a burst still being put beat by beat.
+ */
+static inline bool
+pism_queue_ready(uint8_t busno, pism_device_t *dev, pism_data_t *req)
 {
 
-	return (pism_fifo_head[busno] == pism_fifo_tail[busno]);
+	if (dev->pd_burst_pending)
+		return (false);
+	if (PISM_REQ_ACCTYPE(req) == PISM_ACC_FETCH &&
+	    (pism_queue_full(busno) || dev->pd_outstanding >= dev->pd_depth))
+		return (false);
+	return (true);
 }
 
-static inline pism_device_t *
-pism_fifo_dequeue_internal(uint8_t busno, bool dequeue)
+/*
+ * Allocate the next slot for a fetch to a device, returning its index.  The
+ * caller accounts for requests put to the device.
+ */
+static u_int
+pism_queue_enqueue(uint8_t busno, pism_device_t *dev, uint16_t tag)
+{
+	struct pism_queue *pq;
+	struct pism_slot *ps;
+	u_int i;
+
+	pq = &pism_queue[busno];
+	assert(pq->pq_count < pq->pq_depth);
+	i = pism_queue_index(pq, pq->pq_count);
+	pq->pq_count++;
+	ps = &pq->pq_slots[i];
+	ps->ps_dev = dev;
+	ps->ps_tag = tag;
+	ps->ps_burst = false;
+	ps->ps_nbeats = ps->ps_beats_put = 1;
+	ps->ps_done = false;
+	ps->ps_delivered = false;
+	ps->ps_putcycle = pism_cycle_count[busno];
+	return (i);
+}
+
+static inline bool
+pism_dev_has_burst(pism_device_t *dev)
+{
+
+	return (dev->pd_mod->pm_dev_request_put_burst != NULL);
+}
+
+/*
+ * Bursts to devices without pm_dev_request_put_burst are broken up into
+ * single-beat fetches, put as the device has room for them.  Until all beats
+ * have been put, other requests to the device are refused so that they
+ * can't overtake the burst.
+ */
+static void
+pism_queue_burst_advance(struct pism_slot *ps)
 {
 	pism_device_t *dev;
+	pism_data_t beat;
+
+	dev = ps->ps_dev;
+	while (ps->ps_beats_put < ps->ps_nbeats &&
+	    dev->pd_outstanding < dev->pd_depth) {
+		beat = ps->ps_resp;
+		beat.pd_int.pdi_addr += ps->ps_beats_put * PISM_DATA_BYTES;
+		if (!pism_method_request_ready(dev, &beat))
+			break;
+		pism_method_request_put(dev, &beat);
+		dev->pd_outstanding++;
+		ps->ps_beats_put++;
+	}
+	dev->pd_burst_pending = (ps->ps_beats_put < ps->ps_nbeats);
+}
 
-	assert(pism_fifo_head[busno] != pism_fifo_tail[busno]);
-	dev = pism_fifo[busno][pism_fifo_tail[busno]];
-	if (dequeue)
-		pism_fifo_tail[busno] = pism_fifo_inc(pism_fifo_tail[busno]);
-	return (dev);
+/*
+ * Record a response collected from a device against its slot.
+ */
+static void
+pism_slot_complete(struct pism_slot *ps, pism_data_t *resp)
+{
+	pism_device_t *dev;
+	u_int beat;
+
+	dev = ps->ps_dev;
+	if (!ps->ps_burst) {
+		ps->ps_resp = *resp;
+		ps->ps_done = true;
+		return;
+	}
+	if (pism_dev_has_burst(dev)) {
+		/* Data were written directly to ps_data by the device. */
+		ps->ps_resp.pd_int.pdi_captag = resp->pd_int.pdi_captag;
+		ps->ps_done = true;
+		return;
+	}
+	if (dev->pd_mod->pm_flags & PISM_MODULE_FLAG_UNORDERED)
+		beat = (resp->pd_int.pdi_addr - ps->ps_resp.pd_int.pdi_addr) /
+		    PISM_DATA_BYTES;
+	else
+		beat = ps->ps_beats_got;
+	assert(beat < ps->ps_nbeats);
+	memcpy(ps->ps_data + beat * PISM_DATA_BYTES, resp->pd_int.pdi_data,
+	    PISM_DATA_BYTES);
+	ps->ps_resp.pd_int.pdi_captag |= PISM_CAPTAG_BEAT(resp, 0) << beat;
+	if (++ps->ps_beats_got == ps->ps_nbeats)
+		ps->ps_done = true;
 }
 
-static pism_device_t *
-pism_fifo_dequeue(uint8_t busno)
+/*
+ * Find the oldest slot awaiting a response from a device.
+ */
+static struct pism_slot *
+pism_queue_oldest(struct pism_queue *pq, pism_device_t *dev)
 {
+	struct pism_slot *ps;
+	u_int i, n;
+
+	for (n = 0, i = pq->pq_tail; n < pq->pq_count;
+	    n++, i = pism_queue_inc(pq, i)) {
+		ps = &pq->pq_slots[i];
+		if (ps->ps_dev == dev && !ps->ps_done)
+			return (ps);
+	}
+	return (NULL);
+}
 
-	return (pism_fifo_dequeue_internal(busno, true));
+/*
+ * Pick up any responses that devices have ready for outstanding fetches.
+ */
+static void
+pism_queue_collect(uint8_t busno)
+{
+	struct pism_queue *pq;
+	struct pism_slot *ps;
+	pism_device_t *dev;
+	pism_data_t resp;
+	u_int i, n;
+
+	pq = &pism_queue[busno];
+	for (n = 0, i = pq->pq_tail; n < pq->pq_count;
+	    n++, i = pism_queue_inc(pq, i)) {
+		ps = &pq->pq_slots[i];
+		if (ps->ps_done)
+			continue;
+		dev = ps->ps_dev;
+		if (ps->ps_beats_put < ps->ps_nbeats)
+			pism_queue_burst_advance(ps);
+		while (dev->pd_outstanding > 0) {
+			assert(dev->pd_mod->pm_dev_response_ready != NULL);
+			if (!pism_method_response_ready(dev))
+				break;
+			assert(dev->pd_mod->pm_dev_response_get != NULL);
+			resp = pism_method_response_get(dev);
+			if (dev->pd_mod->pm_flags & PISM_MODULE_FLAG_UNORDERED) {
+				assert(PISM_REQ_TAG(&resp) < pq->pq_depth);
+				ps = &pq->pq_slots[PISM_REQ_TAG(&resp)];
+				assert(ps->ps_dev == dev && !ps->ps_done);
+			} else
+				ps = pism_queue_oldest(pq, dev);
+			assert(ps != NULL);
+			pism_slot_complete(ps, &resp);
+			dev->pd_outstanding--;
+		}
+		ps = &pq->pq_slots[i];
+		if (ps->ps_beats_put < ps->ps_nbeats)
+			pism_queue_burst_advance(ps);
+	}
+}
+
+/*
+ * Find the response that PISM should return next, if any.
+ */
+static struct pism_slot *
+pism_queue_next(uint8_t busno)
+{
+	struct pism_queue *pq;
+	struct pism_slot *ps;
+	u_int i, n;
+
+	pq = &pism_queue[busno];
+	if (pq->pq_count == 0)
+		return (NULL);
+	if (!pq->pq_tagged) {
+		ps = &pq->pq_slots[pq->pq_tail];
+		return (ps->ps_done ? ps : NULL);
+	}
+	for (n = 0, i = pq->pq_tail; n < pq->pq_count;
+	    n++, i = pism_queue_inc(pq, i)) {
+		ps = &pq->pq_slots[i];
+		if (ps->ps_done && !ps->ps_delivered)
+			return (ps);
+	}
+	return (NULL);
 }
 
-static pism_device_t *
-pism_fifo_peek(uint8_t busno)
+/*
+ * Charge a stall cycle to the device holding up the oldest fetch, if its
+ * response has not yet been collected.
+ */
+static inline void
+pism_queue_stall(uint8_t busno)
 {
+	struct pism_queue *pq;
+	struct pism_slot *ps;
+
+	pq = &pism_queue[busno];
+	if (pq->pq_count == 0)
+		return;
+	ps = &pq->pq_slots[pq->pq_tail];
+	if (!ps->ps_done)
+		ps->ps_dev->pd_stats.pds_stall_cycles++;
+}
 
-	return (pism_fifo_dequeue_internal(busno, false));
+/*
+ * Mark a response as returned, and release any delivered slots at the tail
+ * of the ring.
+ */
+static void
+pism_queue_deliver(uint8_t busno, struct pism_slot *ps)
+{
+	struct pism_queue *pq;
+
+	pq = &pism_queue[busno];
+	pism_stats_latency(ps->ps_dev,
+	    pism_cycle_count[busno] - ps->ps_putcycle);
+	ps->ps_delivered = true;
+	while (pq->pq_count > 0 && pq->pq_slots[pq->pq_tail].ps_delivered) {
+		pq->pq_tail = pism_queue_inc(pq, pq->pq_tail);
+		pq->pq_count--;
+	}
+}
+
+static void
+pism_bus_ticklist_build(uint8_t busno)
+{
+	pism_device_t *dev;
+	u_int count;
+
+	count = 0;
+	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+		if (dev->pd_mod->pm_dev_cycle_tick != NULL)
+			count++;
+	}
+	free(pism_ticklist[busno]);
+	pism_ticklist[busno] = calloc(MAX(count, 1),
+	    sizeof(*pism_ticklist[busno]));
+	assert(pism_ticklist[busno] != NULL);
+	pism_ticklist_count[busno] = 0;
+	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+		if (dev->pd_mod->pm_dev_cycle_tick != NULL)
+			pism_ticklist[busno][pism_ticklist_count[busno]++] =
+			    dev;
+	}
+}
+
+void
+pism_timer_init(struct pism_timer *pt, pism_device_t *dev,
+    pism_timer_func_t *func, void *arg)
+{
+
+	memset(pt, 0, sizeof(*pt));
+	pt->pt_dev = dev;
+	pt->pt_func = func;
+	pt->pt_arg = arg;
+}
+
+/*
+ * Schedule (or reschedule) a timer to fire during the pism_cycle_tick() that
+ * advances the cycle count to 'cycle'.  Timers requested for the current or
+ * an earlier cycle fire on the next tick.
+ */
+void
+pism_timer_schedule(struct pism_timer *pt, uint64_t cycle)
+{
+	uint8_t busno;
+
+	assert(pt->pt_dev != NULL && pt->pt_func != NULL);
+	busno = pt->pt_dev->pd_busno;
+	if (pt->pt_pending)
+		LIST_REMOVE(pt, pt_entries);
+	if (cycle <= pism_cycle_count[busno])
+		cycle = pism_cycle_count[busno] + 1;
+	pt->pt_cycle = cycle;
+	pt->pt_pending = true;
+	LIST_INSERT_HEAD(&pism_timer_wheel[busno]
+	    [cycle & (PISM_TIMER_WHEEL_SLOTS - 1)], pt, pt_entries);
+}
+
+void
+pism_timer_cancel(struct pism_timer *pt)
+{
+
+	if (!pt->pt_pending)
+		return;
+	LIST_REMOVE(pt, pt_entries);
+	pt->pt_pending = false;
+}
+
+bool
+pism_timer_pending(struct pism_timer *pt)
+{
+
+	return (pt->pt_pending);
+}
+
+static void
+pism_timers_run(uint8_t busno)
+{
+	struct pism_timer_list expired;
+	struct pism_timer *pt, *next;
+	uint64_t now, start;
+
+	now = pism_cycle_count[busno];
+	LIST_INIT(&expired);
+	for (pt = LIST_FIRST(&pism_timer_wheel[busno]
+	    [now & (PISM_TIMER_WHEEL_SLOTS - 1)]); pt != NULL; pt = next) {
+		next = LIST_NEXT(pt, pt_entries);
+		if (pt->pt_cycle > now)
+			continue;
+		LIST_REMOVE(pt, pt_entries);
+		LIST_INSERT_HEAD(&expired, pt, pt_entries);
+	}
+
+	/*
+	 * Callbacks may reschedule or cancel any timer, including others that
+	 * have expired this cycle, so pop one at a time.
+	 */
+	while ((pt = LIST_FIRST(&expired)) != NULL) {
+		LIST_REMOVE(pt, pt_entries);
+		pt->pt_pending = false;
+		PISM_PROF_START(start);
+		pt->pt_func(pt->pt_dev, pt->pt_arg);
+		PISM_PROF_STOP(pt->pt_dev->pd_mod, PISM_PROF_TIMER, start);
+	}
 }
 
 void
 pism_cycle_tick(uint8_t busno)
 {
 	pism_device_t *dev;
-
-	PDBG(busno, "called");
+	u_int i;
 
 	/*
 	 * Update global cycle counter. 
 	 */
 	pism_cycle_count[busno]++;
 
-	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
-		if (dev->pd_mod->pm_dev_cycle_tick != NULL)
-			dev->pd_mod->pm_dev_cycle_tick(dev);
+	pism_timers_run(busno);
+	pism_queue_stall(busno);
+	pism_stats_poll();
+	PISM_LOG_POLL();
+
+	/*
+	 * Modules that haven't moved to timers are still ticked every cycle.
+	 */
+	for (i = 0; i < pism_ticklist_count[busno]; i++) {
+		dev = pism_ticklist[busno][i];
+		pism_method_cycle_tick(dev);
 	}
 
-	PDBG(busno, "returned");
+	if (g_pism_fork_armed && busno == PISM_BUSNO_MEMORY &&
+	    pism_cycle_count[busno] == g_pism_fork_cycle)
+		pism_fork_trigger();
 }
 
 
@@ -273,8 +792,6 @@ pism_interrupt_get(uint8_t busno)
 	pism_device_t *dev;
 	uint32_t interrupts;
 
-	PDBG(busno, "called");
-
 	/*
 	 * Walk modules and query each for an interrupt.
 	 */
@@ -282,12 +799,15 @@ pism_interrupt_get(uint8_t busno)
 	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
 		if (dev->pd_mod->pm_dev_interrupt_get == NULL)
 			continue;
-		if (dev->pd_mod->pm_dev_interrupt_get(dev) &&
+		if (pism_method_interrupt_get(dev) &&
 		    dev->pd_irq != -1)
 			interrupts |= (1 << dev->pd_irq);
 	}
 
-	PDBG(busno, "returned - %u", interrupts);
+	if (interrupts != pism_interrupts_last[busno]) {
+		PISM_LOG_BUS(busno, PISM_LOG_EV_INTERRUPT, 0, interrupts);
+		pism_interrupts_last[busno] = interrupts;
+	}
 	return (interrupts);
 }
 
@@ -303,38 +823,173 @@ pism_cycle_count_get(uint8_t busno)
 }
 
 /*
- * Given a request structure, find a suitable device.  If required, request
- * address validity must be performed by the caller.
+ * Per-bus address decoder.  Device mappings are flattened into a sorted array
+ * of non-overlapping intervals of request addresses, each naming the device
+ * that a walk of g_pism_devices would have found first, so that lookups are a
+ * binary search rather than a list walk.  Overlapping mappings (e.g., a
+ * memory-mapped kernel on top of DRAM) therefore resolve as they always have.
+ *
+ * A single memory access resolves the same address in pism_addr_valid(),
+ * pism_request_ready() and pism_request_put() in turn, so the interval most
+ * recently hit is kept as the resolved-device handle for the bus and checked
+ * before searching.
  */
-static pism_device_t *
-pism_dev_lookup_req(uint8_t busno, pism_data_t *req)
+struct pism_decode_entry {
+	uint64_t	 pde_start;	/* First request address covered. */
+	uint64_t	 pde_end;	/* First request address not covered. */
+	pism_device_t	*pde_dev;
+};
+
+struct pism_decoder {
+	struct pism_decode_entry	*pdc_entries;
+	u_int				 pdc_count;
+	struct pism_decode_entry	*pdc_resolved;	/* Last hit. */
+};
+
+static struct pism_decoder	pism_decoder[PISM_BUS_COUNT];
+
+static int
+pism_addr_compare(const void *a, const void *b)
 {
-	pism_device_t *dev;
-	uint64_t addr;
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return ((x > y) - (x < y));
+}
+
+/*
+ * (Re)build the decoder for a bus from its device list.  Called once the
+ * configuration has been parsed; must be called again if devices are added
+ * or removed later.
+ */
+void
+pism_bus_decoder_build(uint8_t busno)
+{
+	struct pism_decoder *pdc;
+	struct pism_decode_entry *pde;
+	pism_device_t *dev, *segdev;
+	uint64_t *points, start, end;
+	u_int count, i, npoints;
+
+	assert(busno < PISM_BUS_COUNT);
+	pdc = &pism_decoder[busno];
+	free(pdc->pdc_entries);
+	pdc->pdc_entries = NULL;
+	pdc->pdc_count = 0;
+	pdc->pdc_resolved = NULL;
+
+	count = 0;
+	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next)
+		count++;
+	if (count == 0)
+		return;
 
-	addr = req->pd_int.pdi_addr;
+	/*
+	 * A device accepts a request at addr if the whole PISM_DATA_BYTES
+	 * line lies within its mapping; collect the boundaries of those
+	 * ranges of addr.
+	 */
+	points = calloc(count * 2, sizeof(*points));
+	assert(points != NULL);
+	npoints = 0;
 	SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
-		if (addr >= dev->pd_base && addr + PISM_DATA_BYTES - 1 <
-		    dev->pd_base + dev->pd_length)
-			return (dev);
+		if (dev->pd_length < PISM_DATA_BYTES)
+			continue;
+		points[npoints++] = dev->pd_base;
+		points[npoints++] = dev->pd_base + dev->pd_length -
+		    PISM_DATA_BYTES + 1;
+	}
+	qsort(points, npoints, sizeof(*points), pism_addr_compare);
+
+	/*
+	 * There are at most npoints - 1 elementary intervals between
+	 * boundaries; give each the first device covering it, merging
+	 * neighbours that resolve to the same device.
+	 */
+	pdc->pdc_entries = calloc(MAX(npoints, 1), sizeof(*pdc->pdc_entries));
+	assert(pdc->pdc_entries != NULL);
+	for (i = 0; i + 1 < npoints; i++) {
+		start = points[i];
+		end = points[i + 1];
+		if (start == end)
+			continue;
+		segdev = NULL;
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_length < PISM_DATA_BYTES)
+				continue;
+			if (start >= dev->pd_base && start <
+			    dev->pd_base + dev->pd_length - PISM_DATA_BYTES +
+			    1) {
+				segdev = dev;
+				break;
+			}
+		}
+		if (segdev == NULL)
+			continue;
+		if (pdc->pdc_count > 0) {
+			pde = &pdc->pdc_entries[pdc->pdc_count - 1];
+			if (pde->pde_dev == segdev && pde->pde_end == start) {
+				pde->pde_end = end;
+				continue;
+			}
+		}
+		pde = &pdc->pdc_entries[pdc->pdc_count++];
+		pde->pde_start = start;
+		pde->pde_end = end;
+		pde->pde_dev = segdev;
+	}
+	free(points);
+}
+
+/*
+ * Given a request address, find a suitable device.  If required, request
+ * address validity must be performed by the caller.
+ */
+pism_device_t *
+pism_dev_lookup(uint8_t busno, uint64_t addr)
+{
+	struct pism_decoder *pdc;
+	struct pism_decode_entry *pde;
+	u_int lo, hi, mid;
+
+	pdc = &pism_decoder[busno];
+	pde = pdc->pdc_resolved;
+	if (pde != NULL && addr >= pde->pde_start && addr < pde->pde_end)
+		return (pde->pde_dev);
+
+	lo = 0;
+	hi = pdc->pdc_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		pde = &pdc->pdc_entries[mid];
+		if (addr < pde->pde_start)
+			hi = mid;
+		else if (addr >= pde->pde_end)
+			lo = mid + 1;
+		else {
+			pdc->pdc_resolved = pde;
+			return (pde->pde_dev);
+		}
 	}
 	return (NULL);
 }
 
+static inline pism_device_t *
+pism_dev_lookup_req(uint8_t busno, pism_data_t *req)
+{
+
+	return (pism_dev_lookup(busno, req->pd_int.pdi_addr));
+}
+
 bool
 pism_request_ready(uint8_t busno, pism_data_t *req)
 {
 	pism_device_t *dev;
 	bool response;
 
-	PDBG(busno, "called - acctype %d addr %jx byteenable %x",
-	    PISM_REQ_ACCTYPE(req), req->pd_int.pdi_addr,
-	    req->pd_int.pdi_byteenable);
-
-	if (!pism_initialized[busno]) {
-		PDBG(busno, "returned - %d", false);
+	if (!pism_initialized[busno])
 		return (false);
-	}
 
 	assert(req->pd_int.pdi_addr % PISM_DATA_BYTES == 0);
 
@@ -345,10 +1000,20 @@ pism_request_ready(uint8_t busno, pism_data_t *req)
 	dev = pism_dev_lookup_req(busno, req);
 	assert(dev != NULL);
 
-	/* Assign to variable so debug messages are in correct order. */
-	response = (dev->pd_mod->pm_dev_request_ready(dev, req));
+	if (!pism_queue_ready(busno, dev, req)) {
+		dev->pd_stats.pds_refusals++;
+		PISM_LOG(dev, PISM_LOG_EV_REQUEST_READY, req->pd_int.pdi_addr,
+		    false);
+		return (false);
+	}
 
-	PDBG(busno, "returned - %d", response);
+	/* Assign to variable so log records are in correct order. */
+	response = (pism_method_request_ready(dev, req));
+	if (!response)
+		dev->pd_stats.pds_refusals++;
+
+	PISM_LOG(dev, PISM_LOG_EV_REQUEST_READY, req->pd_int.pdi_addr,
+	    response);
 	return (response);
 }
 
@@ -356,109 +1021,104 @@ void
 pism_request_put(uint8_t busno, pism_data_t *req)
 {
 	pism_device_t *dev;
+	pism_data_t devreq;
 
-	PDBG(busno, "called - acctype %d addr %jx byteenable %x",
-	    PISM_REQ_ACCTYPE(req), req->pd_int.pdi_addr,
-	    req->pd_int.pdi_byteenable);
 	assert(req->pd_int.pdi_addr % PISM_DATA_BYTES == 0);
 
 	dev = pism_dev_lookup_req(busno, req);
 	assert(dev != NULL);
 	assert(dev->pd_mod->pm_dev_request_put != NULL);
-	dev->pd_mod->pm_dev_request_put(dev, req);
+	PISM_LOG(dev, PISM_LOG_EV_REQUEST_PUT, req->pd_int.pdi_addr,
+	    (uint64_t)PISM_REQ_ACCTYPE(req) << 32 |
+	    req->pd_int.pdi_byteenable);
+	pism_stats_request(dev, req, 1);
+	if (PISM_REQ_ACCTYPE(req) != PISM_ACC_FETCH) {
+		pism_method_request_put(dev, req);
+		if (g_pism_fork_armed &&
+		    req->pd_int.pdi_addr == g_pism_fork_addr)
+			pism_fork_trigger();
+		return;
+	}
 
 	/*
-	 * Enqueue this device to the FIFO so that response order is
-	 * maintained across devices.
+	 * Allocate a slot for the response, and hand the device a copy of
+	 * the request tagged with the slot index.
 	 */
-	if (PISM_REQ_ACCTYPE(req) == PISM_ACC_FETCH)
-		pism_fifo_enqueue(busno, dev);
-
-	PDBG(busno, "returned");
+	devreq = *req;
+	PISM_REQ_TAG(&devreq) = pism_queue_enqueue(busno, dev,
+	    PISM_REQ_TAG(req));
+	pism_method_request_put(dev, &devreq);
+	dev->pd_outstanding++;
 }
 
 bool
 pism_response_ready(uint8_t busno)
 {
-	pism_device_t *dev;
 	bool ret;
 
-	PDBG(busno, "called");
-
-	if (!pism_initialized[busno]) {
-		PDBG(busno, "returned");
+	if (!pism_initialized[busno])
 		return (false);
-	}
-
-	if (pism_fifo_empty(busno)) {
-		PDBG(busno, "returned");
-		return (false);
-	}
 
-	dev = pism_fifo_peek(busno);
-	assert(dev != NULL);
-
-	assert(dev->pd_mod->pm_dev_response_ready != NULL);
-	ret = dev->pd_mod->pm_dev_response_ready(dev);
-
-	PDBG(busno, "returned - %d", ret);
+	pism_queue_collect(busno);
+	ret = (pism_queue_next(busno) != NULL);
 	return (ret);
 }
 
 pism_data_t
 pism_response_get(uint8_t busno)
 {
-	pism_device_t *dev;
+	struct pism_slot *ps;
 	pism_data_t return_data;
 
-	PDBG(busno, "called");
+	ps = pism_queue_next(busno);
+	if (ps == NULL) {
+		pism_queue_collect(busno);
+		ps = pism_queue_next(busno);
+	}
 
 	/*
 	 * XXXRW: We should instead fail an assertion here, as
 	 * pism_response_ready() should prevent calls when PISM is not
 	 * actually ready.
 	 */
-	if (pism_fifo_empty(busno)) {
-		PDBG(busno, "Returning default response");
+	if (ps == NULL) {
+		PISM_LOG_BUS(busno, PISM_LOG_EV_ERROR, 0, 0);
 		memset(&return_data, 0x00, sizeof(return_data));
 		return (return_data);
 	}
 
-	dev = pism_fifo_dequeue(busno);
-	assert(dev != NULL);
-
-	assert(dev->pd_mod->pm_dev_response_get != NULL);
-	return_data = dev->pd_mod->pm_dev_response_get(dev);
-
-	PDBG(busno, "Returning device response");
+	/* Bursts must be collected with pism_burst_response_get(). */
+	assert(!ps->ps_burst);
+	return_data = ps->ps_resp;
+	PISM_REQ_TAG(&return_data) = ps->ps_tag;
+	PISM_LOG(ps->ps_dev, PISM_LOG_EV_RESPONSE_GET,
+	    return_data.pd_int.pdi_addr, ps->ps_tag);
+	pism_queue_deliver(busno, ps);
 	return (return_data);
 }
 
-bool
-pism_addr_valid(uint8_t busno, pism_data_t *req)
+/*
+ * Check device permissions and ask the device whether it will accept a
+ * request.
+ */
+static bool
+pism_dev_addr_valid(uint8_t busno, pism_device_t *dev, pism_data_t *req)
 {
-	pism_device_t *dev;
 	bool ret;
 
-	PDBG(busno, "called - %08jx", req->pd_int.pdi_addr);
-
-	dev = pism_dev_lookup_req(busno, req);
-	if (dev == NULL) {
-		PDBG(busno, "returned - %d", false);
-		return (false);
-	}
-
 	switch (PISM_REQ_ACCTYPE(req)) {
 	case PISM_ACC_FETCH:
 		if (!(dev->pd_perms & PISM_PERM_ALLOW_FETCH)) {
-			PDBG(busno, "returned - %d - permissions", false);
+			PISM_LOG(dev, PISM_LOG_EV_ADDR_VALID,
+			    req->pd_int.pdi_addr, false);
 			return (false);
 		}
 		break;
 
 	case PISM_ACC_STORE:
 		if (!(dev->pd_perms & PISM_PERM_ALLOW_STORE)) {
-			PDBG(busno, "returned - %d - permissions", false);
+			PISM_LOG(dev, PISM_LOG_EV_ADDR_VALID,
+			    req->pd_int.pdi_addr, false);
 			return (false);
 		}
 		break;
@@ -468,8 +1128,474 @@ pism_addr_valid(uint8_t busno, pism_data_t *req)
 	}
 
 	assert(dev->pd_mod->pm_dev_addr_valid != NULL);
-	ret = dev->pd_mod->pm_dev_addr_valid(dev, req);
+	ret = pism_method_addr_valid(dev, req);
 
-	PDBG(busno, "returned - %d", ret);
+	PISM_LOG(dev, PISM_LOG_EV_ADDR_VALID, req->pd_int.pdi_addr, ret);
 	return (ret);
 }
+
+bool
+pism_addr_valid(uint8_t busno, pism_data_t *req)
+{
+	pism_device_t *dev;
+
+	dev = pism_dev_lookup_req(busno, req);
+	if (dev == NULL) {
+		PISM_LOG_BUS(busno, PISM_LOG_EV_ADDR_VALID,
+		    req->pd_int.pdi_addr, false);
+		return (false);
+	}
+	return (pism_dev_addr_valid(busno, dev, req));
+}
+
+/*
+ * Burst interfaces.  A burst is described by the request for its first beat,
+ * and must lie entirely within one device.
+ */
+bool
+pism_burst_addr_valid(uint8_t busno, pism_data_t *req, u_int nbeats)
+{
+	pism_device_t *dev;
+
+	if (nbeats < 1 || nbeats > PISM_BURST_MAX_BEATS) {
+		PISM_LOG_BUS(busno, PISM_LOG_EV_ADDR_VALID,
+		    req->pd_int.pdi_addr, false);
+		return (false);
+	}
+	dev = pism_dev_lookup_req(busno, req);
+	if (dev == NULL || pism_dev_lookup(busno, req->pd_int.pdi_addr +
+	    (nbeats - 1) * PISM_DATA_BYTES) != dev) {
+		PISM_LOG_BUS(busno, PISM_LOG_EV_ADDR_VALID,
+		    req->pd_int.pdi_addr, false);
+		return (false);
+	}
+	return (pism_dev_addr_valid(busno, dev, req));
+}
+
+bool
+pism_burst_request_ready(uint8_t busno, pism_data_t *req, u_int nbeats)
+{
+	pism_device_t *dev;
+	pism_data_t beat;
+	u_int i;
+	bool response;
+
+	if (!pism_initialized[busno])
+		return (false);
+
+	assert(req->pd_int.pdi_addr % PISM_DATA_BYTES == 0);
+	assert(nbeats >= 1 && nbeats <= PISM_BURST_MAX_BEATS);
+	dev = pism_dev_lookup_req(busno, req);
+	assert(dev != NULL);
+
+	if (!pism_queue_ready(busno, dev, req)) {
+		dev->pd_stats.pds_refusals++;
+		PISM_LOG(dev, PISM_LOG_EV_BURST_READY, req->pd_int.pdi_addr,
+		    false);
+		return (false);
+	}
+
+	/*
+	 * Per-beat stores are all put at once, so every beat must be
+	 * accepted; per-beat fetches are put as the device becomes ready.
+	 */
+	response = pism_method_request_ready(dev, req);
+	if (response && !pism_dev_has_burst(dev) &&
+	    PISM_REQ_ACCTYPE(req) == PISM_ACC_STORE) {
+		beat = *req;
+		for (i = 1; i < nbeats && response; i++) {
+			beat.pd_int.pdi_addr += PISM_DATA_BYTES;
+			response = pism_method_request_ready(dev,
+			    &beat);
+		}
+	}
+	if (!response)
+		dev->pd_stats.pds_refusals++;
+
+	PISM_LOG(dev, PISM_LOG_EV_BURST_READY, req->pd_int.pdi_addr,
+	    response);
+	return (response);
+}
+
+/*
+ * Put a burst of nbeats beats.  For stores, data holds nbeats *
+ * PISM_DATA_BYTES bytes to write, and the request's byte enable applies to
+ * every beat; for fetches, data is unused.
+ */
+void
+pism_burst_request_put(uint8_t busno, pism_data_t *req, u_int nbeats,
+    uint8_t *data)
+{
+	struct pism_slot *ps;
+	pism_device_t *dev;
+	pism_data_t beat;
+	u_int i;
+
+	assert(req->pd_int.pdi_addr % PISM_DATA_BYTES == 0);
+	assert(nbeats >= 1 && nbeats <= PISM_BURST_MAX_BEATS);
+
+	dev = pism_dev_lookup_req(busno, req);
+	assert(dev != NULL);
+	assert(dev->pd_mod->pm_dev_request_put != NULL);
+	PISM_LOG(dev, PISM_LOG_EV_BURST_PUT, req->pd_int.pdi_addr, nbeats);
+	pism_stats_request(dev, req, nbeats);
+	if (PISM_REQ_ACCTYPE(req) != PISM_ACC_FETCH) {
+		if (pism_dev_has_burst(dev))
+			pism_method_request_put_burst(dev, req,
+			    nbeats, data);
+		else {
+			beat = *req;
+			for (i = 0; i < nbeats; i++) {
+				memcpy(beat.pd_int.pdi_data,
+				    data + i * PISM_DATA_BYTES,
+				    PISM_DATA_BYTES);
+				beat.pd_int.pdi_captag =
+				    PISM_CAPTAG_BEAT(req, i);
+				pism_method_request_put(dev, &beat);
+				beat.pd_int.pdi_addr += PISM_DATA_BYTES;
+			}
+		}
+		return;
+	}
+
+	i = pism_queue_enqueue(busno, dev, PISM_REQ_TAG(req));
+	ps = &pism_queue[busno].pq_slots[i];
+	ps->ps_burst = true;
+	ps->ps_nbeats = nbeats;
+	ps->ps_beats_got = 0;
+	ps->ps_resp = *req;
+	PISM_REQ_TAG(&ps->ps_resp) = i;
+	if (pism_dev_has_burst(dev)) {
+		/*
+		 * The device writes the data straight into the slot when its
+		 * response is collected.
+		 */
+		ps->ps_beats_put = nbeats;
+		pism_method_request_put_burst(dev, &ps->ps_resp,
+		    nbeats, ps->ps_data);
+		dev->pd_outstanding++;
+	} else {
+		ps->ps_beats_put = 0;
+		ps->ps_resp.pd_int.pdi_captag = 0;	/* Gathered per beat. */
+		pism_queue_burst_advance(ps);
+	}
+}
+
+/*
+ * Collect the next response, which may be a single beat or a burst, copying
+ * its data into a buffer of at least PISM_BURST_MAX_BYTES bytes.  Returns
+ * the number of beats, or 0 if no response was ready.
+ */
+u_int
+pism_burst_response_get(uint8_t busno, pism_data_t *resp, uint8_t *data)
+{
+	struct pism_slot *ps;
+	u_int nbeats;
+
+	ps = pism_queue_next(busno);
+	if (ps == NULL) {
+		pism_queue_collect(busno);
+		ps = pism_queue_next(busno);
+	}
+	if (ps == NULL) {
+		memset(resp, 0x00, sizeof(*resp));
+		return (0);
+	}
+
+	*resp = ps->ps_resp;
+	PISM_REQ_TAG(resp) = ps->ps_tag;
+	if (ps->ps_burst) {
+		nbeats = ps->ps_nbeats;
+		memcpy(data, ps->ps_data, nbeats * PISM_DATA_BYTES);
+	} else {
+		nbeats = 1;
+		memcpy(data, resp->pd_int.pdi_data, PISM_DATA_BYTES);
+	}
+	PISM_LOG(ps->ps_dev, PISM_LOG_EV_BURST_GET, resp->pd_int.pdi_addr,
+	    nbeats);
+	pism_queue_deliver(busno, ps);
+	return (nbeats);
+}
+
+/*
+ * Checkpoints.  The file is a header holding the cycle counters, followed by
+ * a section for each device, which records the length of the device's state
+ * so that restore can check the module read back what it wrote.  A section
+ * with PISM_CHECKPOINT_BUS_END ends the file.
+ */
+#define	PISM_CHECKPOINT_MAGIC		"PISMCKPT"
+#define	PISM_CHECKPOINT_VERSION		1
+#define	PISM_CHECKPOINT_NAME_LEN	32
+#define	PISM_CHECKPOINT_BUS_END		0xff
+
+struct pism_checkpoint_header {
+	char		pch_magic[8];
+	uint32_t	pch_version;
+	uint32_t	pch_buscount;
+	uint64_t	pch_cycles[PISM_BUS_COUNT];
+};
+
+struct pism_checkpoint_section {
+	uint64_t	pcs_length;
+	uint8_t		pcs_busno;
+	char		pcs_name[PISM_CHECKPOINT_NAME_LEN];
+};
+
+bool
+pism_checkpoint_write(FILE *fp, const void *buf, size_t len)
+{
+
+	if (fwrite(buf, 1, len, fp) != len) {
+		warn("%s", __func__);
+		return (false);
+	}
+	return (true);
+}
+
+bool
+pism_checkpoint_read(FILE *fp, void *buf, size_t len)
+{
+
+	if (fread(buf, 1, len, fp) != len) {
+		if (feof(fp))
+			warnx("%s: checkpoint truncated", __func__);
+		else
+			warn("%s", __func__);
+		return (false);
+	}
+	return (true);
+}
+
+static bool
+pism_checkpoint_quiescent(void)
+{
+	pism_device_t *dev;
+	uint8_t busno;
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		if (!pism_initialized[busno])
+			continue;
+		if (pism_queue[busno].pq_count != 0) {
+			warnx("%s: bus %u has requests outstanding", __func__,
+			    busno);
+			return (false);
+		}
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next)
+			assert(dev->pd_outstanding == 0);
+	}
+	return (true);
+}
+
+static bool
+pism_checkpoint_save_device(FILE *fp, pism_device_t *dev)
+{
+	struct pism_checkpoint_section pcs;
+	off_t start, end;
+
+	if (strlen(dev->pd_name) >= sizeof(pcs.pcs_name)) {
+		warnx("%s: device name %s too long", __func__, dev->pd_name);
+		return (false);
+	}
+	memset(&pcs, 0, sizeof(pcs));
+	pcs.pcs_busno = dev->pd_busno;
+	strcpy(pcs.pcs_name, dev->pd_name);
+	if (!pism_checkpoint_write(fp, &pcs, sizeof(pcs)))
+		return (false);
+	if (dev->pd_mod->pm_dev_checkpoint == NULL)
+		return (true);
+
+	/*
+	 * Fill in the section length once the device has written its state.
+	 */
+	start = ftello(fp);
+	if (!dev->pd_mod->pm_dev_checkpoint(dev, fp)) {
+		warnx("%s: device %s failed", __func__, dev->pd_name);
+		return (false);
+	}
+	end = ftello(fp);
+	pcs.pcs_length = end - start;
+	if (fseeko(fp, start - sizeof(pcs), SEEK_SET) != 0 ||
+	    !pism_checkpoint_write(fp, &pcs, sizeof(pcs)) ||
+	    fseeko(fp, end, SEEK_SET) != 0) {
+		warn("%s: fseeko", __func__);
+		return (false);
+	}
+	return (true);
+}
+
+/*
+ * Write to a temporary file and rename it into place, so that an existing
+ * checkpoint is not lost if this one fails.
+ */
+bool
+pism_checkpoint_save(const char *path)
+{
+	struct pism_checkpoint_header pch;
+	struct pism_checkpoint_section pcs;
+	char tmppath[MAXPATHLEN];
+	pism_device_t *dev;
+	uint8_t busno;
+	FILE *fp;
+
+	if (!pism_checkpoint_quiescent())
+		return (false);
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		if (!pism_initialized[busno])
+			continue;
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_quiesce != NULL)
+				dev->pd_mod->pm_dev_quiesce(dev);
+		}
+	}
+	if (snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >=
+	    (int)sizeof(tmppath)) {
+		warnx("%s: path too long", __func__);
+		return (false);
+	}
+	fp = fopen(tmppath, "w");
+	if (fp == NULL) {
+		warn("%s: %s", __func__, tmppath);
+		return (false);
+	}
+	memset(&pch, 0, sizeof(pch));
+	memcpy(pch.pch_magic, PISM_CHECKPOINT_MAGIC, sizeof(pch.pch_magic));
+	pch.pch_version = PISM_CHECKPOINT_VERSION;
+	pch.pch_buscount = PISM_BUS_COUNT;
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++)
+		pch.pch_cycles[busno] = pism_cycle_count[busno];
+	if (!pism_checkpoint_write(fp, &pch, sizeof(pch)))
+		goto fail;
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		if (!pism_initialized[busno])
+			continue;
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (!pism_checkpoint_save_device(fp, dev))
+				goto fail;
+		}
+	}
+	memset(&pcs, 0, sizeof(pcs));
+	pcs.pcs_busno = PISM_CHECKPOINT_BUS_END;
+	if (!pism_checkpoint_write(fp, &pcs, sizeof(pcs)))
+		goto fail;
+	if (fclose(fp) != 0) {
+		warn("%s: %s", __func__, tmppath);
+		(void)remove(tmppath);
+		return (false);
+	}
+	if (rename(tmppath, path) != 0) {
+		warn("%s: rename to %s", __func__, path);
+		(void)remove(tmppath);
+		return (false);
+	}
+	return (true);
+
+fail:
+	fclose(fp);
+	(void)remove(tmppath);
+	return (false);
+}
+
+/*
+ * Pending timers keep their distance from the current cycle.
+ */
+static void
+pism_timers_rebase(uint8_t busno, uint64_t oldcount)
+{
+	struct pism_timer_list pending;
+	struct pism_timer *pt;
+	uint64_t delta;
+	u_int i;
+
+	LIST_INIT(&pending);
+	for (i = 0; i < PISM_TIMER_WHEEL_SLOTS; i++) {
+		while ((pt = LIST_FIRST(&pism_timer_wheel[busno][i])) != NULL) {
+			LIST_REMOVE(pt, pt_entries);
+			LIST_INSERT_HEAD(&pending, pt, pt_entries);
+		}
+	}
+	while ((pt = LIST_FIRST(&pending)) != NULL) {
+		LIST_REMOVE(pt, pt_entries);
+		pt->pt_pending = false;
+		delta = pt->pt_cycle > oldcount ? pt->pt_cycle - oldcount : 1;
+		pism_timer_schedule(pt, pism_cycle_count[busno] + delta);
+	}
+}
+
+bool
+pism_checkpoint_restore(const char *path)
+{
+	struct pism_checkpoint_header pch;
+	struct pism_checkpoint_section pcs;
+	pism_device_t *dev;
+	uint64_t oldcount;
+	uint8_t busno;
+	off_t start;
+	FILE *fp;
+
+	if (!pism_checkpoint_quiescent())
+		return (false);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		warn("%s: %s", __func__, path);
+		return (false);
+	}
+	if (!pism_checkpoint_read(fp, &pch, sizeof(pch)))
+		goto fail;
+	if (memcmp(pch.pch_magic, PISM_CHECKPOINT_MAGIC,
+	    sizeof(pch.pch_magic)) != 0 ||
+	    pch.pch_version != PISM_CHECKPOINT_VERSION ||
+	    pch.pch_buscount != PISM_BUS_COUNT) {
+		warnx("%s: %s: not a compatible checkpoint", __func__, path);
+		goto fail;
+	}
+	for (;;) {
+		if (!pism_checkpoint_read(fp, &pcs, sizeof(pcs)))
+			goto fail;
+		if (pcs.pcs_busno == PISM_CHECKPOINT_BUS_END)
+			break;
+		pcs.pcs_name[sizeof(pcs.pcs_name) - 1] = '\0';
+		dev = NULL;
+		if (pcs.pcs_busno < PISM_BUS_COUNT) {
+			SLIST_FOREACH(dev, g_pism_devices[pcs.pcs_busno],
+			    pd_next) {
+				if (strcmp(dev->pd_name, pcs.pcs_name) == 0)
+					break;
+			}
+		}
+		if (dev == NULL) {
+			warnx("%s: %s: no device %s on bus %u", __func__,
+			    path, pcs.pcs_name, pcs.pcs_busno);
+			goto fail;
+		}
+		if (pcs.pcs_length == 0)
+			continue;
+		if (dev->pd_mod->pm_dev_restore == NULL) {
+			warnx("%s: %s: device %s cannot be restored",
+			    __func__, path, dev->pd_name);
+			goto fail;
+		}
+		start = ftello(fp);
+		if (!dev->pd_mod->pm_dev_restore(dev, fp)) {
+			warnx("%s: device %s failed", __func__, dev->pd_name);
+			goto fail;
+		}
+		if ((uint64_t)(ftello(fp) - start) != pcs.pcs_length) {
+			warnx("%s: device %s read %jd bytes of %ju", __func__,
+			    dev->pd_name, (intmax_t)(ftello(fp) - start),
+			    (uintmax_t)pcs.pcs_length);
+			goto fail;
+		}
+	}
+	fclose(fp);
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		oldcount = pism_cycle_count[busno];
+		pism_cycle_count[busno] = pch.pch_cycles[busno];
+		pism_timers_rebase(busno, oldcount);
+	}
+	return (true);
+
+fail:
+	fclose(fp);
+	return (false);
+}
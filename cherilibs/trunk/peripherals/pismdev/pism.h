@@ -38,6 +38,8 @@
 #include <sys/queue.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 
 /*
  * Number and description of PISM busses
@@ -56,6 +58,8 @@
 #define	PISM_DATA_BYTES		32
 
 struct pism_data_int {
+	uint8_t		pdi_captag;	/* CHERI tag bits, one per beat. */
+	uint16_t	pdi_tag;	/* Matches fetch responses to requests. */
 	uint8_t		pdi_acctype;
 	uint32_t	pdi_byteenable;
 	uint8_t		pdi_data[PISM_DATA_BYTES];
@@ -73,6 +77,25 @@ typedef struct pism_data	pism_data_t;
 #define	PISM_ACC_FETCH	0
 #define	PISM_ACC_STORE	1
 
+/*
+ * Memory devices that keep CHERI tags hold one per PISM_DATA_BYTES line.  A
+ * store of a whole beat sets the line's tag from bit i of pdi_captag, for
+ * beat i of a burst or bit 0 for a single beat; any partial store clears it.
+ * Fetches return tags in the same bits.  Other devices ignore pdi_captag.
+ */
+#define	PISM_CAPTAG_BEAT(req, beat)	\
+	(((req)->pd_int.pdi_captag >> (beat)) & 1)
+
+/*
+ * Bounds on the number of fetches that may be outstanding on a bus.  The
+ * depth of each bus may be set using CHERI_{MEMORY,PERIPHERAL,TRACE}_
+ * QUEUE_DEPTH; if CHERI_{MEMORY,PERIPHERAL,TRACE}_TAGGED is set, responses
+ * are returned as they complete rather than in request order, and the CPU
+ * must use pdi_tag to match them up.
+ */
+#define	PISM_BUS_DEPTH_DEFAULT	16
+#define	PISM_BUS_DEPTH_MAX	1024
+
 bool		pism_init(uint8_t busno);
 void		pism_cycle_tick(uint8_t busno);
 uint32_t	pism_interrupt_get(uint8_t busno);
@@ -82,6 +105,24 @@ bool		pism_response_ready(uint8_t busno);
 pism_data_t	pism_response_get(uint8_t busno);
 bool		pism_addr_valid(uint8_t busno, pism_data_t *req);
 
+/*
+ * Burst interfaces move up to PISM_BURST_MAX_BEATS consecutive beats, such
+ * as a cache line, in one call, passing data by reference rather than as a
+ * pism_data_t per beat.  pism_response_ready() reports burst responses as
+ * for single beats.
+ */
+#define	PISM_BURST_MAX_BEATS	8
+#define	PISM_BURST_MAX_BYTES	(PISM_BURST_MAX_BEATS * PISM_DATA_BYTES)
+
+bool		pism_burst_addr_valid(uint8_t busno, pism_data_t *req,
+		    u_int nbeats);
+bool		pism_burst_request_ready(uint8_t busno, pism_data_t *req,
+		    u_int nbeats);
+void		pism_burst_request_put(uint8_t busno, pism_data_t *req,
+		    u_int nbeats, uint8_t *data);
+u_int		pism_burst_response_get(uint8_t busno, pism_data_t *resp,
+		    uint8_t *data);
+
 /*
  * Forward declare structs and typedefs so they can be used arbitrarily in
  * later structure definitions.
@@ -93,6 +134,8 @@ typedef struct pism_module	pism_module_t;
 
 struct pism_module	*pism_module_lookup(const char *);
 void	*pism_dev_get_private(uint8_t busno, const char *name);
+void	 pism_bus_decoder_build(uint8_t busno);
+pism_device_t	*pism_dev_lookup(uint8_t busno, uint64_t addr);
 
 typedef bool		pism_mod_init_t(pism_module_t *);
 
@@ -106,9 +149,74 @@ typedef bool		pism_dev_response_ready_t(pism_device_t *);
 typedef pism_data_t	pism_dev_response_get_t(pism_device_t *);
 typedef bool		pism_dev_addr_valid_t(pism_device_t *, pism_data_t *);
 typedef void		pism_dev_cycle_tick_t(pism_device_t *);
+typedef void		pism_dev_request_put_burst_t(pism_device_t *,
+			    pism_data_t *, u_int, uint8_t *);
+typedef bool		pism_dev_checkpoint_t(pism_device_t *, FILE *);
+typedef bool		pism_dev_restore_t(pism_device_t *, FILE *);
+typedef void		pism_dev_quiesce_t(pism_device_t *);
+typedef bool		pism_dev_fork_t(pism_device_t *, int);
 
 pism_data_t	pism_handler(pism_data_t	*arg);
 
+/*
+ * Host profiling of module methods.  If CHERI_PISM_PROFILE is set, PISM
+ * timestamps every call into a module and reports, at exit, where host time
+ * went, ranked by module and method.  The report is written to the file
+ * named, or to stderr for "-".
+ */
+enum pism_prof_method {
+	PISM_PROF_DEV_INIT,
+	PISM_PROF_INTERRUPT_GET,
+	PISM_PROF_REQUEST_READY,
+	PISM_PROF_REQUEST_PUT,
+	PISM_PROF_REQUEST_PUT_BURST,
+	PISM_PROF_RESPONSE_READY,
+	PISM_PROF_RESPONSE_GET,
+	PISM_PROF_ADDR_VALID,
+	PISM_PROF_CYCLE_TICK,
+	PISM_PROF_TIMER,
+	PISM_PROF_NMETHODS
+};
+
+struct pism_module_prof {
+	uint64_t	pmp_calls[PISM_PROF_NMETHODS];
+	uint64_t	pmp_ticks[PISM_PROF_NMETHODS];
+};
+
+extern bool	g_pism_prof;
+
+void	pism_prof_init(void);
+
+/*
+ * A cheap, monotonic timestamp in arbitrary units; the report converts to
+ * seconds by calibrating against the system clock.
+ */
+static inline uint64_t
+pism_prof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+
+	return (__builtin_ia32_rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+#define	PISM_PROF_START(start) do {					\
+	(start) = g_pism_prof ? pism_prof_ticks() : 0;			\
+} while (0)
+
+#define	PISM_PROF_STOP(mod, method, start) do {				\
+	if (g_pism_prof) {						\
+		(mod)->pm_prof.pmp_calls[(method)]++;			\
+		(mod)->pm_prof.pmp_ticks[(method)] +=			\
+		    pism_prof_ticks() - (start);			\
+	}								\
+} while (0)
+
 /*
  * Simulator modules.
  */
@@ -124,6 +232,11 @@ struct pism_module {
 	 */
 	const char		**pm_option_list;
 
+	/*
+	 * Module properties; see PISM_MODULE_FLAG_*.
+	 */
+	uint32_t		pm_flags;
+
 	/*
 	 * Module-private data handle.
 	 */
@@ -146,9 +259,51 @@ struct pism_module {
 	pism_dev_addr_valid_t		*pm_dev_addr_valid;
 	pism_dev_cycle_tick_t		*pm_dev_cycle_tick;
 
+	/*
+	 * Optional burst support.  For stores, the data buffer holds all
+	 * beats; for fetches, it is where the device must write them when
+	 * the response is taken with pm_dev_response_get, which need then
+	 * only return the request.  Devices without this method are sent
+	 * bursts one beat at a time.
+	 */
+	pism_dev_request_put_burst_t	*pm_dev_request_put_burst;
+
+	/*
+	 * Optional checkpoint support.  pm_dev_checkpoint writes the device's
+	 * state to the stream, and pm_dev_restore reads back exactly what it
+	 * wrote, into a device configured identically.  Both are called only
+	 * when no requests are outstanding.  Devices without these methods
+	 * are assumed to have no state worth saving.  pm_dev_quiesce, if
+	 * present, is called on every device before any is saved, and must
+	 * wait for work the device runs off the simulator thread, such as
+	 * host I/O into DRAM, to finish.
+	 */
+	pism_dev_checkpoint_t		*pm_dev_checkpoint;
+	pism_dev_restore_t		*pm_dev_restore;
+	pism_dev_quiesce_t		*pm_dev_quiesce;
+
+	/*
+	 * Optional; called in each child after the simulator forks, with the
+	 * child's number, so that the device can move to per-child host
+	 * resources (see pism_fork_path()).  Returning false kills the child.
+	 */
+	pism_dev_fork_t			*pm_dev_fork;
+
+	/*
+	 * Maintained by PISM if profiling is enabled.
+	 */
+	struct pism_module_prof		pm_prof;
+
 	SLIST_ENTRY(pism_module) pm_next;
 };
 SLIST_HEAD(pism_modules, pism_module);
+
+/*
+ * Devices of a module with PISM_MODULE_FLAG_UNORDERED may return fetch
+ * responses in any order, and must preserve each request's pdi_tag in its
+ * response.  Otherwise, responses are taken to be in request order.
+ */
+#define	PISM_MODULE_FLAG_UNORDERED	0x00000001
 extern struct pism_modules *g_pism_modules;
 
 #define	___mkstr(s...)	#s
@@ -159,6 +314,25 @@ extern struct pism_modules *g_pism_modules;
 	__attribute__((used))			\
 	__attribute__((section(".modinfo"),unused))
 
+/*
+ * Per-device statistics, maintained by PISM.  Latencies, from a fetch being
+ * put to its response being returned, are kept as a log2 histogram: bucket
+ * 0 counts zero-cycle latencies, and bucket i latencies of [2^(i-1), 2^i)
+ * cycles.  Stall cycles are those in which the device held the oldest
+ * outstanding fetch on the bus without having responded.
+ */
+#define	PISM_STATS_LATENCY_BUCKETS	32
+
+struct pism_device_stats {
+	uint64_t	pds_fetches;
+	uint64_t	pds_fetch_bytes;
+	uint64_t	pds_stores;
+	uint64_t	pds_store_bytes;
+	uint64_t	pds_refusals;		/* request_ready refusals. */
+	uint64_t	pds_stall_cycles;
+	uint64_t	pds_latency[PISM_STATS_LATENCY_BUCKETS];
+};
+
 /*
  * Device abstractions
  */
@@ -181,6 +355,16 @@ struct pism_device {
 	uint64_t		pd_base;	/* Mapping base address. */
 	uint64_t		pd_length;	/* Mapping length. */
 	int			pd_irq;		/* IRQ, or -1 if none. */
+	u_int			pd_depth;	/* Max outstanding fetches. */
+
+	/*
+	 * Maintained by PISM: fetches put to the device whose responses have
+	 * not yet been collected.
+	 */
+	u_int			pd_outstanding;
+	bool			pd_burst_pending;	/* Beats yet to put. */
+	struct pism_device_stats pd_stats;
+	uint16_t		pd_logid;	/* Device number in the log. */
 
 	/*
 	 * Text configuration file parameters captured, but not interpreted,
@@ -217,6 +401,7 @@ bool	pism_device_options_finalise(pism_device_t *dev);
 #define	PISM_DEVICE_OPTION_LENGTH	"length"	/* Mapping length. */
 #define	PISM_DEVICE_OPTION_PERMS	"perms"		/* Supported ops. */
 #define	PISM_DEVICE_OPTION_IRQ		"irq"		/* Interrupt request. */
+#define	PISM_DEVICE_OPTION_DEPTH	"depth"		/* Outstanding fetches. */
 
 /*
  * Constants for the "perms" option.
@@ -241,11 +426,213 @@ bool	pism_device_options_finalise(pism_device_t *dev);
 #define	PISM_IRQ_MIN			0	/* Minimum IRQ number. */
 #define	PISM_IRQ_MAX			4	/* Maximum IRQ number. */
 
+/*
+ * Constants for the "depth" option.  Most devices hold a single request;
+ * those that can do better size their queues from pd_depth.
+ */
+#define	PISM_DEPTH_DEFAULT		1
+#define	PISM_DEPTH_MIN			1
+#define	PISM_DEPTH_MAX			PISM_BUS_DEPTH_MAX
+
 /*
  * Utility functions provided by PISM for device implementations.
  */
 uint64_t	pism_cycle_count_get(uint8_t busno);
 
+/*
+ * Statistics are always collected; if CHERI_PISM_STATS names a file, they
+ * are written there at exit and on SIGUSR1, as JSON if the name ends in
+ * ".json" and CSV otherwise.  "-" means stderr.
+ */
+void	pism_stats_init(void);
+void	pism_stats_poll(void);
+void	pism_stats_dump(FILE *fp, bool json);
+
+/*
+ * Checkpoints hold the cycle counters and the state of every device on every
+ * initialised bus.  They may be taken only when no requests are outstanding,
+ * and restored only into a simulator with the same configuration.  Modules
+ * use pism_checkpoint_write() and pism_checkpoint_read(), which warn and
+ * return false on error.
+ */
+bool	pism_checkpoint_save(const char *path);
+bool	pism_checkpoint_restore(const char *path);
+bool	pism_checkpoint_write(FILE *fp, const void *buf, size_t len);
+bool	pism_checkpoint_read(FILE *fp, void *buf, size_t len);
+
+/*
+ * Fork-many: if CHERI_PISM_FORK is set to N, the simulator forks N children
+ * when the memory bus reaches cycle CHERI_PISM_FORK_CYCLE, or when a store
+ * is made to the line containing address CHERI_PISM_FORK_ADDR on any bus,
+ * whichever comes first.  Children continue the simulation from that point,
+ * sharing memory copy-on-write; the parent waits for them all and exits,
+ * failing if any child did.  g_pism_fork_child is the child's number, or -1
+ * if the simulator has not forked.
+ */
+extern int	 g_pism_fork_child;
+extern bool	 g_pism_fork_armed;
+extern uint64_t	 g_pism_fork_cycle;
+extern uint64_t	 g_pism_fork_addr;
+
+void	pism_fork_init(void);
+void	pism_fork(u_int nchildren);
+void	pism_fork_trigger(void);
+bool	pism_fork_path(const char *path, char *buf, size_t len);
+
+/*
+ * Copy-on-write disk images, shared by the block devices.  The base image is
+ * only read; writes go to a sparse delta file, created afresh by
+ * pism_overlay_open() whatever the image size, and reads take each block
+ * from whichever holds it.  At exit the delta is deleted, after being
+ * written back to the base if commit was asked for.  Overlays may be used
+ * from several threads at once.  Disks save their delta's blocks in
+ * checkpoints with pism_overlay_checkpoint(), but not the base image.
+ */
+struct iovec;
+struct pism_overlay;
+
+void	pism_overlay_init(void);
+struct pism_overlay	*pism_overlay_open(const char *base, const char *delta,
+	    bool commit);
+void	pism_overlay_close(struct pism_overlay *po);
+uint64_t	pism_overlay_length(struct pism_overlay *po);
+ssize_t	pism_overlay_pread(struct pism_overlay *po, void *buf, size_t len,
+	    off_t off);
+ssize_t	pism_overlay_pwrite(struct pism_overlay *po, const void *buf,
+	    size_t len, off_t off);
+ssize_t	pism_overlay_preadv(struct pism_overlay *po, const struct iovec *iov,
+	    int iovcnt, off_t off);
+ssize_t	pism_overlay_pwritev(struct pism_overlay *po,
+	    const struct iovec *iov, int iovcnt, off_t off);
+int	pism_overlay_fdatasync(struct pism_overlay *po);
+int	pism_overlay_discard(struct pism_overlay *po, off_t off, off_t len);
+int	pism_overlay_zero(struct pism_overlay *po, off_t off, off_t len);
+bool	pism_overlay_fork(struct pism_overlay *po);
+bool	pism_overlay_fork_image(pism_device_t *dev, struct pism_overlay *po,
+	    const char *image, int *fdp);
+bool	pism_overlay_checkpoint(struct pism_overlay *po, FILE *fp);
+bool	pism_overlay_restore(struct pism_overlay *po, FILE *fp);
+int	pism_punch_hole(int fd, off_t off, off_t len);
+
+/*
+ * Event logging shared by PISM and its modules.  Logging is compiled in only
+ * if PISM_LOGGING is defined ("make PISM_LOG=1"); otherwise PISM_LOG() and
+ * friends expand to nothing.  When compiled in, setting CHERI_PISM_LOG to a
+ * file name enables it: fixed-size binary records are written to a lock-free
+ * in-memory ring, which is flushed to the file as it fills and at exit.
+ * Use pismlog to render the file as text.
+ */
+enum pism_log_event {
+	PISM_LOG_EV_DEVICE,		/* Device name record, see below. */
+	PISM_LOG_EV_INIT,		/* Initialisation; arg is result. */
+	PISM_LOG_EV_CONFIG,		/* Configuration value in arg. */
+	PISM_LOG_EV_ERROR,		/* Unexpected request or state. */
+	PISM_LOG_EV_REQUEST_READY,	/* arg is result. */
+	PISM_LOG_EV_REQUEST_PUT,	/* arg is acctype << 32 | byteenable. */
+	PISM_LOG_EV_RESPONSE_READY,	/* arg is result. */
+	PISM_LOG_EV_RESPONSE_GET,	/* arg is tag, or data if a register. */
+	PISM_LOG_EV_ADDR_VALID,		/* arg is result. */
+	PISM_LOG_EV_INTERRUPT,		/* arg is interrupt state. */
+	PISM_LOG_EV_BURST_READY,	/* arg is result. */
+	PISM_LOG_EV_BURST_PUT,		/* arg is number of beats. */
+	PISM_LOG_EV_BURST_GET,		/* arg is number of beats. */
+	PISM_LOG_EV_REG_READ,		/* Device register read; arg is value. */
+	PISM_LOG_EV_REG_WRITE,		/* Device register write; arg is value. */
+	PISM_LOG_EV_IO_READ,		/* Backing store read; arg is length. */
+	PISM_LOG_EV_IO_WRITE,		/* Backing store write; arg is length. */
+	PISM_LOG_EV_COUNT
+};
+
+/*
+ * Records are 32 bytes.  A PISM_LOG_EV_DEVICE record is written once for
+ * each device as it is configured; in it the cycle, addr and arg fields
+ * instead hold the device name, NUL-padded and truncated if necessary.
+ */
+struct pism_log_record {
+	uint64_t	plr_cycle;
+	uint64_t	plr_addr;
+	uint64_t	plr_arg;
+	uint16_t	plr_event;
+	uint16_t	plr_device;
+	uint8_t		plr_bus;
+	uint8_t		plr_pad[3];
+};
+
+#define	PISM_LOG_DEVICE_NONE	0xffff	/* Bus-level events. */
+#define	PISM_LOG_BUS_NONE	0xff	/* Module-level events. */
+#define	PISM_LOG_NAME_LEN	24
+
+struct pism_log_header {
+	char		plh_magic[8];
+	uint32_t	plh_version;
+	uint32_t	plh_recsize;
+};
+
+#define	PISM_LOG_MAGIC		"PISMLOG"
+#define	PISM_LOG_VERSION	1
+
+extern bool	g_pism_log;
+
+void	pism_log_init(void);
+void	pism_log_device(pism_device_t *dev);
+void	pism_log_event(pism_device_t *dev, u_int event, uint64_t addr,
+	    uint64_t arg);
+void	pism_log_bus_event(uint8_t busno, u_int event, uint64_t addr,
+	    uint64_t arg);
+void	pism_log_poll(void);
+void	pism_log_flush(void);
+void	pism_log_fork(void);
+
+#ifdef PISM_LOGGING
+#define	PISM_LOG(dev, event, addr, arg) do {				\
+	if (g_pism_log)							\
+		pism_log_event((dev), (event), (addr), (arg));		\
+} while (0)
+
+#define	PISM_LOG_BUS(busno, event, addr, arg) do {			\
+	if (g_pism_log)							\
+		pism_log_bus_event((busno), (event), (addr), (arg));	\
+} while (0)
+
+#define	PISM_LOG_DEVICE(dev) do {					\
+	if (g_pism_log)							\
+		pism_log_device(dev);					\
+} while (0)
+
+#define	PISM_LOG_POLL() do {						\
+	if (g_pism_log)							\
+		pism_log_poll();					\
+} while (0)
+#else
+#define	PISM_LOG(dev, event, addr, arg)		do { } while (0)
+#define	PISM_LOG_BUS(busno, event, addr, arg)	do { } while (0)
+#define	PISM_LOG_DEVICE(dev)			do { } while (0)
+#define	PISM_LOG_POLL()				do { } while (0)
+#endif
+
+/*
+ * Timers let a device ask to be called back at a particular cycle, rather
+ * than implementing pm_dev_cycle_tick, which is called on every cycle.  The
+ * timer structure is owned by the device and must remain valid while
+ * pending; a callback may reschedule its own timer.
+ */
+typedef void	pism_timer_func_t(pism_device_t *dev, void *arg);
+
+struct pism_timer {
+	LIST_ENTRY(pism_timer)	 pt_entries;
+	pism_device_t		*pt_dev;
+	pism_timer_func_t	*pt_func;
+	void			*pt_arg;
+	uint64_t		 pt_cycle;	/* Cycle at which to fire. */
+	bool			 pt_pending;
+};
+
+void	pism_timer_init(struct pism_timer *pt, pism_device_t *dev,
+	    pism_timer_func_t *func, void *arg);
+void	pism_timer_schedule(struct pism_timer *pt, uint64_t cycle);
+void	pism_timer_cancel(struct pism_timer *pt);
+bool	pism_timer_pending(struct pism_timer *pt);
+
 /*
  * Macros operating on PISM requests.
  */
@@ -255,6 +642,9 @@ uint64_t	pism_cycle_count_get(uint8_t busno);
 #define	PISM_REQ_ACCTYPE(req)						\
 	((req)->pd_int.pdi_acctype)
 
+#define	PISM_REQ_TAG(req)						\
+	((req)->pd_int.pdi_tag)
+
 #define	PISM_REQ_BYTEENABLED(req, i)					\
 	((req)->pd_int.pdi_byteenable & (1 << (i)))
 
@@ -50,6 +50,7 @@ static const char *pism_option_list[] = {
 	PISM_DEVICE_OPTION_LENGTH,
 	PISM_DEVICE_OPTION_PERMS,
 	PISM_DEVICE_OPTION_IRQ,
+	PISM_DEVICE_OPTION_DEPTH,
 	NULL
 };
 
@@ -264,6 +265,24 @@ pism_device_option_finalise_irq(pism_device_t *dev)
 	return (true);
 }
 
+static bool
+pism_device_option_finalise_depth(pism_device_t *dev)
+{
+	const char *optval;
+	long long ll;
+
+	if (!pism_device_option_get(dev, PISM_DEVICE_OPTION_DEPTH, &optval)) {
+		dev->pd_depth = PISM_DEPTH_DEFAULT;
+		return (true);
+	}
+	if (!pism_device_option_parse_longlong(dev, optval, &ll))
+		return (false);
+	if (ll < PISM_DEPTH_MIN || ll > PISM_DEPTH_MAX)
+		return (false);
+	dev->pd_depth = ll;
+	return (true);
+}
+
 /*
  * Check that all options defined on a device are valid; interpret any core
  * PISM options.  This must be called before the device initialisation
@@ -312,5 +331,11 @@ pism_device_options_finalise(pism_device_t *dev)
 		    dev->pd_name);
 		return (false);
 	}
+	if (!pism_device_option_finalise_depth(dev)) {
+		fprintf(stderr,
+		    "%s: invalid depth option on device %s\n", __func__,
+		    dev->pd_name);
+		return (false);
+	}
 	return (true);
 }
@@ -0,0 +1,209 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * This file implements fork-many: running a simulation to a point of
+ * interest once, then forking a child for each of several experiments run
+ * from there.  Memory is shared copy-on-write by fork() itself; devices with
+ * host resources that must not be shared, such as output files, sockets and
+ * writable disk images, move to per-child ones in pm_dev_fork.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pismdev/pism.h"
+
+#define	PISM_FORK_MAX		1024
+
+int		 g_pism_fork_child = -1;
+bool		 g_pism_fork_armed;
+uint64_t	 g_pism_fork_cycle;
+uint64_t	 g_pism_fork_addr = UINT64_MAX;	/* Never a line address. */
+
+static u_int	 pism_fork_nchildren;
+
+static bool
+pism_fork_getenv_ull(const char *name, unsigned long long *vp)
+{
+	const char *env;
+	char *endp;
+
+	env = getenv(name);
+	if (env == NULL)
+		return (false);
+	errno = 0;
+	*vp = strtoull(env, &endp, 0);
+	if (*env == '\0' || *endp != '\0' || errno != 0) {
+		warnx("%s: invalid %s \"%s\"", __func__, name, env);
+		return (false);
+	}
+	return (true);
+}
+
+void
+pism_fork_init(void)
+{
+	unsigned long long v;
+
+	if (!pism_fork_getenv_ull("CHERI_PISM_FORK", &v))
+		return;
+	if (v < 1 || v > PISM_FORK_MAX) {
+		warnx("%s: CHERI_PISM_FORK must be between 1 and %d",
+		    __func__, PISM_FORK_MAX);
+		return;
+	}
+	pism_fork_nchildren = v;
+	if (pism_fork_getenv_ull("CHERI_PISM_FORK_CYCLE", &v))
+		g_pism_fork_cycle = v;
+	if (pism_fork_getenv_ull("CHERI_PISM_FORK_ADDR", &v))
+		g_pism_fork_addr = v & ~(uint64_t)(PISM_DATA_BYTES - 1);
+	if (g_pism_fork_cycle == 0 && g_pism_fork_addr == UINT64_MAX) {
+		warnx("%s: CHERI_PISM_FORK needs CHERI_PISM_FORK_CYCLE or "
+		    "CHERI_PISM_FORK_ADDR", __func__);
+		return;
+	}
+	g_pism_fork_armed = true;
+}
+
+/*
+ * Per-child host paths are the configured path with the child's number
+ * appended; before a fork, the configured path itself is used.
+ */
+bool
+pism_fork_path(const char *path, char *buf, size_t len)
+{
+	int ret;
+
+	if (g_pism_fork_child < 0)
+		ret = snprintf(buf, len, "%s", path);
+	else
+		ret = snprintf(buf, len, "%s.%d", path, g_pism_fork_child);
+	if (ret < 0 || (size_t)ret >= len) {
+		warnx("%s: path too long: %s", __func__, path);
+		return (false);
+	}
+	return (true);
+}
+
+static void
+pism_fork_child_init(int child)
+{
+	pism_device_t *dev;
+	uint8_t busno;
+
+	g_pism_fork_child = child;
+	pism_log_fork();
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_fork == NULL)
+				continue;
+			if (!dev->pd_mod->pm_dev_fork(dev, child))
+				errx(1, "%s: child %d: device %s failed",
+				    __func__, child, dev->pd_name);
+		}
+	}
+}
+
+/*
+ * Fork nchildren children, which return to continue the simulation.  The
+ * parent does not return: it waits for the children and exits.
+ */
+void
+pism_fork(u_int nchildren)
+{
+	pid_t pid, *pids;
+	int child, status, failed;
+
+	g_pism_fork_armed = false;
+	pids = calloc(nchildren, sizeof(*pids));
+	if (pids == NULL)
+		err(1, "%s: calloc", __func__);
+
+	/*
+	 * Don't let children inherit, and so repeat, buffered output.
+	 */
+	pism_log_flush();
+	fflush(NULL);
+
+	for (child = 0; child < (int)nchildren; child++) {
+		pid = fork();
+		if (pid < 0) {
+			warn("%s: fork", __func__);
+			break;
+		}
+		if (pid == 0) {
+			free(pids);
+			pism_fork_child_init(child);
+			return;
+		}
+		pids[child] = pid;
+	}
+
+	failed = nchildren - child;	/* Children we failed to fork. */
+	while (child-- > 0) {
+		if (waitpid(pids[child], &status, 0) < 0) {
+			warn("%s: waitpid", __func__);
+			failed++;
+			continue;
+		}
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
+		if (WIFSIGNALED(status))
+			warnx("%s: child %d killed by signal %d", __func__,
+			    child, WTERMSIG(status));
+		else
+			warnx("%s: child %d exited with status %d", __func__,
+			    child, WEXITSTATUS(status));
+		failed++;
+	}
+	free(pids);
+	exit(failed != 0 ? 1 : 0);
+}
+
+/*
+ * Called when a trigger fires; see pism.h.
+ */
+void
+pism_fork_trigger(void)
+{
+
+	pism_fork(pism_fork_nchildren);
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * This file contains the PISM event log: a ring of fixed-size records that
+ * producers claim with an atomic increment and publish with a sequence
+ * number, and that is drained to a file in large writes.  Producers never
+ * block; if the ring laps the flusher, the oldest records are lost and
+ * counted.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pismdev/pism.h"
+
+#define	PISM_LOG_RING_ENTRIES	65536	/* Must be a power of two. */
+#define	PISM_LOG_RING_MASK	(PISM_LOG_RING_ENTRIES - 1)
+#define	PISM_LOG_FLUSH_BATCH	1024
+
+/*
+ * pls_seq is zero while a slot is being written, and one more than the
+ * record's ring index once it is published.
+ */
+struct pism_log_slot {
+	uint64_t		pls_seq;
+	struct pism_log_record	pls_rec;
+};
+
+bool				 g_pism_log;
+
+static const char		*pism_log_path;
+static FILE			*pism_log_fp;
+static struct pism_log_slot	*pism_log_ring;
+static uint64_t			 pism_log_head;		/* Next to claim. */
+static uint64_t			 pism_log_tail;		/* Next to flush. */
+static uint64_t			 pism_log_lost;
+static bool			 pism_log_flushing;
+static uint16_t			 pism_log_ndevices;
+
+static void
+pism_log_put(struct pism_log_record *rec)
+{
+	struct pism_log_slot *pls;
+	uint64_t idx;
+
+	idx = __atomic_fetch_add(&pism_log_head, 1, __ATOMIC_RELAXED);
+	pls = &pism_log_ring[idx & PISM_LOG_RING_MASK];
+	__atomic_store_n(&pls->pls_seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	pls->pls_rec = *rec;
+	__atomic_store_n(&pls->pls_seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Drain published records to the file.  Only one thread flushes at a time;
+ * anyone else finding a flush in progress returns immediately.
+ */
+void
+pism_log_flush(void)
+{
+	struct pism_log_record batch[PISM_LOG_FLUSH_BATCH];
+	struct pism_log_slot *pls;
+	uint64_t seq, tail;
+	u_int count;
+
+	if (pism_log_fp == NULL)
+		return;
+	if (__atomic_exchange_n(&pism_log_flushing, true, __ATOMIC_ACQUIRE))
+		return;
+	tail = pism_log_tail;
+	count = 0;
+	for (;;) {
+		pls = &pism_log_ring[tail & PISM_LOG_RING_MASK];
+		seq = __atomic_load_n(&pls->pls_seq, __ATOMIC_ACQUIRE);
+		if (seq <= tail)
+			break;			/* Not yet published. */
+		if (seq > tail + 1) {
+			/* Lapped: skip to the oldest record still present. */
+			pism_log_lost += seq - 1 - tail;
+			tail = seq - 1;
+		}
+		batch[count] = pls->pls_rec;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&pls->pls_seq, __ATOMIC_RELAXED) != seq)
+			continue;		/* Overwritten while copying. */
+		tail++;
+		if (++count == PISM_LOG_FLUSH_BATCH) {
+			fwrite(batch, sizeof(batch[0]), count, pism_log_fp);
+			count = 0;
+		}
+	}
+	if (count != 0)
+		fwrite(batch, sizeof(batch[0]), count, pism_log_fp);
+	fflush(pism_log_fp);
+	pism_log_tail = tail;
+	__atomic_store_n(&pism_log_flushing, false, __ATOMIC_RELEASE);
+}
+
+static void
+pism_log_close(void)
+{
+
+	if (pism_log_fp == NULL)
+		return;
+	g_pism_log = false;
+	pism_log_flush();
+	fclose(pism_log_fp);
+	if (pism_log_lost != 0)
+		warnx("%s: %ju records lost", pism_log_path,
+		    (uintmax_t)pism_log_lost);
+}
+
+static bool
+pism_log_open(const char *path)
+{
+	struct pism_log_header plh;
+
+	pism_log_fp = fopen(path, "w");
+	if (pism_log_fp == NULL) {
+		warn("%s: %s", __func__, path);
+		return (false);
+	}
+	memset(&plh, 0, sizeof(plh));
+	strncpy(plh.plh_magic, PISM_LOG_MAGIC, sizeof(plh.plh_magic));
+	plh.plh_version = PISM_LOG_VERSION;
+	plh.plh_recsize = sizeof(struct pism_log_record);
+	fwrite(&plh, sizeof(plh), 1, pism_log_fp);
+	return (true);
+}
+
+void
+pism_log_init(void)
+{
+
+	pism_log_path = getenv("CHERI_PISM_LOG");
+	if (pism_log_path == NULL)
+		return;
+	pism_log_ring = calloc(PISM_LOG_RING_ENTRIES, sizeof(*pism_log_ring));
+	if (pism_log_ring == NULL) {
+		warn("%s: calloc", __func__);
+		return;
+	}
+	if (!pism_log_open(pism_log_path)) {
+		free(pism_log_ring);
+		return;
+	}
+	if (atexit(pism_log_close) != 0) {
+		warnx("%s: atexit failed", __func__);
+		fclose(pism_log_fp);
+		free(pism_log_ring);
+		return;
+	}
+	g_pism_log = true;
+}
+
+static void
+pism_log_device_name(pism_device_t *dev)
+{
+	struct pism_log_record rec;
+	char name[PISM_LOG_NAME_LEN];
+
+	memset(&rec, 0, sizeof(rec));
+	memset(name, 0, sizeof(name));
+	memcpy(name, dev->pd_name, strnlen(dev->pd_name, sizeof(name)));
+	memcpy(&rec.plr_cycle, name, sizeof(name));
+	rec.plr_event = PISM_LOG_EV_DEVICE;
+	rec.plr_device = dev->pd_logid;
+	rec.plr_bus = dev->pd_busno;
+	pism_log_put(&rec);
+}
+
+/*
+ * Number a newly configured device and record its name.
+ */
+void
+pism_log_device(pism_device_t *dev)
+{
+
+	dev->pd_logid = pism_log_ndevices++;
+	pism_log_device_name(dev);
+}
+
+/*
+ * Called in a child after the simulator forks, with the log flushed: start a
+ * log of the child's own, which begins by naming every device again.
+ */
+void
+pism_log_fork(void)
+{
+	char path[MAXPATHLEN];
+	pism_device_t *dev;
+	uint8_t busno;
+
+	if (!g_pism_log)
+		return;
+	fclose(pism_log_fp);
+	pism_log_fp = NULL;
+	if (!pism_fork_path(pism_log_path, path, sizeof(path)) ||
+	    !pism_log_open(path)) {
+		g_pism_log = false;
+		return;
+	}
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next)
+			pism_log_device_name(dev);
+	}
+}
+
+/*
+ * A NULL device logs a module-level event.
+ */
+void
+pism_log_event(pism_device_t *dev, u_int event, uint64_t addr, uint64_t arg)
+{
+	struct pism_log_record rec;
+
+	if (dev != NULL) {
+		rec.plr_cycle = pism_cycle_count_get(dev->pd_busno);
+		rec.plr_device = dev->pd_logid;
+		rec.plr_bus = dev->pd_busno;
+	} else {
+		rec.plr_cycle = 0;
+		rec.plr_device = PISM_LOG_DEVICE_NONE;
+		rec.plr_bus = PISM_LOG_BUS_NONE;
+	}
+	rec.plr_addr = addr;
+	rec.plr_arg = arg;
+	rec.plr_event = event;
+	memset(rec.plr_pad, 0, sizeof(rec.plr_pad));
+	pism_log_put(&rec);
+}
+
+void
+pism_log_bus_event(uint8_t busno, u_int event, uint64_t addr, uint64_t arg)
+{
+	struct pism_log_record rec;
+
+	rec.plr_cycle = pism_cycle_count_get(busno);
+	rec.plr_addr = addr;
+	rec.plr_arg = arg;
+	rec.plr_event = event;
+	rec.plr_device = PISM_LOG_DEVICE_NONE;
+	rec.plr_bus = busno;
+	memset(rec.plr_pad, 0, sizeof(rec.plr_pad));
+	pism_log_put(&rec);
+}
+
+/*
+ * Called once per cycle; flush once the ring is half full, so that the
+ * flush normally completes before producers can lap it.
+ */
+void
+pism_log_poll(void)
+{
+
+	if (__atomic_load_n(&pism_log_head, __ATOMIC_RELAXED) - pism_log_tail <
+	    PISM_LOG_RING_ENTRIES / 2)
+		return;
+	pism_log_flush();
+}
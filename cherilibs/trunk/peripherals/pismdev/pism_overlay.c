@@ -0,0 +1,725 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * This file implements copy-on-write disk images for the block devices.  The
+ * configured image is the base, and is only read; writes go to a sparse
+ * delta file of the same length, created afresh for each run, and a bitmap
+ * says which blocks have been written there.  Opening an overlay therefore
+ * costs the same whatever the size of the image.  At exit the delta is
+ * deleted, having first been copied into the base if the overlay commits.
+ */
+
+#define _GNU_SOURCE		/* fallocate() */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pismdev/pism.h"
+
+#define	PISM_OVERLAY_BLOCK	4096
+
+struct pism_overlay {
+	SLIST_ENTRY(pism_overlay)	po_next;
+	char			*po_path;	/* Of the delta. */
+	int			 po_base;
+	int			 po_delta;
+	uint64_t		 po_length;	/* Of the base. */
+	uint64_t		 po_nblocks;
+	uint8_t			*po_bitmap;	/* Blocks in the delta. */
+	pthread_mutex_t		 po_lock;	/* Writers of clean blocks. */
+	bool			 po_commit;
+};
+
+static SLIST_HEAD(, pism_overlay)	pism_overlays =
+    SLIST_HEAD_INITIALIZER(pism_overlays);
+
+static uint8_t	pism_overlay_zeroes[PISM_OVERLAY_BLOCK];
+
+static void	pism_overlay_exit(void);
+
+/*
+ * pism_init() calls this before initialising any module, so deltas are
+ * finished only after modules' own exit handlers have stopped their I/O.
+ */
+void
+pism_overlay_init(void)
+{
+
+	if (atexit(pism_overlay_exit) != 0)
+		warnx("%s: atexit failed", __func__);
+}
+
+/*
+ * Bits are only ever set, other than by a restore with the disk idle, so
+ * readers need not take po_lock.
+ */
+static inline bool
+pism_overlay_dirty(struct pism_overlay *po, uint64_t block)
+{
+
+	return ((__atomic_load_n(&po->po_bitmap[block / NBBY],
+	    __ATOMIC_ACQUIRE) & (1 << (block % NBBY))) != 0);
+}
+
+static inline void
+pism_overlay_mark(struct pism_overlay *po, uint64_t block)
+{
+
+	__atomic_fetch_or(&po->po_bitmap[block / NBBY], 1 << (block % NBBY),
+	    __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy a block between files, reading zeroes past the end of the source.
+ */
+static bool
+pism_overlay_copy(struct pism_overlay *po, int from, int to, uint64_t block)
+{
+	uint8_t buf[PISM_OVERLAY_BLOCK];
+	ssize_t len;
+	off_t off;
+
+	off = block * PISM_OVERLAY_BLOCK;
+	len = pread(from, buf, sizeof(buf), off);
+	if (len < 0)
+		return (false);
+	memset(buf + len, 0, sizeof(buf) - len);
+	len = MIN(sizeof(buf), po->po_length - off);
+	return (pwrite(to, buf, len, off) == len);
+}
+
+/*
+ * Create an empty delta at path, refusing to truncate the base.
+ */
+static int
+pism_overlay_create(struct pism_overlay *po, const char *path)
+{
+	struct stat sb, base_sb;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		warn("%s: open of %s failed", __func__, path);
+		return (-1);
+	}
+	if (fstat(fd, &sb) < 0 || fstat(po->po_base, &base_sb) < 0) {
+		warn("%s: fstat of %s failed", __func__, path);
+		close(fd);
+		return (-1);
+	}
+	if (sb.st_dev == base_sb.st_dev && sb.st_ino == base_sb.st_ino) {
+		warnx("%s: delta %s is the base image", __func__, path);
+		close(fd);
+		return (-1);
+	}
+	if (ftruncate(fd, 0) < 0 || ftruncate(fd, po->po_length) < 0) {
+		warn("%s: ftruncate of %s failed", __func__, path);
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+struct pism_overlay *
+pism_overlay_open(const char *base, const char *delta, bool commit)
+{
+	struct pism_overlay *po;
+	struct stat sb;
+
+	po = calloc(1, sizeof(*po));
+	if (po == NULL) {
+		warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	po->po_delta = -1;
+	po->po_commit = commit;
+	po->po_base = open(base, commit ? O_RDWR : O_RDONLY);
+	if (po->po_base < 0) {
+		warn("%s: open of %s failed", __func__, base);
+		goto fail;
+	}
+	if (fstat(po->po_base, &sb) < 0) {
+		warn("%s: fstat of %s failed", __func__, base);
+		goto fail;
+	}
+	po->po_length = sb.st_size;
+	po->po_nblocks = howmany(po->po_length, PISM_OVERLAY_BLOCK);
+	po->po_bitmap = calloc(howmany(po->po_nblocks, NBBY), 1);
+	po->po_path = strdup(delta);
+	if (po->po_bitmap == NULL || po->po_path == NULL) {
+		warn("%s: calloc", __func__);
+		goto fail;
+	}
+	po->po_delta = pism_overlay_create(po, delta);
+	if (po->po_delta < 0)
+		goto fail;
+	pthread_mutex_init(&po->po_lock, NULL);
+	SLIST_INSERT_HEAD(&pism_overlays, po, po_next);
+	return (po);
+
+fail:
+	if (po->po_base >= 0)
+		close(po->po_base);
+	free(po->po_bitmap);
+	free(po->po_path);
+	free(po);
+	return (NULL);
+}
+
+uint64_t
+pism_overlay_length(struct pism_overlay *po)
+{
+
+	return (po->po_length);
+}
+
+/*
+ * Read len bytes at off from fd into iov, starting skip bytes into it.
+ */
+static ssize_t
+pism_overlay_readpart(int fd, const struct iovec *iov, int iovcnt,
+    size_t skip, size_t len, off_t off)
+{
+	size_t done, n;
+	ssize_t ret;
+	int i;
+
+	done = 0;
+	for (i = 0; i < iovcnt && done < len; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(iov[i].iov_len - skip, len - done);
+		ret = pread(fd, (uint8_t *)iov[i].iov_base + skip, n,
+		    off + done);
+		if (ret < 0)
+			return (-1);
+		done += ret;
+		if ((size_t)ret < n)
+			break;
+		skip = 0;
+	}
+	return (done);
+}
+
+/*
+ * As preadv(), taking each run of blocks from whichever file holds it.
+ * Like the base, the overlay reads short at its end.
+ */
+ssize_t
+pism_overlay_preadv(struct pism_overlay *po, const struct iovec *iov,
+    int iovcnt, off_t off)
+{
+	uint64_t block, end;
+	size_t len, done, n;
+	ssize_t ret;
+	bool dirty;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (off < 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if ((uint64_t)off >= po->po_length)
+		return (0);
+	len = MIN(len, po->po_length - off);
+
+	for (done = 0; done < len; done += n) {
+		block = (off + done) / PISM_OVERLAY_BLOCK;
+		dirty = pism_overlay_dirty(po, block);
+		end = (block + 1) * PISM_OVERLAY_BLOCK;
+		while (end < off + len &&
+		    pism_overlay_dirty(po, end / PISM_OVERLAY_BLOCK) == dirty)
+			end += PISM_OVERLAY_BLOCK;
+		n = MIN(end, off + len) - (off + done);
+		if (n == len)
+			return (preadv(dirty ? po->po_delta : po->po_base,
+			    iov, iovcnt, off));
+		ret = pism_overlay_readpart(dirty ? po->po_delta :
+		    po->po_base, iov, iovcnt, done, n, off + done);
+		if (ret < 0)
+			return (-1);
+		if ((size_t)ret < n)
+			return (done + ret);
+	}
+	return (done);
+}
+
+/*
+ * As pwritev(), into the delta.  The overlay can't grow the image.
+ */
+ssize_t
+pism_overlay_pwritev(struct pism_overlay *po, const struct iovec *iov,
+    int iovcnt, off_t off)
+{
+	uint64_t block, first, last;
+	size_t len;
+	ssize_t ret;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len == 0)
+		return (0);
+	if (off < 0 || (uint64_t)off + len > po->po_length) {
+		errno = EFBIG;
+		return (-1);
+	}
+	first = off / PISM_OVERLAY_BLOCK;
+	last = (off + len - 1) / PISM_OVERLAY_BLOCK;
+	for (block = first; block <= last; block++) {
+		if (!pism_overlay_dirty(po, block))
+			break;
+	}
+	if (block > last)
+		return (pwritev(po->po_delta, iov, iovcnt, off));
+
+	/*
+	 * Copy partly-written clean blocks up from the base first, and mark
+	 * the others only once written, so that readers never find a marked
+	 * block missing from the delta.  Writers of clean blocks are
+	 * serialised so that a copy-up can't undo another's write.
+	 */
+	pthread_mutex_lock(&po->po_lock);
+	ret = -1;
+	if (off > first * PISM_OVERLAY_BLOCK &&
+	    !pism_overlay_dirty(po, first)) {
+		if (!pism_overlay_copy(po, po->po_base, po->po_delta, first))
+			goto out;
+		pism_overlay_mark(po, first);
+	}
+	if (off + len < MIN((last + 1) * PISM_OVERLAY_BLOCK, po->po_length) &&
+	    !pism_overlay_dirty(po, last)) {
+		if (!pism_overlay_copy(po, po->po_base, po->po_delta, last))
+			goto out;
+		pism_overlay_mark(po, last);
+	}
+	ret = pwritev(po->po_delta, iov, iovcnt, off);
+	if (ret == (ssize_t)len) {
+		for (block = first; block <= last; block++)
+			pism_overlay_mark(po, block);
+	}
+out:
+	pthread_mutex_unlock(&po->po_lock);
+	return (ret);
+}
+
+ssize_t
+pism_overlay_pread(struct pism_overlay *po, void *buf, size_t len, off_t off)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return (pism_overlay_preadv(po, &iov, 1, off));
+}
+
+ssize_t
+pism_overlay_pwrite(struct pism_overlay *po, const void *buf, size_t len,
+    off_t off)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	return (pism_overlay_pwritev(po, &iov, 1, off));
+}
+
+int
+pism_overlay_fdatasync(struct pism_overlay *po)
+{
+
+	return (fdatasync(po->po_delta));
+}
+
+/*
+ * The whole blocks in [off, off + len), counting a short last block of the
+ * image as whole.
+ */
+static void
+pism_overlay_blocks(struct pism_overlay *po, off_t off, off_t len,
+    uint64_t *firstp, uint64_t *endp)
+{
+
+	*firstp = howmany(off, PISM_OVERLAY_BLOCK);
+	if ((uint64_t)(off + len) == po->po_length)
+		*endp = po->po_nblocks;
+	else
+		*endp = (off + len) / PISM_OVERLAY_BLOCK;
+}
+
+/*
+ * Give back the delta's space for the whole blocks of a range.  Blocks
+ * still read from whichever file held them, so what is read from a
+ * discarded range is unspecified, as the guest expects.
+ */
+int
+pism_overlay_discard(struct pism_overlay *po, off_t off, off_t len)
+{
+	uint64_t first, end;
+
+	if (off < 0 || len < 0 || (uint64_t)(off + len) > po->po_length) {
+		errno = EFBIG;
+		return (-1);
+	}
+	pism_overlay_blocks(po, off, len, &first, &end);
+	if (first >= end)
+		return (0);
+	return (pism_punch_hole(po->po_delta, first * PISM_OVERLAY_BLOCK,
+	    (end - first) * PISM_OVERLAY_BLOCK));
+}
+
+static int
+pism_overlay_write_zeroes(struct pism_overlay *po, off_t off, off_t len)
+{
+	ssize_t n;
+
+	for (; len > 0; off += n, len -= n) {
+		n = MIN(len, (off_t)sizeof(pism_overlay_zeroes));
+		if (pism_overlay_pwrite(po, pism_overlay_zeroes, n, off) != n)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Make a range read as zeroes: whole blocks become holes in the delta,
+ * or are written with zeroes if the host can't punch them.
+ */
+int
+pism_overlay_zero(struct pism_overlay *po, off_t off, off_t len)
+{
+	uint64_t first, end, block;
+	off_t head, tail;
+	int error;
+
+	if (off < 0 || len < 0 || (uint64_t)(off + len) > po->po_length) {
+		errno = EFBIG;
+		return (-1);
+	}
+	pism_overlay_blocks(po, off, len, &first, &end);
+	if (first >= end)
+		return (pism_overlay_write_zeroes(po, off, len));
+	head = first * PISM_OVERLAY_BLOCK - off;
+	tail = off + len - MIN(end * PISM_OVERLAY_BLOCK, po->po_length);
+	if (pism_overlay_write_zeroes(po, off, head) != 0 ||
+	    pism_overlay_write_zeroes(po, off + len - tail, tail) != 0)
+		return (-1);
+
+	/* Serialised with copy-ups, which could otherwise fill a hole. */
+	pthread_mutex_lock(&po->po_lock);
+	error = pism_punch_hole(po->po_delta, first * PISM_OVERLAY_BLOCK,
+	    (end - first) * PISM_OVERLAY_BLOCK);
+	if (error == 0) {
+		for (block = first; block < end; block++)
+			pism_overlay_mark(po, block);
+	}
+	pthread_mutex_unlock(&po->po_lock);
+	if (error == 0 || errno != EOPNOTSUPP)
+		return (error);
+	return (pism_overlay_write_zeroes(po, first * PISM_OVERLAY_BLOCK,
+	    MIN(end * PISM_OVERLAY_BLOCK, po->po_length) -
+	    first * PISM_OVERLAY_BLOCK));
+}
+
+/*
+ * Deallocate a range of a file, which then reads as zeroes.  Fails with
+ * EOPNOTSUPP where the host can't.
+ */
+int
+pism_punch_hole(int fd, off_t off, off_t len)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+
+	return (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    off, len));
+#elif defined(SPACECTL_DEALLOC)
+	struct spacectl_range sr;
+
+	sr.r_offset = off;
+	sr.r_len = len;
+	return (fspacectl(fd, SPACECTL_DEALLOC, &sr, 0, NULL));
+#else
+
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/*
+ * Called from a child's pm_dev_fork: move to a delta of its own (see
+ * pism_fork_path()), seeded with the blocks written so far, which costs
+ * time in proportion to those rather than to the image.  Children share
+ * the base, so never commit.
+ */
+bool
+pism_overlay_fork(struct pism_overlay *po)
+{
+	char path[MAXPATHLEN];
+	uint64_t block;
+	char *dup;
+	int fd;
+
+	if (!pism_fork_path(po->po_path, path, sizeof(path)))
+		return (false);
+	fd = pism_overlay_create(po, path);
+	if (fd < 0)
+		return (false);
+	dup = strdup(path);
+	if (dup == NULL) {
+		warn("%s: strdup", __func__);
+		goto fail;
+	}
+	for (block = 0; block < po->po_nblocks; block++) {
+		if (pism_overlay_dirty(po, block) &&
+		    !pism_overlay_copy(po, po->po_delta, fd, block)) {
+			warn("%s: copy to %s failed", __func__, path);
+			free(dup);
+			goto fail;
+		}
+	}
+	close(po->po_delta);
+	po->po_delta = fd;
+	free(po->po_path);
+	po->po_path = dup;
+	if (po->po_commit) {
+		warnx("%s: %s will not be committed", __func__, path);
+		po->po_commit = false;
+	}
+	return (true);
+
+fail:
+	close(fd);
+	unlink(path);
+	return (false);
+}
+
+/*
+ * Called from a writable disk's pm_dev_fork with its overlay, if it has one,
+ * or else its image's configured path and descriptor.  Overlays move to a
+ * per-child delta.  Otherwise the disk switches to a per-child image if one
+ * has been prepared next to the configured one; failing that, children
+ * share, and race on, the image.
+ */
+bool
+pism_overlay_fork_image(pism_device_t *dev, struct pism_overlay *po,
+    const char *image, int *fdp)
+{
+	char path[MAXPATHLEN];
+	int fd;
+
+	if (po != NULL)
+		return (pism_overlay_fork(po));
+	if (!pism_fork_path(image, path, sizeof(path)))
+		return (false);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		warn("%s: open of %s failed on device %s; sharing %s",
+		    __func__, path, dev->pd_name, image);
+		return (true);
+	}
+	close(*fdp);
+	*fdp = fd;
+	return (true);
+}
+
+#define	PISM_OVERLAY_CHECKPOINT_END	UINT64_MAX
+
+/*
+ * Called from a disk's pm_dev_checkpoint once its I/O has stopped, with its
+ * overlay if it has one: save the blocks in the delta, each as its number
+ * then its data, so that restoring doesn't depend on the delta, which is
+ * deleted at exit.  The base image is not saved and must be unchanged when
+ * restoring.
+ */
+bool
+pism_overlay_checkpoint(struct pism_overlay *po, FILE *fp)
+{
+	uint8_t buf[PISM_OVERLAY_BLOCK];
+	uint64_t block, end;
+	ssize_t len;
+	bool present;
+
+	present = (po != NULL);
+	if (!pism_checkpoint_write(fp, &present, sizeof(present)))
+		return (false);
+	if (!present)
+		return (true);
+	if (!pism_checkpoint_write(fp, &po->po_length, sizeof(po->po_length)))
+		return (false);
+	for (block = 0; block < po->po_nblocks; block++) {
+		if (!pism_overlay_dirty(po, block))
+			continue;
+		len = pread(po->po_delta, buf, sizeof(buf),
+		    block * PISM_OVERLAY_BLOCK);
+		if (len < 0) {
+			warn("%s: read of %s failed", __func__, po->po_path);
+			return (false);
+		}
+		memset(buf + len, 0, sizeof(buf) - len);
+		if (!pism_checkpoint_write(fp, &block, sizeof(block)) ||
+		    !pism_checkpoint_write(fp, buf, sizeof(buf)))
+			return (false);
+	}
+	end = PISM_OVERLAY_CHECKPOINT_END;
+	return (pism_checkpoint_write(fp, &end, sizeof(end)));
+}
+
+/*
+ * Replace the delta's contents with those saved by pism_overlay_checkpoint().
+ */
+bool
+pism_overlay_restore(struct pism_overlay *po, FILE *fp)
+{
+	uint8_t buf[PISM_OVERLAY_BLOCK];
+	uint64_t block, length, next;
+	ssize_t len;
+	bool ok, present;
+
+	if (!pism_checkpoint_read(fp, &present, sizeof(present)))
+		return (false);
+	if (present != (po != NULL)) {
+		warnx("%s: checkpoint %s an overlay", __func__,
+		    present ? "has" : "lacks");
+		return (false);
+	}
+	if (!present)
+		return (true);
+	if (!pism_checkpoint_read(fp, &length, sizeof(length)))
+		return (false);
+	if (length != po->po_length) {
+		warnx("%s: checkpoint of a %ju-byte image, not %ju", __func__,
+		    (uintmax_t)length, (uintmax_t)po->po_length);
+		return (false);
+	}
+	ok = false;
+	pthread_mutex_lock(&po->po_lock);
+	memset(po->po_bitmap, 0, howmany(po->po_nblocks, NBBY));
+	(void)pism_punch_hole(po->po_delta, 0, po->po_length);
+	for (next = 0;; next = block + 1) {
+		if (!pism_checkpoint_read(fp, &block, sizeof(block)))
+			goto out;
+		if (block == PISM_OVERLAY_CHECKPOINT_END)
+			break;
+		if (block < next || block >= po->po_nblocks) {
+			warnx("%s: bad block %ju", __func__, (uintmax_t)block);
+			goto out;
+		}
+		if (!pism_checkpoint_read(fp, buf, sizeof(buf)))
+			goto out;
+		len = MIN(sizeof(buf), po->po_length -
+		    block * PISM_OVERLAY_BLOCK);
+		if (pwrite(po->po_delta, buf, len, block * PISM_OVERLAY_BLOCK) !=
+		    len) {
+			warn("%s: write of %s failed", __func__, po->po_path);
+			goto out;
+		}
+		pism_overlay_mark(po, block);
+	}
+	ok = true;
+out:
+	pthread_mutex_unlock(&po->po_lock);
+	return (ok);
+}
+
+/*
+ * Commit the delta if asked to, then delete it, unless the commit failed.
+ */
+static void
+pism_overlay_finish(struct pism_overlay *po)
+{
+	uint64_t block;
+
+	if (po->po_commit) {
+		for (block = 0; block < po->po_nblocks; block++) {
+			if (po->po_bitmap[block / NBBY] == 0) {
+				block |= NBBY - 1;
+				continue;
+			}
+			if (pism_overlay_dirty(po, block) &&
+			    !pism_overlay_copy(po, po->po_delta, po->po_base,
+			    block)) {
+				warn("%s: commit of %s failed; keeping it",
+				    __func__, po->po_path);
+				return;
+			}
+		}
+		if (fsync(po->po_base) < 0)
+			warn("%s: fsync", __func__);
+	}
+	close(po->po_delta);
+	if (unlink(po->po_path) < 0)
+		warn("%s: unlink of %s failed", __func__, po->po_path);
+}
+
+static void
+pism_overlay_exit(void)
+{
+	struct pism_overlay *po;
+
+	SLIST_FOREACH(po, &pism_overlays, po_next)
+		pism_overlay_finish(po);
+}
+
+/*
+ * Finish an overlay early, as at exit, and free it.  For devices that fail
+ * to initialise after opening one.
+ */
+void
+pism_overlay_close(struct pism_overlay *po)
+{
+
+	SLIST_REMOVE(&pism_overlays, po, pism_overlay, po_next);
+	pism_overlay_finish(po);
+	close(po->po_base);
+	pthread_mutex_destroy(&po->po_lock);
+	free(po->po_bitmap);
+	free(po->po_path);
+	free(po);
+}
@@ -0,0 +1,187 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * This file contains routines to report host time spent in each PISM module
+ * method.  Timestamps are taken by the wrappers in pism.c; here we calibrate
+ * them against the system clock and print a ranked table at exit.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pismdev/pism.h"
+
+bool			 g_pism_prof;
+
+static const char	*pism_prof_path;
+static uint64_t		 pism_prof_start_ticks;
+static uint64_t		 pism_prof_start_ns;
+
+static const char *pism_prof_method_names[PISM_PROF_NMETHODS] = {
+	[PISM_PROF_DEV_INIT] = "dev_init",
+	[PISM_PROF_INTERRUPT_GET] = "interrupt_get",
+	[PISM_PROF_REQUEST_READY] = "request_ready",
+	[PISM_PROF_REQUEST_PUT] = "request_put",
+	[PISM_PROF_REQUEST_PUT_BURST] = "request_put_burst",
+	[PISM_PROF_RESPONSE_READY] = "response_ready",
+	[PISM_PROF_RESPONSE_GET] = "response_get",
+	[PISM_PROF_ADDR_VALID] = "addr_valid",
+	[PISM_PROF_CYCLE_TICK] = "cycle_tick",
+	[PISM_PROF_TIMER] = "timer",
+};
+
+struct pism_prof_entry {
+	struct pism_module	*ppe_mod;
+	enum pism_prof_method	 ppe_method;
+	uint64_t		 ppe_ticks;
+};
+
+static uint64_t
+pism_prof_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static int
+pism_prof_entry_cmp(const void *a, const void *b)
+{
+	const struct pism_prof_entry *ea = a, *eb = b;
+
+	if (ea->ppe_ticks > eb->ppe_ticks)
+		return (-1);
+	if (ea->ppe_ticks < eb->ppe_ticks)
+		return (1);
+	return (0);
+}
+
+static void
+pism_prof_dump(FILE *fp)
+{
+	struct pism_prof_entry *entries;
+	struct pism_module *pm;
+	uint64_t elapsed_ticks, elapsed_ns, calls;
+	double ns_per_tick, secs, total;
+	u_int count, i, method;
+
+	elapsed_ticks = pism_prof_ticks() - pism_prof_start_ticks;
+	elapsed_ns = pism_prof_ns() - pism_prof_start_ns;
+	if (elapsed_ticks == 0 || elapsed_ns == 0)
+		return;
+	ns_per_tick = (double)elapsed_ns / elapsed_ticks;
+	total = elapsed_ns / 1e9;
+
+	count = 0;
+	SLIST_FOREACH(pm, g_pism_modules, pm_next)
+		count += PISM_PROF_NMETHODS;
+	if (count == 0)
+		return;
+	entries = calloc(count, sizeof(*entries));
+	if (entries == NULL) {
+		warn("%s: calloc", __func__);
+		return;
+	}
+	count = 0;
+	SLIST_FOREACH(pm, g_pism_modules, pm_next) {
+		for (method = 0; method < PISM_PROF_NMETHODS; method++) {
+			if (pm->pm_prof.pmp_calls[method] == 0)
+				continue;
+			entries[count].ppe_mod = pm;
+			entries[count].ppe_method = method;
+			entries[count].ppe_ticks =
+			    pm->pm_prof.pmp_ticks[method];
+			count++;
+		}
+	}
+	qsort(entries, count, sizeof(*entries), pism_prof_entry_cmp);
+
+	fprintf(fp, "PISM host profile (%.3f s elapsed)\n", total);
+	fprintf(fp, "%-16s %-18s %14s %12s %7s %10s\n", "module", "method",
+	    "calls", "seconds", "%time", "ns/call");
+	for (i = 0; i < count; i++) {
+		pm = entries[i].ppe_mod;
+		method = entries[i].ppe_method;
+		calls = pm->pm_prof.pmp_calls[method];
+		secs = entries[i].ppe_ticks * ns_per_tick / 1e9;
+		fprintf(fp, "%-16s %-18s %14ju %12.6f %6.2f%% %10.1f\n",
+		    pm->pm_name, pism_prof_method_names[method],
+		    (uintmax_t)calls, secs, 100.0 * secs / total,
+		    secs * 1e9 / calls);
+	}
+	free(entries);
+	fflush(fp);
+}
+
+static void
+pism_prof_write(void)
+{
+	char path[MAXPATHLEN];
+	FILE *fp;
+
+	if (strcmp(pism_prof_path, "-") == 0) {
+		pism_prof_dump(stderr);
+		return;
+	}
+	if (!pism_fork_path(pism_prof_path, path, sizeof(path)))
+		return;
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		warn("%s: %s", __func__, path);
+		return;
+	}
+	pism_prof_dump(fp);
+	fclose(fp);
+}
+
+void
+pism_prof_init(void)
+{
+
+	pism_prof_path = getenv("CHERI_PISM_PROFILE");
+	if (pism_prof_path == NULL)
+		return;
+	pism_prof_start_ticks = pism_prof_ticks();
+	pism_prof_start_ns = pism_prof_ns();
+	if (atexit(pism_prof_write) != 0) {
+		warnx("%s: atexit failed", __func__);
+		return;
+	}
+	g_pism_prof = true;
+}
@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * This file contains routines to report the per-device statistics that PISM
+ * maintains in struct pism_device.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pismdev/pism.h"
+
+static const char		*pism_stats_path;
+static bool			 pism_stats_json;
+static volatile sig_atomic_t	 pism_stats_requested;
+
+static void
+pism_stats_dump_csv(FILE *fp)
+{
+	struct pism_device_stats *pds;
+	pism_device_t *dev;
+	uint8_t busno;
+	int i;
+
+	fprintf(fp, "bus,device,cycles,fetches,fetch_bytes,stores,"
+	    "store_bytes,refusals,stall_cycles");
+	for (i = 0; i < PISM_STATS_LATENCY_BUCKETS; i++)
+		fprintf(fp, ",latency_%d", i);
+	fprintf(fp, "\n");
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			pds = &dev->pd_stats;
+			fprintf(fp, "%u,%s,%ju,%ju,%ju,%ju,%ju,%ju,%ju", busno,
+			    dev->pd_name,
+			    (uintmax_t)pism_cycle_count_get(busno),
+			    (uintmax_t)pds->pds_fetches,
+			    (uintmax_t)pds->pds_fetch_bytes,
+			    (uintmax_t)pds->pds_stores,
+			    (uintmax_t)pds->pds_store_bytes,
+			    (uintmax_t)pds->pds_refusals,
+			    (uintmax_t)pds->pds_stall_cycles);
+			for (i = 0; i < PISM_STATS_LATENCY_BUCKETS; i++)
+				fprintf(fp, ",%ju",
+				    (uintmax_t)pds->pds_latency[i]);
+			fprintf(fp, "\n");
+		}
+	}
+}
+
+static void
+pism_stats_dump_json(FILE *fp)
+{
+	struct pism_device_stats *pds;
+	pism_device_t *dev;
+	uint8_t busno;
+	const char *sep;
+	int i;
+
+	sep = "";
+	fprintf(fp, "[\n");
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			pds = &dev->pd_stats;
+			fprintf(fp, "%s  {\"bus\": %u, \"device\": \"%s\", "
+			    "\"cycles\": %ju, \"fetches\": %ju, "
+			    "\"fetch_bytes\": %ju, \"stores\": %ju, "
+			    "\"store_bytes\": %ju, \"refusals\": %ju, "
+			    "\"stall_cycles\": %ju, \"latency\": [", sep,
+			    busno, dev->pd_name,
+			    (uintmax_t)pism_cycle_count_get(busno),
+			    (uintmax_t)pds->pds_fetches,
+			    (uintmax_t)pds->pds_fetch_bytes,
+			    (uintmax_t)pds->pds_stores,
+			    (uintmax_t)pds->pds_store_bytes,
+			    (uintmax_t)pds->pds_refusals,
+			    (uintmax_t)pds->pds_stall_cycles);
+			for (i = 0; i < PISM_STATS_LATENCY_BUCKETS; i++)
+				fprintf(fp, "%s%ju", i == 0 ? "" : ", ",
+				    (uintmax_t)pds->pds_latency[i]);
+			fprintf(fp, "]}");
+			sep = ",\n";
+		}
+	}
+	fprintf(fp, "\n]\n");
+}
+
+void
+pism_stats_dump(FILE *fp, bool json)
+{
+
+	if (json)
+		pism_stats_dump_json(fp);
+	else
+		pism_stats_dump_csv(fp);
+	fflush(fp);
+}
+
+/*
+ * Write statistics to the configured file, replacing any earlier snapshot.
+ */
+static void
+pism_stats_write(void)
+{
+	char path[MAXPATHLEN];
+	FILE *fp;
+
+	if (strcmp(pism_stats_path, "-") == 0) {
+		pism_stats_dump(stderr, pism_stats_json);
+		return;
+	}
+	if (!pism_fork_path(pism_stats_path, path, sizeof(path)))
+		return;
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		warn("%s: %s", __func__, path);
+		return;
+	}
+	pism_stats_dump(fp, pism_stats_json);
+	fclose(fp);
+}
+
+static void
+pism_stats_sigusr1(int sig)
+{
+
+	pism_stats_requested = 1;
+}
+
+void
+pism_stats_init(void)
+{
+	size_t len;
+
+	pism_stats_path = getenv("CHERI_PISM_STATS");
+	if (pism_stats_path == NULL)
+		return;
+	len = strlen(pism_stats_path);
+	pism_stats_json = (len >= 5 &&
+	    strcmp(pism_stats_path + len - 5, ".json") == 0);
+	if (atexit(pism_stats_write) != 0)
+		warnx("%s: atexit failed", __func__);
+	if (signal(SIGUSR1, pism_stats_sigusr1) == SIG_ERR)
+		warn("%s: signal", __func__);
+}
+
+/*
+ * The SIGUSR1 handler just sets a flag; the dump is done from the simulation
+ * loop, where it is safe to use stdio.
+ */
+void
+pism_stats_poll(void)
+{
+
+	if (!pism_stats_requested)
+		return;
+	pism_stats_requested = 0;
+	pism_stats_write();
+}
@@ -0,0 +1,136 @@
+/*-
+ * Copyright (c) 2012 Robert N. M. Watson
+ * All rights reserved.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-10-C-0237
+ * ("CTSRD"), as part of the DARPA CRASH research programme.
+ *
+ * This software was developed by SRI International and the University of
+ * Cambridge Computer Laboratory under DARPA/AFRL contract FA8750-11-C-0249
+ * ("MRC2"), as part of the DARPA MRC research programme.
+ *
+ * @BERI_LICENSE_HEADER_START@
+ *
+ * Licensed to BERI Open Systems C.I.C. (BERI) under one or more contributor
+ * license agreements.  See the NOTICE file distributed with this work for
+ * additional information regarding copyright ownership.  BERI licenses this
+ * file to you under the BERI Hardware-Software License, Version 1.0 (the
+ * "License"); you may not use this file except in compliance with the
+ * License.  You may obtain a copy of the License at:
+ *
+ *   http://www.beri-open-systems.org/legal/license-1-0.txt
+ *
+ * Unless required by applicable law or agreed to in writing, Work distributed
+ * under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+ * CONDITIONS OF ANY KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations under the License.
+ *
+ * @BERI_LICENSE_HEADER_END@
+ */
+
+/*
+ * pismlog: render a binary PISM event log, written if CHERI_PISM_LOG was set
+ * in a simulator built with "make PISM_LOG=1", as text.
+ */
+
+#include <sys/queue.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pismdev/pism.h"
+
+#define	PISMLOG_MAXDEVICES	256
+
+static const char *pismlog_event_names[PISM_LOG_EV_COUNT] = {
+	[PISM_LOG_EV_DEVICE] = "device",
+	[PISM_LOG_EV_INIT] = "init",
+	[PISM_LOG_EV_CONFIG] = "config",
+	[PISM_LOG_EV_ERROR] = "error",
+	[PISM_LOG_EV_REQUEST_READY] = "request_ready",
+	[PISM_LOG_EV_REQUEST_PUT] = "request_put",
+	[PISM_LOG_EV_RESPONSE_READY] = "response_ready",
+	[PISM_LOG_EV_RESPONSE_GET] = "response_get",
+	[PISM_LOG_EV_ADDR_VALID] = "addr_valid",
+	[PISM_LOG_EV_INTERRUPT] = "interrupt",
+	[PISM_LOG_EV_BURST_READY] = "burst_ready",
+	[PISM_LOG_EV_BURST_PUT] = "burst_put",
+	[PISM_LOG_EV_BURST_GET] = "burst_get",
+	[PISM_LOG_EV_REG_READ] = "reg_read",
+	[PISM_LOG_EV_REG_WRITE] = "reg_write",
+	[PISM_LOG_EV_IO_READ] = "io_read",
+	[PISM_LOG_EV_IO_WRITE] = "io_write",
+};
+
+static char	pismlog_devices[PISMLOG_MAXDEVICES][PISM_LOG_NAME_LEN + 1];
+
+static const char *
+pismlog_device_name(uint16_t device)
+{
+
+	if (device == PISM_LOG_DEVICE_NONE)
+		return ("-");
+	if (device >= PISMLOG_MAXDEVICES || pismlog_devices[device][0] == '\0')
+		return ("?");
+	return (pismlog_devices[device]);
+}
+
+static void
+pismlog_print(struct pism_log_record *rec)
+{
+	const char *event;
+
+	if (rec->plr_event == PISM_LOG_EV_DEVICE) {
+		if (rec->plr_device < PISMLOG_MAXDEVICES)
+			memcpy(pismlog_devices[rec->plr_device],
+			    &rec->plr_cycle, PISM_LOG_NAME_LEN);
+		printf("%20s %3u %-12s %-14s %s\n", "-", rec->plr_bus,
+		    pismlog_device_name(rec->plr_device), "device",
+		    pismlog_device_name(rec->plr_device));
+		return;
+	}
+	if (rec->plr_event < PISM_LOG_EV_COUNT)
+		event = pismlog_event_names[rec->plr_event];
+	else
+		event = "?";
+	if (rec->plr_bus == PISM_LOG_BUS_NONE)
+		printf("%20s %3s", "-", "-");
+	else
+		printf("%20ju %3u", (uintmax_t)rec->plr_cycle, rec->plr_bus);
+	printf(" %-12s %-14s %016jx %jx\n",
+	    pismlog_device_name(rec->plr_device), event,
+	    (uintmax_t)rec->plr_addr, (uintmax_t)rec->plr_arg);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct pism_log_header plh;
+	struct pism_log_record rec;
+	FILE *fp;
+
+	if (argc != 2)
+		errx(1, "Usage: pismlog filename");
+	if ((fp = fopen(argv[1], "r")) == NULL)
+		err(2, "%s", argv[1]);
+	if (fread(&plh, sizeof(plh), 1, fp) != 1)
+		errx(3, "%s: short header", argv[1]);
+	if (strncmp(plh.plh_magic, PISM_LOG_MAGIC, sizeof(plh.plh_magic)) != 0)
+		errx(3, "%s: not a PISM log", argv[1]);
+	if (plh.plh_version != PISM_LOG_VERSION ||
+	    plh.plh_recsize != sizeof(rec))
+		errx(3, "%s: unsupported version %u, record size %u", argv[1],
+		    plh.plh_version, plh.plh_recsize);
+
+	printf("%20s %3s %-12s %-14s %16s %s\n", "cycle", "bus", "device",
+	    "event", "addr", "arg");
+	while (fread(&rec, sizeof(rec), 1, fp) == 1)
+		pismlog_print(&rec);
+	if (ferror(fp))
+		err(4, "%s", argv[1]);
+	fclose(fp);
+	return (0);
+}
@@ -46,17 +46,35 @@
  *   so that we could test for the desired characters in both directions.
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include <assert.h>
 #if defined(__linux__)
 #include <endian.h>
 #elif (__FreeBSD__)
 #include <sys/endian.h>
 #endif
+#include <elf.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pismdev/pism.h"
+#include "pismdev/dram/dram.h"
+#include "pismdev/virtio/virtio_blk.h"
+#include "pismdev/virtio/virtio_config.h"
+#include "pismdev/virtio/virtio_mmio.h"
+#include "pismdev/virtio/virtio_ring.h"
 
 /*
  * Errors for PISM memory access.
@@ -157,34 +175,2360 @@ pismtest_mem_store8(uint8_t busno, uint64_t addr, uint8_t v)
 	return (pismtest_request(busno, &pd));
 }
 
-#include <stdio.h>
+/*
+ * Store a whole line, setting or clearing its CHERI tag, and fetch a line's
+ * tag.
+ */
+static int
+pismtest_mem_store_line(uint8_t busno, uint64_t addr, uint8_t captag)
+{
+	pism_data_t pd;
 
-int
-main(int argc, char *argv[])
+	memset(&pd, 0x00, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_STORE;
+	pd.pd_int.pdi_addr = addr;
+	pd.pd_int.pdi_byteenable = 0xffffffff;
+	pd.pd_int.pdi_captag = captag;
+	if (!pism_addr_valid(busno, &pd))
+		return (PISMTEST_ERROR_INVALID_ADDR);
+	return (pismtest_request(busno, &pd));
+}
+
+static int
+pismtest_mem_fetch_captag(uint8_t busno, uint64_t addr, uint8_t *captagp)
+{
+	pism_data_t pd;
+	int ret;
+
+	memset(&pd, 0x00, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_FETCH;
+	pd.pd_int.pdi_addr = addr;
+	pd.pd_int.pdi_byteenable = 0xffffffff;
+	if (!pism_addr_valid(busno, &pd))
+		return (PISMTEST_ERROR_INVALID_ADDR);
+	ret = pismtest_request(busno, &pd);
+	if (ret != PISMTEST_SUCCESS)
+		return (ret);
+	ret = pismtest_response(busno, &pd);
+	if (ret != PISMTEST_SUCCESS)
+		return (ret);
+	*captagp = pd.pd_int.pdi_captag;
+	return (PISMTEST_SUCCESS);
+}
+
+/*
+ * Attach a bus using a configuration generated from fmt.  Each bus may be
+ * attached only once per process, so tests needing devices of their own run
+ * in a child with pismtest_run().
+ */
+static bool
+pismtest_attach(uint8_t busno, const char *fmt, ...)
+{
+	static const char *envs[PISM_BUS_COUNT] = {
+		[PISM_BUSNO_MEMORY] = "CHERI_MEMORY_CONFIG",
+		[PISM_BUSNO_PERIPHERAL] = "CHERI_PERIPHERAL_CONFIG",
+		[PISM_BUSNO_TRACE] = "CHERI_TRACE_CONFIG",
+	};
+	char path[] = "/tmp/pismtest.XXXXXX";
+	va_list ap;
+	FILE *fp;
+	bool ret;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		err(1, "mkstemp");
+	fp = fdopen(fd, "w");
+	if (fp == NULL)
+		err(1, "fdopen");
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	fclose(fp);
+	setenv(envs[busno], path, 1);
+	ret = pism_init(busno);
+	unlink(path);
+	return (ret);
+}
+
+static void
+pismtest_run(const char *name, void (*fn)(void))
+{
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0) {
+		fn();
+		exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "%s failed", name);
+}
+
+/*
+ * Generate a big-endian MIPS image with one PT_LOAD segment at the kseg0
+ * address of paddr, its file data at a page-aligned offset, and load it
+ * with DRAM of type "elf".
+ */
+#define	PISMTEST_ELF_PADDR	0x100000
+#define	PISMTEST_ELF_OFFSET	0x1000
+#define	PISMTEST_ELF_FILESZ	0x1100
+#define	PISMTEST_ELF_MEMSZ	0x3000
+
+static const char pismtest_elf_config[] =
+    "module dram.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x200000;\n"
+    "	option type \"elf\";\n"
+    "	option path \"%s\";\n"
+    "};\n";
+
+static void
+pismtest_elf_write(char *path, uint64_t filesz)
+{
+	uint8_t buf[PISMTEST_ELF_FILESZ];
+	Elf64_Ehdr eh;
+	Elf64_Phdr ph;
+	int fd, i;
+
+	memset(&eh, 0, sizeof(eh));
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELFCLASS64;
+	eh.e_ident[EI_DATA] = ELFDATA2MSB;
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+	eh.e_type = htobe16(ET_EXEC);
+	eh.e_machine = htobe16(EM_MIPS);
+	eh.e_version = htobe32(EV_CURRENT);
+	eh.e_phoff = htobe64(sizeof(eh));
+	eh.e_ehsize = htobe16(sizeof(eh));
+	eh.e_phentsize = htobe16(sizeof(ph));
+	eh.e_phnum = htobe16(1);
+	memset(&ph, 0, sizeof(ph));
+	ph.p_type = htobe32(PT_LOAD);
+	ph.p_offset = htobe64(PISMTEST_ELF_OFFSET);
+	ph.p_vaddr = ph.p_paddr = htobe64(0xffffffff80000000ULL |
+	    PISMTEST_ELF_PADDR);
+	ph.p_filesz = htobe64(filesz);
+	ph.p_memsz = htobe64(PISMTEST_ELF_MEMSZ);
+	for (i = 0; i < PISMTEST_ELF_FILESZ; i++)
+		buf[i] = i * 7 + 1;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(pwrite(fd, &eh, sizeof(eh), 0) == sizeof(eh));
+	assert(pwrite(fd, &ph, sizeof(ph), sizeof(eh)) == sizeof(ph));
+	assert(pwrite(fd, buf, sizeof(buf), PISMTEST_ELF_OFFSET) ==
+	    sizeof(buf));
+	close(fd);
+}
+
+static void
+pismtest_elf(void)
 {
+	char path[] = "/tmp/pismtest.XXXXXX";
+	uint64_t addr;
+	uint8_t b;
 	int ret;
+
+	pismtest_elf_write(path, PISMTEST_ELF_FILESZ);
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, pismtest_elf_config, path));
+	unlink(path);
+	assert(pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0") != NULL);
+	for (addr = 0; addr < PISMTEST_ELF_MEMSZ; addr += 0x7f) {
+		ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY,
+		    PISMTEST_ELF_PADDR + addr, &b);
+		assert(ret == PISMTEST_SUCCESS);
+		assert(b == (addr < PISMTEST_ELF_FILESZ ?
+		    (uint8_t)(addr * 7 + 1) : 0));
+	}
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, PISMTEST_ELF_PADDR - 1,
+	    &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0);
+}
+
+/*
+ * A segment running whole pages past the end of the image is refused rather
+ * than mapped, which would fault when the pages were touched.
+ */
+static void
+pismtest_elf_truncated(void)
+{
+	char path[] = "/tmp/pismtest.XXXXXX";
+
+	pismtest_elf_write(path, PISMTEST_ELF_MEMSZ);
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, pismtest_elf_config, path));
+	unlink(path);
+	assert(pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0") == NULL);
+}
+
+/*
+ * Fork two children at a cycle with writable file-backed DRAM, and check
+ * that both see the parent's writes to the file but that their own writes
+ * reach neither it nor each other.  The parent waits for the children in
+ * pism_fork() and exits with their status, and removes the file at exit.
+ */
+#define	PISMTEST_FORK_CYCLE	5
+#define	PISMTEST_FORK_LENGTH	0x10000
+
+static const char pismtest_fork_config[] =
+    "module dram.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x10000;\n"
+    "	option type \"mmap\";\n"
+    "	option path \"%s\";\n"
+    "};\n";
+
+static char pismtest_fork_image[] = "/tmp/pismtest.XXXXXX";
+
+static void
+pismtest_fork_exit(void)
+{
+
+	if (g_pism_fork_child < 0)
+		unlink(pismtest_fork_image);
+}
+
+static void
+pismtest_fork(void)
+{
+	uint8_t buf[PISMTEST_FORK_LENGTH];
+	char cycle[16];
+	int fd, i, ret;
 	uint8_t b;
 
-	assert(pism_init(0));
+	fd = mkstemp(pismtest_fork_image);
+	assert(fd >= 0);
+	memset(buf, 0x11, sizeof(buf));
+	assert(write(fd, buf, sizeof(buf)) == sizeof(buf));
+	assert(atexit(pismtest_fork_exit) == 0);
+	setenv("CHERI_PISM_FORK", "2", 1);
+	snprintf(cycle, sizeof(cycle), "%d", PISMTEST_FORK_CYCLE);
+	setenv("CHERI_PISM_FORK_CYCLE", cycle, 1);
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, pismtest_fork_config,
+	    pismtest_fork_image));
+
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x100, 0x22);
+	assert(ret == PISMTEST_SUCCESS);
+	for (i = 0; i <= PISMTEST_FORK_CYCLE; i++)
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+	assert(g_pism_fork_child == 0 || g_pism_fork_child == 1);
+
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x100, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0x22);
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x200,
+	    0x30 + g_pism_fork_child);
+	assert(ret == PISMTEST_SUCCESS);
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x200, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0x30 + g_pism_fork_child);
+	assert(pread(fd, buf, sizeof(buf), 0) == sizeof(buf));
+	assert(buf[0x100] == 0x22);
+	assert(buf[0x200] == 0x11);
+	close(fd);
+}
+
+/*
+ * Slot ring tests.  A synthetic device on the trace bus, attached with an
+ * empty configuration, holds the fetches put to it until the test completes
+ * them, in whatever order it chooses; its module is unordered, so responses
+ * are matched to requests by tag.
+ */
+#define	PISMTEST_SLOT_BUSNO	PISM_BUSNO_TRACE
+#define	PISMTEST_SLOT_DEPTH	4
+
+struct pismtest_slot_state {
+	pism_data_t	pss_reqs[PISMTEST_SLOT_DEPTH];
+	bool		pss_put[PISMTEST_SLOT_DEPTH];
+	bool		pss_done[PISMTEST_SLOT_DEPTH];
+};
+
+static struct pismtest_slot_state	pismtest_slot_state;
+static pism_device_t			pismtest_slot_dev;
+
+static bool
+pismtest_slot_request_ready(pism_device_t *dev, pism_data_t *req)
+{
+
+	return (true);
+}
+
+static void
+pismtest_slot_request_put(pism_device_t *dev, pism_data_t *req)
+{
+	struct pismtest_slot_state *pss;
+	u_int i;
+
+	if (PISM_REQ_ACCTYPE(req) != PISM_ACC_FETCH)
+		return;
+	pss = &pismtest_slot_state;
+	for (i = 0; i < PISMTEST_SLOT_DEPTH && pss->pss_put[i]; i++)
+		continue;
+	assert(i < PISMTEST_SLOT_DEPTH);
+	pss->pss_reqs[i] = *req;
+	pss->pss_put[i] = true;
+	pss->pss_done[i] = false;
+}
+
+static bool
+pismtest_slot_response_ready(pism_device_t *dev)
+{
+	struct pismtest_slot_state *pss;
+	u_int i;
+
+	pss = &pismtest_slot_state;
+	for (i = 0; i < PISMTEST_SLOT_DEPTH; i++) {
+		if (pss->pss_put[i] && pss->pss_done[i])
+			return (true);
+	}
+	return (false);
+}
+
+static pism_data_t
+pismtest_slot_response_get(pism_device_t *dev)
+{
+	struct pismtest_slot_state *pss;
+	u_int i;
+
+	pss = &pismtest_slot_state;
+	for (i = 0; i < PISMTEST_SLOT_DEPTH; i++) {
+		if (pss->pss_put[i] && pss->pss_done[i])
+			break;
+	}
+	assert(i < PISMTEST_SLOT_DEPTH);
+	pss->pss_put[i] = false;
+	return (pss->pss_reqs[i]);
+}
+
+static bool
+pismtest_slot_addr_valid(pism_device_t *dev, pism_data_t *req)
+{
+
+	return (true);
+}
+
+static struct pism_module pismtest_slot_module = {
+	.pm_name = "pismtest_slot",
+	.pm_flags = PISM_MODULE_FLAG_UNORDERED,
+	.pm_dev_request_ready = pismtest_slot_request_ready,
+	.pm_dev_request_put = pismtest_slot_request_put,
+	.pm_dev_response_ready = pismtest_slot_response_ready,
+	.pm_dev_response_get = pismtest_slot_response_get,
+	.pm_dev_addr_valid = pismtest_slot_addr_valid,
+};
+
+static void
+pismtest_slot_attach(void)
+{
+	pism_device_t *dev;
+
+	assert(pismtest_attach(PISMTEST_SLOT_BUSNO, ""));
+	dev = &pismtest_slot_dev;
+	dev->pd_mod = &pismtest_slot_module;
+	dev->pd_name = "slot";
+	dev->pd_busno = PISMTEST_SLOT_BUSNO;
+	dev->pd_base = 0;
+	dev->pd_length = 0x1000;
+	dev->pd_perms = PISM_PERM_ALLOW_FETCH | PISM_PERM_ALLOW_STORE;
+	dev->pd_irq = PISM_IRQ_NONE;
+	dev->pd_depth = PISMTEST_SLOT_DEPTH;
+	TAILQ_INIT(&dev->pd_options);
+	SLIST_INSERT_HEAD(g_pism_devices[PISMTEST_SLOT_BUSNO], dev, pd_next);
+	pism_bus_decoder_build(PISMTEST_SLOT_BUSNO);
+}
+
+/*
+ * Offer a fetch of line n with the CPU's tag, putting it if accepted.
+ */
+static bool
+pismtest_slot_fetch(u_int n, uint16_t tag)
+{
+	pism_data_t pd;
+
+	memset(&pd, 0, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_FETCH;
+	pd.pd_int.pdi_addr = n * PISM_DATA_BYTES;
+	pd.pd_int.pdi_byteenable = 0xffffffff;
+	pd.pd_int.pdi_tag = tag;
+	if (!pism_request_ready(PISMTEST_SLOT_BUSNO, &pd))
+		return (false);
+	pism_request_put(PISMTEST_SLOT_BUSNO, &pd);
+	return (true);
+}
+
+/*
+ * Complete the device's fetch of line n.
+ */
+static void
+pismtest_slot_complete(u_int n)
+{
+	struct pismtest_slot_state *pss;
+	u_int i;
+
+	pss = &pismtest_slot_state;
+	for (i = 0; i < PISMTEST_SLOT_DEPTH; i++) {
+		if (pss->pss_put[i] &&
+		    pss->pss_reqs[i].pd_int.pdi_addr == n * PISM_DATA_BYTES) {
+			pss->pss_done[i] = true;
+			return;
+		}
+	}
+	assert(0);
+}
+
+/*
+ * Take the next response, checking that it is for line n and carries the
+ * tag the CPU gave it.
+ */
+static void
+pismtest_slot_response(u_int n, uint16_t tag)
+{
+	pism_data_t pd;
+
+	assert(pism_response_ready(PISMTEST_SLOT_BUSNO));
+	pd = pism_response_get(PISMTEST_SLOT_BUSNO);
+	assert(pd.pd_int.pdi_addr == n * PISM_DATA_BYTES);
+	assert(pd.pd_int.pdi_tag == tag);
+}
+
+/*
+ * Once the bus's queue depth is reached, further fetches are refused, but
+ * stores are not; delivering a response frees a slot.
+ */
+static void
+pismtest_slot_depth(void)
+{
+	pism_data_t pd;
+
+	setenv("CHERI_TRACE_QUEUE_DEPTH", "2", 1);
+	pismtest_slot_attach();
+	assert(pismtest_slot_fetch(0, 100));
+	assert(pismtest_slot_fetch(1, 101));
+	assert(!pismtest_slot_fetch(2, 102));
+	memset(&pd, 0, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_STORE;
+	pd.pd_int.pdi_addr = 2 * PISM_DATA_BYTES;
+	pd.pd_int.pdi_byteenable = 0xffffffff;
+	assert(pism_request_ready(PISMTEST_SLOT_BUSNO, &pd));
+	pismtest_slot_complete(0);
+	assert(!pismtest_slot_fetch(2, 102));
+	pismtest_slot_response(0, 100);
+	assert(pismtest_slot_fetch(2, 102));
+}
+
+/*
+ * On an untagged bus, a device completing out of order still has its
+ * responses returned in request order.
+ */
+static void
+pismtest_slot_ordered(void)
+{
+
+	pismtest_slot_attach();
+	assert(pismtest_slot_fetch(0, 100));
+	assert(pismtest_slot_fetch(1, 101));
+	assert(pismtest_slot_fetch(2, 102));
+	pismtest_slot_complete(2);
+	pismtest_slot_complete(1);
+	assert(!pism_response_ready(PISMTEST_SLOT_BUSNO));
+	pismtest_slot_complete(0);
+	pismtest_slot_response(0, 100);
+	pismtest_slot_response(1, 101);
+	pismtest_slot_response(2, 102);
+	assert(!pism_response_ready(PISMTEST_SLOT_BUSNO));
+}
+
+/*
+ * On a tagged bus, responses are returned as they complete.
+ */
+static void
+pismtest_slot_tagged(void)
+{
+
+	setenv("CHERI_TRACE_QUEUE_DEPTH", "3", 1);
+	setenv("CHERI_TRACE_TAGGED", "1", 1);
+	pismtest_slot_attach();
+	assert(pismtest_slot_fetch(0, 100));
+	assert(pismtest_slot_fetch(1, 101));
+	assert(pismtest_slot_fetch(2, 102));
+	pismtest_slot_complete(2);
+	pismtest_slot_response(2, 102);
+	assert(!pism_response_ready(PISMTEST_SLOT_BUSNO));
+	pismtest_slot_complete(0);
+	pismtest_slot_complete(1);
+	pismtest_slot_response(0, 100);
+	pismtest_slot_response(1, 101);
+	assert(!pism_response_ready(PISMTEST_SLOT_BUSNO));
+
+	/* The ring wraps once its oldest slots are delivered. */
+	assert(pismtest_slot_fetch(3, 103));
+	pismtest_slot_complete(3);
+	pismtest_slot_response(3, 103);
+}
+
+/*
+ * Timer tests.  Timers need only a device's bus, so theirs is a synthetic
+ * device that is never put on the otherwise empty trace bus.  Each timer's
+ * argument is its record of when it fired, and of a timer for it to act on.
+ */
+#define	PISMTEST_TIMER_BUSNO	PISM_BUSNO_TRACE
+#define	PISMTEST_TIMER_WHEEL	1024	/* PISM_TIMER_WHEEL_SLOTS in pism.c. */
+
+struct pismtest_timer {
+	struct pism_timer	 ptt_timer;
+	struct pism_timer	*ptt_other;	/* Cancelled on firing. */
+	uint64_t		 ptt_cycle;	/* Last fired. */
+	uint64_t		 ptt_period;	/* If rescheduling itself. */
+	u_int			 ptt_fired;
+};
+
+static pism_device_t	pismtest_timer_dev;
+
+static void
+pismtest_timer_fire(pism_device_t *dev, void *arg)
+{
+	struct pismtest_timer *ptt;
+
+	ptt = arg;
+	ptt->ptt_cycle = pism_cycle_count_get(dev->pd_busno);
+	ptt->ptt_fired++;
+	if (ptt->ptt_other != NULL)
+		pism_timer_cancel(ptt->ptt_other);
+	if (ptt->ptt_period != 0)
+		pism_timer_schedule(&ptt->ptt_timer,
+		    ptt->ptt_cycle + ptt->ptt_period);
+}
+
+static void
+pismtest_timer_init(struct pismtest_timer *ptt)
+{
+
+	memset(ptt, 0, sizeof(*ptt));
+	pism_timer_init(&ptt->ptt_timer, &pismtest_timer_dev,
+	    pismtest_timer_fire, ptt);
+}
+
+static void
+pismtest_timer_ticks(uint64_t n)
+{
+
+	while (n-- > 0)
+		pism_cycle_tick(PISMTEST_TIMER_BUSNO);
+}
+
+static void
+pismtest_timer(void)
+{
+	struct pismtest_timer a, b;
+	uint64_t now;
+
+	assert(pismtest_attach(PISMTEST_TIMER_BUSNO, ""));
+	pismtest_timer_dev.pd_name = "timer";
+	pismtest_timer_dev.pd_busno = PISMTEST_TIMER_BUSNO;
+
+	/* A timer fires on the tick that reaches its cycle, and only then. */
+	pismtest_timer_init(&a);
+	now = pism_cycle_count_get(PISMTEST_TIMER_BUSNO);
+	pism_timer_schedule(&a.ptt_timer, now + 5);
+	assert(pism_timer_pending(&a.ptt_timer));
+	pismtest_timer_ticks(4);
+	assert(a.ptt_fired == 0);
+	pismtest_timer_ticks(1);
+	assert(a.ptt_fired == 1 && a.ptt_cycle == now + 5);
+	assert(!pism_timer_pending(&a.ptt_timer));
+	pismtest_timer_ticks(PISMTEST_TIMER_WHEEL);
+	assert(a.ptt_fired == 1);
+
+	/* A cancelled timer doesn't fire. */
+	now = pism_cycle_count_get(PISMTEST_TIMER_BUSNO);
+	pism_timer_schedule(&a.ptt_timer, now + 3);
+	pism_timer_cancel(&a.ptt_timer);
+	assert(!pism_timer_pending(&a.ptt_timer));
+	pismtest_timer_ticks(PISMTEST_TIMER_WHEEL);
+	assert(a.ptt_fired == 1);
+
+	/* A callback may reschedule its own timer. */
+	pismtest_timer_init(&a);
+	a.ptt_period = 3;
+	now = pism_cycle_count_get(PISMTEST_TIMER_BUSNO);
+	pism_timer_schedule(&a.ptt_timer, now + 3);
+	pismtest_timer_ticks(10);
+	assert(a.ptt_fired == 3 && a.ptt_cycle == now + 9);
+	assert(pism_timer_pending(&a.ptt_timer));
+	pism_timer_cancel(&a.ptt_timer);
 
 	/*
-	 * Write a byte to the UART.
-	 *
-	 * XXXRW: It would be quite nice if we coudl configure the UART to
-	 * output to a pipe so that we could read the pipe and check the byte.
+	 * Of two timers expiring on the same cycle, each cancelling the
+	 * other, only the first to be called fires.
 	 */
-	ret = pismtest_mem_store8(PISM_BUSNO_PERIPHERAL, 0x7f000000, 0x52);
-	assert(ret == PISMTEST_SUCCESS);
- 
+	pismtest_timer_init(&a);
+	pismtest_timer_init(&b);
+	a.ptt_other = &b.ptt_timer;
+	b.ptt_other = &a.ptt_timer;
+	now = pism_cycle_count_get(PISMTEST_TIMER_BUSNO);
+	pism_timer_schedule(&a.ptt_timer, now + 2);
+	pism_timer_schedule(&b.ptt_timer, now + 2);
+	pismtest_timer_ticks(PISMTEST_TIMER_WHEEL);
+	assert(a.ptt_fired + b.ptt_fired == 1);
+	assert(!pism_timer_pending(&a.ptt_timer) &&
+	    !pism_timer_pending(&b.ptt_timer));
+
 	/*
-	 * Attempt to store, and then fetch, a byte from DRAM.
+	 * Deadlines more than a turn of the wheel ahead share a slot with
+	 * nearer ones, but fire only when due.
 	 */
-	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x10000, 0x5e);
-	assert(ret == PISMTEST_SUCCESS);
+	pismtest_timer_init(&a);
+	pismtest_timer_init(&b);
+	now = pism_cycle_count_get(PISMTEST_TIMER_BUSNO);
+	pism_timer_schedule(&a.ptt_timer, now + 2 * PISMTEST_TIMER_WHEEL + 7);
+	pism_timer_schedule(&b.ptt_timer, now + 7);
+	pismtest_timer_ticks(PISMTEST_TIMER_WHEEL + 7);
+	assert(a.ptt_fired == 0 && b.ptt_fired == 1);
+	pismtest_timer_ticks(PISMTEST_TIMER_WHEEL - 1);
+	assert(a.ptt_fired == 0);
+	pismtest_timer_ticks(1);
+	assert(a.ptt_fired == 1);
+	assert(a.ptt_cycle == now + 2 * PISMTEST_TIMER_WHEEL + 7);
+}
 
-	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x10000, &b);
+/*
+ * Cache tests.  Each cache has a single set of two 64-byte ways, so that the
+ * test controls eviction, and is backed by DRAM with the default delay of a
+ * cycle, shorter than the cache's latencies, so that those are measured.
+ */
+#define	PISMTEST_CACHE_HIT	2
+#define	PISMTEST_CACHE_MISS	10
+#define	PISMTEST_CACHE_WRITEBACK	5
+#define	PISMTEST_CACHE_LRU	0x0
+#define	PISMTEST_CACHE_FIFO	0x100000
+#define	PISMTEST_CACHE_LINE	64
+
+static const char pismtest_cache_config[] =
+    "module dram.so\n"
+    "module cache.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x100000;\n"
+    "};\n"
+    "device \"cache0\" {\n"
+    "	class cache;\n"
+    "	addr 0x0;\n"
+    "	length 0x100000;\n"
+    "	option backing \"dram0\";\n"
+    "	option size \"128\";\n"
+    "	option ways \"2\";\n"
+    "	option replacement \"lru\";\n"
+    "	option hitlatency \"%d\";\n"
+    "	option misslatency \"%d\";\n"
+    "	option writebacklatency \"%d\";\n"
+    "};\n"
+    "device \"dram1\" {\n"
+    "	class dram;\n"
+    "	addr 0x100000;\n"
+    "	length 0x100000;\n"
+    "};\n"
+    "device \"cache1\" {\n"
+    "	class cache;\n"
+    "	addr 0x100000;\n"
+    "	length 0x100000;\n"
+    "	option backing \"dram1\";\n"
+    "	option size \"128\";\n"
+    "	option ways \"2\";\n"
+    "	option replacement \"fifo\";\n"
+    "	option hitlatency \"%d\";\n"
+    "	option misslatency \"%d\";\n"
+    "};\n";
+
+/*
+ * Fetch line n of a cache, returning the cycles taken.
+ */
+static u_int
+pismtest_cache_fetch(uint64_t base, u_int n)
+{
+	pism_data_t pd;
+	u_int cycles;
+
+	memset(&pd, 0, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_FETCH;
+	pd.pd_int.pdi_addr = base + n * PISMTEST_CACHE_LINE;
+	pd.pd_int.pdi_byteenable = 0xffffffff;
+	assert(pismtest_request(PISM_BUSNO_MEMORY, &pd) == PISMTEST_SUCCESS);
+	for (cycles = 0; !pism_response_ready(PISM_BUSNO_MEMORY); cycles++) {
+		assert(cycles < 100);
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+	}
+	pd = pism_response_get(PISM_BUSNO_MEMORY);
+	assert(pd.pd_int.pdi_addr == base + n * PISMTEST_CACHE_LINE);
+	return (cycles);
+}
+
+static void
+pismtest_cache(void)
+{
+	struct dram_private *dpp;
+	int ret;
+
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, pismtest_cache_config,
+	    PISMTEST_CACHE_HIT, PISMTEST_CACHE_MISS, PISMTEST_CACHE_WRITEBACK,
+	    PISMTEST_CACHE_HIT, PISMTEST_CACHE_MISS));
+	assert(pism_dev_get_private(PISM_BUSNO_MEMORY, "cache0") != NULL);
+	assert(pism_dev_get_private(PISM_BUSNO_MEMORY, "cache1") != NULL);
+
+	/* LRU: a hit keeps line 0 in, so line 1 is evicted by line 2. */
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 0) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 0) ==
+	    PISMTEST_CACHE_HIT);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 1) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 0) ==
+	    PISMTEST_CACHE_HIT);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 2) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 0) ==
+	    PISMTEST_CACHE_HIT);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 1) ==
+	    PISMTEST_CACHE_MISS);
+
+	/* FIFO: the same accesses evict line 0, the first filled. */
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 0) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 1) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 0) ==
+	    PISMTEST_CACHE_HIT);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 2) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 1) ==
+	    PISMTEST_CACHE_HIT);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_FIFO, 0) ==
+	    PISMTEST_CACHE_MISS);
+
+	/*
+	 * The LRU cache holds lines 0 and 1, 1 the more recent.  A store
+	 * dirties line 0 and reaches DRAM at once; line 3 then evicts the
+	 * clean line 1, and line 4 the dirty line 0, paying for a writeback.
+	 */
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, PISMTEST_CACHE_LRU + 5,
+	    0x5a);
 	assert(ret == PISMTEST_SUCCESS);
-	assert(b == 0x5e);
+	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
+	assert(dpp != NULL && dpp->dp_data[5] == 0x5a);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 3) ==
+	    PISMTEST_CACHE_MISS);
+	assert(pismtest_cache_fetch(PISMTEST_CACHE_LRU, 4) ==
+	    PISMTEST_CACHE_MISS + PISMTEST_CACHE_WRITEBACK);
+}
+
+/*
+ * Banked timing model tests.  With two banks of 2KiB rows, 0x0 and 0x1000
+ * are different rows of bank 0, and 0x800 is in bank 1.  Transfers take no
+ * port time, so a fetch's latency is that of its bank, but still waits for
+ * earlier transfers to finish.
+ */
+#define	PISMTEST_TIMING_REFRESH		1000
+#define	PISMTEST_TIMING_REFRESHTIME	16
+
+static const char pismtest_timing_config[] =
+    "module dram.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x100000;\n"
+    "	option banks \"2\";\n"
+    "	option rowhit \"4\";\n"
+    "	option rowmiss \"8\";\n"
+    "	option precharge \"4\";\n"
+    "	option refresh \"1000\";\n"
+    "	option refreshtime \"16\";\n"
+    "};\n";
+
+static void
+pismtest_timing_req(pism_data_t *pd, uint8_t acctype, uint64_t addr)
+{
+
+	memset(pd, 0, sizeof(*pd));
+	pd->pd_int.pdi_acctype = acctype;
+	pd->pd_int.pdi_addr = addr;
+	pd->pd_int.pdi_byteenable = 0xffffffff;
+}
+
+/*
+ * Post a store, which must be accepted this cycle.
+ */
+static void
+pismtest_timing_store(uint64_t addr)
+{
+	pism_data_t pd;
+
+	pismtest_timing_req(&pd, PISM_ACC_STORE, addr);
+	assert(pism_request_ready(PISM_BUSNO_MEMORY, &pd));
+	pism_request_put(PISM_BUSNO_MEMORY, &pd);
+}
+
+/*
+ * Fetch a line and return the cycles until its reply.
+ */
+static uint64_t
+pismtest_timing_fetch(uint64_t addr)
+{
+	pism_data_t pd;
+	uint64_t issue;
+	u_int i;
+
+	pismtest_timing_req(&pd, PISM_ACC_FETCH, addr);
+	assert(pism_request_ready(PISM_BUSNO_MEMORY, &pd));
+	issue = pism_cycle_count_get(PISM_BUSNO_MEMORY);
+	pism_request_put(PISM_BUSNO_MEMORY, &pd);
+	for (i = 0; !pism_response_ready(PISM_BUSNO_MEMORY); i++) {
+		assert(i < 100);
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+	}
+	(void)pism_response_get(PISM_BUSNO_MEMORY);
+	return (pism_cycle_count_get(PISM_BUSNO_MEMORY) - issue);
+}
+
+static void
+pismtest_timing_ticks_to(uint64_t offset)
+{
+
+	while (pism_cycle_count_get(PISM_BUSNO_MEMORY) %
+	    PISMTEST_TIMING_REFRESH != offset)
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+}
+
+static void
+pismtest_timing(void)
+{
+	pism_data_t pd;
+	u_int i;
+
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, "%s",
+	    pismtest_timing_config));
+
+	/*
+	 * Clear of refresh: a closed bank misses, the open row hits, and
+	 * another row of the same bank must first be closed.
+	 */
+	pismtest_timing_ticks_to(100);
+	assert(pismtest_timing_fetch(0x0) == 8);
+	assert(pismtest_timing_fetch(0x20) == 4);
+	assert(pismtest_timing_fetch(0x1000) == 4 + 8);
+
+	/*
+	 * A store conflicting in bank 0 leaves bank 1 free to open its row
+	 * at the same time, so the fetch waits only for the store's transfer.
+	 */
+	pismtest_timing_store(0x0);
+	assert(pismtest_timing_fetch(0x800) == 4 + 8);
+
+	/*
+	 * A fetch behind a conflicting store in the same bank waits for the
+	 * bank, then conflicts again.  A further store is refused until the
+	 * bank is free.
+	 */
+	pismtest_timing_store(0x1000);
+	assert(pismtest_timing_fetch(0x0) == 2 * (4 + 8));
+	pismtest_timing_store(0x1000);
+	pismtest_timing_req(&pd, PISM_ACC_STORE, 0x0);
+	for (i = 0; !pism_request_ready(PISM_BUSNO_MEMORY, &pd); i++)
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+	assert(i == 4 + 8);
+	pism_request_put(PISM_BUSNO_MEMORY, &pd);
+
+	/*
+	 * An access at the start of a period waits out the refresh, which
+	 * closed every row.
+	 */
+	pismtest_timing_ticks_to(0);
+	assert(pismtest_timing_fetch(0x0) == PISMTEST_TIMING_REFRESHTIME + 8);
+	assert(pismtest_timing_fetch(0x0) == 4);
+
+	/*
+	 * A store is refused until the refresh is over.
+	 */
+	pismtest_timing_ticks_to(0);
+	pismtest_timing_req(&pd, PISM_ACC_STORE, 0x800);
+	for (i = 0; !pism_request_ready(PISM_BUSNO_MEMORY, &pd); i++)
+		pism_cycle_tick(PISM_BUSNO_MEMORY);
+	assert(i == PISMTEST_TIMING_REFRESHTIME);
+	pism_request_put(PISM_BUSNO_MEMORY, &pd);
+}
+
+/*
+ * Fill and poison tests.  dram0 holds the test ELF image, fills with a word
+ * and detects reads of unwritten lines; dram1 fills with a doubleword.
+ */
+#define	PISMTEST_POISON_DRAM1	0x200000
+
+static const char pismtest_poison_config[] =
+    "module dram.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x200000;\n"
+    "	option type \"elf\";\n"
+    "	option path \"%s\";\n"
+    "	option fill4 \"0xdeadbeef\";\n"
+    "	option poison \"4\";\n"
+    "};\n"
+    "device \"dram1\" {\n"
+    "	class dram;\n"
+    "	addr 0x200000;\n"
+    "	length 0x100000;\n"
+    "	option fill8 \"0x0123456789abcdef\";\n"
+    "};\n";
+
+static const uint8_t pismtest_poison_fill4[] = { 0xde, 0xad, 0xbe, 0xef };
+static const uint8_t pismtest_poison_fill8[] =
+    { 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef };
+
+static void
+pismtest_poison_fetch(uint64_t addr, uint32_t byteenable, uint8_t *data)
+{
+	pism_data_t pd;
+
+	memset(&pd, 0, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_FETCH;
+	pd.pd_int.pdi_addr = addr;
+	pd.pd_int.pdi_byteenable = byteenable;
+	assert(pismtest_request(PISM_BUSNO_MEMORY, &pd) == PISMTEST_SUCCESS);
+	assert(pismtest_response(PISM_BUSNO_MEMORY, &pd) == PISMTEST_SUCCESS);
+	memcpy(data, pd.pd_int.pdi_data, PISM_DATA_BYTES);
+}
+
+/*
+ * Report whether a line fetched with all bytes enabled reads as the fill
+ * word, as unwritten lines of dram0 do.
+ */
+static bool
+pismtest_poison_filled(uint64_t addr)
+{
+	uint8_t data[PISM_DATA_BYTES];
+	u_int i;
+
+	pismtest_poison_fetch(addr, 0xffffffff, data);
+	for (i = 0; i < PISM_DATA_BYTES; i++) {
+		if (data[i] != pismtest_poison_fill4[i % 4])
+			return (false);
+	}
+	return (true);
+}
+
+static void
+pismtest_poison(void)
+{
+	char path[] = "/tmp/pismtest.XXXXXX";
+	char ckpt[64];
+	uint8_t data[PISM_DATA_BYTES];
+	struct dram_private *dpp;
+	u_int i;
+	int ret;
+
+	pismtest_elf_write(path, PISMTEST_ELF_FILESZ);
+	assert(pismtest_attach(PISM_BUSNO_MEMORY, pismtest_poison_config,
+	    path));
+	unlink(path);
+	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
+	assert(dpp != NULL && dpp->dp_poison != NULL);
+
+	/* Bytes a fetch doesn't enable read as the fill word. */
+	pismtest_poison_fetch(PISMTEST_ELF_PADDR, 0x0000ffff, data);
+	for (i = 0; i < PISM_DATA_BYTES; i++)
+		assert(data[i] == (i < 16 ? (uint8_t)(i * 7 + 1) :
+		    pismtest_poison_fill4[i % 4]));
+	pismtest_poison_fetch(PISMTEST_POISON_DRAM1, 0x00000001, data);
+	for (i = 0; i < PISM_DATA_BYTES; i++)
+		assert(data[i] == (i == 0 ? 0 : pismtest_poison_fill8[i % 8]));
+
+	/*
+	 * The image's data and BSS were written by loading it; other lines
+	 * are poisoned, and each fetch of one is counted.
+	 */
+	assert(!pismtest_poison_filled(PISMTEST_ELF_PADDR +
+	    PISMTEST_ELF_FILESZ));
+	pismtest_poison_fetch(PISMTEST_ELF_PADDR + PISMTEST_ELF_MEMSZ -
+	    PISM_DATA_BYTES, 0xffffffff, data);
+	for (i = 0; i < PISM_DATA_BYTES; i++)
+		assert(data[i] == 0);
+	assert(dpp->dp_poison->dpn_count == 0);
+	assert(pismtest_poison_filled(0x10000));
+	assert(pismtest_poison_filled(PISMTEST_ELF_PADDR +
+	    PISMTEST_ELF_MEMSZ));
+	assert(dpp->dp_poison->dpn_count == 2);
+
+	/* A store of any part of a line marks all of it written. */
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x10004, 0x44);
+	assert(ret == PISMTEST_SUCCESS);
+	pismtest_poison_fetch(0x10000, 0xffffffff, data);
+	for (i = 0; i < PISM_DATA_BYTES; i++)
+		assert(data[i] == (i == 4 ? 0x44 : 0));
+	assert(dpp->dp_poison->dpn_count == 2);
+
+	/* Checkpoints hold the bitmap of written lines. */
+	snprintf(ckpt, sizeof(ckpt), "/tmp/pismtest.%d.ckpt", getpid());
+	assert(pism_checkpoint_save(ckpt));
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x20000, 0x55);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(pism_checkpoint_restore(ckpt));
+	unlink(ckpt);
+	assert(!pismtest_poison_filled(0x10000));
+	assert(pismtest_poison_filled(0x20000));
+	assert(dpp->dp_poison->dpn_count == 3);
+}
+
+/*
+ * Checkpoint a UART holding input the guest hasn't yet taken and output not
+ * yet written, with a socket as the host side.  The output must reach the
+ * host by the time the checkpoint is saved, and the input must be taken
+ * again after a restore.
+ */
+#define	PISMTEST_UART_ADDR	0x7f000000
+#define	PISMTEST_UART_WAIT	5000	/* Milliseconds for input to arrive. */
+
+static const char pismtest_uart_config[] =
+    "module uart.so\n"
+    "device \"uart0\" {\n"
+    "	class uart;\n"
+    "	addr 0x7f000000;\n"
+    "	length 0x20;\n"
+    "	irq 0;\n"
+    "	option type \"socket\";\n"
+    "	option path \"%s\";\n"
+    "};\n";
+
+/*
+ * Read the data register, returning the character or -1 if none is valid.
+ */
+static int
+pismtest_uart_getc(void)
+{
+	pism_data_t pd;
+
+	memset(&pd, 0x00, sizeof(pd));
+	pd.pd_int.pdi_acctype = PISM_ACC_FETCH;
+	pd.pd_int.pdi_addr = PISMTEST_UART_ADDR;
+	pd.pd_int.pdi_byteenable = 0xf;
+	assert(pism_addr_valid(PISM_BUSNO_PERIPHERAL, &pd));
+	assert(pismtest_request(PISM_BUSNO_PERIPHERAL, &pd) ==
+	    PISMTEST_SUCCESS);
+	memset(&pd, 0x00, sizeof(pd));
+	assert(pismtest_response(PISM_BUSNO_PERIPHERAL, &pd) ==
+	    PISMTEST_SUCCESS);
+	if ((pd.pd_int.pdi_data[1] & 0x80) == 0)	/* RVALID */
+		return (-1);
+	return (pd.pd_int.pdi_data[0]);
+}
+
+static void
+pismtest_uart(void)
+{
+	struct sockaddr_un sun;
+	char ckpt[64], buf[8];
+	const char *p;
+	int c, i, s;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_LOCAL;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "/tmp/pismtest.%d.sock",
+	    getpid());
+	assert(pismtest_attach(PISM_BUSNO_PERIPHERAL, pismtest_uart_config,
+	    sun.sun_path));
+	s = socket(PF_LOCAL, SOCK_STREAM, 0);
+	assert(s >= 0);
+	assert(connect(s, (struct sockaddr *)&sun, sizeof(sun)) == 0);
+	assert(send(s, "abcdef", 6, 0) == 6);
+
+	/* The I/O thread accepts, and reads all the input at once. */
+	for (i = 0; (c = pismtest_uart_getc()) == -1; i++) {
+		assert(i < PISMTEST_UART_WAIT);
+		usleep(1000);
+	}
+	assert(c == 'a');
+	assert(pismtest_mem_store8(PISM_BUSNO_PERIPHERAL, PISMTEST_UART_ADDR,
+	    'x') == PISMTEST_SUCCESS);
+	assert(pismtest_mem_store8(PISM_BUSNO_PERIPHERAL, PISMTEST_UART_ADDR,
+	    'y') == PISMTEST_SUCCESS);
+
+	snprintf(ckpt, sizeof(ckpt), "/tmp/pismtest.%d.ckpt", getpid());
+	assert(pism_checkpoint_save(ckpt));
+	assert(recv(s, buf, sizeof(buf), MSG_DONTWAIT) == 2);
+	assert(memcmp(buf, "xy", 2) == 0);
+	assert(pismtest_uart_getc() == 'b');
+	assert(pismtest_uart_getc() == 'c');
+	assert(pism_checkpoint_restore(ckpt));
+	unlink(ckpt);
+	for (p = "bcdef"; *p != '\0'; p++)
+		assert(pismtest_uart_getc() == *p);
+	assert(pismtest_uart_getc() == -1);
+	close(s);
+	unlink(sun.sun_path);
+}
+
+/*
+ * Microbenchmarks.  These attach synthetic devices to the otherwise unused
+ * trace bus, so do not require a configuration file.
+ */
+#define	PISMTEST_BENCH_BUSNO		PISM_BUSNO_TRACE
+#define	PISMTEST_BENCH_ITERATIONS	(16 * 1024 * 1024)
+#define	PISMTEST_BENCH_ADDRS		4096
+#define	PISMTEST_BENCH_DEVSPACING	0x100000
+#define	PISMTEST_BENCH_DEVLENGTH	0x1000
+
+static bool
+pismtest_bench_addr_valid(pism_device_t *dev, pism_data_t *req)
+{
+
+	return (true);
+}
+
+static struct pism_module pismtest_bench_module = {
+	.pm_name = "pismtest_bench",
+	.pm_dev_addr_valid = pismtest_bench_addr_valid,
+};
+
+static double
+pismtest_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime");
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void
+pismtest_bench_devices_attach(u_int ndevs, pism_device_t *devs)
+{
+	pism_device_t *dev;
+	u_int i;
+
+	SLIST_INIT(g_pism_devices[PISMTEST_BENCH_BUSNO]);
+	for (i = 0; i < ndevs; i++) {
+		dev = &devs[i];
+		memset(dev, 0, sizeof(*dev));
+		dev->pd_mod = &pismtest_bench_module;
+		dev->pd_name = "bench";
+		dev->pd_busno = PISMTEST_BENCH_BUSNO;
+		dev->pd_base = (uint64_t)i * PISMTEST_BENCH_DEVSPACING;
+		dev->pd_length = PISMTEST_BENCH_DEVLENGTH;
+		dev->pd_perms = PISM_PERM_ALLOW_FETCH | PISM_PERM_ALLOW_STORE;
+		dev->pd_irq = PISM_IRQ_NONE;
+		TAILQ_INIT(&dev->pd_options);
+		SLIST_INSERT_HEAD(g_pism_devices[PISMTEST_BENCH_BUSNO], dev,
+		    pd_next);
+	}
+	pism_bus_decoder_build(PISMTEST_BENCH_BUSNO);
+}
+
+/*
+ * Measure pism_addr_valid() lookups per second, once with a stream of
+ * requests scattered over all devices (defeating the last-hit cache), and
+ * once with consecutive requests to a single device, as is typical of the
+ * addr_valid/request_ready/request_put sequence.
+ */
+static void
+pismtest_bench_lookup(u_int ndevs)
+{
+	pism_device_t *devs;
+	pism_data_t *reqs;
+	double start, scattered, repeated;
+	u_int i, dev;
+
+	devs = calloc(ndevs, sizeof(*devs));
+	reqs = calloc(PISMTEST_BENCH_ADDRS, sizeof(*reqs));
+	assert(devs != NULL && reqs != NULL);
+	pismtest_bench_devices_attach(ndevs, devs);
+
+	srandom(ndevs);
+	for (i = 0; i < PISMTEST_BENCH_ADDRS; i++) {
+		dev = random() % ndevs;
+		reqs[i].pd_int.pdi_acctype = PISM_ACC_FETCH;
+		reqs[i].pd_int.pdi_addr = devs[dev].pd_base +
+		    (random() % (PISMTEST_BENCH_DEVLENGTH / PISM_DATA_BYTES)) *
+		    PISM_DATA_BYTES;
+	}
+
+	start = pismtest_time();
+	for (i = 0; i < PISMTEST_BENCH_ITERATIONS; i++) {
+		if (!pism_addr_valid(PISMTEST_BENCH_BUSNO,
+		    &reqs[i % PISMTEST_BENCH_ADDRS]))
+			errx(1, "lookup failed");
+	}
+	scattered = PISMTEST_BENCH_ITERATIONS / (pismtest_time() - start);
+
+	start = pismtest_time();
+	for (i = 0; i < PISMTEST_BENCH_ITERATIONS; i++) {
+		if (!pism_addr_valid(PISMTEST_BENCH_BUSNO,
+		    &reqs[(i / 3) % PISMTEST_BENCH_ADDRS]))
+			errx(1, "lookup failed");
+	}
+	repeated = PISMTEST_BENCH_ITERATIONS / (pismtest_time() - start);
+
+	printf("lookup: %3u devices: %12.0f lookups/s scattered, "
+	    "%12.0f lookups/s repeated\n", ndevs, scattered, repeated);
+
+	SLIST_INIT(g_pism_devices[PISMTEST_BENCH_BUSNO]);
+	pism_bus_decoder_build(PISMTEST_BENCH_BUSNO);
+	free(reqs);
+	free(devs);
+}
+
+/*
+ * Compare moving cache lines to and from DRAM one beat at a time against
+ * moving them as bursts.  DRAM is attached to the memory bus using a
+ * temporary configuration file, so dram.so and cache.so must be loadable.
+ */
+#define	PISMTEST_BENCH_DRAM_LENGTH	(1024 * 1024)
+#define	PISMTEST_BENCH_LINE_BEATS	4
+#define	PISMTEST_BENCH_LINES		(1024 * 1024)
+
+static const char pismtest_bench_dram_config[] =
+    "module dram.so\n"
+    "device \"dram0\" {\n"
+    "	class dram;\n"
+    "	addr 0x0;\n"
+    "	length 0x100000;\n"
+    "};\n"
+    "device \"dram1\" {\n"
+    "	class dram;\n"
+    "	addr 0x100000;\n"
+    "	length 0x100000;\n"
+    "	option banks \"8\";\n"
+    "	option refresh \"780\";\n"
+    "	option refreshtime \"16\";\n"
+    "	option bandwidth \"16\";\n"
+    "};\n"
+    "device \"dram3\" {\n"
+    "	class dram;\n"
+    "	addr 0x300000;\n"
+    "	length 0x100000;\n"
+    "	option delay \"13\";\n"
+    "};\n"
+    "module cache.so\n"
+    "device \"dram2\" {\n"
+    "	class dram;\n"
+    "	addr 0x200000;\n"
+    "	length 0x100000;\n"
+    "};\n"
+    "device \"cache2\" {\n"
+    "	class cache;\n"
+    "	addr 0x200000;\n"
+    "	length 0x100000;\n"
+    "	option backing \"dram2\";\n"
+    "	option size \"262144\";\n"
+    "	option hitlatency \"2\";\n"
+    "	option misslatency \"8\";\n"
+    "};\n";
+
+static void
+pismtest_bench_dram_attach(void)
+{
+
+	if (!pismtest_attach(PISM_BUSNO_MEMORY, "%s",
+	    pismtest_bench_dram_config))
+		errx(1, "pism_init");
+}
+
+static void
+pismtest_bench_line_req(pism_data_t *req, uint8_t acctype, uint64_t base,
+    u_int line)
+{
+
+	memset(req, 0, sizeof(*req));
+	req->pd_int.pdi_acctype = acctype;
+	req->pd_int.pdi_byteenable = 0xffffffff;
+	req->pd_int.pdi_addr = base + ((uint64_t)line *
+	    PISMTEST_BENCH_LINE_BEATS * PISM_DATA_BYTES) %
+	    PISMTEST_BENCH_DRAM_LENGTH;
+}
+
+static void
+pismtest_bench_line_beats(uint8_t busno, uint8_t acctype, uint64_t base,
+    uint8_t *line)
+{
+	pism_data_t req;
+	u_int beat, i;
+
+	for (i = 0; i < PISMTEST_BENCH_LINES; i++) {
+		pismtest_bench_line_req(&req, acctype, base, i);
+		for (beat = 0; beat < PISMTEST_BENCH_LINE_BEATS; beat++) {
+			if (acctype == PISM_ACC_STORE)
+				memcpy(req.pd_int.pdi_data,
+				    line + beat * PISM_DATA_BYTES,
+				    PISM_DATA_BYTES);
+			if (!pism_addr_valid(busno, &req) ||
+			    pismtest_request(busno, &req) != PISMTEST_SUCCESS)
+				errx(1, "beat request failed");
+			if (acctype == PISM_ACC_FETCH) {
+				if (pismtest_response(busno, &req) !=
+				    PISMTEST_SUCCESS)
+					errx(1, "beat response failed");
+				memcpy(line + beat * PISM_DATA_BYTES,
+				    req.pd_int.pdi_data, PISM_DATA_BYTES);
+			}
+			req.pd_int.pdi_addr += PISM_DATA_BYTES;
+		}
+	}
+}
+
+static void
+pismtest_bench_line_bursts(uint8_t busno, uint8_t acctype, uint64_t base,
+    uint8_t *line)
+{
+	pism_data_t req;
+	u_int i, j;
+
+	for (i = 0; i < PISMTEST_BENCH_LINES; i++) {
+		pismtest_bench_line_req(&req, acctype, base, i);
+		if (!pism_burst_addr_valid(busno, &req,
+		    PISMTEST_BENCH_LINE_BEATS))
+			errx(1, "burst address invalid");
+		for (j = 0; j < PISMTEST_MAXWAIT; j++) {
+			if (pism_burst_request_ready(busno, &req,
+			    PISMTEST_BENCH_LINE_BEATS))
+				break;
+		}
+		if (j == PISMTEST_MAXWAIT)
+			errx(1, "burst request timed out");
+		pism_burst_request_put(busno, &req, PISMTEST_BENCH_LINE_BEATS,
+		    line);
+		if (acctype == PISM_ACC_STORE)
+			continue;
+		for (j = 0; j < PISMTEST_MAXWAIT; j++) {
+			pism_cycle_tick(busno);
+			if (pism_response_ready(busno))
+				break;
+		}
+		if (pism_burst_response_get(busno, &req, line) !=
+		    PISMTEST_BENCH_LINE_BEATS)
+			errx(1, "burst response failed");
+	}
+}
+
+static void
+pismtest_bench_burst(void)
+{
+	uint8_t line[PISM_BURST_MAX_BYTES];
+	double start, rate;
+	int acctype, burst;
+
+	pismtest_bench_dram_attach();
+	memset(line, 0x5a, sizeof(line));
+	for (acctype = PISM_ACC_FETCH; acctype <= PISM_ACC_STORE; acctype++) {
+		for (burst = 0; burst <= 1; burst++) {
+			start = pismtest_time();
+			if (burst)
+				pismtest_bench_line_bursts(PISM_BUSNO_MEMORY,
+				    acctype, 0, line);
+			else
+				pismtest_bench_line_beats(PISM_BUSNO_MEMORY,
+				    acctype, 0, line);
+			rate = (double)PISMTEST_BENCH_LINES *
+			    PISMTEST_BENCH_LINE_BEATS * PISM_DATA_BYTES /
+			    (pismtest_time() - start) / (1024 * 1024);
+			printf("dram %s: %u-beat lines %-8s %10.1f MB/s\n",
+			    acctype == PISM_ACC_FETCH ? "fetch" : "store",
+			    PISMTEST_BENCH_LINE_BEATS,
+			    burst ? "burst:" : "per-beat:", rate);
+		}
+	}
+}
+
+/*
+ * Move the same bursts through cache2, which is a quarter the size of the
+ * range covered, to show the cost of the cache model over that of dram0
+ * above.  Its latencies are kept within PISMTEST_MAXWAIT.  Must follow
+ * pismtest_bench_burst().
+ */
+static void
+pismtest_bench_cache(void)
+{
+	uint8_t line[PISM_BURST_MAX_BYTES];
+	double start, rate;
+	int acctype;
+
+	memset(line, 0x5a, sizeof(line));
+	for (acctype = PISM_ACC_FETCH; acctype <= PISM_ACC_STORE; acctype++) {
+		start = pismtest_time();
+		pismtest_bench_line_bursts(PISM_BUSNO_MEMORY, acctype,
+		    0x200000, line);
+		rate = (double)PISMTEST_BENCH_LINES *
+		    PISMTEST_BENCH_LINE_BEATS * PISM_DATA_BYTES /
+		    (pismtest_time() - start) / (1024 * 1024);
+		printf("cache %s: %u-beat lines burst:   %10.1f MB/s\n",
+		    acctype == PISM_ACC_FETCH ? "fetch" : "store",
+		    PISMTEST_BENCH_LINE_BEATS, rate);
+	}
+}
+
+/*
+ * Drive the same bursts through the bus as a CPU model would, ticking the
+ * clock every cycle, polling for each reply and issuing a line every
+ * PISMTEST_BENCH_TIMED_CYCLES cycles, which is longer than dram1 takes.  So
+ * every DRAM simulates the same cycles, and cycles/s shows how fast each
+ * runs.  Fetches from dram1 are compared with dram3, whose fixed delay is
+ * about dram1's latency, as waiting for a reply costs a poll each cycle
+ * whatever the model; the gap is the cost of the timing model.  Stalls, as
+ * at refresh, are waited out.  Must follow pismtest_bench_burst().
+ */
+#define	PISMTEST_BENCH_TIMED_CYCLES	16
+
+static const u_int pismtest_bench_timed_drams[] = { 0, 3, 1 };
+
+static uint64_t
+pismtest_bench_timed_bursts(uint8_t busno, uint8_t acctype, uint64_t base,
+    uint8_t *line)
+{
+	pism_data_t req;
+	uint64_t first, issue;
+	u_int i;
+
+	first = pism_cycle_count_get(busno);
+	for (i = 0; i < PISMTEST_BENCH_LINES; i++) {
+		pismtest_bench_line_req(&req, acctype, base, i);
+		if (!pism_burst_addr_valid(busno, &req,
+		    PISMTEST_BENCH_LINE_BEATS))
+			errx(1, "burst address invalid");
+		while (!pism_burst_request_ready(busno, &req,
+		    PISMTEST_BENCH_LINE_BEATS))
+			pism_cycle_tick(busno);
+		issue = pism_cycle_count_get(busno);
+		pism_burst_request_put(busno, &req, PISMTEST_BENCH_LINE_BEATS,
+		    line);
+		if (acctype == PISM_ACC_FETCH) {
+			while (!pism_response_ready(busno))
+				pism_cycle_tick(busno);
+			if (pism_burst_response_get(busno, &req, line) !=
+			    PISMTEST_BENCH_LINE_BEATS)
+				errx(1, "burst response failed");
+		}
+		while (pism_cycle_count_get(busno) - issue <
+		    PISMTEST_BENCH_TIMED_CYCLES)
+			pism_cycle_tick(busno);
+	}
+	return (pism_cycle_count_get(busno) - first);
+}
+
+static void
+pismtest_bench_timing(void)
+{
+	uint8_t line[PISM_BURST_MAX_BYTES];
+	double elapsed, start;
+	uint64_t cycles;
+	u_int dram, i;
+	int acctype;
+
+	memset(line, 0x5a, sizeof(line));
+	for (acctype = PISM_ACC_FETCH; acctype <= PISM_ACC_STORE; acctype++) {
+		for (i = 0; i < sizeof(pismtest_bench_timed_drams) /
+		    sizeof(pismtest_bench_timed_drams[0]); i++) {
+			dram = pismtest_bench_timed_drams[i];
+			start = pismtest_time();
+			cycles = pismtest_bench_timed_bursts(PISM_BUSNO_MEMORY,
+			    acctype, dram * PISMTEST_BENCH_DRAM_LENGTH, line);
+			elapsed = pismtest_time() - start;
+			printf("dram%u %s: timed bursts %5.1f cycles/line "
+			    "%12.0f cycles/s\n", dram,
+			    acctype == PISM_ACC_FETCH ? "fetch" : "store",
+			    (double)cycles / PISMTEST_BENCH_LINES,
+			    cycles / elapsed);
+		}
+	}
+}
+
+/*
+ * Measure the DRAM data path alone by calling the module directly, bypassing
+ * the bus, for fully and partially enabled beats.  dram1 adds the cost of the
+ * banked timing model.  Must follow pismtest_bench_burst(), which attaches
+ * the DRAM.
+ */
+#define	PISMTEST_BENCH_DRAM_BEATS	(16 * 1024 * 1024)
+
+static const uint32_t pismtest_bench_dram_enables[] = {
+	0xffffffff,
+	0x0000ffff,
+	0x33333333,
+};
+
+static void
+pismtest_bench_dram_device(pism_device_t *dev)
+{
+	pism_module_t *mod;
+	pism_data_t req;
+	double start, rate;
+	u_int i, j;
+	int acctype;
+
+	mod = dev->pd_mod;
+	for (acctype = PISM_ACC_FETCH; acctype <= PISM_ACC_STORE; acctype++) {
+		for (j = 0; j < sizeof(pismtest_bench_dram_enables) /
+		    sizeof(pismtest_bench_dram_enables[0]); j++) {
+			memset(&req, 0x5a, sizeof(req));
+			req.pd_int.pdi_acctype = acctype;
+			req.pd_int.pdi_byteenable =
+			    pismtest_bench_dram_enables[j];
+			start = pismtest_time();
+			for (i = 0; i < PISMTEST_BENCH_DRAM_BEATS; i++) {
+				req.pd_int.pdi_addr = dev->pd_base +
+				    ((uint64_t)i * PISM_DATA_BYTES) %
+				    dev->pd_length;
+				mod->pm_dev_request_put(dev, &req);
+				if (acctype == PISM_ACC_FETCH)
+					req = mod->pm_dev_response_get(dev);
+			}
+			rate = (double)PISMTEST_BENCH_DRAM_BEATS *
+			    PISM_DATA_BYTES / (pismtest_time() - start) /
+			    (1024 * 1024);
+			printf("%s %s: enables 0x%08x %10.1f MB/s\n",
+			    dev->pd_name,
+			    acctype == PISM_ACC_FETCH ? "fetch" : "store",
+			    pismtest_bench_dram_enables[j], rate);
+		}
+	}
+}
+
+static void
+pismtest_bench_dram(void)
+{
+	pism_device_t *dev;
+
+	SLIST_FOREACH(dev, g_pism_devices[PISM_BUSNO_MEMORY], pd_next) {
+		if (strcmp(dev->pd_mod->pm_name, "dram") == 0)
+			pismtest_bench_dram_device(dev);
+	}
+}
+
+/*
+ * A fio-style closed-loop random 4KiB read and write benchmark, with the
+ * bench playing the guest driver for virtio_block.so over a sparse scratch
+ * image.  Chains use indirect descriptors, and as many are kept in flight as
+ * the queue allows, up to PISMTEST_BENCH_VTBLK_DEPTH.  vtblk0 does its I/O
+ * synchronously in the notify store, and vtblk1 on its worker threads;
+ * cycles/IO is how long the simulated guest waits for each.  EVENT_IDX is
+ * negotiated, and kicks and intrs count the notify writes and interrupts
+ * the guest sees.  Must follow pismtest_bench_burst(), which attaches dram0
+ * for the rings and buffers.
+ */
+#define	PISMTEST_BENCH_VTBLK_BASE	0x7f100000
+#define	PISMTEST_BENCH_VTBLK_IMAGE	(64 * 1024 * 1024)
+#define	PISMTEST_BENCH_VTBLK_IOS	(32 * 1024)
+#define	PISMTEST_BENCH_VTBLK_DEPTH	16
+#define	PISMTEST_BENCH_VTBLK_BLOCK	4096
+
+/*
+ * Guest memory in dram0 is laid out per device, from the ring: indirect
+ * tables, with header and status, at 128 bytes per chain, then buffers.
+ */
+#define	PISMTEST_BENCH_VTBLK_RING	0x80000
+#define	PISMTEST_BENCH_VTBLK_SPACING	0x40000
+#define	PISMTEST_BENCH_VTBLK_TABLES	0x10000
+#define	PISMTEST_BENCH_VTBLK_CHAIN	128
+#define	PISMTEST_BENCH_VTBLK_BUFS	0x20000
+
+static const char pismtest_bench_vtblk_config[] =
+    "module virtio_block.so\n"
+    "device \"vtblk0\" {\n"
+    "	class virtio_block;\n"
+    "	addr 0x7f100000;\n"
+    "	length 0x200;\n"
+    "	irq 1;\n"
+    "	option path \"%s\";\n"
+    "	option workers \"0\";\n"
+    "};\n"
+    "device \"vtblk1\" {\n"
+    "	class virtio_block;\n"
+    "	addr 0x7f101000;\n"
+    "	length 0x200;\n"
+    "	irq 2;\n"
+    "	option path \"%s\";\n"
+    "};\n";
+
+struct pismtest_bench_vtblk_chain {
+	struct virtio_blk_outhdr	vbc_hdr;
+	uint8_t				vbc_status;
+};
+
+static void
+pismtest_bench_vtblk_attach(char *image)
+{
+	int fd;
+
+	fd = mkstemp(image);
+	if (fd < 0)
+		err(1, "mkstemp");
+	if (ftruncate(fd, PISMTEST_BENCH_VTBLK_IMAGE) < 0)
+		err(1, "ftruncate");
+	close(fd);
+	if (!pismtest_attach(PISM_BUSNO_PERIPHERAL,
+	    pismtest_bench_vtblk_config, image, image))
+		errx(1, "pism_init");
+}
+
+static void
+pismtest_bench_vtblk_reg_req(pism_data_t *req, uint8_t acctype,
+    uint64_t base, u_int reg, u_int len)
+{
+	u_int i, lane;
+
+	memset(req, 0, sizeof(*req));
+	req->pd_int.pdi_acctype = acctype;
+	req->pd_int.pdi_addr = (base + reg) & ~(uint64_t)(PISM_DATA_BYTES - 1);
+	lane = reg % PISM_DATA_BYTES;
+	for (i = 0; i < len; i++)
+		req->pd_int.pdi_byteenable |= 1 << (lane + i);
+}
+
+/*
+ * Registers are big-endian, as for the MIPS guest.
+ */
+static void
+pismtest_bench_vtblk_write(uint64_t base, u_int reg, uint32_t v, u_int len)
+{
+	pism_data_t req;
+	u_int i;
+
+	pismtest_bench_vtblk_reg_req(&req, PISM_ACC_STORE, base, reg, len);
+	for (i = 0; i < len; i++)
+		req.pd_int.pdi_data[reg % PISM_DATA_BYTES + i] =
+		    v >> (8 * (len - 1 - i));
+	if (!pism_addr_valid(PISM_BUSNO_PERIPHERAL, &req) ||
+	    pismtest_request(PISM_BUSNO_PERIPHERAL, &req) != PISMTEST_SUCCESS)
+		errx(1, "virtio register write failed");
+}
+
+static uint32_t
+pismtest_bench_vtblk_read(uint64_t base, u_int reg)
+{
+	pism_data_t req;
+	uint32_t v;
+
+	pismtest_bench_vtblk_reg_req(&req, PISM_ACC_FETCH, base, reg, 4);
+	if (!pism_addr_valid(PISM_BUSNO_PERIPHERAL, &req) ||
+	    pismtest_request(PISM_BUSNO_PERIPHERAL, &req) !=
+	    PISMTEST_SUCCESS ||
+	    pismtest_response(PISM_BUSNO_PERIPHERAL, &req) !=
+	    PISMTEST_SUCCESS)
+		errx(1, "virtio register read failed");
+	memcpy(&v, &req.pd_int.pdi_data[reg % PISM_DATA_BYTES], sizeof(v));
+	return (be32toh(v));
+}
+
+/*
+ * Point chain i's descriptor at an indirect table of header, buffer and
+ * status, for a random block, and make it available.
+ */
+static void
+pismtest_bench_vtblk_post(uint8_t *mem, uint64_t gbase, struct vring *vr,
+    uint16_t *availp, u_int i, int type)
+{
+	struct pismtest_bench_vtblk_chain *chain;
+	struct vring_desc *table;
+	uint64_t gtable, gchain, gbuf;
+
+	gtable = gbase + PISMTEST_BENCH_VTBLK_TABLES +
+	    i * PISMTEST_BENCH_VTBLK_CHAIN;
+	gchain = gtable + 3 * sizeof(*table);
+	gbuf = gbase + PISMTEST_BENCH_VTBLK_BUFS +
+	    i * PISMTEST_BENCH_VTBLK_BLOCK;
+	table = (struct vring_desc *)(mem + gtable);
+	chain = (struct pismtest_bench_vtblk_chain *)(mem + gchain);
+
+	chain->vbc_hdr.type = htobe32(type);
+	chain->vbc_hdr.ioprio = 0;
+	chain->vbc_hdr.sector = htobe64((random() %
+	    (PISMTEST_BENCH_VTBLK_IMAGE / PISMTEST_BENCH_VTBLK_BLOCK)) *
+	    (PISMTEST_BENCH_VTBLK_BLOCK / 512));
+	chain->vbc_status = 0xff;
+
+	table[0].addr = htobe64(gchain);
+	table[0].len = htobe32(sizeof(chain->vbc_hdr));
+	table[0].flags = htobe16(VRING_DESC_F_NEXT);
+	table[0].next = htobe16(1);
+	table[1].addr = htobe64(gbuf);
+	table[1].len = htobe32(PISMTEST_BENCH_VTBLK_BLOCK);
+	table[1].flags = htobe16(VRING_DESC_F_NEXT |
+	    (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0));
+	table[1].next = htobe16(2);
+	table[2].addr = htobe64(gchain + offsetof(
+	    struct pismtest_bench_vtblk_chain, vbc_status));
+	table[2].len = htobe32(1);
+	table[2].flags = htobe16(VRING_DESC_F_WRITE);
+	table[2].next = 0;
+
+	vr->desc[i].addr = htobe64(gtable);
+	vr->desc[i].len = htobe32(3 * sizeof(*table));
+	vr->desc[i].flags = htobe16(VRING_DESC_F_INDIRECT);
+	vr->desc[i].next = 0;
+	vr->avail->ring[*availp % vr->num] = htobe16(i);
+	(*availp)++;
+}
+
+/*
+ * Make newly posted chains visible, notifying the device only if it has
+ * asked to be told about them.
+ */
+static u_int
+pismtest_bench_vtblk_kick(pism_device_t *dev, struct vring *vr,
+    uint16_t old, uint16_t avail)
+{
+	uint16_t *event;
+
+	/* vring_avail_event(), without the type-punned dereference. */
+	event = (uint16_t *)(void *)&vr->used->ring[vr->num];
+	vr->avail->idx = htobe16(avail);
+	if (avail == old || !vring_need_event(be16toh(*event), avail, old))
+		return (0);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_NOTIFY,
+	    0, 4);
+	return (1);
+}
+
+static void
+pismtest_bench_vtblk_device(uint8_t *mem, pism_device_t *dev, u_int n,
+    int type)
+{
+	struct vring vr;
+	uint64_t gbase, cycles;
+	uint16_t avail, old, used;
+	double start, iops;
+	u_int depth, posted, done, kicks, intrs, i;
+
+	gbase = PISMTEST_BENCH_VTBLK_RING + n * PISMTEST_BENCH_VTBLK_SPACING;
+	depth = pismtest_bench_vtblk_read(dev->pd_base,
+	    VIRTIO_MMIO_QUEUE_NUM_MAX);
+	if (depth > PISMTEST_BENCH_VTBLK_DEPTH)
+		depth = PISMTEST_BENCH_VTBLK_DEPTH;
+	memset(mem + gbase, 0, vring_size(depth, VIRTIO_MMIO_VRING_ALIGN));
+	vring_init(&vr, depth, mem + gbase, VIRTIO_MMIO_VRING_ALIGN);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_GUEST_FEATURES,
+	    VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_SEL, 0, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_NUM,
+	    depth, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_PFN,
+	    gbase >> 12, 4);
+
+	srandom(n);
+	avail = used = 0;
+	posted = done = kicks = intrs = 0;
+	cycles = pism_cycle_count_get(PISM_BUSNO_PERIPHERAL);
+	start = pismtest_time();
+	for (i = 0; i < depth; i++, posted++)
+		pismtest_bench_vtblk_post(mem, gbase, &vr, &avail, i, type);
+	kicks += pismtest_bench_vtblk_kick(dev, &vr, 0, avail);
+	while (done < PISMTEST_BENCH_VTBLK_IOS) {
+		if ((pism_interrupt_get(PISM_BUSNO_PERIPHERAL) &
+		    (1 << dev->pd_irq)) == 0) {
+			pism_cycle_tick(PISM_BUSNO_PERIPHERAL);
+			continue;
+		}
+		intrs++;
+		pismtest_bench_vtblk_write(dev->pd_base,
+		    VIRTIO_MMIO_INTERRUPT_ACK, VIRTIO_MMIO_INT_VRING, 4);
+		old = avail;
+		for (; used != be16toh(vr.used->idx); used++, done++) {
+			i = be32toh(vr.used->ring[used % depth].id);
+			if (mem[gbase + PISMTEST_BENCH_VTBLK_TABLES +
+			    i * PISMTEST_BENCH_VTBLK_CHAIN +
+			    3 * sizeof(struct vring_desc) + offsetof(
+			    struct pismtest_bench_vtblk_chain, vbc_status)] !=
+			    VIRTIO_BLK_S_OK)
+				errx(1, "%s: I/O failed", dev->pd_name);
+			if (posted < PISMTEST_BENCH_VTBLK_IOS) {
+				pismtest_bench_vtblk_post(mem, gbase, &vr,
+				    &avail, i, type);
+				posted++;
+			}
+		}
+		/* Interrupt on the next completion. */
+		vring_used_event(&vr) = htobe16(used);
+		kicks += pismtest_bench_vtblk_kick(dev, &vr, old, avail);
+	}
+	iops = PISMTEST_BENCH_VTBLK_IOS / (pismtest_time() - start);
+	cycles = pism_cycle_count_get(PISM_BUSNO_PERIPHERAL) - cycles;
+	printf("%s: 4KiB random %-5s depth %2u: %9.0f IOPS %8.1f cycles/IO "
+	    "%5.2f kicks/IO %5.2f intrs/IO\n", dev->pd_name,
+	    type == VIRTIO_BLK_T_IN ? "read" : "write", depth, iops,
+	    (double)cycles / PISMTEST_BENCH_VTBLK_IOS,
+	    (double)kicks / PISMTEST_BENCH_VTBLK_IOS,
+	    (double)intrs / PISMTEST_BENCH_VTBLK_IOS);
+}
+
+static void
+pismtest_bench_vtblk(void)
+{
+	char image[] = "/tmp/pismtest.XXXXXX";
+	struct dram_private *dpp;
+	pism_device_t *dev;
+	u_int n;
+	int type;
+
+	pismtest_bench_vtblk_attach(image);
+	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
+	assert(dpp != NULL);
+	for (type = VIRTIO_BLK_T_IN; type <= VIRTIO_BLK_T_OUT; type++) {
+		n = 0;
+		SLIST_FOREACH(dev, g_pism_devices[PISM_BUSNO_PERIPHERAL],
+		    pd_next)
+			pismtest_bench_vtblk_device(dpp->dp_data, dev, n++,
+			    type);
+	}
+	unlink(image);
+}
+
+/*
+ * Drive each virtio_block device as the bench does, checking the status of
+ * DISCARD and WRITE_ZEROES, that zeroed ranges read back as zero and their
+ * neighbours don't, and that ranges past the capacity and flags a command
+ * doesn't take are refused.  A FLUSH posted behind a batch of writes must
+ * complete after all of them.  Each device works on its own ranges of the
+ * shared image, which is kept on tmpfs.
+ */
+#define	PISMTEST_VTBLK_DEPTH	8
+#define	PISMTEST_VTBLK_SECTORS	(PISMTEST_BENCH_VTBLK_IMAGE / 512)
+#define	PISMTEST_VTBLK_RANGE	16384
+#define	PISMTEST_VTBLK_LONG	(PISMTEST_VTBLK_SECTORS / 4)
+#define	PISMTEST_VTBLK_FILL	0xa5
+
+struct pismtest_vtblk_chain {
+	struct virtio_blk_outhdr		pvc_hdr;
+	struct virtio_blk_discard_write_zeroes	pvc_range;
+	uint8_t					pvc_status;
+};
+
+/*
+ * Post chain i: a write of one block from the chain's buffer, a flush, or a
+ * DISCARD or WRITE_ZEROES of a single range.
+ */
+static struct pismtest_vtblk_chain *
+pismtest_vtblk_post(uint8_t *mem, uint64_t gbase, struct vring *vr,
+    uint16_t *availp, u_int i, int type, uint64_t sector, uint32_t nsectors,
+    uint32_t flags)
+{
+	struct pismtest_vtblk_chain *chain;
+	struct vring_desc *table;
+	uint64_t gtable, gchain;
+	u_int n;
+
+	gtable = gbase + PISMTEST_BENCH_VTBLK_TABLES +
+	    i * PISMTEST_BENCH_VTBLK_CHAIN;
+	gchain = gtable + 3 * sizeof(*table);
+	table = (struct vring_desc *)(mem + gtable);
+	chain = (struct pismtest_vtblk_chain *)(mem + gchain);
+
+	memset(chain, 0, sizeof(*chain));
+	chain->pvc_hdr.type = htobe32(type);
+	chain->pvc_status = 0xff;
+
+	n = 0;
+	table[n].addr = htobe64(gchain);
+	table[n].len = htobe32(sizeof(chain->pvc_hdr));
+	table[n].flags = htobe16(VRING_DESC_F_NEXT);
+	table[n].next = htobe16(n + 1);
+	n++;
+	if (type == VIRTIO_BLK_T_OUT) {
+		chain->pvc_hdr.sector = htobe64(sector);
+		table[n].addr = htobe64(gbase + PISMTEST_BENCH_VTBLK_BUFS +
+		    i * PISMTEST_BENCH_VTBLK_BLOCK);
+		table[n].len = htobe32(PISMTEST_BENCH_VTBLK_BLOCK);
+	} else if (type != VIRTIO_BLK_T_FLUSH) {
+		chain->pvc_range.sector = htobe64(sector);
+		chain->pvc_range.num_sectors = htobe32(nsectors);
+		chain->pvc_range.flags = htobe32(flags);
+		table[n].addr = htobe64(gchain + offsetof(
+		    struct pismtest_vtblk_chain, pvc_range));
+		table[n].len = htobe32(sizeof(chain->pvc_range));
+	}
+	if (type != VIRTIO_BLK_T_FLUSH) {
+		table[n].flags = htobe16(VRING_DESC_F_NEXT);
+		table[n].next = htobe16(n + 1);
+		n++;
+	}
+	table[n].addr = htobe64(gchain + offsetof(
+	    struct pismtest_vtblk_chain, pvc_status));
+	table[n].len = htobe32(1);
+	table[n].flags = htobe16(VRING_DESC_F_WRITE);
+	table[n].next = 0;
+	n++;
+
+	vr->desc[i].addr = htobe64(gtable);
+	vr->desc[i].len = htobe32(n * sizeof(*table));
+	vr->desc[i].flags = htobe16(VRING_DESC_F_INDIRECT);
+	vr->desc[i].next = 0;
+	vr->avail->ring[*availp % vr->num] = htobe16(i);
+	(*availp)++;
+	return (chain);
+}
+
+/*
+ * Make the posted chains available, and run the bus until the device has
+ * used them all.
+ */
+static void
+pismtest_vtblk_kick(pism_device_t *dev, struct vring *vr, uint16_t avail)
+{
+
+	vr->avail->idx = htobe16(avail);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_NOTIFY,
+	    0, 4);
+	while (be16toh(vr->used->idx) != avail)
+		pism_cycle_tick(PISM_BUSNO_PERIPHERAL);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_INTERRUPT_ACK,
+	    VIRTIO_MMIO_INT_VRING, 4);
+}
+
+/*
+ * Post and run a single DISCARD or WRITE_ZEROES, returning its status.
+ */
+static uint8_t
+pismtest_vtblk_range(uint8_t *mem, uint64_t gbase, pism_device_t *dev,
+    struct vring *vr, uint16_t *availp, int type, uint64_t sector,
+    uint32_t nsectors, uint32_t flags)
+{
+	struct pismtest_vtblk_chain *chain;
+
+	chain = pismtest_vtblk_post(mem, gbase, vr, availp, 0, type, sector,
+	    nsectors, flags);
+	pismtest_vtblk_kick(dev, vr, *availp);
+	return (chain->pvc_status);
+}
+
+/*
+ * Check that every byte of a run of sectors in the image is v.
+ */
+static bool
+pismtest_vtblk_is(int fd, uint64_t sector, u_int nsectors, uint8_t v)
+{
+	uint8_t buf[512];
+	u_int i, j;
+
+	for (i = 0; i < nsectors; i++) {
+		if (pread(fd, buf, sizeof(buf), (sector + i) * 512) !=
+		    sizeof(buf))
+			return (false);
+		for (j = 0; j < sizeof(buf); j++) {
+			if (buf[j] != v)
+				return (false);
+		}
+	}
+	return (true);
+}
+
+static void
+pismtest_vtblk_device(uint8_t *mem, pism_device_t *dev, u_int n, int fd)
+{
+	struct pismtest_vtblk_chain *chain[PISMTEST_VTBLK_DEPTH];
+	struct vring vr;
+	uint8_t buf[PISMTEST_BENCH_VTBLK_BLOCK];
+	uint64_t gbase, base, sector;
+	uint16_t avail;
+	u_int i, j;
+
+	gbase = PISMTEST_BENCH_VTBLK_RING + n * PISMTEST_BENCH_VTBLK_SPACING;
+	base = n * PISMTEST_VTBLK_RANGE;
+	assert((pismtest_bench_vtblk_read(dev->pd_base,
+	    VIRTIO_MMIO_HOST_FEATURES) & (VIRTIO_BLK_F_FLUSH |
+	    VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES)) ==
+	    (VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD |
+	    VIRTIO_BLK_F_WRITE_ZEROES));
+	assert(pismtest_bench_vtblk_read(dev->pd_base,
+	    VIRTIO_MMIO_QUEUE_NUM_MAX) >= PISMTEST_VTBLK_DEPTH);
+	memset(mem + gbase, 0, vring_size(PISMTEST_VTBLK_DEPTH,
+	    VIRTIO_MMIO_VRING_ALIGN));
+	vring_init(&vr, PISMTEST_VTBLK_DEPTH, mem + gbase,
+	    VIRTIO_MMIO_VRING_ALIGN);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_GUEST_FEATURES,
+	    VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_BLK_F_FLUSH |
+	    VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_SEL, 0, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_NUM,
+	    PISMTEST_VTBLK_DEPTH, 4);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_QUEUE_PFN,
+	    gbase >> 12, 4);
+	avail = 0;
+
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_DISCARD, base, 8, 0) == VIRTIO_BLK_S_OK);
+
+	/* Zero a run within a block, then whole blocks, unmapping them. */
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_WRITE_ZEROES, base + 100, 3, 0) == VIRTIO_BLK_S_OK);
+	assert(pismtest_vtblk_is(fd, base + 99, 1, PISMTEST_VTBLK_FILL));
+	assert(pismtest_vtblk_is(fd, base + 100, 3, 0));
+	assert(pismtest_vtblk_is(fd, base + 103, 1, PISMTEST_VTBLK_FILL));
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_WRITE_ZEROES, base + 256, 64,
+	    VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) == VIRTIO_BLK_S_OK);
+	assert(pismtest_vtblk_is(fd, base + 255, 1, PISMTEST_VTBLK_FILL));
+	assert(pismtest_vtblk_is(fd, base + 256, 64, 0));
+	assert(pismtest_vtblk_is(fd, base + 320, 1, PISMTEST_VTBLK_FILL));
+
+	/* DISCARD takes no flags, and WRITE_ZEROES only UNMAP. */
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_DISCARD, base, 8,
+	    VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) == VIRTIO_BLK_S_UNSUPP);
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_WRITE_ZEROES, base + 400, 1, 2) ==
+	    VIRTIO_BLK_S_UNSUPP);
+	assert(pismtest_vtblk_is(fd, base + 400, 1, PISMTEST_VTBLK_FILL));
+
+	/* Ranges running past the capacity are refused untouched. */
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_DISCARD, PISMTEST_VTBLK_SECTORS - 1, 2, 0) ==
+	    VIRTIO_BLK_S_IOERR);
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_WRITE_ZEROES, PISMTEST_VTBLK_SECTORS - 1, 2, 0) ==
+	    VIRTIO_BLK_S_IOERR);
+	assert(pismtest_vtblk_range(mem, gbase, dev, &vr, &avail,
+	    VIRTIO_BLK_T_WRITE_ZEROES, PISMTEST_VTBLK_SECTORS + 1, 0, 0) ==
+	    VIRTIO_BLK_S_IOERR);
+	assert(pismtest_vtblk_is(fd, PISMTEST_VTBLK_SECTORS - 1, 1,
+	    PISMTEST_VTBLK_FILL));
+
+	/*
+	 * A long WRITE_ZEROES and some writes, then a flush behind them, all
+	 * in one kick.  A flush to tmpfs is quick, so one that didn't wait
+	 * would finish first.
+	 */
+	chain[0] = pismtest_vtblk_post(mem, gbase, &vr, &avail, 0,
+	    VIRTIO_BLK_T_WRITE_ZEROES, PISMTEST_VTBLK_LONG * (n + 1),
+	    PISMTEST_VTBLK_LONG, 0);
+	for (i = 1; i < PISMTEST_VTBLK_DEPTH - 1; i++) {
+		memset(mem + gbase + PISMTEST_BENCH_VTBLK_BUFS +
+		    i * PISMTEST_BENCH_VTBLK_BLOCK, n * 16 + i,
+		    PISMTEST_BENCH_VTBLK_BLOCK);
+		chain[i] = pismtest_vtblk_post(mem, gbase, &vr, &avail, i,
+		    VIRTIO_BLK_T_OUT, base + 1024 + i * 8, 0, 0);
+	}
+	chain[i] = pismtest_vtblk_post(mem, gbase, &vr, &avail, i,
+	    VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+	pismtest_vtblk_kick(dev, &vr, avail);
+	assert(be32toh(vr.used->ring[(avail - 1) % PISMTEST_VTBLK_DEPTH].id) ==
+	    PISMTEST_VTBLK_DEPTH - 1);
+	for (i = 0; i < PISMTEST_VTBLK_DEPTH; i++)
+		assert(chain[i]->pvc_status == VIRTIO_BLK_S_OK);
+	assert(pismtest_vtblk_is(fd, PISMTEST_VTBLK_LONG * (n + 1),
+	    PISMTEST_VTBLK_LONG, 0));
+	for (i = 1; i < PISMTEST_VTBLK_DEPTH - 1; i++) {
+		sector = base + 1024 + i * 8;
+		assert(pread(fd, buf, sizeof(buf), sector * 512) ==
+		    sizeof(buf));
+		for (j = 0; j < sizeof(buf); j++)
+			assert(buf[j] == n * 16 + i);
+	}
+}
+
+static void
+pismtest_vtblk(void)
+{
+	char image[] = "/dev/shm/pismtest.XXXXXX";
+	uint8_t buf[PISMTEST_BENCH_VTBLK_BLOCK];
+	struct dram_private *dpp;
+	pism_device_t *dev;
+	off_t off;
+	u_int n;
+	int fd;
+
+	pismtest_bench_dram_attach();
+	pismtest_bench_vtblk_attach(image);
+	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
+	assert(dpp != NULL);
+	fd = open(image, O_RDWR);
+	assert(fd >= 0);
+	memset(buf, PISMTEST_VTBLK_FILL, sizeof(buf));
+	for (off = 0; off < PISMTEST_BENCH_VTBLK_IMAGE; off += sizeof(buf))
+		assert(pwrite(fd, buf, sizeof(buf), off) == sizeof(buf));
+	assert(fsync(fd) == 0);
+
+	n = 0;
+	SLIST_FOREACH(dev, g_pism_devices[PISM_BUSNO_PERIPHERAL], pd_next) {
+		assert(pism_dev_get_private(PISM_BUSNO_PERIPHERAL,
+		    dev->pd_name) != NULL);
+		pismtest_vtblk_device(dpp->dp_data, dev, n++, fd);
+	}
+	assert(n == 2);
+	close(fd);
+	unlink(image);
+}
+
+/*
+ * Give a synchronous device two queues, post a flush on each, and check that
+ * a notify services only the queue it names.  Notifies are 32-bit stores of
+ * the queue index, and with no workers the flush completes within the store.
+ */
+#define	PISMTEST_VTBLK_NOTIFY_QUEUES	2
+
+static const char pismtest_vtblk_notify_config[] =
+    "module virtio_block.so\n"
+    "device \"vtblk0\" {\n"
+    "	class virtio_block;\n"
+    "	addr 0x7f100000;\n"
+    "	length 0x200;\n"
+    "	irq 1;\n"
+    "	option path \"%s\";\n"
+    "	option workers \"0\";\n"
+    "	option queues \"2\";\n"
+    "};\n";
+
+static void
+pismtest_vtblk_notify(void)
+{
+	char image[] = "/tmp/pismtest.XXXXXX";
+	struct pismtest_vtblk_chain *chain[PISMTEST_VTBLK_NOTIFY_QUEUES];
+	struct vring vr[PISMTEST_VTBLK_NOTIFY_QUEUES];
+	struct dram_private *dpp;
+	pism_device_t *dev;
+	uint64_t gbase;
+	uint16_t avail;
+	u_int q;
+	int fd;
+
+	pismtest_bench_dram_attach();
+	fd = mkstemp(image);
+	assert(fd >= 0);
+	assert(ftruncate(fd, PISMTEST_BENCH_VTBLK_BLOCK) == 0);
+	close(fd);
+	assert(pismtest_attach(PISM_BUSNO_PERIPHERAL,
+	    pismtest_vtblk_notify_config, image));
+	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
+	assert(dpp != NULL);
+	dev = SLIST_FIRST(g_pism_devices[PISM_BUSNO_PERIPHERAL]);
+	assert(dev != NULL);
+
+	assert(pismtest_bench_vtblk_read(dev->pd_base,
+	    VIRTIO_MMIO_HOST_FEATURES) & VIRTIO_BLK_F_MQ);
+	pismtest_bench_vtblk_write(dev->pd_base, VIRTIO_MMIO_GUEST_FEATURES,
+	    VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_BLK_F_FLUSH |
+	    VIRTIO_BLK_F_MQ, 4);
+	for (q = 0; q < PISMTEST_VTBLK_NOTIFY_QUEUES; q++) {
+		gbase = PISMTEST_BENCH_VTBLK_RING +
+		    q * PISMTEST_BENCH_VTBLK_SPACING;
+		memset(dpp->dp_data + gbase, 0, vring_size(
+		    PISMTEST_VTBLK_DEPTH, VIRTIO_MMIO_VRING_ALIGN));
+		vring_init(&vr[q], PISMTEST_VTBLK_DEPTH,
+		    dpp->dp_data + gbase, VIRTIO_MMIO_VRING_ALIGN);
+		pismtest_bench_vtblk_write(dev->pd_base,
+		    VIRTIO_MMIO_QUEUE_SEL, q, 4);
+		pismtest_bench_vtblk_write(dev->pd_base,
+		    VIRTIO_MMIO_QUEUE_NUM, PISMTEST_VTBLK_DEPTH, 4);
+		pismtest_bench_vtblk_write(dev->pd_base,
+		    VIRTIO_MMIO_QUEUE_PFN, gbase >> 12, 4);
+		avail = 0;
+		chain[q] = pismtest_vtblk_post(dpp->dp_data, gbase, &vr[q],
+		    &avail, 0, VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+		vr[q].avail->idx = htobe16(avail);
+	}
+
+	/* Notify the last queue first; the other must be left alone. */
+	for (q = PISMTEST_VTBLK_NOTIFY_QUEUES; q-- > 0;) {
+		pismtest_bench_vtblk_write(dev->pd_base,
+		    VIRTIO_MMIO_QUEUE_NOTIFY, q, 4);
+		assert(be16toh(vr[q].used->idx) == 1);
+		assert(chain[q]->pvc_status == VIRTIO_BLK_S_OK);
+		if (q > 0) {
+			assert(be16toh(vr[0].used->idx) == 0);
+			assert(chain[0]->pvc_status == 0xff);
+		}
+	}
+	unlink(image);
+}
+
+/*
+ * Write across a block boundary through an overlay, and check that reads
+ * see the write over the base, that the base is untouched, and that the
+ * image can't grow.  Zero a range across the write, too.
+ */
+#define	PISMTEST_OVERLAY_LENGTH	(3 * 4096 + 512)
+
+static void
+pismtest_overlay(void)
+{
+	char base[] = "/tmp/pismtest.XXXXXX";
+	char delta[] = "/tmp/pismtest.XXXXXX";
+	uint8_t buf[PISMTEST_OVERLAY_LENGTH];
+	struct pism_overlay *po;
+	int fd, i;
+
+	fd = mkstemp(base);
+	assert(fd >= 0);
+	memset(buf, 0x55, sizeof(buf));
+	assert(write(fd, buf, sizeof(buf)) == sizeof(buf));
+	close(fd);
+	fd = mkstemp(delta);
+	assert(fd >= 0);
+	close(fd);
+
+	po = pism_overlay_open(base, delta, false);
+	assert(po != NULL);
+	assert(pism_overlay_length(po) == PISMTEST_OVERLAY_LENGTH);
+	memset(buf, 0xaa, 200);
+	assert(pism_overlay_pwrite(po, buf, 200, 4000) == 200);
+	assert(pism_overlay_pwrite(po, buf, 200, PISMTEST_OVERLAY_LENGTH -
+	    100) < 0);
+	assert(pism_overlay_pread(po, buf, sizeof(buf), 0) == sizeof(buf));
+	for (i = 0; i < PISMTEST_OVERLAY_LENGTH; i++)
+		assert(buf[i] == (i >= 4000 && i < 4200 ? 0xaa : 0x55));
+	assert(pism_overlay_pread(po, buf, 512, PISMTEST_OVERLAY_LENGTH -
+	    256) == 256);
+
+	/* Whole blocks are punched out of the delta, the ends written. */
+	assert(pism_overlay_zero(po, 100, 2 * 4096) == 0);
+	assert(pism_overlay_pread(po, buf, sizeof(buf), 0) == sizeof(buf));
+	for (i = 0; i < PISMTEST_OVERLAY_LENGTH; i++)
+		assert(buf[i] == (i >= 100 && i < 100 + 2 * 4096 ? 0 :
+		    i >= 4000 && i < 4200 ? 0xaa : 0x55));
+
+	fd = open(base, O_RDONLY);
+	assert(fd >= 0);
+	assert(pread(fd, buf, sizeof(buf), 0) == sizeof(buf));
+	close(fd);
+	for (i = 0; i < PISMTEST_OVERLAY_LENGTH; i++)
+		assert(buf[i] == 0x55);
+	unlink(base);
+}
+
+static void
+pismtest_bench(void)
+{
+
+	pismtest_bench_lookup(1);
+	pismtest_bench_lookup(8);
+	pismtest_bench_lookup(64);
+	pismtest_bench_burst();
+	pismtest_bench_cache();
+	pismtest_bench_timing();
+	pismtest_bench_dram();
+	pismtest_bench_vtblk();
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: pismtest [-b]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char ckpt[64];
+	uint64_t cycle;
+	int ch, ret;
+	uint8_t b;
+	bool bflag;
+
+	bflag = false;
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			bflag = true;
+			break;
+
+		default:
+			usage();
+		}
+	}
+	if (bflag) {
+		pismtest_bench();
+		exit(0);
+	}
+
+	pismtest_run("elf", pismtest_elf);
+	pismtest_run("elf_truncated", pismtest_elf_truncated);
+	pismtest_run("fork", pismtest_fork);
+	pismtest_run("slot_depth", pismtest_slot_depth);
+	pismtest_run("slot_ordered", pismtest_slot_ordered);
+	pismtest_run("slot_tagged", pismtest_slot_tagged);
+	pismtest_run("timer", pismtest_timer);
+	pismtest_run("cache", pismtest_cache);
+	pismtest_run("timing", pismtest_timing);
+	pismtest_run("poison", pismtest_poison);
+	pismtest_run("uart", pismtest_uart);
+	pismtest_run("vtblk", pismtest_vtblk);
+	pismtest_run("vtblk_notify", pismtest_vtblk_notify);
+
+	assert(pism_init(PISM_BUSNO_MEMORY));
+	assert(pism_init(PISM_BUSNO_PERIPHERAL));
+
+	/*
+	 * Write a byte to the UART.
+	 *
+	 * XXXRW: It would be quite nice if we coudl configure the UART to
+	 * output to a pipe so that we could read the pipe and check the byte.
+	 */
+	ret = pismtest_mem_store8(PISM_BUSNO_PERIPHERAL, 0x7f000000, 0x52);
+	assert(ret == PISMTEST_SUCCESS);
+ 
+	/*
+	 * Attempt to store, and then fetch, a byte from DRAM.
+	 */
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x10000, 0x5e);
+	assert(ret == PISMTEST_SUCCESS);
+
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x10000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0x5e);
+
+	/*
+	 * A whole-line store sets the line's tag, and a partial store to the
+	 * line clears it.
+	 */
+	ret = pismtest_mem_store_line(PISM_BUSNO_MEMORY, 0x30000, 1);
+	assert(ret == PISMTEST_SUCCESS);
+	ret = pismtest_mem_fetch_captag(PISM_BUSNO_MEMORY, 0x30000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 1);
+	ret = pismtest_mem_fetch_captag(PISM_BUSNO_MEMORY, 0x30020, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0);
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x30004, 0x33);
+	assert(ret == PISMTEST_SUCCESS);
+	ret = pismtest_mem_fetch_captag(PISM_BUSNO_MEMORY, 0x30000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0);
+	ret = pismtest_mem_store_line(PISM_BUSNO_MEMORY, 0x30000, 1);
+	assert(ret == PISMTEST_SUCCESS);
+
+	/*
+	 * Checkpoint, scribble on DRAM, and check that restoring puts back
+	 * the data, the tags and the cycle count.
+	 */
+	snprintf(ckpt, sizeof(ckpt), "/tmp/pismtest.%d.ckpt", getpid());
+	cycle = pism_cycle_count_get(PISM_BUSNO_MEMORY);
+	assert(pism_checkpoint_save(ckpt));
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x10000, 0x11);
+	assert(ret == PISMTEST_SUCCESS);
+	ret = pismtest_mem_store8(PISM_BUSNO_MEMORY, 0x20000, 0x22);
+	assert(ret == PISMTEST_SUCCESS);
+	ret = pismtest_mem_store_line(PISM_BUSNO_MEMORY, 0x30000, 0);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(pism_checkpoint_restore(ckpt));
+	unlink(ckpt);
+	assert(pism_cycle_count_get(PISM_BUSNO_MEMORY) == cycle);
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x10000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0x5e);
+	ret = pismtest_mem_fetch8(PISM_BUSNO_MEMORY, 0x20000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 0x00);
+	ret = pismtest_mem_fetch_captag(PISM_BUSNO_MEMORY, 0x30000, &b);
+	assert(ret == PISMTEST_SUCCESS);
+	assert(b == 1);
+
+	pismtest_overlay();
 
 	exit(0);
 }
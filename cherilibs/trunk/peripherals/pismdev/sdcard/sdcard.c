@@ -69,6 +69,9 @@ static pism_dev_request_put_t		sdcard_dev_request_put;
 static pism_dev_response_ready_t	sdcard_dev_response_ready;
 static pism_dev_response_get_t		sdcard_dev_response_get;
 static pism_dev_addr_valid_t		sdcard_dev_addr_valid;
+static pism_dev_checkpoint_t		sdcard_dev_checkpoint;
+static pism_dev_restore_t		sdcard_dev_restore;
+static pism_dev_fork_t			sdcard_dev_fork;
 
 /*
  * I/O register/buffer offsets, from Table 4.1.1 in the Altera University
@@ -182,7 +185,8 @@ static pism_dev_addr_valid_t		sdcard_dev_addr_valid;
  * need to actually be a FIFO, and the reply cycle will be per-entry.
  */
 struct sdcard_private {
-	int		 sdp_imagefile;		/* Image file. */
+	int		 sdp_imagefile;		/* Image file, or -1. */
+	struct pism_overlay	*sdp_overlay;	/* Or copy-on-write. */
 	uint64_t	 sdp_length;		/* Image file length. */
 	pism_data_t	 sdp_reqfifo;
 	bool		 sdp_reqfifo_empty;
@@ -206,22 +210,13 @@ struct sdcard_private {
 #define	SDCARD_OPTION_PATH	"path"	/* File system path to memory map. */
 #define	SDCARD_OPTION_DELAY	"delay"	/* Cycles each read takes. */
 #define	SDCARD_OPTION_READONLY	"readonly"	/* Read-only. */
+#define	SDCARD_OPTION_OVERLAY	"overlay"	/* Delta for path. */
+#define	SDCARD_OPTION_OVERLAY_COMMIT	"overlay_commit" /* Keep writes. */
 
 #define	SDCARD_DELAY_DEFAULT	1
 #define	SDCARD_DELAY_MINIMUM	1
 #define	SDCARD_DELAY_MAXIMUM	UINT_MAX
 
-static char		*g_sdcard_debug = NULL;
-
-#define	DDBG(...)	do	{		\
-	if (g_sdcard_debug == NULL) {		\
-		break;				\
-	}					\
-	printf("%s(%d): ", __func__, __LINE__);	\
-	printf(__VA_ARGS__);			\
-	printf("\n");				\
-} while (0)
-
 #define	ROUNDUP(x, y)	((((x) + (y) - 1)/(y)) * (y))
 
 static void
@@ -319,11 +314,6 @@ static bool
 sdcard_mod_init(pism_module_t *mod)
 {
 
-	DDBG("called");
-
-	g_sdcard_debug = getenv("CHERI_DEBUG_SDCARD");
-
-	DDBG("returned");
 	return (true);
 }
 
@@ -333,15 +323,14 @@ sdcard_dev_init(pism_device_t *dev)
 	struct stat sb;
 	struct sdcard_private *sdpp;
 	const char *option_path, *option_delay, *option_readonly;
+	const char *option_overlay, *option_commit;
+	struct pism_overlay *po;
 	uint64_t length;
 	uint16_t c_size;
 	uint8_t csd_structure, c_size_mult, read_bl_len;
 	long long delayll;
 	int delay, fd, open_flags;
-	bool readonly;
-
-	DDBG("called for mapping at %jx, length %jx", dev->pd_base,
-	    dev->pd_length);
+	bool readonly, commit;
 
 	assert(dev->pd_base % PISM_DATA_BYTES == 0);
 	assert(dev->pd_length % PISM_DATA_BYTES == 0);
@@ -357,6 +346,12 @@ sdcard_dev_init(pism_device_t *dev)
 	if (!(pism_device_option_get(dev, SDCARD_OPTION_READONLY,
 	    &option_readonly)))
 		option_readonly = NULL;
+	if (!(pism_device_option_get(dev, SDCARD_OPTION_OVERLAY,
+	    &option_overlay)))
+		option_overlay = NULL;
+	if (!(pism_device_option_get(dev, SDCARD_OPTION_OVERLAY_COMMIT,
+	    &option_commit)))
+		option_commit = NULL;
 	if (option_path == NULL) {
 		warnx("%s: option path required on device %s", __func__,
 		    dev->pd_name);
@@ -393,6 +388,15 @@ sdcard_dev_init(pism_device_t *dev)
 		}
 	} else
 		readonly = false;
+	if (option_commit != NULL) {
+		if (!pism_device_option_parse_bool(dev, option_commit,
+		    &commit)) {
+			warnx("%s: invalid overlay_commit option on device %s",
+			    __func__, dev->pd_name);
+			return (false);
+		}
+	} else
+		commit = false;
 
 	/*
 	 * Although we might restrict SD Card access to read-only, the SD Card
@@ -402,27 +406,39 @@ sdcard_dev_init(pism_device_t *dev)
 	 */
 	assert(dev->pd_perms &
 	    (PISM_PERM_ALLOW_FETCH | PISM_PERM_ALLOW_STORE));
-	if (readonly)
-		open_flags = O_RDONLY;
-	else
-		open_flags = O_RDWR;
-	fd = open(option_path, open_flags);
-	if (fd < 0) {
-		warn("%s: open of %s failed on device %s", __func__,
-		    option_path, dev->pd_name);
-		return (false);
+	if (option_overlay != NULL) {
+		po = pism_overlay_open(option_path, option_overlay, commit);
+		if (po == NULL) {
+			warnx("%s: overlay of %s failed on device %s",
+			    __func__, option_path, dev->pd_name);
+			return (false);
+		}
+		fd = -1;
+		sb.st_size = pism_overlay_length(po);
+	} else {
+		po = NULL;
+		if (readonly)
+			open_flags = O_RDONLY;
+		else
+			open_flags = O_RDWR;
+		fd = open(option_path, open_flags);
+		if (fd < 0) {
+			warn("%s: open of %s failed on device %s", __func__,
+			    option_path, dev->pd_name);
+			return (false);
+		}
+		if (fstat(fd, &sb) < 0) {
+			warn("%s: fstat of %s failed on device %s", __func__,
+			    option_path, dev->pd_name);
+			close(fd);
+			return (false);
+		}
 	}
 
 	/*
 	 * We can't handle live resize on SD Card images, and support only
 	 * even multiples of 512 byte sector-size.
 	 */
-	if (fstat(fd, &sb) < 0) {
-		warn("%s: fstat of %s failed on device %s", __func__,
-		    option_path, dev->pd_name);
-		close(fd);
-		return (false);
-	}
 	length = sb.st_size;
 	if (length > ALTERA_SDCARD_MAXSIZE) {
 		warnx("%s: truncating image from %ju to maximum SD Card size "
@@ -445,11 +461,16 @@ sdcard_dev_init(pism_device_t *dev)
 	sdpp = calloc(1, sizeof(*sdpp));
 	if (sdpp == NULL) {
 		warn("%s: calloc", __func__);
-		close(fd);
+		if (po != NULL)
+			pism_overlay_close(po);
+		if (fd >= 0)
+			close(fd);
 		return (false);
 	}
 	sdpp->sdp_imagefile = fd;
+	sdpp->sdp_overlay = po;
 	sdpp->sdp_delay = delay;
+	sdpp->sdp_readonly = readonly;
 	sdpp->sdp_reqfifo_empty = true;
 	dev->pd_private = sdpp;
 	sdpp->sdp_length = length;
@@ -483,7 +504,7 @@ sdcard_dev_init(pism_device_t *dev)
 	c_size_mult = 7;			/* Up to 2G disk sizes. */
 	sdcard_csd_set(sdpp, csd_structure, read_bl_len, c_size, c_size_mult);
 
-	DDBG("returned");
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, true);
 	return (true);
 }
 
@@ -517,9 +538,14 @@ sdcard_cmd_read(struct sdcard_private *sdpp)
 		sdcard_rr1_set(sdpp, ALTERA_SDCARD_RR1_ADDRBLOCKRANGE);
 		return;
 	}
-	len = pread(sdpp->sdp_imagefile,
-	    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
-	    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
+	if (sdpp->sdp_overlay != NULL)
+		len = pism_overlay_pread(sdpp->sdp_overlay,
+		    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
+		    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
+	else
+		len = pread(sdpp->sdp_imagefile,
+		    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
+		    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
 	if (len != ALTERA_SDCARD_SECTORSIZE) {
 		sdcard_asr_setbits(sdpp, ALTERA_SDCARD_ASR_CMDDATAERROR);
 		return;
@@ -563,9 +589,14 @@ sdcard_cmd_write(struct sdcard_private *sdpp)
 		sdcard_rr1_set(sdpp, ALTERA_SDCARD_RR1_ILLEGALCOMMAND);
 		return;
 	}
-	len = pwrite(sdpp->sdp_imagefile,
-	    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
-	    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
+	if (sdpp->sdp_overlay != NULL)
+		len = pism_overlay_pwrite(sdpp->sdp_overlay,
+		    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
+		    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
+	else
+		len = pwrite(sdpp->sdp_imagefile,
+		    &sdpp->sdp_data[ALTERA_SDCARD_OFF_RXTX_BUFFER],
+		    ALTERA_SDCARD_SECTORSIZE, cmd_arg);
 	if (len != ALTERA_SDCARD_SECTORSIZE) {
 		sdcard_asr_setbits(sdpp, ALTERA_SDCARD_ASR_CMDDATAERROR);
 		return;
@@ -624,8 +655,6 @@ sdcard_dev_request_ready(pism_device_t *dev, pism_data_t *req)
 {
 	struct sdcard_private *sdpp;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -648,8 +677,6 @@ sdcard_dev_request_put(pism_device_t *dev, pism_data_t *req)
 	uint64_t addr;
 	int i;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -677,8 +704,6 @@ sdcard_dev_request_put(pism_device_t *dev, pism_data_t *req)
 	default:
 		assert(0);
 	}
-
-	DDBG("returned");
 }
 
 static bool
@@ -687,8 +712,6 @@ sdcard_dev_response_ready(pism_device_t *dev)
 	struct sdcard_private *sdpp;
 	bool ret;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -700,8 +723,6 @@ sdcard_dev_response_ready(pism_device_t *dev)
 		ret = !sdpp->sdp_reqfifo_empty;
 	else
 		ret = false;
-
-	DDBG("returned - %d", ret);
 	return (ret);
 }
 
@@ -713,8 +734,6 @@ sdcard_dev_response_get(pism_device_t *dev)
 	uint64_t addr;
 	int i;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -754,10 +773,73 @@ sdcard_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
 	return (true);
 }
 
+/*
+ * The card image is not saved: blocks written since the checkpoint was taken
+ * remain in it after a restore.  An overlay's delta is saved, though, so a
+ * card with one is restored as it was.
+ */
+static bool
+sdcard_dev_checkpoint(pism_device_t *dev, FILE *fp)
+{
+	struct sdcard_private *sdpp;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	return (pism_checkpoint_write(fp, &sdpp->sdp_reqfifo,
+	    sizeof(sdpp->sdp_reqfifo)) &&
+	    pism_checkpoint_write(fp, &sdpp->sdp_reqfifo_empty,
+	    sizeof(sdpp->sdp_reqfifo_empty)) &&
+	    pism_checkpoint_write(fp, &sdpp->sdp_replycycle,
+	    sizeof(sdpp->sdp_replycycle)) &&
+	    pism_checkpoint_write(fp, sdpp->sdp_data,
+	    sizeof(sdpp->sdp_data)) &&
+	    pism_overlay_checkpoint(sdpp->sdp_overlay, fp));
+}
+
+static bool
+sdcard_dev_restore(pism_device_t *dev, FILE *fp)
+{
+	struct sdcard_private *sdpp;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	return (pism_checkpoint_read(fp, &sdpp->sdp_reqfifo,
+	    sizeof(sdpp->sdp_reqfifo)) &&
+	    pism_checkpoint_read(fp, &sdpp->sdp_reqfifo_empty,
+	    sizeof(sdpp->sdp_reqfifo_empty)) &&
+	    pism_checkpoint_read(fp, &sdpp->sdp_replycycle,
+	    sizeof(sdpp->sdp_replycycle)) &&
+	    pism_checkpoint_read(fp, sdpp->sdp_data,
+	    sizeof(sdpp->sdp_data)) &&
+	    pism_overlay_restore(sdpp->sdp_overlay, fp));
+}
+
+/*
+ * Writable cards move to a per-child delta or image; see
+ * pism_overlay_fork_image().
+ */
+static bool
+sdcard_dev_fork(pism_device_t *dev, int child)
+{
+	struct sdcard_private *sdpp;
+	const char *option_path;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	if (sdpp->sdp_readonly)
+		return (true);
+	if (!pism_device_option_get(dev, SDCARD_OPTION_PATH, &option_path))
+		assert(0);
+	return (pism_overlay_fork_image(dev, sdpp->sdp_overlay, option_path,
+	    &sdpp->sdp_imagefile));
+}
+
 static const char *sdcard_option_list[] = {
 	SDCARD_OPTION_PATH,
 	SDCARD_OPTION_DELAY,
 	SDCARD_OPTION_READONLY,
+	SDCARD_OPTION_OVERLAY,
+	SDCARD_OPTION_OVERLAY_COMMIT,
 	NULL
 };
 
@@ -771,4 +853,7 @@ PISM_MODULE_INFO(sdcard_module) = {
 	.pm_dev_response_ready = sdcard_dev_response_ready,
 	.pm_dev_response_get = sdcard_dev_response_get,
 	.pm_dev_addr_valid = sdcard_dev_addr_valid,
+	.pm_dev_checkpoint = sdcard_dev_checkpoint,
+	.pm_dev_restore = sdcard_dev_restore,
+	.pm_dev_fork = sdcard_dev_fork,
 };
@@ -27,6 +27,7 @@
  *
  * @BERI_LICENSE_HEADER_END@
  */
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
@@ -41,8 +42,11 @@
 #elif (__FreeBSD__)
 #include <sys/endian.h>
 #endif
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,6 +65,38 @@ static pism_dev_request_put_t		uart_dev_request_put;
 static pism_dev_response_ready_t	uart_dev_response_ready;
 static pism_dev_response_get_t		uart_dev_response_get;
 static pism_dev_addr_valid_t		uart_dev_addr_valid;
+static pism_dev_checkpoint_t		uart_dev_checkpoint;
+static pism_dev_restore_t		uart_dev_restore;
+static pism_dev_quiesce_t		uart_dev_quiesce;
+static pism_dev_fork_t			uart_dev_fork;
+
+/*-
+ * Host I/O for each UART other than type null is done by a thread of its
+ * own, so that the simulator makes no system calls to move a byte.  The
+ * thread reads input into the RX ring as it arrives, accepts connections on
+ * a listen socket, and writes out the TX ring in batches: the simulator
+ * wakes it through a pipe when a newline is stored or UART_TX_THRESHOLD
+ * bytes are waiting, and it otherwise wakes every UART_TX_FLUSH_MS.
+ *
+ * Each ring has a single producer and a single consumer.  Indices run freely
+ * and are masked on use; each is written only by its own side, with release
+ * semantics, and read by the other with acquire semantics.  Once the thread
+ * is running it owns the file descriptors; the simulator reads only
+ * up_fdoutput, to see whether a socket is connected.
+ *
+ * Threads don't survive fork(), so all are stopped, with their output
+ * flushed, before any fork and at exit, and restarted by the simulator when
+ * it next touches the UART.  Checkpoints stop them in the same way.
+ */
+#define	UART_RING_SIZE		4096	/* Power of two. */
+#define	UART_TX_THRESHOLD	256
+#define	UART_TX_FLUSH_MS	10
+
+struct uart_ring {
+	uint32_t	ur_head;	/* Next byte written, by producer. */
+	uint32_t	ur_tail;	/* Next byte read, by consumer. */
+	uint8_t		ur_buf[UART_RING_SIZE];
+};
 
 struct uart_private {
 	struct pism_device	*up_dev;	/* Associated PISM device. */
@@ -71,22 +107,16 @@ struct uart_private {
 	uint32_t	up_control;		/* Control register. */
 	pism_data_t	up_reqfifo;		/* 1-element FIFO. */
 	bool		up_reqfifo_empty;
+	struct uart_ring up_rx;			/* Filled by I/O thread. */
+	struct uart_ring up_tx;			/* Drained by I/O thread. */
+	pthread_t	up_thread;
+	bool		up_io_running;		/* up_thread exists. */
+	bool		up_io_stop;		/* Thread should exit. */
+	bool		up_io_kicked;		/* Wakeup pending. */
+	bool		up_rx_eof;		/* Input at end of file. */
+	int		up_wakefd[2];		/* Pipe to wake thread. */
 };
 
-static char *g_uart_debug = NULL;
-#define	UDBG(upp, ...)	do {						\
-	if (g_uart_debug == NULL) {					\
-		break;							\
-	}								\
-	if (upp != NULL)						\
-		printf("%s(%d): %s ", __func__, __LINE__,		\
-		    upp->up_dev->pd_name);				\
-	else								\
-		printf("%s(%d): ", __func__, __LINE__);			\
-	printf(__VA_ARGS__);						\
-	printf("\n");							\
-} while (0)
-
 /*
  * UART-specific option names.
  */
@@ -162,11 +192,18 @@ static char *g_uart_debug = NULL;
 	(ALTERA_JTAG_UART_CONTROL_RE | ALTERA_JTAG_UART_CONTROL_WE |	\
 	    ALTERA_JTAG_UART_CONTROL_AC)
 
+static void	uart_io_stop_all(void);
+
 static bool
 uart_mod_init(pism_module_t *mod)
 {
+	int error;
 
-	g_uart_debug = getenv("CHERI_DEBUG_UART");
+	if (atexit(uart_io_stop_all) != 0)
+		warnx("%s: atexit failed", __func__);
+	error = pthread_atfork(uart_io_stop_all, NULL, NULL);
+	if (error != 0)
+		warnx("%s: pthread_atfork: %s", __func__, strerror(error));
 	return (true);
 }
 
@@ -190,13 +227,69 @@ uart_str_to_type(const char *str, int *typep)
 	return (false);
 }
 
+/*
+ * Open an output file or listen socket, returning -1 on failure.
+ */
+static int
+uart_dev_file_open(pism_device_t *dev, const char *path, bool append_flag)
+{
+	int fd, open_flags;
+
+	open_flags = O_WRONLY | O_CREAT;
+	if (append_flag)
+		open_flags |= O_APPEND;
+	else
+		open_flags |= O_TRUNC;
+	fd = open(path, open_flags, 0600);
+	if (fd < 0)
+		warn("%s: open of %s failed on device %s", __func__, path,
+		    dev->pd_name);
+	return (fd);
+}
+
+static int
+uart_dev_socket_open(pism_device_t *dev, const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	/* BSD-only: sun.sun_len = sizeof(sun); */
+	sun.sun_family = AF_LOCAL;
+	if (strlen(path) + 1 > sizeof(sun.sun_path)) {
+		warnx("%s: path too long on device %s", __func__,
+		    dev->pd_name);
+		return (-1);
+	}
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path));
+	(void)unlink(path);
+	fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+	if (fd < 0) {
+		warn("%s: socket failed on device %s", __func__,
+		    dev->pd_name);
+		return (-1);
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		warn("%s: bind failed on path %s device %s", __func__, path,
+		    dev->pd_name);
+		close(fd);
+		return (-1);
+	}
+	if (listen(fd, -1) < 0) {
+		warn("%s: listen failed on path %s device %s", __func__,
+		    path, dev->pd_name);
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
 static bool
 uart_dev_init(pism_device_t *dev)
 {
 	struct uart_private *upp;
-	struct sockaddr_un sun;
 	const char *option_type, *option_path, *option_append;
-	int fd, open_flags, uart_type;
+	int fd, uart_type;
 	bool append_flag, ret;
 
 	assert(dev->pd_base % PISM_DATA_BYTES == 0);
@@ -264,15 +357,8 @@ uart_dev_init(pism_device_t *dev)
 		break;
 
 	case UART_TYPE_FILE:
-		open_flags = O_WRONLY | O_CREAT;
-		if (append_flag)
-			open_flags |= O_APPEND;
-		else
-			open_flags |= O_TRUNC;
-		fd = open(option_path, open_flags, 0600);
+		fd = uart_dev_file_open(dev, option_path, append_flag);
 		if (fd < 0) {
-			warn("%s: open of %s failed on device %s", __func__,
-			    option_path, dev->pd_name);
 			free(upp);
 			upp = NULL;
 			ret = false;
@@ -284,42 +370,8 @@ uart_dev_init(pism_device_t *dev)
 		break;
 
 	case UART_TYPE_SOCKET:
-		(void)unlink(option_path);
-		fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+		fd = uart_dev_socket_open(dev, option_path);
 		if (fd < 0) {
-			warn("%s: socket failed on device %s", __func__,
-			    dev->pd_name);
-			free(upp);
-			upp = NULL;
-			ret = false;
-			goto out;
-		}
-		memset(&sun, 0, sizeof(sun));
-		/* BSD-only: sun.sun_len = sizeof(sun); */
-		sun.sun_family = AF_LOCAL;
-		if (strlen(option_path) + 1 > sizeof(sun.sun_path)) {
-			warnx("%s: path too long on device %s", __func__,
-			    dev->pd_name);
-			close(fd);
-			free(upp);
-			upp = NULL;
-			ret = false;
-			goto out;
-		}
-		strncpy(sun.sun_path, option_path, sizeof(sun.sun_path));
-		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
-			warn("%s: bind failed on path %s device %s",
-			    option_path, __func__, dev->pd_name);
-			close(fd);
-			free(upp);
-			upp = NULL;
-			ret = false;
-			goto out;
-		}
-		if (listen(fd, -1) < 0) {
-			warn("%s: listen failed on path %s device %s",
-			    option_path, __func__, dev->pd_name);
-			close(fd);
 			free(upp);
 			upp = NULL;
 			ret = false;
@@ -341,39 +393,60 @@ uart_dev_init(pism_device_t *dev)
 	dev->pd_private = upp;
 
 out:
-	UDBG(upp, "returned - %d", ret);
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, ret);
 	return (ret);
 }
 
 /*
- * When we simulate a UART using a socket, we potentially need to accept
- * connections, etc.  Implement this centrally.
+ * Ring operations.  uart_ring_used() and uart_ring_space() may be called by
+ * either side, and are exact for the caller's own purposes.
  */
-static void
-uart_dev_listensock_poll(struct uart_private *upp)
+static inline uint32_t
+uart_ring_used(struct uart_ring *ur)
 {
-	struct pollfd pollfd;
-	int nfds;
 
-	if (upp->up_fdinput != -1)
-		return;
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = upp->up_listensock;
-	pollfd.events = POLLIN;
-	nfds = poll(&pollfd, 1, 0);
-	if (nfds < 0)
-		err(1, "%s: poll on listen socket", __func__);
-	if (nfds == 0)
-		return;
-	assert(pollfd.revents == POLLIN);
-	upp->up_fdinput = upp->up_fdoutput = accept(upp->up_listensock, NULL,
-	    NULL);
-	assert(upp->up_fdinput != -1);
+	return (__atomic_load_n(&ur->ur_head, __ATOMIC_ACQUIRE) -
+	    __atomic_load_n(&ur->ur_tail, __ATOMIC_ACQUIRE));
+}
+
+static inline uint32_t
+uart_ring_space(struct uart_ring *ur)
+{
+
+	return (UART_RING_SIZE - uart_ring_used(ur));
+}
+
+static inline bool
+uart_ring_put(struct uart_ring *ur, uint8_t b)
+{
+	uint32_t head;
+
+	head = __atomic_load_n(&ur->ur_head, __ATOMIC_RELAXED);
+	if (head - __atomic_load_n(&ur->ur_tail, __ATOMIC_ACQUIRE) ==
+	    UART_RING_SIZE)
+		return (false);
+	ur->ur_buf[head % UART_RING_SIZE] = b;
+	__atomic_store_n(&ur->ur_head, head + 1, __ATOMIC_RELEASE);
+	return (true);
+}
+
+static inline bool
+uart_ring_get(struct uart_ring *ur, uint8_t *bp)
+{
+	uint32_t tail;
+
+	tail = __atomic_load_n(&ur->ur_tail, __ATOMIC_RELAXED);
+	if (tail == __atomic_load_n(&ur->ur_head, __ATOMIC_ACQUIRE))
+		return (false);
+	*bp = ur->ur_buf[tail % UART_RING_SIZE];
+	__atomic_store_n(&ur->ur_tail, tail + 1, __ATOMIC_RELEASE);
+	return (true);
 }
 
 /*
  * When we simulate a UART using a socket and something goes wrong, use this
- * centralised connection close routine.
+ * centralised connection close routine.  Called by the I/O thread, or with
+ * it stopped.
  */
 static void
 uart_dev_socket_cleanup(struct uart_private *upp)
@@ -382,182 +455,261 @@ uart_dev_socket_cleanup(struct uart_private *upp)
 	assert(upp->up_fdinput == upp->up_fdoutput);
 	assert(upp->up_fdinput != -1);
 	close(upp->up_fdinput);
-	upp->up_fdinput = upp->up_fdoutput = -1;
+	upp->up_fdinput = -1;
+	__atomic_store_n(&upp->up_fdoutput, -1, __ATOMIC_RELEASE);
 }
 
 /*
- * Per-class ready and fetch routines -- return true if *bp is valid, false
- * otherwise.
+ * Read as much input as fits in the RX ring.  Files, including stdin when
+ * redirected, always poll as readable, so stop at end of file rather than
+ * spin.
  */
-static bool
-uart_dev_file_fetch(struct uart_private *upp, uint8_t *bp)
+static void
+uart_io_read(struct uart_private *upp)
 {
-	struct pollfd pollfd;
-	ssize_t len;
-	uint8_t b;
-	int nfds;
-
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = upp->up_fdinput;
-	pollfd.events = POLLIN;
-	nfds = poll(&pollfd, 1, 0);
-	if (nfds < 0)
-		err(1, "%s: poll", __func__);
-
-	/*
-	 * Note that files return POLLIN and also EOF, so handle that.
-	 */
-	if (nfds == 0 || !(pollfd.revents & POLLIN))
-		return (false);
-	len = read(upp->up_fdinput, &b, sizeof(b));
-	if (len < 0)
-		err(1, "%s: read", __func__);
+	struct uart_ring *ur;
+	uint32_t head, len;
+	ssize_t n;
+
+	ur = &upp->up_rx;
+	head = __atomic_load_n(&ur->ur_head, __ATOMIC_RELAXED);
+	len = uart_ring_space(ur);
+	if (len > UART_RING_SIZE - head % UART_RING_SIZE)
+		len = UART_RING_SIZE - head % UART_RING_SIZE;
 	if (len == 0)
-		return (false);
-	*bp = b;
-	return (true);
+		return;
+	n = read(upp->up_fdinput, &ur->ur_buf[head % UART_RING_SIZE], len);
+	if (n > 0) {
+		__atomic_store_n(&ur->ur_head, head + n, __ATOMIC_RELEASE);
+		return;
+	}
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (upp->up_type == UART_TYPE_SOCKET)
+		uart_dev_socket_cleanup(upp);
+	else
+		upp->up_rx_eof = true;
 }
 
-bool
-uart_dev_file_fetch_ready(struct uart_private *upp)
+/*
+ * Write out everything in the TX ring, discarding it if a socket has no
+ * connection to take it.
+ */
+static void
+uart_io_flush(struct uart_private *upp)
 {
-	struct pollfd pollfd;
-	int nfds;
+	struct uart_ring *ur;
+	uint32_t tail, len;
+	ssize_t n;
+
+	ur = &upp->up_tx;
+	while ((len = uart_ring_used(ur)) != 0) {
+		tail = __atomic_load_n(&ur->ur_tail, __ATOMIC_RELAXED);
+		if (len > UART_RING_SIZE - tail % UART_RING_SIZE)
+			len = UART_RING_SIZE - tail % UART_RING_SIZE;
+		switch (upp->up_type) {
+		case UART_TYPE_FILE:
+		case UART_TYPE_STDIO:
+			n = write(upp->up_fdoutput,
+			    &ur->ur_buf[tail % UART_RING_SIZE], len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				n = len;	/* As before, drop on error. */
+			break;
 
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = upp->up_fdinput;
-	pollfd.events = POLLIN;
-	nfds = poll(&pollfd, 1, 0);
-	if (nfds < 0)
-		err(1, "%s: poll", __func__);
+		case UART_TYPE_SOCKET:
+			if (upp->up_fdoutput == -1) {
+				n = len;
+				break;
+			}
+			n = send(upp->up_fdoutput,
+			    &ur->ur_buf[tail % UART_RING_SIZE], len,
+			    MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				uart_dev_socket_cleanup(upp);
+				n = len;
+			}
+			break;
 
-	/*
-	 * Note that files return POLLIN and also EOF, so handle that.
-	 */
-	if (nfds == 0 || !(pollfd.revents & POLLIN))
-		return (false);
-	return (true);
+		default:
+			assert(0);
+		}
+		__atomic_store_n(&ur->ur_tail, tail + n, __ATOMIC_RELEASE);
+	}
 }
 
-static bool
-uart_dev_socket_fetch(struct uart_private *upp, uint8_t *bp)
+static void *
+uart_io_thread(void *arg)
 {
-	struct pollfd pollfd;
-	ssize_t len;
-	uint8_t b;
-	int nfds;
-
-	uart_dev_listensock_poll(upp);
-	if (upp->up_fdinput == -1)
-		return (false);
-
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = upp->up_fdinput;
-	pollfd.events = POLLIN;
-	nfds = poll(&pollfd, 1, 0);
-	if (nfds < 0)
-		err(1, "%s: poll", __func__);
-	if (nfds == 0)
-		return (false);
-	if (pollfd.revents & POLLIN) {
-		len = read(upp->up_fdinput, &b, sizeof(b));
-		if (len == sizeof(b)) {
-			*bp = b;
-			return (true);
+	struct uart_private *upp;
+	struct pollfd pollfds[2];
+	char buf[64];
+	nfds_t nfds;
+	int fd, in;
+	bool stop;
+
+	upp = arg;
+	for (;;) {
+		memset(pollfds, 0, sizeof(pollfds));
+		pollfds[0].fd = upp->up_wakefd[0];
+		pollfds[0].events = POLLIN;
+		nfds = 1;
+		in = -1;
+		if (upp->up_fdinput == -1 && upp->up_listensock != -1) {
+			in = nfds++;
+			pollfds[in].fd = upp->up_listensock;
+			pollfds[in].events = POLLIN;
+		} else if (upp->up_fdinput != -1 && !upp->up_rx_eof &&
+		    uart_ring_space(&upp->up_rx) != 0) {
+			in = nfds++;
+			pollfds[in].fd = upp->up_fdinput;
+			pollfds[in].events = POLLIN;
 		}
+		if (poll(pollfds, nfds, UART_TX_FLUSH_MS) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "%s: poll", __func__);
+		}
+		if (pollfds[0].revents & POLLIN) {
+			__atomic_store_n(&upp->up_io_kicked, false,
+			    __ATOMIC_RELEASE);
+			while (read(upp->up_wakefd[0], buf, sizeof(buf)) > 0)
+				continue;
+		}
+		if (in != -1 && pollfds[in].revents != 0) {
+			if (upp->up_fdinput == -1) {
+				fd = accept(upp->up_listensock, NULL, NULL);
+				if (fd < 0)
+					warn("%s: accept on device %s",
+					    __func__, upp->up_dev->pd_name);
+				else {
+					upp->up_fdinput = fd;
+					__atomic_store_n(&upp->up_fdoutput,
+					    fd, __ATOMIC_RELEASE);
+				}
+			} else
+				uart_io_read(upp);
+		}
+		stop = __atomic_load_n(&upp->up_io_stop, __ATOMIC_ACQUIRE);
+		uart_io_flush(upp);
+		if (stop)
+			break;
 	}
-	uart_dev_socket_cleanup(upp);
-	return (false);
+	return (NULL);
 }
 
-static bool
-uart_dev_socket_fetch_ready(struct uart_private *upp)
+static void
+uart_io_kick(struct uart_private *upp)
 {
-	struct pollfd pollfd;
-	int nfds;
 
-	uart_dev_listensock_poll(upp);
-	if (upp->up_fdinput == -1)
-		return (false);
-
-	memset(&pollfd, 0, sizeof(pollfd));
-	pollfd.fd = upp->up_fdinput;
-	pollfd.events = POLLIN;
-	nfds = poll(&pollfd, 1, 0);
-	if (nfds < 0)
-		err(1, "%s: poll", __func__);
-	if (nfds == 0)
-		return (false);
-	if (pollfd.revents & POLLIN)
-		return (true);
-	uart_dev_socket_cleanup(upp);
-	return (false);
+	if (!__atomic_exchange_n(&upp->up_io_kicked, true, __ATOMIC_ACQ_REL))
+		(void)write(upp->up_wakefd[1], "", 1);
 }
 
-static bool
-uart_dev_fetch(struct uart_private *upp, uint8_t *bp)
+static void
+uart_io_start(struct uart_private *upp)
 {
-	bool data_valid;
-
-	switch (upp->up_type) {
-	case UART_TYPE_FILE:
-	case UART_TYPE_STDIO:
-		data_valid = uart_dev_file_fetch(upp, bp);
-		break;
+	int error;
+
+	if (pipe(upp->up_wakefd) < 0)
+		err(1, "%s: pipe", __func__);
+	if (fcntl(upp->up_wakefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(upp->up_wakefd[1], F_SETFL, O_NONBLOCK) < 0)
+		err(1, "%s: fcntl", __func__);
+	upp->up_io_stop = false;
+	upp->up_io_kicked = false;
+	error = pthread_create(&upp->up_thread, NULL, uart_io_thread, upp);
+	if (error != 0)
+		errx(1, "%s: pthread_create: %s", __func__, strerror(error));
+	upp->up_io_running = true;
+}
 
-	case UART_TYPE_SOCKET:
-		data_valid = uart_dev_socket_fetch(upp, bp);
-		break;
+/*
+ * Stop a UART's I/O thread, which flushes its output first.
+ */
+static void
+uart_io_stop(struct uart_private *upp)
+{
 
-	case UART_TYPE_NULL:
-		data_valid = false;
-		break;
+	if (!upp->up_io_running)
+		return;
+	__atomic_store_n(&upp->up_io_stop, true, __ATOMIC_RELEASE);
+	(void)write(upp->up_wakefd[1], "", 1);
+	pthread_join(upp->up_thread, NULL);
+	close(upp->up_wakefd[0]);
+	close(upp->up_wakefd[1]);
+	upp->up_io_running = false;
+}
 
-	default:
-		assert(0);
+static void
+uart_io_stop_all(void)
+{
+	pism_device_t *dev;
+	uint8_t busno;
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_init == uart_dev_init &&
+			    dev->pd_private != NULL)
+				uart_io_stop(dev->pd_private);
+		}
 	}
-
-	UDBG(upp, "returning %d", data_valid);
-	return (data_valid);
 }
 
-static bool
-uart_dev_fetch_ready(struct uart_private *upp)
+/*
+ * (Re)start the I/O thread, if needed, before the simulator touches a ring.
+ */
+static inline void
+uart_io_check(struct uart_private *upp)
 {
-	bool data_present;
 
-	switch (upp->up_type) {
-	case UART_TYPE_FILE:
-	case UART_TYPE_STDIO:
-		data_present = uart_dev_file_fetch_ready(upp);
-		break;
+	if (!upp->up_io_running && upp->up_type != UART_TYPE_NULL)
+		uart_io_start(upp);
+}
 
-	case UART_TYPE_SOCKET:
-		data_present = uart_dev_socket_fetch_ready(upp);
-		break;
+static bool
+uart_dev_fetch(struct uart_private *upp, uint8_t *bp)
+{
 
-	case UART_TYPE_NULL:
-		data_present = false;
-		break;
+	uart_io_check(upp);
+	return (uart_ring_get(&upp->up_rx, bp));
+}
 
-	default:
-		assert(0);
-	}
+static bool
+uart_dev_fetch_ready(struct uart_private *upp)
+{
 
-	UDBG(upp, "returning %d", data_present);
-	return (data_present);
+	uart_io_check(upp);
+	return (uart_ring_used(&upp->up_rx) != 0);
 }
 
 static bool
 uart_dev_store_ready(struct uart_private *upp)
 {
-	bool store_ready;
 
-	/* XXXRW: Possibly something more mature here. */
-	store_ready = true;
+	return (uart_ring_space(&upp->up_tx) != 0);
+}
+
+/*
+ * Queue a byte for output.  If the TX ring is full, wait for the I/O thread
+ * to make room, just as a write() would have blocked.
+ */
+static void
+uart_dev_put(struct uart_private *upp, uint8_t b)
+{
 
-	UDBG(upp, "returning %d", store_ready);
-	return (store_ready);
+	if (upp->up_type == UART_TYPE_NULL)
+		return;
+	uart_io_check(upp);
+	while (!uart_ring_put(&upp->up_tx, b)) {
+		uart_io_kick(upp);
+		sched_yield();
+	}
+	if (b == '\n' || uart_ring_used(&upp->up_tx) >= UART_TX_THRESHOLD)
+		uart_io_kick(upp);
 }
 
 static void
@@ -572,7 +724,8 @@ uart_dev_control_update(struct uart_private *upp)
 	 * should be set.
 	 */
 	control_old = upp->up_control;
-	if (upp->up_fdoutput != -1 || upp->up_type == UART_TYPE_NULL)
+	if (__atomic_load_n(&upp->up_fdoutput, __ATOMIC_ACQUIRE) != -1 ||
+	    upp->up_type == UART_TYPE_NULL)
 		upp->up_control |= ALTERA_JTAG_UART_CONTROL_AC;
 	else
 		upp->up_control &= ~ALTERA_JTAG_UART_CONTROL_AC;
@@ -587,8 +740,8 @@ uart_dev_control_update(struct uart_private *upp)
 	else
 		upp->up_control &= ~ALTERA_JTAG_UART_CONTROL_WI;
 	if (upp->up_control != control_old)
-		UDBG(upp, "returned - up_control from %08x to %08x",
-		    control_old, upp->up_control);
+		PISM_LOG(upp->up_dev, PISM_LOG_EV_CONFIG,
+		    upp->up_dev->pd_base + sizeof(uint32_t), upp->up_control);
 }
 
 static bool
@@ -609,8 +762,6 @@ uart_dev_interrupt_get(pism_device_t *dev)
 		    ALTERA_JTAG_UART_CONTROL_WI))
 			ret = true;
 	}
-
-	UDBG(upp, "returned - %d", ret);
 	return (ret);
 }
 
@@ -639,31 +790,9 @@ uart_dev_request_ready(pism_device_t *dev, pism_data_t *req)
 	default:
 		assert(0);
 	}
-
-	UDBG(upp, "returned - %d", ret);
 	return (ret);
 }
 
-static void
-uart_dev_file_put(struct uart_private *upp, uint8_t b)
-{
-
-	(void)write(upp->up_fdoutput, &b, sizeof(b));
-}
-
-static void
-uart_dev_socket_put(struct uart_private *upp, uint8_t b)
-{
-	ssize_t len;
-
-	uart_dev_listensock_poll(upp);
-	if (upp->up_fdoutput == -1)
-		return;
-	len = send(upp->up_fdoutput, &b, sizeof(b), MSG_NOSIGNAL);
-	if (len != sizeof(b))
-		uart_dev_socket_cleanup(upp);
-}
-
 static void
 uart_dev_request_put(pism_device_t *dev, pism_data_t *req)
 {
@@ -680,23 +809,8 @@ uart_dev_request_put(pism_device_t *dev, pism_data_t *req)
 		assert(addr == 0);
 		if (PISM_REQ_BYTEENABLED(req, 0)) {
 			b = PISM_REQ_BYTE(req, 0);
-			UDBG(upp, "data byte written");
-			switch (upp->up_type) {
-			case UART_TYPE_FILE:
-			case UART_TYPE_STDIO:
-				uart_dev_file_put(upp, b);
-				break;
-
-			case UART_TYPE_SOCKET:
-				uart_dev_socket_put(upp, b);
-				break;
-
-			case UART_TYPE_NULL:
-				break;
-
-			default:
-				assert(0);
-			}
+			PISM_LOG(dev, PISM_LOG_EV_REG_WRITE, dev->pd_base, b);
+			uart_dev_put(upp, b);
 		}
 
 		/*
@@ -719,9 +833,8 @@ uart_dev_request_put(pism_device_t *dev, pism_data_t *req)
 			    ~ALTERA_JTAG_UART_CONTROL_PERSISTENT;
 			new_control_reg |= (control_reg &
 			    ALTERA_JTAG_UART_CONTROL_PERSISTENT);
-			UDBG(upp, "control word written value %08x old %08x "
-			    "new %08x", control_reg, upp->up_control,
-			    new_control_reg);
+			PISM_LOG(dev, PISM_LOG_EV_REG_WRITE,
+			    dev->pd_base + sizeof(uint32_t), new_control_reg);
 			upp->up_control = new_control_reg;
 		}
 		break;
@@ -729,7 +842,6 @@ uart_dev_request_put(pism_device_t *dev, pism_data_t *req)
 	case PISM_ACC_FETCH:
 		assert(upp->up_reqfifo_empty);
 
-		UDBG(upp, "fetch enqueued");
 		memcpy(&upp->up_reqfifo, req, sizeof(upp->up_reqfifo));
 		upp->up_reqfifo_empty = false;
 		break;
@@ -747,8 +859,6 @@ uart_dev_response_ready(pism_device_t *dev)
 
 	upp = dev->pd_private;
 	ret = !upp->up_reqfifo_empty;
-
-	UDBG(upp, "returned - %d", ret);
 	return (ret);
 }
 
@@ -788,7 +898,8 @@ uart_dev_response_get(pism_device_t *dev)
 				data_reg = b | ALTERA_JTAG_UART_DATA_RVALID;
 			else
 				data_reg = 0;
-			UDBG(upp, "response data %08x", data_reg);
+			PISM_LOG(dev, PISM_LOG_EV_REG_READ, dev->pd_base,
+			    data_reg);
 			data_reg = htole32(data_reg);
 			for (i = 0; i < sizeof(data_reg); i++) {
 				if (!(PISM_REQ_BYTEENABLED(req, i)))
@@ -812,7 +923,8 @@ uart_dev_response_get(pism_device_t *dev)
 			if (uart_dev_store_ready(upp))
 				control_reg |= (1 <<
 				    ALTERA_JTAG_UART_CONTROL_WSPACE_SHIFT);
-			UDBG(upp, "response control %08x", control_reg);
+			PISM_LOG(dev, PISM_LOG_EV_REG_READ,
+			    dev->pd_base + sizeof(uint32_t), control_reg);
 			control_reg = htole32(control_reg);
 			for (i = 0; i < sizeof(control_reg); i++) {
 				if (!(PISM_REQ_BYTEENABLED(req, i +
@@ -839,6 +951,130 @@ uart_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
 	return (true);
 }
 
+/*
+ * Stopping the I/O thread writes out the TX ring, so that output sent before
+ * a checkpoint isn't lost, and leaves the RX ring still.  The thread is
+ * restarted when the simulator next touches the UART.
+ */
+static void
+uart_dev_quiesce(pism_device_t *dev)
+{
+
+	uart_io_stop(dev->pd_private);
+}
+
+/*
+ * Register state is saved, along with input that has been read into the RX
+ * ring but not yet by the guest.  The TX ring is empty once quiesced.  The
+ * host side of the UART isn't saved, and stays as it is on restore.
+ */
+static bool
+uart_dev_checkpoint(pism_device_t *dev, FILE *fp)
+{
+	struct uart_private *upp;
+	struct uart_ring *ur;
+	uint32_t used, tail, len;
+
+	upp = dev->pd_private;
+	assert(!upp->up_io_running);
+	assert(uart_ring_used(&upp->up_tx) == 0);
+	if (!pism_checkpoint_write(fp, &upp->up_control,
+	    sizeof(upp->up_control)) ||
+	    !pism_checkpoint_write(fp, &upp->up_reqfifo,
+	    sizeof(upp->up_reqfifo)) ||
+	    !pism_checkpoint_write(fp, &upp->up_reqfifo_empty,
+	    sizeof(upp->up_reqfifo_empty)))
+		return (false);
+	ur = &upp->up_rx;
+	used = uart_ring_used(ur);
+	if (!pism_checkpoint_write(fp, &used, sizeof(used)))
+		return (false);
+	tail = ur->ur_tail % UART_RING_SIZE;
+	len = MIN(used, UART_RING_SIZE - tail);
+	return (pism_checkpoint_write(fp, &ur->ur_buf[tail], len) &&
+	    pism_checkpoint_write(fp, ur->ur_buf, used - len));
+}
+
+static bool
+uart_dev_restore(pism_device_t *dev, FILE *fp)
+{
+	struct uart_private *upp;
+	struct uart_ring *ur;
+	uint32_t used;
+
+	upp = dev->pd_private;
+	uart_io_stop(upp);
+	if (!pism_checkpoint_read(fp, &upp->up_control,
+	    sizeof(upp->up_control)) ||
+	    !pism_checkpoint_read(fp, &upp->up_reqfifo,
+	    sizeof(upp->up_reqfifo)) ||
+	    !pism_checkpoint_read(fp, &upp->up_reqfifo_empty,
+	    sizeof(upp->up_reqfifo_empty)) ||
+	    !pism_checkpoint_read(fp, &used, sizeof(used)))
+		return (false);
+	if (used > UART_RING_SIZE) {
+		warnx("%s: %u bytes of input on device %s", __func__, used,
+		    dev->pd_name);
+		return (false);
+	}
+	ur = &upp->up_rx;
+	if (!pism_checkpoint_read(fp, ur->ur_buf, used))
+		return (false);
+	ur->ur_tail = 0;
+	ur->ur_head = used;
+	return (true);
+}
+
+/*
+ * Each child of a fork writes to its own file or listens on its own socket;
+ * stdio is shared.
+ */
+static bool
+uart_dev_fork(pism_device_t *dev, int child)
+{
+	struct uart_private *upp;
+	const char *option_path, *option_append;
+	char path[MAXPATHLEN];
+	bool append_flag;
+	int fd;
+
+	upp = dev->pd_private;
+	if (upp->up_type != UART_TYPE_FILE && upp->up_type != UART_TYPE_SOCKET)
+		return (true);
+	uart_io_stop(upp);
+	if (!pism_device_option_get(dev, UART_OPTION_PATH, &option_path))
+		assert(0);
+	if (!pism_fork_path(option_path, path, sizeof(path)))
+		return (false);
+	switch (upp->up_type) {
+	case UART_TYPE_FILE:
+		append_flag = false;
+		if (pism_device_option_get(dev, UART_OPTION_APPEND,
+		    &option_append))
+			(void)pism_device_option_parse_bool(dev,
+			    option_append, &append_flag);
+		fd = uart_dev_file_open(dev, path, append_flag);
+		if (fd < 0)
+			return (false);
+		close(upp->up_fdoutput);
+		upp->up_fdoutput = fd;
+		break;
+
+	case UART_TYPE_SOCKET:
+		if (upp->up_fdinput != -1)
+			uart_dev_socket_cleanup(upp);
+		close(upp->up_listensock);
+		fd = uart_dev_socket_open(dev, path);
+		if (fd < 0) {
+			upp->up_listensock = -1;
+			return (false);
+		}
+		upp->up_listensock = fd;
+		break;
+	}
+	return (true);
+}
+
 static const char *uart_option_list[] = {
 	UART_OPTION_TYPE,
 	UART_OPTION_PATH,
@@ -856,4 +1092,8 @@ PISM_MODULE_INFO(uart_module) = {
 	.pm_dev_response_ready = uart_dev_response_ready,
 	.pm_dev_response_get = uart_dev_response_get,
 	.pm_dev_addr_valid = uart_dev_addr_valid,
+	.pm_dev_checkpoint = uart_dev_checkpoint,
+	.pm_dev_restore = uart_dev_restore,
+	.pm_dev_quiesce = uart_dev_quiesce,
+	.pm_dev_fork = uart_dev_fork,
 };
@@ -90,12 +90,9 @@ paddr_unmap(void *phys, uint32_t size)
 
 static inline void
 _vq_record(uint64_t offs, int i, volatile struct vring_desc *vd,
-	struct iovec *iov, int n_iov, uint16_t *flags)
+	struct iovec *iov, uint16_t *flags)
 {
 
-	if (i >= n_iov)
-		return;
-
 	iov[i].iov_base = paddr_map(offs, be64toh(vd->addr),
 				be32toh(vd->len));
 	iov[i].iov_len = be32toh(vd->len);
@@ -103,66 +100,181 @@ _vq_record(uint64_t offs, int i, volatile struct vring_desc *vd,
 		flags[i] = be16toh(vd->flags);
 }
 
-int
-vq_getchain(uint64_t offs, struct vqueue_info *vq,
+/*
+ * Walk an indirect table, which can't itself refer to another.
+ */
+static int
+_vq_getindir(uint64_t offs, volatile struct vring_desc *vdir,
 	struct iovec *iov, int n_iov, uint16_t *flags)
 {
-	volatile struct vring_desc *vdir, *vindir, *vp;
-	int idx, ndesc;
-	int head, next;
-	int i;
+	volatile struct vring_desc *vindir, *vp;
+	int i, next, nindir;
+
+	nindir = be32toh(vdir->len) / sizeof(*vindir);
+	vindir = paddr_map(offs, be64toh(vdir->addr), be32toh(vdir->len));
+	next = 0;
+	for (i = 0; i < nindir && i < n_iov; i++) {
+		vp = &vindir[next];
+		if (be16toh(vp->flags) & VRING_DESC_F_INDIRECT)
+			break;
+		_vq_record(offs, i, vp, iov, flags);
+		if ((be16toh(vp->flags) & VRING_DESC_F_NEXT) == 0) {
+			paddr_unmap((void *)vindir, be32toh(vdir->len));
+			return (i + 1);
+		}
+		next = be16toh(vp->next);
+		if (next >= nindir)
+			break;
+	}
+	paddr_unmap((void *)vindir, be32toh(vdir->len));
+	return (-1);
+}
 
-	idx = vq->vq_last_avail;
-	ndesc = (be16toh(vq->vq_avail->idx) - idx);
-	if (ndesc == 0)
-		return (0);
+/*
+ * Walk the chain starting at descriptor head into iov.
+ */
+static int
+_vq_walk(uint64_t offs, struct vqueue_info *vq, int head,
+	struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	volatile struct vring_desc *vdir;
+	int next;
+	int i, j, n;
 
-	head = be16toh(vq->vq_avail->ring[idx & (vq->vq_qsize - 1)]);
+	/* A chain can't be longer than the ring, so this catches loops. */
 	next = head;
-
-	for (i = 0; i < VQ_MAX_DESCRIPTORS; next = be16toh(vdir->next)) {
+	for (i = 0, j = 0; j < vq->vq_qsize; j++, next = be16toh(vdir->next)) {
+		if (next >= vq->vq_qsize)
+			return (-1);
 		vdir = &vq->vq_desc[next];
 		if ((be16toh(vdir->flags) & VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(offs, i, vdir, iov, n_iov, flags);
+			if (i >= n_iov)
+				return (-1);
+			_vq_record(offs, i, vdir, iov, flags);
 			i++;
 		} else {
-			vindir = paddr_map(offs, be64toh(vdir->addr),
-					be32toh(vdir->len));
-			next = 0;
-			for (;;) {
-				vp = &vindir[next];
-				_vq_record(offs, i, vp, iov, n_iov, flags);
-				i+=1;
-				if ((be16toh(vp->flags) & \
-					VRING_DESC_F_NEXT) == 0)
-					break;
-				next = be16toh(vp->next);
-			}
-			paddr_unmap((void *)vindir, be32toh(vdir->len));
+			/* An indirect table ends the chain. */
+			if (be16toh(vdir->flags) & VRING_DESC_F_NEXT)
+				return (-1);
+			n = _vq_getindir(offs, vdir, iov + i, n_iov - i,
+			    flags != NULL ? flags + i : NULL);
+			return (n < 0 ? -1 : i + n);
 		}
 
 		if ((be16toh(vdir->flags) & VRING_DESC_F_NEXT) == 0)
 			return (i);
 	}
 
-	return (i);
+	return (-1);
+}
+
+/*
+ * Consume the chain at the head of the avail ring, returning its head
+ * index for vq_relchain().
+ */
+static inline int
+_vq_next(struct vqueue_info *vq, uint16_t *pidx)
+{
+	int head;
+
+	head = be16toh(vq->vq_avail->ring[vq->vq_last_avail &
+	    (vq->vq_qsize - 1)]);
+	*pidx = head;
+	vq->vq_last_avail++;
+	vq->vq_flags |= VQ_REARM;
+	return (head);
+}
+
+/*
+ * Walk the chain at the head of the avail ring into iov and consume it,
+ * returning its head index in *pidx for vq_relchain().  Chains may be
+ * released in any order.  Returns -1, with the chain still consumed, if
+ * it is malformed or has more than n_iov descriptors.
+ */
+int
+vq_getchain(uint64_t offs, struct vqueue_info *vq, uint16_t *pidx,
+	struct iovec *iov, int n_iov, uint16_t *flags)
+{
+
+	if (!vq_has_descs(vq))
+		return (0);
+	return (_vq_walk(offs, vq, _vq_next(vq, pidx), iov, n_iov, flags));
+}
+
+/*
+ * Preallocate room to walk nchains chains of up to nsegs descriptors each,
+ * so that vq_getchain_arena() needn't allocate.  The arena survives
+ * vq_init(), and must cover the largest queue size the guest may pick.
+ */
+int
+vq_arena_init(struct vqueue_info *vq, int nchains, int nsegs)
+{
+
+	vq->vq_iov = calloc((size_t)nchains * nsegs, sizeof(*vq->vq_iov));
+	if (vq->vq_iov == NULL)
+		return (-1);
+	vq->vq_iov_chains = nchains;
+	vq->vq_iov_segs = nsegs;
+	return (0);
 }
 
 void
-vq_relchain(struct vqueue_info *vq, struct iovec *iov, int n, uint32_t iolen)
+vq_arena_free(struct vqueue_info *vq)
+{
+
+	free(vq->vq_iov);
+	vq->vq_iov = NULL;
+	vq->vq_iov_chains = vq->vq_iov_segs = 0;
+}
+
+/*
+ * The guest can't reuse a head index until the chain has been released,
+ * so each chain in flight has its own slot.
+ */
+struct iovec *
+vq_arena_iov(struct vqueue_info *vq, uint16_t idx)
+{
+
+	assert(idx < vq->vq_iov_chains);
+	return (vq->vq_iov + (size_t)idx * vq->vq_iov_segs);
+}
+
+/*
+ * As vq_getchain(), into the arena slot for the chain's head, which is
+ * returned in *piov and stays valid until vq_relchain().
+ */
+int
+vq_getchain_arena(uint64_t offs, struct vqueue_info *vq, uint16_t *pidx,
+	struct iovec **piov)
+{
+	int head;
+
+	assert(vq->vq_qsize <= vq->vq_iov_chains);
+	*piov = NULL;
+	if (!vq_has_descs(vq))
+		return (0);
+	head = _vq_next(vq, pidx);
+	if (head >= vq->vq_qsize)
+		return (-1);
+	*piov = vq_arena_iov(vq, head);
+	return (_vq_walk(offs, vq, head, *piov, vq->vq_iov_segs, NULL));
+}
+
+void
+vq_relchain(struct vqueue_info *vq, uint16_t idx, struct iovec *iov, int n,
+	uint32_t iolen)
 {
 	volatile struct vring_used_elem *vue;
 	volatile struct vring_used *vu;
-	uint16_t head, uidx, mask;
+	uint16_t uidx, mask;
 	int i;
 
 	mask = vq->vq_qsize - 1;
 	vu = vq->vq_used;
-	head = be16toh(vq->vq_avail->ring[vq->vq_last_avail++ & mask]);
 
 	uidx = be16toh(vu->idx);
 	vue = &vu->ring[uidx++ & mask];
-	vue->id = htobe32(head);
+	vue->id = htobe32(idx);
 
 	vue->len = htobe32(iolen);
 	vu->idx = htobe16(uidx);
@@ -173,26 +285,67 @@ vq_relchain(struct vqueue_info *vq, struct iovec *iov, int n, uint32_t iolen)
 	}
 }
 
+/*
+ * Called once a batch of chains has been released, to decide whether the
+ * guest wants an interrupt for them: with EVENT_IDX, if the used index
+ * has passed the one it published at the end of the avail ring.
+ */
 int
-setup_offset(uint32_t dev, uint32_t *offset)
+vq_endchains(struct vqueue_info *vq)
 {
+	uint16_t event_idx, new_idx, old_idx;
 
-	*offset = 0;
+	old_idx = vq->vq_save_used;
+	new_idx = be16toh(vq->vq_used->idx);
+	vq->vq_save_used = new_idx;
+	if (new_idx == old_idx)
+		return (0);
+	if (vq->vq_flags & VQ_EVENT_IDX) {
+		event_idx = be16toh(vq_used_event(vq));
+		return (vring_need_event(event_idx, new_idx, old_idx));
+	}
+	return ((be16toh(vq->vq_avail->flags) &
+	    VRING_AVAIL_F_NO_INTERRUPT) == 0);
+}
 
-	return (0);
+/*
+ * Ask the guest not to notify us of new chains, while we poll the avail
+ * ring anyway.  With EVENT_IDX, publish an index the guest has passed.
+ */
+void
+vq_kick_disable(struct vqueue_info *vq)
+{
+
+	vq->vq_flags |= VQ_REARM;
+	if (vq->vq_flags & VQ_EVENT_IDX)
+		vq_avail_event(vq) = htobe16(vq->vq_last_avail - 1);
+	else
+		vq->vq_used->flags |= htobe16(VRING_USED_F_NO_NOTIFY);
 }
 
-struct iovec *
-getcopy(struct iovec *iov, int n)
+/*
+ * Ask to be notified of the next chain.  Returns true if chains were made
+ * available before the guest could have seen the request, in which case
+ * the caller must process them itself.
+ */
+int
+vq_kick_enable(struct vqueue_info *vq)
 {
-	struct iovec *tiov;
-	int i;
 
-	tiov = malloc(n * sizeof(struct iovec));
-	for (i = 0; i < n; i++) {
-		tiov[i].iov_base = iov[i].iov_base;
-		tiov[i].iov_len = iov[i].iov_len;
-	}
+	vq->vq_flags &= ~VQ_REARM;
+	if (vq->vq_flags & VQ_EVENT_IDX)
+		vq_avail_event(vq) = htobe16(vq->vq_last_avail);
+	else
+		vq->vq_used->flags &= ~htobe16(VRING_USED_F_NO_NOTIFY);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return (vq_has_descs(vq));
+}
 
-	return (tiov);
+int
+setup_offset(uint32_t dev, uint32_t *offset)
+{
+
+	*offset = 0;
+
+	return (0);
 }
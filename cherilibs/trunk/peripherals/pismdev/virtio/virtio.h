@@ -34,6 +34,8 @@
 #define	VRING_ALIGN		4096
 
 #define	VQ_ALLOC		0x01	/* set once we have a pfn */
+#define	VQ_EVENT_IDX		0x02	/* guest negotiated EVENT_IDX */
+#define	VQ_REARM		0x04	/* kick request is out of date */
 #define	VQ_MAX_DESCRIPTORS	512
 
 struct vqueue_info {
@@ -47,13 +49,31 @@ struct vqueue_info {
 	volatile struct vring_desc *vq_desc;	/* descriptor array */
 	volatile struct vring_avail *vq_avail;	/* the "avail" ring */
 	volatile struct vring_used *vq_used;	/* the "used" ring */
+
+	struct iovec *vq_iov;	/* vq_iov_segs per chain, by head index */
+	int vq_iov_chains;
+	int vq_iov_segs;
 };
 
+/* As vring_used_event() and vring_avail_event(), for a vqueue_info. */
+#define	vq_used_event(vq)	((vq)->vq_avail->ring[(vq)->vq_qsize])
+#define	vq_avail_event(vq)						\
+	(((volatile uint16_t *)(void *)(vq)->vq_used)[2 +		\
+	    (vq)->vq_qsize * sizeof(struct vring_used_elem) / sizeof(uint16_t)])
+
 int vq_ring_ready(struct vqueue_info *vq);
 int vq_has_descs(struct vqueue_info *vq);
 void * paddr_map(uint64_t offset, uint64_t phys, int size);
 void paddr_unmap(void *phys, uint32_t size);
-int vq_getchain(uint64_t, struct vqueue_info *vq,
+int vq_getchain(uint64_t, struct vqueue_info *vq, uint16_t *pidx,
 		struct iovec *iov, int n_iov, uint16_t *flags);
-void vq_relchain(struct vqueue_info *vq, struct iovec *iov, int n, uint32_t iolen);
-struct iovec * getcopy(struct iovec *iov, int n);
+int vq_arena_init(struct vqueue_info *vq, int nchains, int nsegs);
+void vq_arena_free(struct vqueue_info *vq);
+struct iovec * vq_arena_iov(struct vqueue_info *vq, uint16_t idx);
+int vq_getchain_arena(uint64_t, struct vqueue_info *vq, uint16_t *pidx,
+		struct iovec **piov);
+void vq_relchain(struct vqueue_info *vq, uint16_t idx, struct iovec *iov,
+		int n, uint32_t iolen);
+int vq_endchains(struct vqueue_info *vq);
+void vq_kick_disable(struct vqueue_info *vq);
+int vq_kick_enable(struct vqueue_info *vq);
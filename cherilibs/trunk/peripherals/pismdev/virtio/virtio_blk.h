@@ -40,8 +40,12 @@
 #define VIRTIO_BLK_F_BLK_SIZE	0x0040	/* Block size of disk is available*/
 #define VIRTIO_BLK_F_SCSI	0x0080	/* Supports scsi command passthru */
 #define VIRTIO_BLK_F_WCE	0x0200	/* Writeback mode enabled after reset */
+#define VIRTIO_BLK_F_FLUSH	0x0200	/* Cache flush command support */
 #define VIRTIO_BLK_F_TOPOLOGY	0x0400	/* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 0x0800	/* Writeback mode available in config */
+#define VIRTIO_BLK_F_MQ		0x1000	/* Support more than one vq */
+#define VIRTIO_BLK_F_DISCARD	0x2000	/* DISCARD is supported */
+#define VIRTIO_BLK_F_WRITE_ZEROES 0x4000 /* WRITE_ZEROES is supported */
 
 #define VIRTIO_BLK_ID_BYTES	20	/* ID string length */
 
@@ -72,6 +76,21 @@ struct virtio_blk_config {
 
 	/* Writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
 	uint8_t writeback;
+	uint8_t unused0;
+
+	/* Number of vqs (if VIRTIO_BLK_F_MQ) */
+	uint16_t num_queues;
+
+	/* Limits on DISCARD (if VIRTIO_BLK_F_DISCARD) */
+	uint32_t max_discard_sectors;
+	uint32_t max_discard_seg;
+	uint32_t discard_sector_alignment;
+
+	/* Limits on WRITE_ZEROES (if VIRTIO_BLK_F_WRITE_ZEROES) */
+	uint32_t max_write_zeroes_sectors;
+	uint32_t max_write_zeroes_seg;
+	uint8_t write_zeroes_may_unmap;
+	uint8_t unused1[3];
 
 } __packed;
 
@@ -99,6 +118,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID	8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD	11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES	13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER	0x80000000
 
@@ -115,6 +140,18 @@ struct virtio_blk_outhdr {
 	uint64_t sector;
 };
 
+/*
+ * The data of DISCARD and WRITE_ZEROES is an array of these.  UNMAP lets
+ * WRITE_ZEROES deallocate the range, and must be clear for DISCARD.
+ */
+struct virtio_blk_discard_write_zeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags;
+};
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP	0x00000001
+
 struct virtio_scsi_inhdr {
 	uint32_t errors;
 	uint32_t data_len;
@@ -43,8 +43,10 @@
 #include <sys/endian.h>
 #endif
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,34 +67,70 @@
 /* PISM simulation of the Virtio Block Device */
 
 static pism_mod_init_t			vtblk_mod_init;
+static pism_dev_init_t			vtblk_dev_init;
 static pism_dev_interrupt_get_t		vtblk_dev_interrupt_get;
 static pism_dev_request_ready_t		vtblk_dev_request_ready;
 static pism_dev_request_put_t		vtblk_dev_request_put;
 static pism_dev_response_ready_t	vtblk_dev_response_ready;
 static pism_dev_response_get_t		vtblk_dev_response_get;
 static pism_dev_addr_valid_t		vtblk_dev_addr_valid;
+static pism_dev_checkpoint_t		vtblk_dev_checkpoint;
+static pism_dev_restore_t		vtblk_dev_restore;
+static pism_dev_quiesce_t		vtblk_dev_quiesce;
+static pism_dev_fork_t			vtblk_dev_fork;
 
-/* We use indirect descriptors */
-#define	NUM_DESCS	1
-#define	NUM_QUEUES	1
+/*
+ * The number of queues, and the size each offers, are options.  Guests may
+ * ask for smaller queues through QUEUE_NUM.
+ */
+#define	VTBLK_QUEUES_DEFAULT	1
+#define	VTBLK_QUEUES_MAXIMUM	16
+#define	VTBLK_QSIZE_DEFAULT	128
 
 #define	VTBLK_BLK_ID_BYTES	20
 #define	VTBLK_MAXSEGS		256
 
+/*
+ * DISCARD and WRITE_ZEROES limits, per request and per range.  Ranges are
+ * aligned to the host page so that they can be punched as holes.
+ */
+#define	VTBLK_RANGE_SECTORS	(1 << 22)
+#define	VTBLK_RANGE_SEGS	VTBLK_MAXSEGS
+#define	VTBLK_RANGE_ALIGN	(4096 / DEV_BSIZE)
+#define	VTBLK_ZEROES		(64 * 1024)
+
 #define	MMIO_WINDOW_SIZE	512
 
 /* FreeBSD compatibility */
-#define	ENOSYS		22
 #define	DEV_BSIZE	512
 #define	MIN(a,b)	(((a)<(b))?(a):(b))
 #define	roundup2(x, y)	(((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
 
+/*
+ * A chain taken from a queue, held until its completion is pushed to the
+ * used ring.  Reads and writes run on a worker thread if the device has
+ * any; everything else, including all access to the rings, happens on the
+ * simulator thread.
+ */
+struct vtblk_request {
+	STAILQ_ENTRY(vtblk_request)	vr_next;
+	struct vqueue_info	*vr_vq;
+	struct iovec		*vr_iov;	/* In vr_vq's arena. */
+	int			vr_n;
+	int			vr_type;
+	off_t			vr_offset;
+	uint16_t		vr_idx;		/* Head of the chain. */
+	int			vr_error;
+};
+STAILQ_HEAD(vtblk_request_list, vtblk_request);
+
 /*
  * Data structure describing virtio block device instance fields, hung off of
  * pism_device_t->pd_private.
  */
 struct vtblk_private {
-	int		sdp_imagefile;		/* Image file. */
+	int		sdp_imagefile;		/* Image file, or -1. */
+	struct pism_overlay	*sdp_overlay;	/* Or copy-on-write. */
 	uint64_t	sdp_length;		/* Image file length. */
 	pism_data_t	sdp_reqfifo;
 	bool		sdp_reqfifo_empty;
@@ -106,24 +144,73 @@ struct vtblk_private {
 	uint8_t		intr;
 
 	struct virtio_blk_config	*cfg;
-	struct vqueue_info		vs_queues[NUM_QUEUES];
+	struct vqueue_info		*vs_queues;
+	u_int				sdp_nqueues;
+	u_int				sdp_qsize;	/* QUEUE_NUM_MAX */
+	uint32_t			sdp_host_features;
+	uint32_t			sdp_features;	/* Negotiated. */
+
+	/*
+	 * Requests in flight are at most one per descriptor.  Those handed to
+	 * the workers are reaped by sdp_poll_timer every sdp_pollcycles,
+	 * which also takes new chains so that the guest need not notify.
+	 */
+	struct vtblk_request		*sdp_reqs;
+	struct vtblk_request_list	sdp_free;
+	u_int				sdp_inflight;
+	struct pism_timer		sdp_poll_timer;
+	uint64_t			sdp_pollcycles;
+
+	/*
+	 * Worker threads, started on first use.  sdp_io_lock protects the
+	 * queue of requests awaiting a worker, the list of those done but
+	 * not yet reaped, and the count of those running.  sdp_io_cv is
+	 * signalled when a request is queued or the workers must stop, and
+	 * sdp_io_donecv when one is done, for a flush waiting its turn too.
+	 */
+	u_int				sdp_workers;
+	pthread_t			*sdp_threads;
+	bool				sdp_io_running;
+	bool				sdp_io_stop;
+	pthread_mutex_t			sdp_io_lock;
+	pthread_cond_t			sdp_io_cv;
+	pthread_cond_t			sdp_io_donecv;
+	struct vtblk_request_list	sdp_io_queue;
+	struct vtblk_request_list	sdp_io_done;
+	u_int				sdp_io_busy;
 };
 
 /*
  * Virtio block option names.
  */
 #define	VTBLK_OPTION_PATH	"path"	/* File system path to memory map. */
+#define	VTBLK_OPTION_WORKERS	"workers"	/* I/O threads, or 0. */
+#define	VTBLK_OPTION_POLLCYCLES	"pollcycles"	/* Reap interval. */
+#define	VTBLK_OPTION_QUEUES	"queues"	/* Number of queues. */
+#define	VTBLK_OPTION_QSIZE	"queuesize"	/* Power of 2. */
+#define	VTBLK_OPTION_OVERLAY	"overlay"	/* Delta for path. */
+#define	VTBLK_OPTION_OVERLAY_COMMIT	"overlay_commit" /* Keep writes. */
+
+#define	VTBLK_WORKERS_DEFAULT		4
+#define	VTBLK_WORKERS_MAXIMUM		64
+#define	VTBLK_POLLCYCLES_DEFAULT	64
+
+static void	vtblk_io_stop_all(void);
+static void	vtblk_poll(pism_device_t *dev, void *arg);
+
+static inline uint32_t
+vtblk_reg_read(struct vtblk_private *sdpp, int reg)
+{
 
-static char		*g_vtblk_debug = NULL;
+	return (be32toh(*(volatile uint32_t *)(sdpp->mmio_data + reg)));
+}
 
-#define	DDBG(...)	do	{		\
-	if (g_vtblk_debug == NULL) {		\
-		break;				\
-	}					\
-	printf("%s(%d): ", __func__, __LINE__);	\
-	printf(__VA_ARGS__);			\
-	printf("\n");				\
-} while (0)
+static inline void
+vtblk_reg_write(struct vtblk_private *sdpp, int reg, uint32_t val)
+{
+
+	*(volatile uint32_t *)(sdpp->mmio_data + reg) = htobe32(val);
+}
 
 static void
 virtio_init(struct vtblk_private *sdpp)
@@ -140,21 +227,34 @@ virtio_init(struct vtblk_private *sdpp)
 	reg = htobe32(VIRTIO_ID_BLOCK);
 	*(volatile uint32_t *)(data + VIRTIO_MMIO_DEVICE_ID) = reg;
 
-	/* Queue size */
-	reg = htobe32(NUM_DESCS);
-	*(volatile uint32_t *)(data + VIRTIO_MMIO_QUEUE_NUM_MAX) = reg;
+	/* Queue size, for queue 0 until another is selected */
+	vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_NUM_MAX, sdpp->sdp_qsize);
 
 	/* Our features */
-	reg = htobe32(VIRTIO_RING_F_INDIRECT_DESC
+	sdpp->sdp_host_features = VIRTIO_RING_F_INDIRECT_DESC
+	    | VIRTIO_RING_F_EVENT_IDX
 	    | VIRTIO_BLK_F_BLK_SIZE
-	    | VIRTIO_BLK_F_SEG_MAX);
-	*(volatile uint32_t *)(data + VIRTIO_MMIO_HOST_FEATURES) = reg;
+	    | VIRTIO_BLK_F_SEG_MAX
+	    | VIRTIO_BLK_F_FLUSH
+	    | VIRTIO_BLK_F_DISCARD
+	    | VIRTIO_BLK_F_WRITE_ZEROES;
+	if (sdpp->sdp_nqueues > 1)
+		sdpp->sdp_host_features |= VIRTIO_BLK_F_MQ;
+	vtblk_reg_write(sdpp, VIRTIO_MMIO_HOST_FEATURES,
+	    sdpp->sdp_host_features);
 
 	cfg = sdpp->cfg;
 	cfg->capacity = htobe64(sdpp->sdp_length / DEV_BSIZE);
 	cfg->size_max = 0; /* not negotiated */
 	cfg->seg_max = htobe32(VTBLK_MAXSEGS);
 	cfg->blk_size = htobe32(DEV_BSIZE);
+	cfg->num_queues = htobe16(sdpp->sdp_nqueues);
+	cfg->max_discard_sectors = htobe32(VTBLK_RANGE_SECTORS);
+	cfg->max_discard_seg = htobe32(VTBLK_RANGE_SEGS);
+	cfg->discard_sector_alignment = htobe32(VTBLK_RANGE_ALIGN);
+	cfg->max_write_zeroes_sectors = htobe32(VTBLK_RANGE_SECTORS);
+	cfg->max_write_zeroes_seg = htobe32(VTBLK_RANGE_SEGS);
+	cfg->write_zeroes_may_unmap = 1;
 
 	s = (uint32_t *)cfg;
 	for (i = 0; i < sizeof(struct virtio_blk_config); i += 4) {
@@ -162,72 +262,122 @@ virtio_init(struct vtblk_private *sdpp)
 		s += 1;
 	}
 
-	sprintf(sdpp->ident, "PISM Virtio Block Device");
+	/* The ID fills the field so, as the spec allows, has no NUL. */
+	memcpy(sdpp->ident, "PISM Virtio Block Device", sizeof(sdpp->ident));
 }
 
+/*
+ * Map a queue's rings once the guest has written its PFN, at the size the
+ * guest asked for if that is valid.
+ */
 static int
-vq_init(struct vtblk_private *sdpp)
+vq_init(struct vtblk_private *sdpp, struct vqueue_info *vq)
 {
-	struct vqueue_info *vq;
 	uint8_t *base;
-	uint8_t *data;
 	uint32_t size;
-	int reg;
 	int pfn;
 
-	DDBG("vq init addr 0x%016lx", (uint64_t)&vq_init);
-
-	data = (uint8_t *)&sdpp->mmio_data;
-
-	vq = &sdpp->vs_queues[0];
-	vq->vq_qsize = NUM_DESCS;
+	if (vq->vq_num != 0 && vq->vq_num <= sdpp->sdp_qsize &&
+	    (vq->vq_num & (vq->vq_num - 1)) == 0)
+		vq->vq_qsize = vq->vq_num;
+	else
+		vq->vq_qsize = sdpp->sdp_qsize;
 
-	reg = *(volatile uint32_t *)(data + VIRTIO_MMIO_QUEUE_PFN);
-	pfn = be32toh(reg);
-	vq->vq_pfn = pfn;
+	pfn = vq->vq_pfn;
 
 	size = vring_size(vq->vq_qsize, VRING_ALIGN);
 	base = paddr_map(sdpp->mem_offset,
 		(pfn << PAGE_SHIFT), size);
 
-	DDBG("mem_offset is 0x%016lx base is 0x%016lx",
-			(uint64_t)sdpp->mem_offset,
-			(uint64_t)base);
+	PISM_LOG(sdpp->dev, PISM_LOG_EV_CONFIG, (uint64_t)pfn << PAGE_SHIFT,
+	    (uintptr_t)base);
 	/* First pages are descriptors */
 	vq->vq_desc = (struct vring_desc *)base;
 	base += vq->vq_qsize * sizeof(struct vring_desc);
 
 	/* Then avail ring */
 	vq->vq_avail = (struct vring_avail *)base;
-	DDBG("vq->vq_avail addr 0x%016lx", (uint64_t)&vq->vq_avail);
 	base += (2 + vq->vq_qsize + 1) * sizeof(uint16_t);
 
 	/* Then it's rounded up to the next page */
-	DDBG("base 0x%016lx", (uint64_t)base);
 	base = (uint8_t *)roundup2((uintptr_t)base, VRING_ALIGN);
-	DDBG("base aligned 0x%016lx", (uint64_t)base);
 
 	/* And the last pages are the used ring */
 	vq->vq_used = (struct vring_used *)base;
-	DDBG("vq->vq_used->idx addr 0x%016lx",
-			(uint64_t)&vq->vq_used->idx);
 
 	/* Mark queue as allocated, and start at 0 when we use it. */
 	vq->vq_flags = VQ_ALLOC;
+	if (sdpp->sdp_features & VIRTIO_RING_F_EVENT_IDX)
+		vq->vq_flags |= VQ_EVENT_IDX;
 	vq->vq_last_avail = 0;
+	vq->vq_save_used = 0;
 
 	return (0);
 }
 
+/*
+ * Show the selected queue's registers.  A size of 0 means there is no such
+ * queue.
+ */
+static void
+vtblk_queue_sel(struct vtblk_private *sdpp)
+{
+	struct vqueue_info *vq;
+	uint32_t queue;
+
+	queue = vtblk_reg_read(sdpp, VIRTIO_MMIO_QUEUE_SEL);
+	if (queue >= sdpp->sdp_nqueues) {
+		vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_NUM_MAX, 0);
+		vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_NUM, 0);
+		vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_PFN, 0);
+		return;
+	}
+	vq = &sdpp->vs_queues[queue];
+	vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_NUM_MAX, sdpp->sdp_qsize);
+	vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_NUM, vq->vq_num);
+	vtblk_reg_write(sdpp, VIRTIO_MMIO_QUEUE_PFN, vq->vq_pfn);
+}
+
+static struct vqueue_info *
+vtblk_queue_selected(struct vtblk_private *sdpp)
+{
+	uint32_t queue;
+
+	queue = vtblk_reg_read(sdpp, VIRTIO_MMIO_QUEUE_SEL);
+	if (queue >= sdpp->sdp_nqueues)
+		return (NULL);
+	return (&sdpp->vs_queues[queue]);
+}
+
 static bool
 vtblk_mod_init(pism_module_t *mod)
 {
+	int error;
 
-	DDBG("called");
+	if (atexit(vtblk_io_stop_all) != 0)
+		warnx("%s: atexit failed", __func__);
+	error = pthread_atfork(vtblk_io_stop_all, NULL, NULL);
+	if (error != 0)
+		warnx("%s: pthread_atfork: %s", __func__, strerror(error));
+	return (true);
+}
 
-	g_vtblk_debug = getenv("CHERI_DEBUG_VIRTIO_BLOCK");
+static bool
+vtblk_option_uint(pism_device_t *dev, const char *name, u_int min,
+    u_int max, u_int *valp)
+{
+	const char *option;
+	long long v;
 
-	DDBG("returned");
+	if (!pism_device_option_get(dev, name, &option))
+		return (true);
+	if (!pism_device_option_parse_longlong(dev, option, &v) ||
+	    v < min || v > max) {
+		warnx("%s: %s option must be between %u and %u on device %s",
+		    __func__, name, min, max, dev->pd_name);
+		return (false);
+	}
+	*valp = v;
 	return (true);
 }
 
@@ -236,13 +386,13 @@ vtblk_dev_init(pism_device_t *dev)
 {
 	struct vtblk_private *sdpp;
 	struct dram_private *dpp;
-	const char *option_path;
+	const char *option_path, *option_overlay, *option_commit;
+	struct pism_overlay *po;
+	u_int workers, pollcycles, queues, qsize;
 	uint64_t length;
 	struct stat sb;
-	int fd;
-
-	DDBG("called for mapping at %jx, length %jx", dev->pd_base,
-	    dev->pd_length);
+	bool commit;
+	int fd, i;
 
 	assert(dev->pd_base % PISM_DATA_BYTES == 0);
 	assert(dev->pd_length % PISM_DATA_BYTES == 0);
@@ -257,52 +407,138 @@ vtblk_dev_init(pism_device_t *dev)
 		    dev->pd_name);
 		return (false);
 	}
+	if (!(pism_device_option_get(dev, VTBLK_OPTION_OVERLAY,
+	    &option_overlay)))
+		option_overlay = NULL;
+	commit = false;
+	if (pism_device_option_get(dev, VTBLK_OPTION_OVERLAY_COMMIT,
+	    &option_commit) &&
+	    !pism_device_option_parse_bool(dev, option_commit, &commit)) {
+		warnx("%s: invalid %s option on device %s", __func__,
+		    VTBLK_OPTION_OVERLAY_COMMIT, dev->pd_name);
+		return (false);
+	}
+	workers = VTBLK_WORKERS_DEFAULT;
+	pollcycles = VTBLK_POLLCYCLES_DEFAULT;
+	queues = VTBLK_QUEUES_DEFAULT;
+	qsize = VTBLK_QSIZE_DEFAULT;
+	if (!vtblk_option_uint(dev, VTBLK_OPTION_WORKERS, 0,
+	    VTBLK_WORKERS_MAXIMUM, &workers) ||
+	    !vtblk_option_uint(dev, VTBLK_OPTION_POLLCYCLES, 1, UINT_MAX,
+	    &pollcycles) ||
+	    !vtblk_option_uint(dev, VTBLK_OPTION_QUEUES, 1,
+	    VTBLK_QUEUES_MAXIMUM, &queues) ||
+	    !vtblk_option_uint(dev, VTBLK_OPTION_QSIZE, 1,
+	    VQ_MAX_DESCRIPTORS, &qsize))
+		return (false);
+	if ((qsize & (qsize - 1)) != 0) {
+		warnx("%s: %s option must be a power of 2 on device %s",
+		    __func__, VTBLK_OPTION_QSIZE, dev->pd_name);
+		return (false);
+	}
 
 	assert(dev->pd_perms & \
 		(PISM_PERM_ALLOW_FETCH | PISM_PERM_ALLOW_STORE));
-	fd = open(option_path, O_RDWR);
-	if (fd < 0) {
-		warn("%s: open of %s failed on device %s", __func__,
-		    option_path, dev->pd_name);
-		return (false);
-	}
+	if (option_overlay != NULL) {
+		po = pism_overlay_open(option_path, option_overlay, commit);
+		if (po == NULL) {
+			warnx("%s: overlay of %s failed on device %s",
+			    __func__, option_path, dev->pd_name);
+			return (false);
+		}
+		fd = -1;
+		length = pism_overlay_length(po);
+	} else {
+		po = NULL;
+		fd = open(option_path, O_RDWR);
+		if (fd < 0) {
+			warn("%s: open of %s failed on device %s", __func__,
+			    option_path, dev->pd_name);
+			return (false);
+		}
 
-	/*
-	 * We can't handle live resize on images, and support only
-	 * even multiples of 512 byte sector-size.
-	 */
-	if (fstat(fd, &sb) < 0) {
-		warn("%s: fstat of %s failed on device %s", __func__,
-		    option_path, dev->pd_name);
-		close(fd);
-		return (false);
+		/*
+		 * We can't handle live resize on images, and support only
+		 * even multiples of 512 byte sector-size.
+		 */
+		if (fstat(fd, &sb) < 0) {
+			warn("%s: fstat of %s failed on device %s", __func__,
+			    option_path, dev->pd_name);
+			close(fd);
+			return (false);
+		}
+		length = sb.st_size;
 	}
-	length = sb.st_size;
 	sdpp = calloc(1, sizeof(*sdpp));
 	if (sdpp == NULL) {
 		warn("%s: calloc", __func__);
-		close(fd);
+		if (po != NULL)
+			pism_overlay_close(po);
+		if (fd >= 0)
+			close(fd);
 		return (false);
 	}
 	sdpp->sdp_imagefile = fd;
+	sdpp->sdp_overlay = po;
 	sdpp->sdp_reqfifo_empty = true;
 	sdpp->sdp_length = length;
 	sdpp->sdp_delay = 0;
 	sdpp->dev = dev;
 	sdpp->intr = 0;
-	sdpp->cfg = malloc(sizeof(struct virtio_blk_config));
+	sdpp->cfg = calloc(1, sizeof(struct virtio_blk_config));
+	sdpp->sdp_nqueues = queues;
+	sdpp->sdp_qsize = qsize;
+	sdpp->vs_queues = calloc(queues, sizeof(*sdpp->vs_queues));
+	sdpp->sdp_reqs = calloc(queues * qsize, sizeof(*sdpp->sdp_reqs));
+	if (sdpp->cfg == NULL || sdpp->vs_queues == NULL ||
+	    sdpp->sdp_reqs == NULL)
+		goto nomem;
+	/* Chains are walked into per-queue arenas rather than allocated. */
+	for (i = 0; i < queues; i++) {
+		if (vq_arena_init(&sdpp->vs_queues[i], qsize,
+		    VTBLK_MAXSEGS + 2) != 0)
+			goto nomem;
+	}
+	STAILQ_INIT(&sdpp->sdp_free);
+	for (i = 0; i < queues * qsize; i++)
+		STAILQ_INSERT_TAIL(&sdpp->sdp_free, &sdpp->sdp_reqs[i],
+		    vr_next);
+	pism_timer_init(&sdpp->sdp_poll_timer, dev, vtblk_poll, NULL);
+	sdpp->sdp_pollcycles = pollcycles;
+	sdpp->sdp_workers = workers;
+	pthread_mutex_init(&sdpp->sdp_io_lock, NULL);
+	pthread_cond_init(&sdpp->sdp_io_cv, NULL);
+	pthread_cond_init(&sdpp->sdp_io_donecv, NULL);
+	STAILQ_INIT(&sdpp->sdp_io_queue);
+	STAILQ_INIT(&sdpp->sdp_io_done);
 	dev->pd_private = sdpp;
 
 	dpp = pism_dev_get_private(PISM_BUSNO_MEMORY, "dram0");
 	if (!dpp)
 		return (false);
 	sdpp->mem_offset = (uint64_t)dpp->dp_data;
-	DDBG("mem_offset 0x%016lx", (uint64_t)sdpp->mem_offset);
+	PISM_LOG(dev, PISM_LOG_EV_CONFIG, 0, sdpp->mem_offset);
 
 	virtio_init(sdpp);
 
-	DDBG("returned");
+	PISM_LOG(dev, PISM_LOG_EV_INIT, dev->pd_base, true);
 	return (true);
+
+nomem:
+	warn("%s: calloc", __func__);
+	if (sdpp->vs_queues != NULL) {
+		for (i = 0; i < queues; i++)
+			vq_arena_free(&sdpp->vs_queues[i]);
+	}
+	free(sdpp->cfg);
+	free(sdpp->vs_queues);
+	free(sdpp->sdp_reqs);
+	free(sdpp);
+	if (po != NULL)
+		pism_overlay_close(po);
+	if (fd >= 0)
+		close(fd);
+	return (false);
 }
 
 static bool
@@ -324,8 +560,6 @@ vtblk_dev_interrupt_get(pism_device_t *dev)
 			ret = true;
 		}
 	}
-
-	DDBG("returned: %d", ret);
 	return (ret);
 }
 
@@ -334,8 +568,6 @@ vtblk_dev_request_ready(pism_device_t *dev, pism_data_t *req)
 {
 	struct vtblk_private *sdpp;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -351,128 +583,478 @@ vtblk_dev_request_ready(pism_device_t *dev, pism_data_t *req)
 	}
 }
 
+/*
+ * A discarded range reads back as anything, so hosts that can't punch
+ * holes just ignore DISCARD.
+ */
 static int
-vtblk_rdwr(struct vtblk_private *sdpp, struct iovec *iov,
-        int cnt, int offset, int operation, int iolen)
+vtblk_discard(struct vtblk_private *sdpp, off_t off, off_t len)
 {
 	int error;
 
-	if (operation == 0) { /* Read */
-		error = preadv(sdpp->sdp_imagefile, iov, cnt, offset);
-		DDBG("preadv cnt %d offset %d err %d\n", cnt, offset, error);
+	if (sdpp->sdp_overlay != NULL)
+		error = pism_overlay_discard(sdpp->sdp_overlay, off, len);
+	else
+		error = pism_punch_hole(sdpp->sdp_imagefile, off, len);
+	if (error != 0 && errno == EOPNOTSUPP)
+		error = 0;
+	return (error);
+}
+
+static int
+vtblk_zero(struct vtblk_private *sdpp, off_t off, off_t len, bool unmap)
+{
+	static uint8_t zeroes[VTBLK_ZEROES];
+	ssize_t n;
 
-	} else { /* Write */
-		error = pwritev(sdpp->sdp_imagefile, iov, cnt, offset);
-		DDBG("pwritev cnt %d offset %d err %d", cnt, offset, error);
+	if (sdpp->sdp_overlay != NULL)
+		return (pism_overlay_zero(sdpp->sdp_overlay, off, len));
+	if (unmap && pism_punch_hole(sdpp->sdp_imagefile, off, len) == 0)
+		return (0);
+	for (; len > 0; off += n, len -= n) {
+		n = pwrite(sdpp->sdp_imagefile, zeroes,
+		    MIN(len, (off_t)sizeof(zeroes)), off);
+		if (n <= 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Apply each range in the data of a DISCARD or WRITE_ZEROES request.
+ */
+static int
+vtblk_ranges(struct vtblk_private *sdpp, struct vtblk_request *req)
+{
+	struct virtio_blk_discard_write_zeroes *vbr;
+	uint64_t sector, nsectors, capacity;
+	uint32_t flags;
+	size_t j;
+	int i;
+
+	capacity = sdpp->sdp_length / DEV_BSIZE;
+	for (i = 1; i < req->vr_n - 1; i++) {
+		if (req->vr_iov[i].iov_len % sizeof(*vbr) != 0)
+			return (-1);
+		vbr = req->vr_iov[i].iov_base;
+		for (j = 0; j < req->vr_iov[i].iov_len / sizeof(*vbr);
+		    j++, vbr++) {
+			sector = be64toh(vbr->sector);
+			nsectors = be32toh(vbr->num_sectors);
+			flags = be32toh(vbr->flags);
+			if (sector > capacity || nsectors > capacity - sector)
+				return (-1);
+			if (req->vr_type == VIRTIO_BLK_T_DISCARD) {
+				if (flags != 0)
+					return (-ENOSYS);
+				if (vtblk_discard(sdpp, sector * DEV_BSIZE,
+				    nsectors * DEV_BSIZE) != 0)
+					return (-1);
+			} else {
+				if (flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)
+					return (-ENOSYS);
+				if (vtblk_zero(sdpp, sector * DEV_BSIZE,
+				    nsectors * DEV_BSIZE, (flags &
+				    VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) != 0) != 0)
+					return (-1);
+			}
+		}
+	}
+	return (0);
+}
+
+/*
+ * Called on worker threads, so must not log or touch the rings.
+ */
+static int
+vtblk_rdwr(struct vtblk_private *sdpp, struct vtblk_request *req)
+{
+	int error;
+
+	switch (req->vr_type) {
+	case VIRTIO_BLK_T_IN:
+		if (sdpp->sdp_overlay != NULL)
+			error = pism_overlay_preadv(sdpp->sdp_overlay,
+			    req->vr_iov + 1, req->vr_n - 2, req->vr_offset);
+		else
+			error = preadv(sdpp->sdp_imagefile, req->vr_iov + 1,
+			    req->vr_n - 2, req->vr_offset);
+		break;
+	case VIRTIO_BLK_T_OUT:
+		if (sdpp->sdp_overlay != NULL)
+			error = pism_overlay_pwritev(sdpp->sdp_overlay,
+			    req->vr_iov + 1, req->vr_n - 2, req->vr_offset);
+		else
+			error = pwritev(sdpp->sdp_imagefile, req->vr_iov + 1,
+			    req->vr_n - 2, req->vr_offset);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		if (sdpp->sdp_overlay != NULL)
+			error = pism_overlay_fdatasync(sdpp->sdp_overlay);
+		else
+			error = fdatasync(sdpp->sdp_imagefile);
+		break;
+	default:
+		error = vtblk_ranges(sdpp, req);
+		break;
 	}
 
 	return (error);
 }
 
+static void
+vtblk_intr(struct vtblk_private *sdpp)
+{
+	uint8_t *data;
+	int reg;
+
+	data = (uint8_t *)&sdpp->mmio_data;
+
+	reg = htobe32(VIRTIO_MMIO_INT_VRING);
+	*(volatile uint32_t *)(data + VIRTIO_MMIO_INTERRUPT_STATUS) = reg;
+	sdpp->intr = 1;
+}
+
+/*
+ * Set the status byte and push the chain to the used ring.
+ */
+static void
+vtblk_done(struct vtblk_private *sdpp, struct vtblk_request *req)
+{
+	uint8_t *status;
+
+	status = req->vr_iov[req->vr_n - 1].iov_base;
+	if (req->vr_error < 0) {
+		if (req->vr_error == -ENOSYS) {
+			*status = VIRTIO_BLK_S_UNSUPP;
+		} else
+			*status = VIRTIO_BLK_S_IOERR;
+	} else
+		*status = VIRTIO_BLK_S_OK;
+
+	vq_relchain(req->vr_vq, req->vr_idx, req->vr_iov, req->vr_n, 1);
+	req->vr_iov = NULL;
+	STAILQ_INSERT_HEAD(&sdpp->sdp_free, req, vr_next);
+}
+
+static void *
+vtblk_io_thread(void *arg)
+{
+	struct vtblk_private *sdpp;
+	struct vtblk_request *req;
+
+	sdpp = arg;
+	pthread_mutex_lock(&sdpp->sdp_io_lock);
+	for (;;) {
+		while (STAILQ_EMPTY(&sdpp->sdp_io_queue) && !sdpp->sdp_io_stop)
+			pthread_cond_wait(&sdpp->sdp_io_cv,
+			    &sdpp->sdp_io_lock);
+
+		/* Finish queued requests before stopping. */
+		req = STAILQ_FIRST(&sdpp->sdp_io_queue);
+		if (req == NULL)
+			break;
+
+		/*
+		 * A flush must cover every write queued before it, so leave
+		 * it, and everything behind it, until those are done.
+		 */
+		if (req->vr_type == VIRTIO_BLK_T_FLUSH &&
+		    sdpp->sdp_io_busy != 0) {
+			pthread_cond_wait(&sdpp->sdp_io_donecv,
+			    &sdpp->sdp_io_lock);
+			continue;
+		}
+		STAILQ_REMOVE_HEAD(&sdpp->sdp_io_queue, vr_next);
+		sdpp->sdp_io_busy++;
+		pthread_mutex_unlock(&sdpp->sdp_io_lock);
+
+		req->vr_error = vtblk_rdwr(sdpp, req);
+
+		pthread_mutex_lock(&sdpp->sdp_io_lock);
+		sdpp->sdp_io_busy--;
+		STAILQ_INSERT_TAIL(&sdpp->sdp_io_done, req, vr_next);
+		pthread_cond_broadcast(&sdpp->sdp_io_donecv);
+	}
+	pthread_mutex_unlock(&sdpp->sdp_io_lock);
+	return (NULL);
+}
+
+static void
+vtblk_io_start(struct vtblk_private *sdpp)
+{
+	u_int i;
+	int error;
+
+	if (sdpp->sdp_threads == NULL) {
+		sdpp->sdp_threads = calloc(sdpp->sdp_workers,
+		    sizeof(*sdpp->sdp_threads));
+		if (sdpp->sdp_threads == NULL)
+			err(1, "%s: calloc", __func__);
+	}
+	sdpp->sdp_io_stop = false;
+	for (i = 0; i < sdpp->sdp_workers; i++) {
+		error = pthread_create(&sdpp->sdp_threads[i], NULL,
+		    vtblk_io_thread, sdpp);
+		if (error != 0)
+			errx(1, "%s: pthread_create: %s", __func__,
+			    strerror(error));
+	}
+	sdpp->sdp_io_running = true;
+}
+
+/*
+ * Stop the workers once they have run every queued request.  Completions
+ * stay on sdp_io_done for the timer, which also survives a fork.
+ */
+static void
+vtblk_io_stop(struct vtblk_private *sdpp)
+{
+	u_int i;
+
+	if (!sdpp->sdp_io_running)
+		return;
+	pthread_mutex_lock(&sdpp->sdp_io_lock);
+	sdpp->sdp_io_stop = true;
+	pthread_cond_broadcast(&sdpp->sdp_io_cv);
+	pthread_mutex_unlock(&sdpp->sdp_io_lock);
+	for (i = 0; i < sdpp->sdp_workers; i++)
+		pthread_join(sdpp->sdp_threads[i], NULL);
+	sdpp->sdp_io_running = false;
+}
+
+static void
+vtblk_io_stop_all(void)
+{
+	pism_device_t *dev;
+	uint8_t busno;
+
+	for (busno = 0; busno < PISM_BUS_COUNT; busno++) {
+		SLIST_FOREACH(dev, g_pism_devices[busno], pd_next) {
+			if (dev->pd_mod->pm_dev_init == vtblk_dev_init &&
+			    dev->pd_private != NULL)
+				vtblk_io_stop(dev->pd_private);
+		}
+	}
+}
+
+/*
+ * Wait until every request handed to the workers is on sdp_io_done.
+ */
+static void
+vtblk_io_wait(struct vtblk_private *sdpp)
+{
+
+	pthread_mutex_lock(&sdpp->sdp_io_lock);
+	while (!STAILQ_EMPTY(&sdpp->sdp_io_queue) || sdpp->sdp_io_busy != 0)
+		pthread_cond_wait(&sdpp->sdp_io_donecv, &sdpp->sdp_io_lock);
+	pthread_mutex_unlock(&sdpp->sdp_io_lock);
+}
+
+static void
+vtblk_io_submit(struct vtblk_private *sdpp, struct vtblk_request *req)
+{
+
+	if (!sdpp->sdp_io_running)
+		vtblk_io_start(sdpp);
+	pthread_mutex_lock(&sdpp->sdp_io_lock);
+	STAILQ_INSERT_TAIL(&sdpp->sdp_io_queue, req, vr_next);
+	pthread_cond_signal(&sdpp->sdp_io_cv);
+	pthread_mutex_unlock(&sdpp->sdp_io_lock);
+	sdpp->sdp_inflight++;
+}
+
+/*
+ * Take the next chain from the queue, completing it at once unless it goes
+ * to the workers.
+ */
 static void
 vtblk_proc(struct vtblk_private *sdpp, struct vqueue_info *vq)
 {
-	struct iovec iov[VTBLK_MAXSEGS + 2];
-	uint16_t flags[VTBLK_MAXSEGS + 2];
 	struct virtio_blk_outhdr *vbh;
-	struct iovec *tiov;
-	uint8_t *status;
-	off_t offset;
+	struct iovec *iov;
+	struct vtblk_request *req;
 	int iolen;
-	int type;
 	int i, n;
-	int err;
-
-	DDBG("called");
 
-	n = vq_getchain(sdpp->mem_offset, vq, iov,
-		VTBLK_MAXSEGS + 2, flags);
-
-	DDBG("n %d\n", n);
+	/* The guest can't have more chains outstanding than descriptors. */
+	req = STAILQ_FIRST(&sdpp->sdp_free);
+	assert(req != NULL);
+	STAILQ_REMOVE_HEAD(&sdpp->sdp_free, vr_next);
+
+	n = vq_getchain_arena(sdpp->mem_offset, vq, &req->vr_idx, &iov);
+	if (n < 2) {
+		/* Nowhere to put a status; just hand the chain back. */
+		warnx("%s: bad chain %u on device %s", __func__, req->vr_idx,
+		    sdpp->dev->pd_name);
+		vq_relchain(vq, req->vr_idx, iov, 0, 0);
+		STAILQ_INSERT_HEAD(&sdpp->sdp_free, req, vr_next);
+		return;
+	}
 
-	tiov = getcopy(iov, n);
+	req->vr_vq = vq;
+	req->vr_iov = iov;
+	req->vr_n = n;
 	vbh = iov[0].iov_base;
 
-	status = iov[n-1].iov_base;
-
-	type = be32toh(vbh->type) & ~VIRTIO_BLK_T_BARRIER;
-	offset = be64toh(vbh->sector) * DEV_BSIZE;
+	req->vr_type = be32toh(vbh->type) & ~VIRTIO_BLK_T_BARRIER;
+	req->vr_offset = be64toh(vbh->sector) * DEV_BSIZE;
 
 	iolen = 0;
 	for (i = 1; i < (n-1); i++) {
 		iolen += iov[i].iov_len;
 	}
 
-	switch (type) {
+	switch (req->vr_type) {
 	case VIRTIO_BLK_T_OUT:
 	case VIRTIO_BLK_T_IN:
-		err = vtblk_rdwr(sdpp, tiov + 1, i - 1,
-			offset, type, iolen);
+		PISM_LOG(sdpp->dev, req->vr_type == VIRTIO_BLK_T_IN ?
+		    PISM_LOG_EV_IO_READ : PISM_LOG_EV_IO_WRITE,
+		    req->vr_offset, iolen);
+		/* FALLTHROUGH */
+	case VIRTIO_BLK_T_FLUSH:
+	case VIRTIO_BLK_T_DISCARD:
+	case VIRTIO_BLK_T_WRITE_ZEROES:
+		if (sdpp->sdp_workers != 0) {
+			vtblk_io_submit(sdpp, req);
+			return;
+		}
+		req->vr_error = vtblk_rdwr(sdpp, req);
 		break;
 	case VIRTIO_BLK_T_GET_ID:
 		/* Assume a single buffer */
-		strlcpy(iov[1].iov_base, sdpp->ident,
+		memcpy(iov[1].iov_base, sdpp->ident,
 		    MIN(iov[1].iov_len, sizeof(sdpp->ident)));
-		err = 0;
+		req->vr_error = 0;
 		break;
-	case VIRTIO_BLK_T_FLUSH:
-		/* Possible? */
 	default:
-		err = -ENOSYS;
+		req->vr_error = -ENOSYS;
 		break;
 	}
 
-	if (err < 0) {
-		if (err == -ENOSYS) {
-			*status = VIRTIO_BLK_S_UNSUPP;
-		} else
-			*status = VIRTIO_BLK_S_IOERR;
-	} else
-		*status = VIRTIO_BLK_S_OK;
+	vtblk_done(sdpp, req);
+}
 
-	free(tiov);
-	vq_relchain(vq, iov, n, 1);
+/*
+ * Take every chain the guest has made available on a queue.
+ */
+static void
+vtblk_queue_run(struct vtblk_private *sdpp, struct vqueue_info *vq)
+{
+
+	while (vq_has_descs(vq))
+		vtblk_proc(sdpp, vq);
 }
 
-static int
-vtblk_notify(struct vtblk_private *sdpp)
+/*
+ * While requests are in flight, vtblk_poll() takes new chains from every
+ * queue, so ask the guest not to notify.  Once idle, ask again, and take
+ * any chains made available in the meantime.  Queues whose request to the
+ * guest is still current (none taken, not told to stop) are left alone.
+ */
+static void
+vtblk_queues_kick(struct vtblk_private *sdpp)
 {
 	struct vqueue_info *vq;
-	int queue;
-	int reg;
-	uint8_t *data;
+	bool more;
+	u_int i;
+
+	do {
+		more = false;
+		for (i = 0; i < sdpp->sdp_nqueues; i++) {
+			vq = &sdpp->vs_queues[i];
+			if (!vq_ring_ready(vq))
+				continue;
+			if (sdpp->sdp_inflight > 0)
+				vq_kick_disable(vq);
+			else if ((vq->vq_flags & VQ_REARM) != 0 &&
+			    vq_kick_enable(vq)) {
+				vtblk_queue_run(sdpp, vq);
+				more = true;
+			}
+		}
+	} while (more);
 
-	DDBG("called");
+	if (sdpp->sdp_inflight > 0 &&
+	    !pism_timer_pending(&sdpp->sdp_poll_timer))
+		pism_timer_schedule(&sdpp->sdp_poll_timer,
+		    pism_cycle_count_get(sdpp->dev->pd_busno) +
+		    sdpp->sdp_pollcycles);
+}
 
-	data = (uint8_t *)&sdpp->mmio_data;
+/*
+ * Interrupt the guest if any queue's completions since the last call want
+ * one.
+ */
+static void
+vtblk_queues_end(struct vtblk_private *sdpp)
+{
+	struct vqueue_info *vq;
+	bool intr;
+	u_int i;
+
+	intr = false;
+	for (i = 0; i < sdpp->sdp_nqueues; i++) {
+		vq = &sdpp->vs_queues[i];
+		if (vq_ring_ready(vq) && vq_endchains(vq))
+			intr = true;
+	}
+	if (intr)
+		vtblk_intr(sdpp);
+}
 
-	vq = &sdpp->vs_queues[0];
-	if (!vq_ring_ready(vq))
-		return (0);
+/*
+ * Reap requests the workers have finished, and take new chains.
+ */
+static void
+vtblk_poll(pism_device_t *dev, void *arg)
+{
+	struct vtblk_request_list done;
+	struct vtblk_private *sdpp;
+	struct vtblk_request *req;
+	u_int i;
 
-	reg = *(volatile uint16_t *)(data + VIRTIO_MMIO_QUEUE_NOTIFY);
-	queue = be16toh(reg);
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
 
-	/* We support single queue only */
-	assert(queue == 0);
+	STAILQ_INIT(&done);
+	pthread_mutex_lock(&sdpp->sdp_io_lock);
+	STAILQ_CONCAT(&done, &sdpp->sdp_io_done);
+	pthread_mutex_unlock(&sdpp->sdp_io_lock);
 
-	/* Process new descriptors */
-	vq = &sdpp->vs_queues[queue];
+	while ((req = STAILQ_FIRST(&done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&done, vr_next);
+		vtblk_done(sdpp, req);
+		assert(sdpp->sdp_inflight > 0);
+		sdpp->sdp_inflight--;
+	}
 
-	DDBG("vq->vq_used addr 0x%016lx", (uint64_t)&vq->vq_used);
-	DDBG("vq->vq_save_used addr 0x%016lx", (uint64_t)&vq->vq_save_used);
-	DDBG("vq->vq_used->idx 0x%016lx", (uint64_t)&vq->vq_used->idx);
-	vq->vq_save_used = be16toh(vq->vq_used->idx);
+	for (i = 0; i < sdpp->sdp_nqueues; i++) {
+		if (vq_ring_ready(&sdpp->vs_queues[i]))
+			vtblk_queue_run(sdpp, &sdpp->vs_queues[i]);
+	}
+	vtblk_queues_kick(sdpp);
+	vtblk_queues_end(sdpp);
+}
 
-	while (vq_has_descs(vq))
-		vtblk_proc(sdpp, vq);
+static int
+vtblk_notify(struct vtblk_private *sdpp)
+{
+	struct vqueue_info *vq;
+	uint32_t queue;
 
-	/* Schedule interrupt if required */
-	if ((be16toh(vq->vq_avail->flags) & VRING_AVAIL_F_NO_INTERRUPT) == 0) {
-		reg = htobe32(VIRTIO_MMIO_INT_VRING);
-		*(volatile uint32_t *)(data + VIRTIO_MMIO_INTERRUPT_STATUS) = reg;
-		sdpp->intr = 1;
-	}
+	queue = vtblk_reg_read(sdpp, VIRTIO_MMIO_QUEUE_NOTIFY);
+	if (queue >= sdpp->sdp_nqueues)
+		return (0);
+
+	/* Process new descriptors */
+	vq = &sdpp->vs_queues[queue];
+	if (!vq_ring_ready(vq))
+		return (0);
+
+	vtblk_queue_run(sdpp, vq);
+	vtblk_queues_kick(sdpp);
+	vtblk_queues_end(sdpp);
 
 	return (0);
 }
@@ -481,6 +1063,7 @@ static void
 vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 {
 	struct vtblk_private *sdpp;
+	struct vqueue_info *vq;
 	uint64_t addr;
 	uint8_t *d;
 	int data;
@@ -490,8 +1073,8 @@ vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 
 	w = 0;
 	offs = 0;
+	data = 0;
 	d = (uint8_t *)&data;
-	DDBG("called");
 
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
@@ -499,13 +1082,10 @@ vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 	switch (PISM_REQ_ACCTYPE(req)) {
 	case PISM_ACC_STORE:
 		addr = PISM_DEV_REQ_ADDR(dev, req);
-		DDBG("PISM_ACC_STORE addr 0x%016lx", addr);
 
 		for (i = 0; i < PISM_DATA_BYTES; i++) {
 			if (!PISM_REQ_BYTEENABLED(req, i))
 				continue;
-			DDBG("PISM_ACC_STORE addr + %d = 0x%016lx, data 0x%02x",
-				i, addr + i, PISM_REQ_BYTE(req, i));
 			if (!offs)
 				offs = (addr + i);
 			*d++ = PISM_REQ_BYTE(req, i);
@@ -514,14 +1094,45 @@ vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 			assert(addr + i < sizeof(sdpp->mmio_data));
 			sdpp->mmio_data[addr + i] = PISM_REQ_BYTE(req, i);
 		}
-		DDBG("offs is 0x%08x width %d", offs, w);
+		PISM_LOG(dev, PISM_LOG_EV_REG_WRITE, dev->pd_base + offs, data);
 
 		switch (offs) {
 		case VIRTIO_MMIO_QUEUE_NOTIFY:
 			vtblk_notify(sdpp);
 			break;
+		case VIRTIO_MMIO_HOST_FEATURES_SEL:
+			/* We have no features above bit 31. */
+			vtblk_reg_write(sdpp, VIRTIO_MMIO_HOST_FEATURES,
+			    vtblk_reg_read(sdpp,
+			    VIRTIO_MMIO_HOST_FEATURES_SEL) == 0 ?
+			    sdpp->sdp_host_features : 0);
+			break;
+		case VIRTIO_MMIO_GUEST_FEATURES:
+			if (vtblk_reg_read(sdpp,
+			    VIRTIO_MMIO_GUEST_FEATURES_SEL) == 0)
+				sdpp->sdp_features = sdpp->sdp_host_features &
+				    vtblk_reg_read(sdpp,
+				    VIRTIO_MMIO_GUEST_FEATURES);
+			break;
+		case VIRTIO_MMIO_QUEUE_SEL:
+			vtblk_queue_sel(sdpp);
+			break;
+		case VIRTIO_MMIO_QUEUE_NUM:
+			vq = vtblk_queue_selected(sdpp);
+			if (vq != NULL)
+				vq->vq_num = vtblk_reg_read(sdpp,
+				    VIRTIO_MMIO_QUEUE_NUM);
+			break;
 		case VIRTIO_MMIO_QUEUE_PFN:
-			vq_init(sdpp);
+			vq = vtblk_queue_selected(sdpp);
+			if (vq == NULL)
+				break;
+			vq->vq_pfn = vtblk_reg_read(sdpp,
+			    VIRTIO_MMIO_QUEUE_PFN);
+			if (vq->vq_pfn != 0)
+				vq_init(sdpp, vq);
+			else
+				vq->vq_flags = 0;
 			break;
 		case VIRTIO_MMIO_INTERRUPT_ACK:
 			sdpp->intr = 0;
@@ -533,7 +1144,6 @@ vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 
 	case PISM_ACC_FETCH:
 		addr = PISM_DEV_REQ_ADDR(dev, req);
-		DDBG("PISM_ACC_FETCH addr 0x%016lx", addr);
 
 		assert(sdpp->sdp_reqfifo_empty);
 		memcpy(&sdpp->sdp_reqfifo, req, sizeof(sdpp->sdp_reqfifo));
@@ -545,8 +1155,6 @@ vtblk_dev_request_put(pism_device_t *dev, pism_data_t *req)
 	default:
 		assert(0);
 	}
-
-	DDBG("returned");
 }
 
 static bool
@@ -555,8 +1163,6 @@ vtblk_dev_response_ready(pism_device_t *dev)
 	struct vtblk_private *sdpp;
 	bool ret;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -570,8 +1176,6 @@ vtblk_dev_response_ready(pism_device_t *dev)
 		ret = false;
 
 	ret = true;
-
-	DDBG("returned: %d", ret);
 	return (ret);
 }
 
@@ -583,8 +1187,6 @@ vtblk_dev_response_get(pism_device_t *dev)
 	uint64_t addr;
 	int i;
 
-	DDBG("called");
-
 	sdpp = dev->pd_private;
 	assert(sdpp != NULL);
 
@@ -600,7 +1202,6 @@ vtblk_dev_response_get(pism_device_t *dev)
 
 	case PISM_ACC_FETCH:
 		addr = PISM_DEV_REQ_ADDR(dev, req);
-		DDBG("PISM_ACC_FETCH addr 0x%016lx", addr);
 
 		for (i = 0; i < PISM_DATA_BYTES; i++) {
 			assert(addr + i >= 0 && addr + i <
@@ -610,9 +1211,6 @@ vtblk_dev_response_get(pism_device_t *dev)
 				continue;
 
 			PISM_REQ_BYTE(req, i) = sdpp->mmio_data[addr + i];
-
-			DDBG("PISM_ACC_FETCH addr + %d = 0x%02x",
-				i, sdpp->mmio_data[addr + i]);
 		}
 		break;
 
@@ -629,8 +1227,215 @@ vtblk_dev_addr_valid(pism_device_t *dev, pism_data_t *req)
 	return (true);
 }
 
+/*
+ * Requests still in flight have had their I/O done by vtblk_dev_quiesce(),
+ * so need only their status and used ring entry on restore.
+ */
+struct vtblk_request_checkpoint {
+	uint64_t	vrc_status;	/* Guest address of status byte. */
+	int32_t		vrc_error;
+	uint16_t	vrc_queue;
+	uint16_t	vrc_idx;
+};
+
+static void
+vtblk_dev_quiesce(pism_device_t *dev)
+{
+
+	vtblk_io_wait(dev->pd_private);
+}
+
+/*
+ * Save the register window and the queue indices.  Ring pointers are host
+ * addresses into DRAM, so are recomputed from the queue PFN on restore.  As
+ * with sdcard, the disk image itself is not saved, but an overlay's delta is.
+ */
+static bool
+vtblk_dev_checkpoint(pism_device_t *dev, FILE *fp)
+{
+	struct vtblk_request_checkpoint vrc;
+	struct vtblk_private *sdpp;
+	struct vtblk_request *req;
+	struct vqueue_info *vq;
+	int i;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	if (!pism_checkpoint_write(fp, sdpp->mmio_data,
+	    sizeof(sdpp->mmio_data)) ||
+	    !pism_checkpoint_write(fp, &sdpp->intr, sizeof(sdpp->intr)) ||
+	    !pism_checkpoint_write(fp, &sdpp->sdp_reqfifo,
+	    sizeof(sdpp->sdp_reqfifo)) ||
+	    !pism_checkpoint_write(fp, &sdpp->sdp_reqfifo_empty,
+	    sizeof(sdpp->sdp_reqfifo_empty)) ||
+	    !pism_checkpoint_write(fp, &sdpp->sdp_replycycle,
+	    sizeof(sdpp->sdp_replycycle)) ||
+	    !pism_checkpoint_write(fp, &sdpp->sdp_features,
+	    sizeof(sdpp->sdp_features)))
+		return (false);
+	for (i = 0; i < sdpp->sdp_nqueues; i++) {
+		vq = &sdpp->vs_queues[i];
+		if (!pism_checkpoint_write(fp, &vq->vq_flags,
+		    sizeof(vq->vq_flags)) ||
+		    !pism_checkpoint_write(fp, &vq->vq_last_avail,
+		    sizeof(vq->vq_last_avail)) ||
+		    !pism_checkpoint_write(fp, &vq->vq_save_used,
+		    sizeof(vq->vq_save_used)) ||
+		    !pism_checkpoint_write(fp, &vq->vq_num,
+		    sizeof(vq->vq_num)) ||
+		    !pism_checkpoint_write(fp, &vq->vq_pfn,
+		    sizeof(vq->vq_pfn)))
+			return (false);
+	}
+
+	vtblk_io_wait(sdpp);
+	if (!pism_checkpoint_write(fp, &sdpp->sdp_inflight,
+	    sizeof(sdpp->sdp_inflight)))
+		return (false);
+	STAILQ_FOREACH(req, &sdpp->sdp_io_done, vr_next) {
+		memset(&vrc, 0, sizeof(vrc));
+		vrc.vrc_status =
+		    (uintptr_t)req->vr_iov[req->vr_n - 1].iov_base -
+		    sdpp->mem_offset;
+		vrc.vrc_error = req->vr_error;
+		vrc.vrc_queue = req->vr_vq - sdpp->vs_queues;
+		vrc.vrc_idx = req->vr_idx;
+		if (!pism_checkpoint_write(fp, &vrc, sizeof(vrc)))
+			return (false);
+	}
+	return (pism_overlay_checkpoint(sdpp->sdp_overlay, fp));
+}
+
+/*
+ * Forget requests in flight, for a restore over a running device.
+ */
+static void
+vtblk_requests_discard(struct vtblk_private *sdpp)
+{
+	struct vtblk_request *req;
+
+	vtblk_io_wait(sdpp);
+	while ((req = STAILQ_FIRST(&sdpp->sdp_io_done)) != NULL) {
+		STAILQ_REMOVE_HEAD(&sdpp->sdp_io_done, vr_next);
+		req->vr_iov = NULL;
+		STAILQ_INSERT_HEAD(&sdpp->sdp_free, req, vr_next);
+	}
+	sdpp->sdp_inflight = 0;
+	pism_timer_cancel(&sdpp->sdp_poll_timer);
+}
+
+static bool
+vtblk_dev_restore(pism_device_t *dev, FILE *fp)
+{
+	struct vtblk_request_checkpoint vrc;
+	struct vtblk_private *sdpp;
+	struct vtblk_request *req;
+	struct vqueue_info *vq;
+	uint16_t flags, last_avail, save_used, num;
+	uint32_t pfn;
+	u_int inflight;
+	int i;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	if (!pism_checkpoint_read(fp, sdpp->mmio_data,
+	    sizeof(sdpp->mmio_data)) ||
+	    !pism_checkpoint_read(fp, &sdpp->intr, sizeof(sdpp->intr)) ||
+	    !pism_checkpoint_read(fp, &sdpp->sdp_reqfifo,
+	    sizeof(sdpp->sdp_reqfifo)) ||
+	    !pism_checkpoint_read(fp, &sdpp->sdp_reqfifo_empty,
+	    sizeof(sdpp->sdp_reqfifo_empty)) ||
+	    !pism_checkpoint_read(fp, &sdpp->sdp_replycycle,
+	    sizeof(sdpp->sdp_replycycle)) ||
+	    !pism_checkpoint_read(fp, &sdpp->sdp_features,
+	    sizeof(sdpp->sdp_features)))
+		return (false);
+	for (i = 0; i < sdpp->sdp_nqueues; i++) {
+		vq = &sdpp->vs_queues[i];
+		if (!pism_checkpoint_read(fp, &flags, sizeof(flags)) ||
+		    !pism_checkpoint_read(fp, &last_avail,
+		    sizeof(last_avail)) ||
+		    !pism_checkpoint_read(fp, &save_used, sizeof(save_used)) ||
+		    !pism_checkpoint_read(fp, &num, sizeof(num)) ||
+		    !pism_checkpoint_read(fp, &pfn, sizeof(pfn)))
+			return (false);
+		/* Start afresh, but keep the arena. */
+		vq->vq_flags = 0;
+		vq->vq_last_avail = vq->vq_save_used = 0;
+		vq->vq_num = num;
+		vq->vq_pfn = pfn;
+		if (flags & VQ_ALLOC) {
+			vq_init(sdpp, vq);
+			vq->vq_last_avail = last_avail;
+			vq->vq_save_used = save_used;
+		}
+	}
+
+	vtblk_requests_discard(sdpp);
+	if (!pism_checkpoint_read(fp, &inflight, sizeof(inflight)))
+		return (false);
+	if (inflight > sdpp->sdp_nqueues * sdpp->sdp_qsize) {
+		warnx("%s: %u requests in flight on device %s", __func__,
+		    inflight, dev->pd_name);
+		return (false);
+	}
+	for (; inflight > 0; inflight--) {
+		if (!pism_checkpoint_read(fp, &vrc, sizeof(vrc)))
+			return (false);
+		if (vrc.vrc_queue >= sdpp->sdp_nqueues ||
+		    !vq_ring_ready(&sdpp->vs_queues[vrc.vrc_queue]) ||
+		    vrc.vrc_idx >= sdpp->vs_queues[vrc.vrc_queue].vq_qsize) {
+			warnx("%s: bad chain %u on queue %u on device %s",
+			    __func__, vrc.vrc_idx, vrc.vrc_queue, dev->pd_name);
+			return (false);
+		}
+		req = STAILQ_FIRST(&sdpp->sdp_free);
+		STAILQ_REMOVE_HEAD(&sdpp->sdp_free, vr_next);
+		req->vr_vq = &sdpp->vs_queues[vrc.vrc_queue];
+		req->vr_iov = vq_arena_iov(req->vr_vq, vrc.vrc_idx);
+		req->vr_iov[0].iov_base = paddr_map(sdpp->mem_offset,
+		    vrc.vrc_status, 1);
+		req->vr_iov[0].iov_len = 1;
+		req->vr_n = 1;
+		req->vr_idx = vrc.vrc_idx;
+		req->vr_error = vrc.vrc_error;
+		STAILQ_INSERT_TAIL(&sdpp->sdp_io_done, req, vr_next);
+		sdpp->sdp_inflight++;
+	}
+	if (!pism_overlay_restore(sdpp->sdp_overlay, fp))
+		return (false);
+	if (sdpp->sdp_inflight > 0)
+		pism_timer_schedule(&sdpp->sdp_poll_timer,
+		    pism_cycle_count_get(dev->pd_busno) +
+		    sdpp->sdp_pollcycles);
+	return (true);
+}
+
+/*
+ * Move to a per-child delta or image; see pism_overlay_fork_image().
+ */
+static bool
+vtblk_dev_fork(pism_device_t *dev, int child)
+{
+	struct vtblk_private *sdpp;
+	const char *option_path;
+
+	sdpp = dev->pd_private;
+	assert(sdpp != NULL);
+	if (!pism_device_option_get(dev, VTBLK_OPTION_PATH, &option_path))
+		assert(0);
+	return (pism_overlay_fork_image(dev, sdpp->sdp_overlay, option_path,
+	    &sdpp->sdp_imagefile));
+}
+
 static const char *vtblk_option_list[] = {
 	VTBLK_OPTION_PATH,
+	VTBLK_OPTION_WORKERS,
+	VTBLK_OPTION_POLLCYCLES,
+	VTBLK_OPTION_QUEUES,
+	VTBLK_OPTION_QSIZE,
+	VTBLK_OPTION_OVERLAY,
+	VTBLK_OPTION_OVERLAY_COMMIT,
 	NULL
 };
 
@@ -645,4 +1450,8 @@ PISM_MODULE_INFO(vtblk_module) = {
 	.pm_dev_response_ready = vtblk_dev_response_ready,
 	.pm_dev_response_get = vtblk_dev_response_get,
 	.pm_dev_addr_valid = vtblk_dev_addr_valid,
+	.pm_dev_checkpoint = vtblk_dev_checkpoint,
+	.pm_dev_restore = vtblk_dev_restore,
+	.pm_dev_quiesce = vtblk_dev_quiesce,
+	.pm_dev_fork = vtblk_dev_fork,
 };
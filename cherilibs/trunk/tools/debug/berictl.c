@@ -117,6 +117,7 @@ static void	loadsof_usage(struct subcommand *);
 
 static int	run_boot(struct subcommand *, int, char **);
 static int	run_console(struct subcommand *, int, char **);
+static int	run_dumpbin(struct subcommand *, int, char **);
 static int	run_dumpdevice(struct subcommand *, int, char **);
 static int	run_dumppic(struct subcommand *, int, char **);
 static int	run_load(struct subcommand *, int, char **);
@@ -218,6 +219,8 @@ struct subcommand berictl_commands[] = {
 	    "store word value at address", 2, run_store),
 	SC_DECLARE_NARGS("sd", "<value> <address>",
 	    "store double word value at address", 2, run_store),
+	SC_DECLARE_NARGS("dumpbin", "<file> <address> <length>",
+	    "dump memory at address to binary file", 3, run_dumpbin),
 
 	SC_DECLARE_HEADER("Tracing"),
 	{
@@ -267,7 +270,7 @@ struct subcommand berictl_commands[] = {
 static char *berictl_path;
 
 static struct beri_debug *bdp;
-static const char *cablep, *devicep, *socketp;
+static const char *cablep, *devicep, *shmp, *socketp;
 static int bflag, uflag, wflag, zflag;
 static int pic_id;
 static int uart_id;
@@ -320,6 +323,16 @@ run_dumpdevice(struct subcommand *scp, int argc, char **argv)
 		    __func__, scp->sc_name);
 }
 
+static int
+run_dumpbin(struct subcommand *scp, int argc, char **argv)
+{
+
+	assert(argc == 3);
+
+	/* XXX: validate argv[1] as an address */
+	return (berictl_dumpbin(bdp, argv[1], argv[2], argv[0]));
+}
+
 static int
 run_dumppic(struct subcommand *scp, int argc, char **argv)
 {
@@ -581,7 +594,8 @@ usage(void)
 #else
 	printf("[-2dNq] ");
 #endif
-	printf("[-c <cable>] [-D <device # on cable>] [-s <socket-path-or-port>] <command> [<args>]\n");
+	printf("[-c <cable>] [-D <device # on cable>] [-m <shm-descriptor>]\n"
+	    "    [-s <socket-path-or-port>] <command> [<args>]\n");
 	for (scp = berictl_commands; !SC_IS_END(scp); scp++) {
 		if (SC_IS_HIDDEN(scp))
 			continue;
@@ -669,6 +683,7 @@ main(int argc, char *argv[])
 
 	cablep = NULL;
 	devicep = NULL;
+	shmp = getenv(BERI_DEBUG_SHM_ENV);
 	socketp = NULL;
 	uart_id = 0;
 
@@ -676,7 +691,7 @@ main(int argc, char *argv[])
 
 	oflags = BERI_DEBUG_CLIENT_OPEN_FLAGS_SOCKET;
 
-	while ((opt = getopt(argc, argv, _GETOPT_PLUS"2c:D:dNnSs:Pqu:Aj")) != -1) {
+	while ((opt = getopt(argc, argv, _GETOPT_PLUS"2c:D:dm:NnSs:Pqu:Aj")) != -1) {
 		switch (opt) {
 		case '2':
 			oflags |= BERI_DEBUG_CLIENT_OPEN_FLAGS_BERI2;
@@ -694,6 +709,10 @@ main(int argc, char *argv[])
 			debugflag++;
 			break;
 
+		case 'm':
+			shmp = optarg;
+			break;
+
 		case 'N':
 			oflags |= BERI_DEBUG_CLIENT_OPEN_FLAGS_NO_PAUSE_RESUME;
 			break;
@@ -897,6 +916,15 @@ main(int argc, char *argv[])
 			    beri_debug_strerror(ret));
 			exit(EXIT_FAILURE);
 		}
+		if (shmp != NULL && bdp != NULL) {
+			ret = beri_debug_client_shm_attach(bdp, shmp);
+			if (ret != BERI_DEBUG_SUCCESS) {
+				fprintf(stderr,
+				    "Failure mapping simulator memory: %s\n",
+				    beri_debug_strerror(ret));
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
 	ret = scp->sc_command(scp, argc, argv);
 
@@ -58,7 +58,9 @@
 #include <arpa/inet.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
@@ -150,6 +152,20 @@ struct beri_debug {
 #define BERI_JTAG_ATLANTIC	0x00000010
 #define	BERI_NETFPGA_SUME_IOCTL	0x00000020
 	uint32_t	bd_flags;
+
+	/*
+	 * Simulator DRAM mapped from POSIX shared memory, if any.
+	 */
+#define	BERI_DEBUG_SHM_MAX	8
+	struct {
+		uint64_t	 bds_base;	/* Physical base address. */
+		uint64_t	 bds_length;
+		uint8_t		*bds_data;
+		size_t		 bds_maplen;
+		uint8_t		*bds_tags;	/* Tag bit per line, or NULL. */
+		u_int		 bds_tagline;	/* Bytes per tagged line. */
+	}		bd_shm[BERI_DEBUG_SHM_MAX];
+	u_int		bd_nshm;
 };
 
 static pid_t nios2_terminal_debug_pid = 0;
@@ -222,8 +238,11 @@ beri_debug_close_internal(struct beri_debug *bdp)
 static void
 beri_debug_destroy(struct beri_debug *bdp)
 {
+	u_int i;
 
 	beri_debug_close_internal(bdp);
+	for (i = 0; i < bdp->bd_nshm; i++)
+		munmap(bdp->bd_shm[i].bds_data, bdp->bd_shm[i].bds_maplen);
 	free(bdp);
 }
 
@@ -1244,6 +1263,152 @@ beri_debug_client_close(struct beri_debug *bdp)
 	beri_debug_destroy(bdp);
 }
 
+/*
+ * Map the DRAM of a running simulator, published by PISM's shm DRAM type as
+ * a descriptor file naming the physical base, length and POSIX shared
+ * memory object of each device, and where in the object the device keeps
+ * its CHERI tags.  Several descriptors may be given, separated by colons.
+ */
+static int
+beri_debug_client_shm_attach_one(struct beri_debug *bdp, const char *desc)
+{
+	char line[PATH_MAX], name[PATH_MAX];
+	unsigned long long base, length, tags;
+	unsigned int tagline;
+	size_t maplen;
+	FILE *fp;
+	void *data;
+	int fd, have;
+
+	if (bdp->bd_nshm == BERI_DEBUG_SHM_MAX) {
+		warnx("%s: too many shared memory descriptors", desc);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	fp = fopen(desc, "r");
+	if (fp == NULL) {
+		warn("%s", desc);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	have = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "base %llx", &base) == 1)
+			have |= 0x1;
+		else if (sscanf(line, "length %llx", &length) == 1)
+			have |= 0x2;
+		else if (sscanf(line, "path %1023s", name) == 1)
+			have |= 0x4;
+		else if (sscanf(line, "tags %llx", &tags) == 1)
+			have |= 0x8;
+		else if (sscanf(line, "tagline %u", &tagline) == 1)
+			have |= 0x10;
+	}
+	fclose(fp);
+	if ((have & 0x7) != 0x7 || length == 0 ||
+	    ((have & 0x18) != 0 && ((have & 0x18) != 0x18 || tagline == 0 ||
+	    tags < length))) {
+		warnx("%s: malformed shared memory descriptor", desc);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	maplen = length;
+	if (have & 0x8)
+		maplen = tags + (length / tagline + 7) / 8;
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		warn("%s: shm_open %s", desc, name);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	data = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		warn("%s: mmap %s", desc, name);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	bdp->bd_shm[bdp->bd_nshm].bds_base = base;
+	bdp->bd_shm[bdp->bd_nshm].bds_length = length;
+	bdp->bd_shm[bdp->bd_nshm].bds_data = data;
+	bdp->bd_shm[bdp->bd_nshm].bds_maplen = maplen;
+	bdp->bd_shm[bdp->bd_nshm].bds_tags = (have & 0x8) ?
+	    (uint8_t *)data + tags : NULL;
+	bdp->bd_shm[bdp->bd_nshm].bds_tagline = (have & 0x10) ? tagline : 0;
+	bdp->bd_nshm++;
+	return (BERI_DEBUG_SUCCESS);
+}
+
+int
+beri_debug_client_shm_attach(struct beri_debug *bdp, const char *descs)
+{
+	char *copy, *desc, *next;
+	int ret;
+
+	copy = strdup(descs);
+	if (copy == NULL)
+		return (BERI_DEBUG_ERROR_MALLOC);
+	ret = BERI_DEBUG_SUCCESS;
+	for (next = copy; (desc = strsep(&next, ":")) != NULL; ) {
+		if (*desc == '\0')
+			continue;
+		ret = beri_debug_client_shm_attach_one(bdp, desc);
+		if (ret != BERI_DEBUG_SUCCESS)
+			break;
+	}
+	free(copy);
+	return (ret);
+}
+
+static int
+beri_debug_client_shm_find(struct beri_debug *bdp, uint64_t paddr,
+    size_t len)
+{
+	u_int i;
+
+	for (i = 0; i < bdp->bd_nshm; i++) {
+		if (paddr >= bdp->bd_shm[i].bds_base &&
+		    len <= bdp->bd_shm[i].bds_length &&
+		    paddr - bdp->bd_shm[i].bds_base <=
+		    bdp->bd_shm[i].bds_length - len)
+			return (i);
+	}
+	return (-1);
+}
+
+/*
+ * Return a pointer to len bytes of simulator DRAM at physical address paddr,
+ * or NULL if they are not all within one mapped device.
+ */
+void *
+beri_debug_client_shm_ptr(struct beri_debug *bdp, uint64_t paddr, size_t len)
+{
+	int i;
+
+	i = beri_debug_client_shm_find(bdp, paddr, len);
+	if (i < 0)
+		return (NULL);
+	return (bdp->bd_shm[i].bds_data + (paddr - bdp->bd_shm[i].bds_base));
+}
+
+/*
+ * Called after writing len bytes at paddr through beri_debug_client_shm_ptr()
+ * to clear the CHERI tags of the lines written, as a store by the CPU
+ * would, so that the new data can't be used as a capability.  The
+ * simulator updates tags atomically too.
+ */
+void
+beri_debug_client_shm_written(struct beri_debug *bdp, uint64_t paddr,
+    size_t len)
+{
+	uint64_t line, end;
+	int i;
+
+	i = beri_debug_client_shm_find(bdp, paddr, len);
+	if (i < 0 || bdp->bd_shm[i].bds_tags == NULL || len == 0)
+		return;
+	paddr -= bdp->bd_shm[i].bds_base;
+	end = (paddr + len - 1) / bdp->bd_shm[i].bds_tagline;
+	for (line = paddr / bdp->bd_shm[i].bds_tagline; line <= end; line++)
+		__atomic_fetch_and(&bdp->bd_shm[i].bds_tags[line / 8],
+		    (uint8_t)~(1 << (line % 8)), __ATOMIC_RELEASE);
+}
+
 /*
  * The BERI debug unit allows 64-bit MIPS instructions to be inserted into
  * the pipeline in order to perform various operations, including moving
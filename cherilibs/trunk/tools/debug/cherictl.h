@@ -65,6 +65,8 @@ int	berictl_c0regs(struct beri_debug *bdp);
 int	berictl_c2regs(struct beri_debug *bdp);
 int	berictl_drain(struct beri_debug *bdp);
 int	berictl_dumpatse(struct beri_debug *, const char *);
+int	berictl_dumpbin(struct beri_debug *, const char *, const char *,
+	    const char *);
 int	berictl_dumpfifo(struct beri_debug *, const char *);
 int	berictl_dumppic(struct beri_debug *, int pic_id);
 int	berictl_get_service_path(struct beri_debug *, const char *cablep,
@@ -776,12 +776,67 @@ berictl_drain(struct beri_debug *bdp)
 	return (beri_debug_client_drain(bdp));
 }
 
+/*
+ * If the simulator's DRAM has been mapped from shared memory, return a
+ * pointer to the len bytes at virtual address addr, so that they can be
+ * accessed without the debug unit.  Only the unmapped segments are
+ * translated, and only naturally aligned accesses are served, so that the
+ * debug unit still reports any exception.  Accesses made this way bypass
+ * the CPU's caches.
+ */
+static int
+berictl_shm_paddr(uint64_t addr, size_t len, uint64_t *paddrp)
+{
+
+	if (addr % len != 0)
+		return (0);
+	if ((addr >> 62) == 0x2)			/* xkphys */
+		*paddrp = addr & 0x07ffffffffffffffULL;
+	else if (addr >= 0xffffffff80000000ULL &&	/* (c)kseg0, (c)kseg1 */
+	    addr < 0xffffffffc0000000ULL)
+		*paddrp = addr & 0x1fffffffULL;
+	else
+		return (0);
+	return (1);
+}
+
+static uint8_t *
+berictl_shm(struct beri_debug *bdp, uint64_t addr, size_t len)
+{
+	uint64_t paddr;
+
+	if (!berictl_shm_paddr(addr, len, &paddr))
+		return (NULL);
+	return (beri_debug_client_shm_ptr(bdp, paddr, len));
+}
+
+/*
+ * Store through shared memory, if mapped, clearing the CHERI tag of the
+ * line written as the CPU would.
+ */
+static int
+berictl_shm_store(struct beri_debug *bdp, uint64_t addr, const void *vp,
+    size_t len)
+{
+	uint64_t paddr;
+	uint8_t *p;
+
+	if (!berictl_shm_paddr(addr, len, &paddr))
+		return (0);
+	p = beri_debug_client_shm_ptr(bdp, paddr, len);
+	if (p == NULL)
+		return (0);
+	memcpy(p, vp, len);
+	beri_debug_client_shm_written(bdp, paddr, len);
+	return (1);
+}
+
 int
 berictl_lbu(struct beri_debug *bdp, const char *addrp)
 {
 	uint64_t addr;
 	int ret;
-	uint8_t excode, oldstate, v;
+	uint8_t excode, oldstate, v, *p;
 
 	if (addrp == NULL)
 		return (BERI_DEBUG_USAGE_ERROR);
@@ -791,6 +846,12 @@ berictl_lbu(struct beri_debug *bdp, const char *addrp)
 		return (ret);
 	if (!quietflag)
 		printf("Attempting to lbu from 0x%016" PRIx64 "\n", addr);
+	p = berictl_shm(bdp, addr, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+		printf("0x%016" PRIx64 " = 0x%02x\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_lbu(bdp, htob64(bdp, addr), &v, &excode);
 	switch (ret) {
@@ -813,7 +874,7 @@ berictl_lhu(struct beri_debug *bdp, const char *addrp)
 {
 	uint64_t addr;
 	int ret;
-	uint8_t excode, oldstate;
+	uint8_t excode, oldstate, *p;
 	uint16_t v;
 
 	if (addrp == NULL)
@@ -824,6 +885,13 @@ berictl_lhu(struct beri_debug *bdp, const char *addrp)
 		return (ret);
 	if (!quietflag)
 		printf("Attempting to lhu from 0x%016" PRIx64 "\n", addr);
+	p = berictl_shm(bdp, addr, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+		v = be16toh(v);
+		printf("0x%016" PRIx64 " = 0x%04x\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_lhu(bdp, htob64(bdp, addr), &v, &excode);
 	switch (ret) {
@@ -846,7 +914,7 @@ berictl_lwu(struct beri_debug *bdp, const char *addrp)
 {
 	uint64_t addr;
 	int ret;
-	uint8_t excode, oldstate;
+	uint8_t excode, oldstate, *p;
 	uint32_t v;
 
 	if (addrp == NULL)
@@ -857,6 +925,13 @@ berictl_lwu(struct beri_debug *bdp, const char *addrp)
 		return (ret);
 	if (!quietflag)
 		printf("Attempting to lwu from 0x%016" PRIx64 "\n", addr);
+	p = berictl_shm(bdp, addr, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+		v = be32toh(v);
+		printf("0x%016" PRIx64 " = 0x%08x\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_lwu(bdp, htob64(bdp, addr), &v, &excode);
 	switch (ret) {
@@ -879,7 +954,7 @@ berictl_ld(struct beri_debug *bdp, const char *addrp)
 {
 	uint64_t addr, v;
 	int ret;
-	uint8_t excode, oldstate;
+	uint8_t excode, oldstate, *p;
 
 	if (addrp == NULL)
 		return (BERI_DEBUG_USAGE_ERROR);
@@ -889,6 +964,13 @@ berictl_ld(struct beri_debug *bdp, const char *addrp)
 		return (ret);
 	if (!quietflag)
 		printf("Attempting to ld from 0x%016" PRIx64 "\n", addr);
+	p = berictl_shm(bdp, addr, sizeof(v));
+	if (p != NULL) {
+		memcpy(&v, p, sizeof(v));
+		v = be64toh(v);
+		printf("0x%016" PRIx64 " = 0x%016" PRIx64 "\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_ld(bdp, htob64(bdp, addr), &v, &excode);
 	switch (ret) {
@@ -913,7 +995,7 @@ berictl_loadbin(struct beri_debug *bdp, const char *addrp,
     const char *filep)
 {
 	struct stat sb;
-	uint8_t buf[8], excode, oldstate;
+	uint8_t buf[8], excode, oldstate, *p;
 	uint64_t addr, bytes, v;
 	int fd, i, outstanding, outstanding_max, ret;
 	ssize_t len;
@@ -942,7 +1024,6 @@ berictl_loadbin(struct beri_debug *bdp, const char *addrp,
 		warnx("Address is not 64-bit aligned");
 		return (BERI_DEBUG_ERROR_ADDR_INVALID);
 	}
-	addr = physical2virtual(bdp, addr);
 
 	/*
 	 * Open file; stat so that we can give a % meter status update.
@@ -958,6 +1039,31 @@ berictl_loadbin(struct beri_debug *bdp, const char *addrp,
 		return (BERI_DEBUG_ERROR_STAT);
 	}
 
+	/*
+	 * If the simulator's DRAM is mapped, read the file straight into it,
+	 * and clear the tags of the lines written.
+	 */
+	p = beri_debug_client_shm_ptr(bdp, addr, sb.st_size);
+	if (p != NULL) {
+		stat_start(&xs, filep, sb.st_size, 0);
+		bytes = 0;
+		len = 0;
+		while (bytes < (uint64_t)sb.st_size &&
+		    (len = read(fd, p + bytes, sb.st_size - bytes)) > 0) {
+			bytes += len;
+			stat_update(&xs, bytes);
+		}
+		close(fd);
+		stat_end(&xs);
+		beri_debug_client_shm_written(bdp, addr, bytes);
+		if (len < 0) {
+			warn("%s: read", __func__);
+			return (BERI_DEBUG_ERROR_READ);
+		}
+		return (BERI_DEBUG_SUCCESS);
+	}
+	addr = physical2virtual(bdp, addr);
+
 	BERI2_PAUSE(bdp, oldstate);
 
 	stat_start(&xs, filep, sb.st_size, 0);
@@ -1031,6 +1137,100 @@ berictl_loadbin(struct beri_debug *bdp, const char *addrp,
 	return (BERI_DEBUG_SUCCESS);
 }
 
+/*
+ * The converse of loadbin: write length bytes of physical memory to a file.
+ * A simulator's shared memory DRAM is written out directly; otherwise we
+ * load a double word, or a byte for the last few, at a time.
+ */
+int
+berictl_dumpbin(struct beri_debug *bdp, const char *addrp,
+    const char *lengthp, const char *filep)
+{
+	uint8_t buf[8], excode, oldstate, *p;
+	uint64_t addr, bytes, length, v;
+	int fd, ret;
+	ssize_t len;
+	char *endp;
+	struct xferstat xs;
+
+	if (addrp == NULL || lengthp == NULL || filep == NULL)
+		return (BERI_DEBUG_USAGE_ERROR);
+	ret = hex2addr(addrp, &addr);
+	if (ret != BERI_DEBUG_SUCCESS)
+		return (ret);
+	length = strtoull(lengthp, &endp, 0);
+	if (*lengthp == '\0' || *endp != '\0')
+		return (BERI_DEBUG_USAGE_ERROR);
+
+	/*
+	 * As with loadbin, the address is a 64-bit aligned physical address.
+	 */
+	if (addr & 0xff00000000000000) {
+		warnx("Invalid physical address");
+		return (BERI_DEBUG_ERROR_ADDR_INVALID);
+	}
+	if (addr % 8 != 0) {
+		warnx("Address is not 64-bit aligned");
+		return (BERI_DEBUG_ERROR_ADDR_INVALID);
+	}
+
+	fd = open(filep, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		warn("%s: open", filep);
+		return (BERI_DEBUG_ERROR_OPEN);
+	}
+	stat_start(&xs, filep, length, 0);
+
+	p = beri_debug_client_shm_ptr(bdp, addr, length);
+	if (p != NULL) {
+		for (bytes = 0; bytes < length; bytes += len) {
+			len = write(fd, p + bytes, length - bytes);
+			if (len < 0) {
+				warn("%s: write", filep);
+				close(fd);
+				stat_end(&xs);
+				return (BERI_DEBUG_ERROR_SEND);
+			}
+			stat_update(&xs, bytes + len);
+		}
+		close(fd);
+		stat_end(&xs);
+		return (BERI_DEBUG_SUCCESS);
+	}
+	addr = physical2virtual(bdp, addr);
+
+	BERI2_PAUSE(bdp, oldstate);
+	for (bytes = 0; bytes < length; bytes += len) {
+		if (length - bytes >= sizeof(buf)) {
+			ret = beri_debug_client_ld(bdp, htob64(bdp, addr), &v,
+			    &excode);
+			/* Memory is big endian; keep its byte order. */
+			v = htobe64(btoh64(bdp, v));
+			memcpy(buf, &v, sizeof(buf));
+			len = sizeof(buf);
+		} else {
+			ret = beri_debug_client_lbu(bdp, htob64(bdp, addr),
+			    buf, &excode);
+			len = 1;
+		}
+		if (ret == BERI_DEBUG_ERROR_EXCEPTION)
+			print_exception(excode);
+		if (ret != BERI_DEBUG_SUCCESS)
+			break;
+		if (write(fd, buf, len) != len) {
+			warn("%s: write", filep);
+			ret = BERI_DEBUG_ERROR_SEND;
+			break;
+		}
+		addr += len;
+		stat_update(&xs, bytes + len);
+	}
+	BERI2_RESUME(bdp, oldstate);
+	close(fd);
+	stat_end(&xs);
+	return (ret);
+}
+
 int
 berictl_loadsof(const char *filep, const char *cablep, const char *devicep)
 {
@@ -1192,7 +1392,7 @@ berictl_sb(struct beri_debug *bdp, const char *addrp, const char *valuep)
 {
 	uint64_t addr, v;
 	int ret;
-	uint8_t excode, oldstate;
+	uint8_t excode, oldstate, sv;
 
 	if (addrp == NULL || valuep == NULL)
 		return (BERI_DEBUG_USAGE_ERROR);
@@ -1206,6 +1406,11 @@ berictl_sb(struct beri_debug *bdp, const char *addrp, const char *valuep)
 	v &= 0xff;
 	if (!quietflag)
 		printf("Attempting to sb 0x%02x to 0x%016" PRIx64 "\n", (uint8_t)v, addr);
+	sv = v;
+	if (berictl_shm_store(bdp, addr, &sv, sizeof(sv))) {
+		printf("0x%016" PRIx64 " = 0x%02" PRIx64 "\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_sb(bdp, htob64(bdp, addr), v, &excode);
 	switch (ret) {
@@ -1226,6 +1431,7 @@ berictl_sb(struct beri_debug *bdp, const char *addrp, const char *valuep)
 int
 berictl_sh(struct beri_debug *bdp, const char *addrp, const char *valuep)
 {
+	uint16_t sv;
 	uint64_t addr, v;
 	int ret;
 	uint8_t excode, oldstate;
@@ -1243,6 +1449,11 @@ berictl_sh(struct beri_debug *bdp, const char *addrp, const char *valuep)
 	if (!quietflag)
 		printf("Attempting to sh 0x%04x to 0x%016" PRIx64 "\n", (uint16_t)v,
 		    addr);
+	sv = htobe16(v);
+	if (berictl_shm_store(bdp, addr, &sv, sizeof(sv))) {
+		printf("0x%016" PRIx64 " = 0x%04" PRIx64 "\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_sh(bdp, htob64(bdp, addr), v, &excode);
 	switch (ret) {
@@ -1263,6 +1474,7 @@ berictl_sh(struct beri_debug *bdp, const char *addrp, const char *valuep)
 int
 berictl_sw(struct beri_debug *bdp, const char *addrp, const char *valuep)
 {
+	uint32_t sv;
 	uint64_t addr, v;
 	int ret;
 	uint8_t excode, oldstate;
@@ -1280,6 +1492,11 @@ berictl_sw(struct beri_debug *bdp, const char *addrp, const char *valuep)
 	if (!quietflag)
 		printf("Attempting to sw 0x%08x to 0x%016" PRIx64 "\n", (uint32_t)v,
 		    addr);
+	sv = htobe32(v);
+	if (berictl_shm_store(bdp, addr, &sv, sizeof(sv))) {
+		printf("0x%016" PRIx64 " = 0x%08" PRIx64 "\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_sw(bdp, htob64(bdp, addr), v, &excode);
 	switch (ret) {
@@ -1300,6 +1517,7 @@ berictl_sw(struct beri_debug *bdp, const char *addrp, const char *valuep)
 int
 berictl_sd(struct beri_debug *bdp, const char *addrp, const char *valuep)
 {
+	uint64_t sv;
 	uint64_t addr, v;
 	int ret;
 	uint8_t excode, oldstate;
@@ -1315,6 +1533,11 @@ berictl_sd(struct beri_debug *bdp, const char *addrp, const char *valuep)
 		return (ret);
 	if (!quietflag)
 		printf("Attempting to sd %016" PRIx64 " to 0x%016" PRIx64 "\n", v, addr);
+	sv = htobe64(v);
+	if (berictl_shm_store(bdp, addr, &sv, sizeof(sv))) {
+		printf("0x%016" PRIx64 " = 0x%016" PRIx64 "\n", addr, v);
+		return (BERI_DEBUG_SUCCESS);
+	}
 	BERI2_PAUSE(bdp, oldstate);
 	ret = beri_debug_client_sd(bdp, htob64(bdp, addr), htob64(bdp, v), &excode);
 	switch (ret) {